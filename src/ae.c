@@ -30,9 +30,11 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "fmacros.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <poll.h>
@@ -44,8 +46,18 @@
 #include "zmalloc.h"
 #include "config.h"
 
+/* I/O operations passed to aeApiSubmitIo(). Multiplexing layers that can
+ * perform them, and not just report ready fds, define AE_API_IO and
+ * implement aeApiSubmitIo(), aeApiCancelIo() and aeApiProcessIo(). */
+#define AE_IO_READ 0
+#define AE_IO_WRITE 1
+#define AE_IO_FSYNC 2
+
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
+#ifdef HAVE_IO_URING
+#include "ae_iouring.c"
+#else
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
@@ -59,6 +71,7 @@
         #endif
     #endif
 #endif
+#endif
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
@@ -69,9 +82,15 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
-    eventLoop->timeEventNextId = 0;
+    memset(eventLoop->wheel,0,sizeof(eventLoop->wheel));
+    memset(eventLoop->wheelUsed,0,sizeof(eventLoop->wheelUsed));
+    eventLoop->wheelTick = aeMonotonicUs() / AE_WHEEL_TICK_US;
+    eventLoop->timeEventPending = NULL;
+    eventLoop->timeEventFiring = NULL;
+    eventLoop->timeEvents = NULL;
+    eventLoop->timeEventsSize = 0;
+    eventLoop->timeEventsFree = -1;
+    eventLoop->timeEventsProcessing = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
@@ -125,6 +144,7 @@ void aeDeleteEventLoop(aeEventLoop *eventLoop) {
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
+    zfree(eventLoop->timeEvents);
     zfree(eventLoop);
 }
 
@@ -177,161 +197,384 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
+/* Return the current time in microseconds from a monotonic clock, so that
+ * time events are not affected by adjustments of the system clock. */
+/* Read up to 'len' bytes, and at most AE_IO_BUFSIZE, from 'fd' once it is
+ * readable. 'proc' is called by the event loop with the data read, that is
+ * only valid during the call, and the number of bytes read, or a negative
+ * errno value. Returns the ID of the operation, or AE_ERR if the
+ * multiplexing layer can't perform I/O operations, in which case the
+ * caller should read the fd itself when it is ready. */
+long long aeSubmitRead(aeEventLoop *eventLoop, int fd, size_t len,
+        aeIoProc *proc, void *clientData)
+{
+#ifdef AE_API_IO
+    return aeApiSubmitIo(eventLoop,AE_IO_READ,fd,NULL,0,len,proc,clientData);
+#else
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(len);
+    AE_NOTUSED(proc); AE_NOTUSED(clientData);
+    return AE_ERR;
+#endif
+}
+
+/* Write up to AE_IO_WRITE_BUFFERS*AE_IO_BUFSIZE bytes of 'iov' to 'fd'. The data is copied, so
+ * the caller can release it right away, but must not write to the fd
+ * until 'proc' is called with the number of bytes written, or a negative
+ * errno value. Returns the ID of the operation or AE_ERR, like
+ * aeSubmitRead(), also when all the I/O buffers are in use. */
+long long aeSubmitWritev(aeEventLoop *eventLoop, int fd,
+        const struct iovec *iov, int iovcnt, aeIoProc *proc, void *clientData)
+{
+#ifdef AE_API_IO
+    return aeApiSubmitIo(eventLoop,AE_IO_WRITE,fd,iov,iovcnt,0,proc,
+                         clientData);
+#else
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd); AE_NOTUSED(iov);
+    AE_NOTUSED(iovcnt); AE_NOTUSED(proc); AE_NOTUSED(clientData);
+    return AE_ERR;
+#endif
+}
+
+/* Flush 'fd' to disk like fsync(2) does, without blocking the event loop.
+ * 'proc' is called with zero, or a negative errno value. Returns the ID of
+ * the operation or AE_ERR, like aeSubmitRead(). */
+long long aeSubmitFsync(aeEventLoop *eventLoop, int fd,
+        aeIoProc *proc, void *clientData)
 {
-    struct timeval tv;
+#ifdef AE_API_IO
+    return aeApiSubmitIo(eventLoop,AE_IO_FSYNC,fd,NULL,0,0,proc,clientData);
+#else
+    AE_NOTUSED(eventLoop); AE_NOTUSED(fd);
+    AE_NOTUSED(proc); AE_NOTUSED(clientData);
+    return AE_ERR;
+#endif
+}
+
+/* Cancel an I/O operation: its handler is not called anymore. Must be
+ * called before closing the fd of the operation. */
+void aeCancelIo(aeEventLoop *eventLoop, long long id) {
+#ifdef AE_API_IO
+    aeApiCancelIo(eventLoop,id);
+#else
+    AE_NOTUSED(eventLoop); AE_NOTUSED(id);
+#endif
+}
+
+long long aeMonotonicUs(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+#endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+    }
+}
+
+/* Count trailing zeros of a non zero 64 bit word. */
+static int aeCtz64(uint64_t v) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* Rotate the slot bitmap so that bit 0 represents 'slot'. */
+static uint64_t aeRotateSlots(uint64_t used, int slot) {
+    if (slot == 0) return used;
+    return (used >> slot) | (used << (AE_WHEEL_SIZE-slot));
+}
+
+/* Link the time event in the wheel slot matching its expire time, that
+ * is the slot of the lowest level able to represent the distance between
+ * the current tick and the expire tick. The expire time is rounded up to
+ * the next tick so that a timer never fires earlier than requested. */
+static void aeWheelLink(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    long long tick = (te->when + AE_WHEEL_TICK_US - 1) / AE_WHEEL_TICK_US;
+    long long delta = tick - eventLoop->wheelTick;
+    long long span = 1LL << (AE_WHEEL_BITS*AE_WHEEL_LEVELS);
+    int level;
+
+    if (delta < 0) {
+        /* Already expired: fire it at the current tick. */
+        tick = eventLoop->wheelTick;
+        delta = 0;
+    } else if (delta >= span) {
+        /* Beyond the wheel range: park it in the farthest slot, it will
+         * be re-linked with its real expire time once cascaded. */
+        tick = eventLoop->wheelTick + span - 1;
+        delta = span - 1;
+    }
+    for (level = 0; level < AE_WHEEL_LEVELS-1; level++)
+        if (delta < (1LL << (AE_WHEEL_BITS*(level+1)))) break;
+
+    te->level = level;
+    te->slot = (tick >> (AE_WHEEL_BITS*level)) & AE_WHEEL_MASK;
+    te->prev = NULL;
+    te->next = eventLoop->wheel[level][te->slot];
+    if (te->next) te->next->prev = te;
+    eventLoop->wheel[level][te->slot] = te;
+    eventLoop->wheelUsed[level] |= 1ULL << te->slot;
+}
+
+static void aeWheelUnlink(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->prev)
+        te->prev->next = te->next;
+    else
+        eventLoop->wheel[te->level][te->slot] = te->next;
+    if (te->next) te->next->prev = te->prev;
+    if (eventLoop->wheel[te->level][te->slot] == NULL)
+        eventLoop->wheelUsed[te->level] &= ~(1ULL << te->slot);
+    te->prev = te->next = NULL;
+}
+
+/* Called every time the lower level completes a revolution: the events
+ * of the slot of the upper level(s) we just entered are moved down to
+ * the slots matching their expire time. */
+static void aeWheelCascade(aeEventLoop *eventLoop) {
+    int level;
+
+    for (level = 1; level < AE_WHEEL_LEVELS; level++) {
+        int slot = (eventLoop->wheelTick >> (AE_WHEEL_BITS*level)) &
+                   AE_WHEEL_MASK;
+        aeTimeEvent *te = eventLoop->wheel[level][slot];
+
+        eventLoop->wheel[level][slot] = NULL;
+        eventLoop->wheelUsed[level] &= ~(1ULL << slot);
+        while(te) {
+            aeTimeEvent *next = te->next;
+
+            aeWheelLink(eventLoop,te);
+            te = next;
+        }
+        /* Upper levels turn only when this one wrapped around. */
+        if (slot != 0) break;
+    }
+}
+
+/* Move the wheel forward, up to 'tick', stopping at the first non empty
+ * slot of level 0 or at the end of the current level 0 revolution,
+ * whatever comes first. */
+static void aeWheelAdvance(aeEventLoop *eventLoop, long long tick) {
+    long long cur = eventLoop->wheelTick;
+    long long next = (cur | AE_WHEEL_MASK) + 1;
+    int slot = cur & AE_WHEEL_MASK;
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    if (slot != AE_WHEEL_MASK) {
+        uint64_t used = eventLoop->wheelUsed[0] >> (slot+1);
+
+        if (used) next = cur + 1 + aeCtz64(used);
+    }
+    if (next > tick) next = tick;
+    eventLoop->wheelTick = next;
+    if ((next & AE_WHEEL_MASK) == 0) aeWheelCascade(eventLoop);
+}
+
+/* Return the number of microseconds before the wheel needs to be serviced
+ * again, that is the time of the nearest non empty slot of level 0, or of
+ * the nearest cascade of a non empty slot of an upper level. Since the
+ * occupancy of every level is tracked in a bitmap this is O(levels).
+ * If there are no timers -1 is returned. */
+static long long aeWheelNextTimeout(aeEventLoop *eventLoop) {
+    long long cur = eventLoop->wheelTick, nearest = -1, us;
+    int level;
+
+    for (level = 0; level < AE_WHEEL_LEVELS; level++) {
+        int shift = AE_WHEEL_BITS*level;
+        int slot = (cur >> shift) & AE_WHEEL_MASK;
+        uint64_t used = eventLoop->wheelUsed[level];
+        long long tick;
+
+        if (used == 0) continue;
+        used = aeRotateSlots(used,slot);
+        if (level == 0) {
+            tick = cur + aeCtz64(used);
+        } else {
+            /* The current slot of an upper level is cascaded only after a
+             * full revolution, so it is the farthest, not the nearest. */
+            used = (used >> 1) | (used << (AE_WHEEL_SIZE-1));
+            tick = ((cur >> shift) + aeCtz64(used) + 1) << shift;
+        }
+        if (nearest == -1 || tick < nearest) nearest = tick;
+    }
+    if (nearest == -1) return -1;
+    us = nearest*AE_WHEEL_TICK_US - aeMonotonicUs();
+    return us < 0 ? 0 : us;
+}
+
+/* Put the event in the list of the events to link in the wheel once the
+ * current slot is drained. */
+static void aePendingLink(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    te->level = AE_WHEEL_PENDING;
+    te->prev = NULL;
+    te->next = eventLoop->timeEventPending;
+    if (te->next) te->next->prev = te;
+    eventLoop->timeEventPending = te;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* Give the event an entry of eventLoop->timeEvents, and return its ID. */
+static long long aeTimeEventIdAlloc(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEventEntry *e;
+    int j;
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+    if (eventLoop->timeEventsFree == -1) {
+        int size = eventLoop->timeEventsSize ? eventLoop->timeEventsSize*2 : 16;
+
+        eventLoop->timeEvents = zrealloc(eventLoop->timeEvents,
+                                         sizeof(aeTimeEventEntry)*size);
+        for (j = eventLoop->timeEventsSize; j < size; j++) {
+            eventLoop->timeEvents[j].te = NULL;
+            eventLoop->timeEvents[j].gen = 1;
+            eventLoop->timeEvents[j].nextFree = j+1 < size ? j+1 : -1;
+        }
+        eventLoop->timeEventsFree = eventLoop->timeEventsSize;
+        eventLoop->timeEventsSize = size;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    j = eventLoop->timeEventsFree;
+    e = eventLoop->timeEvents+j;
+    eventLoop->timeEventsFree = e->nextFree;
+    e->te = te;
+    return ((long long)e->gen << 32) | j;
+}
+
+/* Return the event with the specified ID, or NULL. */
+static aeTimeEvent *aeTimeEventLookup(aeEventLoop *eventLoop, long long id) {
+    long long j = id & 0xffffffff;
+
+    if (id < 0 || j >= eventLoop->timeEventsSize) return NULL;
+    if (eventLoop->timeEvents[j].gen != (unsigned int)(id >> 32)) return NULL;
+    return eventLoop->timeEvents[j].te;
+}
+
+/* Free the entry of the event, bumping its generation. */
+static void aeTimeEventIdFree(aeEventLoop *eventLoop, long long id) {
+    int j = id & 0xffffffff;
+    aeTimeEventEntry *e = eventLoop->timeEvents+j;
+
+    e->te = NULL;
+    e->gen = (e->gen+1) & 0x7fffffff;
+    if (e->gen == 0) e->gen = 1;
+    e->nextFree = eventLoop->timeEventsFree;
+    eventLoop->timeEventsFree = j;
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc)
 {
-    long long id = eventLoop->timeEventNextId++;
     aeTimeEvent *te;
 
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
-    te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->id = aeTimeEventIdAlloc(eventLoop,te);
+    te->when = aeMonotonicUs() + milliseconds*1000;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = eventLoop->timeEventHead;
-    eventLoop->timeEventHead = te;
-    return id;
+    /* Events created by handlers are not fired in the same tick, not to
+     * loop forever. */
+    if (eventLoop->timeEventsProcessing)
+        aePendingLink(eventLoop,te);
+    else
+        aeWheelLink(eventLoop,te);
+    return te->id;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
+/* Delete a time event in constant time, finding it by its ID. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te, *prev = NULL;
+    aeTimeEvent *te = aeTimeEventLookup(eventLoop,id);
 
-    te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            if (prev == NULL)
-                eventLoop->timeEventHead = te->next;
-            else
-                prev->next = te->next;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            return AE_OK;
-        }
-        prev = te;
-        te = te->next;
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    aeTimeEventIdFree(eventLoop,id);
+
+    /* The event is running: flag it, processTimeEvents() will free it
+     * once the handler returns. */
+    if (te == eventLoop->timeEventFiring) {
+        te->id = AE_DELETED_EVENT_ID;
+        return AE_OK;
+    }
+
+    if (te->level == AE_WHEEL_PENDING) {
+        if (te->prev)
+            te->prev->next = te->next;
+        else
+            eventLoop->timeEventPending = te->next;
+        if (te->next) te->next->prev = te->prev;
+    } else {
+        aeWheelUnlink(eventLoop,te);
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    aeFreeTimeEvent(eventLoop,te);
+    return AE_OK;
 }
 
-/* Search the first timer to fire.
- * This operation is useful to know how many time the select can be
- * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
- *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
-{
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
+/* Fire all the events of the current slot of level 0. Events rescheduled
+ * by their handler, and events created by handlers, are put in the pending
+ * list and linked again in the wheel only when the slot is drained, in
+ * order to don't process them twice in the same tick and loop forever. */
+static int aeWheelFireSlot(aeEventLoop *eventLoop) {
+    int slot = eventLoop->wheelTick & AE_WHEEL_MASK;
+    int processed = 0;
+    aeTimeEvent *te;
 
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
+    while((te = eventLoop->wheel[0][slot]) != NULL) {
+        int retval;
+
+        aeWheelUnlink(eventLoop,te);
+        eventLoop->timeEventFiring = te;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        eventLoop->timeEventFiring = NULL;
+        processed++;
+        if (retval != AE_NOMORE && te->id != AE_DELETED_EVENT_ID) {
+            te->when = aeMonotonicUs() + (long long)retval*1000;
+            aePendingLink(eventLoop,te);
+        } else {
+            if (te->id != AE_DELETED_EVENT_ID)
+                aeTimeEventIdFree(eventLoop,te->id);
+            aeFreeTimeEvent(eventLoop,te);
+        }
     }
-    return nearest;
+    return processed;
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
+    long long now = aeMonotonicUs() / AE_WHEEL_TICK_US;
     aeTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+
+    eventLoop->timeEventsProcessing = 1;
+    while(1) {
+        processed += aeWheelFireSlot(eventLoop);
+        if (eventLoop->wheelTick >= now) break;
+        aeWheelAdvance(eventLoop,now);
     }
-    eventLoop->lastTime = now;
+    eventLoop->timeEventsProcessing = 0;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
+    te = eventLoop->timeEventPending;
+    eventLoop->timeEventPending = NULL;
     while(te) {
-        long now_sec, now_ms;
-        long long id;
+        aeTimeEvent *next = te->next;
 
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            /* After an event is processed our time event list may
-             * no longer be the same, so we restart from head.
-             * Still we make sure to don't process events registered
-             * by event handlers itself in order to don't loop forever.
-             * To do so we saved the max ID we want to handle.
-             *
-             * FUTURE OPTIMIZATIONS:
-             * Note that this is NOT great algorithmically. Redis uses
-             * a single time event so it's not a problem but the right
-             * way to do this is to add the new elements on head, and
-             * to flag deleted elements in a special way for later
-             * deletion (putting references to the nodes to delete into
-             * another linked list). */
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                aeDeleteTimeEvent(eventLoop, id);
-            }
-            te = eventLoop->timeEventHead;
-        } else {
-            te = te->next;
-        }
+        aeWheelLink(eventLoop,te);
+        te = next;
     }
     return processed;
 }
@@ -363,27 +606,16 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
     if (eventLoop->maxfd != -1 ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         int j;
-        aeTimeEvent *shortest = NULL;
+        long long us = -1;
         struct timeval tv, *tvp;
 
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
-            shortest = aeSearchNearestTimer(eventLoop);
-        if (shortest) {
-            long now_sec, now_ms;
-
-            /* Calculate the time missing for the nearest
-             * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            us = aeWheelNextTimeout(eventLoop);
+        if (us >= 0) {
+            /* Sleep until the nearest timer needs to be serviced. */
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms+1000) - now_ms)*1000;
-                tvp->tv_sec --;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms)*1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = us/1000000;
+            tvp->tv_usec = us%1000000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -417,6 +649,10 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
             processed++;
         }
+#ifdef AE_API_IO
+        /* Then the I/O operations that completed in the same wait. */
+        processed += aeApiProcessIo(eventLoop);
+#endif
     }
     /* Check time events */
     if (flags & AE_TIME_EVENTS)
@@ -33,6 +33,9 @@
 #ifndef __AE_H__
 #define __AE_H__
 
+#include <stdint.h>
+#include <stddef.h>
+
 #define AE_OK 0
 #define AE_ERR -1
 
@@ -46,6 +49,28 @@
 #define AE_DONT_WAIT 4
 
 #define AE_NOMORE -1
+#define AE_DELETED_EVENT_ID -1
+
+/* Time events are stored in a hierarchical timer wheel. Every level has
+ * AE_WHEEL_SIZE slots, a slot of level 0 spans a single tick of
+ * AE_WHEEL_TICK_US microseconds, and a slot of level N spans a whole
+ * revolution of level N-1. With the defaults the wheel covers ~28 minutes,
+ * timers further in the future are parked in the last slot of the last
+ * level and re-inserted as the wheel turns. */
+#define AE_WHEEL_BITS 6
+#define AE_WHEEL_SIZE (1<<AE_WHEEL_BITS)
+#define AE_WHEEL_MASK (AE_WHEEL_SIZE-1)
+#define AE_WHEEL_LEVELS 4
+#define AE_WHEEL_TICK_US 100
+#define AE_WHEEL_PENDING -1 /* Level of the events in the pending list */
+
+/* Reads and writes submitted with aeSubmitRead() and aeSubmitWritev() go
+ * through AE_IO_BUFFERS buffers of AE_IO_BUFSIZE bytes owned by the event
+ * loop. A read transfers at most one buffer, a write up to
+ * AE_IO_WRITE_BUFFERS contiguous ones. AE_IO_BUFFERS can't exceed 64. */
+#define AE_IO_BUFSIZE (1024*64)
+#define AE_IO_BUFFERS 64
+#define AE_IO_WRITE_BUFFERS 16
 
 /* Macros */
 #define AE_NOTUSED(V) ((void) V)
@@ -57,6 +82,9 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeIoProc(struct aeEventLoop *eventLoop, int fd, void *clientData, char *buf, int res);
+
+struct iovec;
 
 /* File event structure */
 typedef struct aeFileEvent {
@@ -69,14 +97,25 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic time in microseconds */
+    int level; /* wheel level holding this event, or AE_WHEEL_PENDING */
+    int slot;  /* slot of the level holding this event */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
+    struct aeTimeEvent *prev;
     struct aeTimeEvent *next;
 } aeTimeEvent;
 
+/* The ID of a time event is its index in eventLoop->timeEvents, with the
+ * generation of the entry in the upper 32 bits, so that the event is found
+ * in constant time and the ID of a deleted event is not reused right away. */
+typedef struct aeTimeEventEntry {
+    aeTimeEvent *te; /* NULL if the entry is free */
+    unsigned int gen;
+    int nextFree;    /* Next free entry, -1 if none */
+} aeTimeEventEntry;
+
 /* A fired event */
 typedef struct aeFiredEvent {
     int fd;
@@ -87,11 +126,17 @@ typedef struct aeFiredEvent {
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
-    long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    aeTimeEventEntry *timeEvents; /* Time events by ID */
+    int timeEventsSize;
+    int timeEventsFree; /* First free entry of timeEvents, -1 if none */
+    int timeEventsProcessing; /* True while processTimeEvents() runs */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent *wheel[AE_WHEEL_LEVELS][AE_WHEEL_SIZE]; /* Timer wheel */
+    uint64_t wheelUsed[AE_WHEEL_LEVELS]; /* Bitmap of non empty slots */
+    long long wheelTick; /* Current tick of the timer wheel */
+    aeTimeEvent *timeEventPending; /* Fired events waiting to be re-armed */
+    aeTimeEvent *timeEventFiring;  /* Event whose handler is running */
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
@@ -109,6 +154,7 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
+long long aeMonotonicUs(void);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
@@ -116,5 +162,12 @@ char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
+long long aeSubmitRead(aeEventLoop *eventLoop, int fd, size_t len,
+        aeIoProc *proc, void *clientData);
+long long aeSubmitWritev(aeEventLoop *eventLoop, int fd,
+        const struct iovec *iov, int iovcnt, aeIoProc *proc, void *clientData);
+long long aeSubmitFsync(aeEventLoop *eventLoop, int fd,
+        aeIoProc *proc, void *clientData);
+void aeCancelIo(aeEventLoop *eventLoop, long long id);
 
 #endif
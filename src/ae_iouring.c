@@ -0,0 +1,676 @@
+/* Linux io_uring(7) based ae.c module
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Every registered fd has a one shot IORING_OP_POLL_ADD in flight with the
+ * mask of its file events. Polls are (re)armed lazily: changing the mask of
+ * a fd only cancels its poll, and the fds whose poll was cancelled or fired
+ * are armed again right before waiting. This way all the poll changes of an
+ * event loop iteration, and the wait itself, take a single io_uring_enter(2).
+ *
+ * The user_data of a poll is the fd plus a per fd generation, bumped every
+ * time the poll is cancelled, so that completions of cancelled polls are
+ * recognized and dropped even if the fd was closed and reused meanwhile.
+ *
+ * The I/O operations of aeSubmitRead(), aeSubmitWritev() and aeSubmitFsync()
+ * are queued as well, and submitted by the same io_uring_enter(2) that waits,
+ * that also reaps their completions. Reads and writes use IORING_OP_READ_FIXED
+ * and IORING_OP_WRITE_FIXED on AE_IO_BUFFERS buffers registered with the
+ * ring, falling back to IORING_OP_READ and IORING_OP_WRITE on the same
+ * buffers if they can't be registered, for instance because of
+ * RLIMIT_MEMLOCK. A read first polls its fd, and takes a buffer only once
+ * the fd is readable, so that idle clients don't hold one, while a write
+ * copies its data right away into as many contiguous buffers as needed, so
+ * that large replies take a single operation. Their user_data
+ * is the index of the operation plus a generation, with AE_URING_IO set.
+ *
+ * No liburing: the rings are set up with the raw system calls. Kernel 5.11
+ * or greater is required for the timeout argument of io_uring_enter(2). */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+#define AE_API_IO
+
+#define AE_URING_ENTRIES 1024
+#define AE_URING_REMOVE (1ULL<<63) /* user_data flag of cancel ops. */
+#define AE_URING_IO (1ULL<<62)     /* user_data flag of I/O operations. */
+#define AE_URING_GEN_MASK 0x3fffffff
+
+/* States of an I/O operation. */
+#define AE_URING_IO_FREE 0
+#define AE_URING_IO_QUEUED 1    /* To submit before the next wait. */
+#define AE_URING_IO_POLL 2      /* Waiting for the fd to be ready. */
+#define AE_URING_IO_RUN 3       /* The operation itself is in flight. */
+#define AE_URING_IO_DONE 4      /* Completed, the handler is to be called. */
+
+typedef struct aeApiIo {
+    int state;
+    int op;             /* AE_IO_READ, AE_IO_WRITE or AE_IO_FSYNC. */
+    int fd;
+    unsigned events;    /* Poll the fd for them before the operation. */
+    int buf;            /* First I/O buffer of the operation, -1 if none. */
+    int nbufs;
+    unsigned len;
+    int res;
+    uint32_t gen;
+    aeIoProc *proc;     /* NULL once cancelled. */
+    void *clientData;
+    int next;           /* Next free entry, -1 if none. */
+} aeApiIo;
+
+typedef struct aeApiState {
+    int ringfd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    int *armed;         /* Mask of the poll in flight for every fd. */
+    uint32_t *gen;      /* Generation of the poll of every fd. */
+    int *dirty;         /* Fds to arm before waiting. */
+    int ndirty;
+    char *isdirty;
+    aeApiIo *io;        /* I/O operations by ID. */
+    int iosize;
+    int iofree;         /* First free entry of io, -1 if none. */
+    int *ioqueue;       /* Operations to submit before waiting. */
+    int nioqueue;
+    int *iodone;        /* Operations completed by the last wait. */
+    int niodone;
+    char *bufs;         /* The I/O buffers, allocated on first use. */
+    uint64_t freebufs;  /* Bitmap of the free I/O buffers. */
+    int fixed;          /* The I/O buffers are registered with the ring. */
+} aeApiState;
+
+static int aeApiUringEnter(aeApiState *state, unsigned to_submit,
+                           unsigned min_complete, unsigned flags,
+                           void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter,state->ringfd,to_submit,min_complete,
+                   flags,arg,argsz);
+}
+
+static unsigned aeApiUringPending(aeApiState *state) {
+    return *state->sq_tail - __atomic_load_n(state->sq_head,__ATOMIC_ACQUIRE);
+}
+
+/* Return a zeroed entry of the submission ring, to be published with
+ * aeApiUringCommit(). The ring is only flushed here when full, otherwise
+ * everything is submitted by aeApiPoll(). */
+static struct io_uring_sqe *aeApiUringGet(aeApiState *state) {
+    struct io_uring_sqe *sqe;
+
+    if (aeApiUringPending(state) == state->sq_entries) {
+        aeApiUringEnter(state,state->sq_entries,0,0,NULL,0);
+        if (aeApiUringPending(state) == state->sq_entries) return NULL;
+    }
+    sqe = state->sqes+(*state->sq_tail & *state->sq_mask);
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void aeApiUringCommit(aeApiState *state) {
+    unsigned tail = *state->sq_tail, idx = tail & *state->sq_mask;
+
+    state->sq_array[idx] = idx;
+    __atomic_store_n(state->sq_tail,tail+1,__ATOMIC_RELEASE);
+}
+
+/* Queue a poll or cancel operation. */
+static int aeApiUringQueue(aeApiState *state, int opcode, int fd,
+                           uint64_t addr, unsigned events, uint64_t data)
+{
+    struct io_uring_sqe *sqe = aeApiUringGet(state);
+
+    if (sqe == NULL) return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = addr;
+    sqe->poll32_events = events;
+    sqe->user_data = data;
+    aeApiUringCommit(state);
+    return 0;
+}
+
+static void aeApiMarkDirty(aeApiState *state, int fd) {
+    if (state->isdirty[fd]) return;
+    state->isdirty[fd] = 1;
+    state->dirty[state->ndirty++] = fd;
+}
+
+/* Cancel the poll in flight for 'fd' if its mask is not 'mask' anymore. */
+static void aeApiUpdatePoll(aeApiState *state, int fd, int mask) {
+    if (state->armed[fd] != AE_NONE && state->armed[fd] != mask) {
+        uint64_t data = ((uint64_t)state->gen[fd] << 32) | (uint32_t)fd;
+
+        aeApiUringQueue(state,IORING_OP_POLL_REMOVE,-1,data,0,
+                        data|AE_URING_REMOVE);
+        state->armed[fd] = AE_NONE;
+        state->gen[fd] = (state->gen[fd]+1) & AE_URING_GEN_MASK;
+    }
+    if (state->armed[fd] == AE_NONE && mask != AE_NONE)
+        aeApiMarkDirty(state,fd);
+}
+
+static int aeApiResizeArrays(aeApiState *state, int oldsize, int setsize) {
+    int j;
+
+    state->armed = zrealloc(state->armed,sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen,sizeof(uint32_t)*setsize);
+    state->dirty = zrealloc(state->dirty,sizeof(int)*setsize);
+    state->isdirty = zrealloc(state->isdirty,setsize);
+    for (j = oldsize; j < setsize; j++) {
+        state->armed[j] = AE_NONE;
+        state->gen[j] = 0;
+        state->isdirty[j] = 0;
+    }
+    return 0;
+}
+
+static char *aeApiIoBuffer(aeApiState *state, int buf) {
+    return state->bufs+(size_t)buf*AE_IO_BUFSIZE;
+}
+
+static uint64_t aeApiIoBufMask(int buf, int nbufs) {
+    return (nbufs == 64 ? ~0ULL : ((1ULL << nbufs)-1)) << buf;
+}
+
+static int aeApiIoFreeBuffers(aeApiState *state) {
+    return __builtin_popcountll(state->freebufs);
+}
+
+/* Allocate the I/O buffers, and register them with the ring if possible,
+ * so that the kernel doesn't map them again at every operation. They are
+ * registered as a single buffer, that fixed operations address in part, so
+ * that a write can span contiguous ones. */
+static int aeApiIoBuffers(aeApiState *state) {
+    struct iovec iov;
+
+    if (state->bufs) return 0;
+    state->bufs = mmap(NULL,(size_t)AE_IO_BUFFERS*AE_IO_BUFSIZE,
+                       PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (state->bufs == MAP_FAILED) {
+        state->bufs = NULL;
+        return -1;
+    }
+    state->freebufs = aeApiIoBufMask(0,AE_IO_BUFFERS);
+    iov.iov_base = state->bufs;
+    iov.iov_len = (size_t)AE_IO_BUFFERS*AE_IO_BUFSIZE;
+    state->fixed = syscall(__NR_io_uring_register,state->ringfd,
+                           IORING_REGISTER_BUFFERS,&iov,1) == 0;
+    return 0;
+}
+
+/* Take the first run of up to 'want' contiguous free buffers, the longest
+ * one if none is long enough. Returns the number of buffers taken, setting
+ * '*buf' to the first one, or 0 if they are all in use. */
+static int aeApiIoTakeBuffers(aeApiState *state, int want, int *buf) {
+    int j = 0, best = 0, bestlen = 0;
+
+    while (j < AE_IO_BUFFERS && bestlen < want) {
+        int start, len = 0;
+
+        while (j < AE_IO_BUFFERS && !(state->freebufs & (1ULL << j))) j++;
+        start = j;
+        while (j < AE_IO_BUFFERS && len < want &&
+               (state->freebufs & (1ULL << j))) { j++; len++; }
+        if (len > bestlen) {
+            best = start;
+            bestlen = len;
+        }
+    }
+    if (bestlen) state->freebufs &= ~aeApiIoBufMask(best,bestlen);
+    *buf = best;
+    return bestlen;
+}
+
+static int aeApiIoAlloc(aeApiState *state) {
+    int id;
+
+    if (state->iofree == -1) {
+        int j, size = state->iosize ? state->iosize*2 : 64;
+
+        state->io = zrealloc(state->io,sizeof(aeApiIo)*size);
+        state->ioqueue = zrealloc(state->ioqueue,sizeof(int)*size);
+        state->iodone = zrealloc(state->iodone,sizeof(int)*size);
+        for (j = state->iosize; j < size; j++) {
+            state->io[j].state = AE_URING_IO_FREE;
+            state->io[j].gen = 0;
+            state->io[j].next = j+1 < size ? j+1 : -1;
+        }
+        state->iofree = state->iosize;
+        state->iosize = size;
+    }
+    id = state->iofree;
+    state->iofree = state->io[id].next;
+    return id;
+}
+
+static void aeApiIoRelease(aeApiState *state, int id) {
+    aeApiIo *io = state->io+id;
+
+    if (io->buf != -1) state->freebufs |= aeApiIoBufMask(io->buf,io->nbufs);
+    io->state = AE_URING_IO_FREE;
+    io->gen = (io->gen+1) & AE_URING_GEN_MASK;
+    io->next = state->iofree;
+    state->iofree = id;
+}
+
+static uint64_t aeApiIoData(aeApiState *state, int id) {
+    return AE_URING_IO | ((uint64_t)state->io[id].gen << 32) | (uint32_t)id;
+}
+
+static void aeApiIoQueue(aeApiState *state, int id) {
+    state->io[id].state = AE_URING_IO_QUEUED;
+    state->ioqueue[state->nioqueue++] = id;
+}
+
+static long long aeApiSubmitIo(aeEventLoop *eventLoop, int op, int fd,
+        const struct iovec *iov, int iovcnt, size_t len, aeIoProc *proc,
+        void *clientData)
+{
+    aeApiState *state = eventLoop->apidata;
+    aeApiIo *io;
+    int id, buf = -1, nbufs = 0, j;
+
+    if (op != AE_IO_FSYNC && aeApiIoBuffers(state) == -1) return AE_ERR;
+    if (len > AE_IO_BUFSIZE) len = AE_IO_BUFSIZE;
+
+    /* Writes copy the data right away, reads take a buffer once the fd
+     * is readable. Writes to slow peers can hold their buffers for long, so
+     * a quarter of the buffers is left to the reads. */
+    if (op == AE_IO_WRITE) {
+        size_t size = 0, max = (size_t)AE_IO_WRITE_BUFFERS*AE_IO_BUFSIZE;
+        int want, spare = aeApiIoFreeBuffers(state)-AE_IO_BUFFERS/4;
+
+        for (j = 0; j < iovcnt && size < max; j++) size += iov[j].iov_len;
+        if (size > max) size = max;
+        want = (size+AE_IO_BUFSIZE-1)/AE_IO_BUFSIZE;
+        if (want > spare) want = spare;
+        if (want <= 0 || (nbufs = aeApiIoTakeBuffers(state,want,&buf)) == 0)
+            return AE_ERR;
+        max = (size_t)nbufs*AE_IO_BUFSIZE;
+        for (j = 0; j < iovcnt && len < max; j++) {
+            size_t n = iov[j].iov_len;
+
+            if (n > max-len) n = max-len;
+            memcpy(aeApiIoBuffer(state,buf)+len,iov[j].iov_base,n);
+            len += n;
+        }
+    }
+
+    id = aeApiIoAlloc(state);
+    io = state->io+id;
+    io->op = op;
+    io->fd = fd;
+    io->events = op == AE_IO_READ ? POLLIN : 0;
+    io->buf = buf;
+    io->nbufs = nbufs;
+    io->len = len;
+    io->res = 0;
+    io->proc = proc;
+    io->clientData = clientData;
+    aeApiIoQueue(state,id);
+    return ((long long)io->gen << 32) | id;
+}
+
+static void aeApiCancelIo(aeEventLoop *eventLoop, long long id) {
+    aeApiState *state = eventLoop->apidata;
+    int j = (int)(id & 0xffffffff);
+    aeApiIo *io;
+
+    if (id < 0 || j >= state->iosize) return;
+    io = state->io+j;
+    if (io->state == AE_URING_IO_FREE || io->gen != (uint32_t)(id >> 32) ||
+        io->proc == NULL) return;
+
+    /* Queued operations are dropped by aeApiPoll(), the ones in flight are
+     * released once the cancellation completes them. */
+    io->proc = NULL;
+    if (io->state == AE_URING_IO_POLL || io->state == AE_URING_IO_RUN)
+        aeApiUringQueue(state,IORING_OP_ASYNC_CANCEL,-1,aeApiIoData(state,j),
+                        0,AE_URING_REMOVE);
+}
+
+/* Queue the operation 'id' itself, its fd being ready. */
+static int aeApiUringQueueIo(aeApiState *state, int id) {
+    aeApiIo *io = state->io+id;
+    struct io_uring_sqe *sqe = aeApiUringGet(state);
+
+    if (sqe == NULL) return -1;
+    sqe->fd = io->fd;
+    sqe->user_data = aeApiIoData(state,id);
+    if (io->op == AE_IO_FSYNC) {
+        sqe->opcode = IORING_OP_FSYNC;
+    } else {
+        sqe->addr = (uint64_t)(uintptr_t)aeApiIoBuffer(state,io->buf);
+        sqe->len = io->len;
+        if (state->fixed) {
+            sqe->opcode = io->op == AE_IO_READ ? IORING_OP_READ_FIXED :
+                                                 IORING_OP_WRITE_FIXED;
+            sqe->buf_index = 0;
+        } else {
+            sqe->opcode = io->op == AE_IO_READ ? IORING_OP_READ :
+                                                 IORING_OP_WRITE;
+        }
+    }
+    aeApiUringCommit(state);
+    return 0;
+}
+
+/* Handle the completion of the poll or of the operation 'id'. */
+static void aeApiIoComplete(aeApiState *state, uint64_t data, int res) {
+    int id = (int)(data & 0xffffffff);
+    aeApiIo *io;
+
+    if (id >= state->iosize) return;
+    io = state->io+id;
+    if (io->state == AE_URING_IO_FREE ||
+        io->gen != ((data >> 32) & AE_URING_GEN_MASK)) return;
+    if (io->proc == NULL) {
+        aeApiIoRelease(state,id);
+        return;
+    }
+    if (io->state == AE_URING_IO_POLL) {
+        /* Ready, or the operation itself will report the error. */
+        io->events = 0;
+        aeApiIoQueue(state,id);
+    } else if (res == -EAGAIN && io->op != AE_IO_FSYNC) {
+        /* The fds are non blocking: wait until it is ready again. */
+        io->events = io->op == AE_IO_READ ? POLLIN : POLLOUT;
+        aeApiIoQueue(state,id);
+    } else {
+        io->state = AE_URING_IO_DONE;
+        io->res = res;
+        state->iodone[state->niodone++] = id;
+    }
+}
+
+/* Call the handlers of the I/O operations completed by the last wait. */
+static int aeApiProcessIo(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int j, processed = state->niodone;
+
+    for (j = 0; j < processed; j++) {
+        int id = state->iodone[j];
+        aeApiIo *io = state->io+id;
+        aeIoProc *proc = io->proc;
+        char *buf = io->buf == -1 ? NULL : aeApiIoBuffer(state,io->buf);
+        void *clientData = io->clientData;
+        int fd = io->fd, res = io->res;
+
+        /* The handler of a previous operation may have cancelled it. */
+        io->proc = NULL;
+        if (proc) proc(eventLoop,fd,clientData,buf,res);
+        aeApiIoRelease(state,id);
+    }
+    state->niodone = 0;
+    return processed;
+}
+
+static void aeApiUnmap(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqes_len);
+    if (state->cq_ptr && state->cq_ptr != state->sq_ptr)
+        munmap(state->cq_ptr,state->cq_len);
+    if (state->sq_ptr) munmap(state->sq_ptr,state->sq_len);
+    close(state->ringfd);
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+    struct io_uring_params p;
+    unsigned cq_entries = 2*AE_URING_ENTRIES;
+
+    if (!state) return -1;
+    memset(state,0,sizeof(*state));
+    state->iofree = -1;
+
+    /* Every registered fd can have a poll and an I/O operation completion
+     * pending. */
+    while (cq_entries < 2*(unsigned)eventLoop->setsize) cq_entries *= 2;
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP;
+    p.cq_entries = cq_entries;
+    state->ringfd = syscall(__NR_io_uring_setup,AE_URING_ENTRIES,&p);
+    if (state->ringfd == -1) {
+        zfree(state);
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_EXT_ARG)) goto err;
+
+    state->sq_entries = p.sq_entries;
+    state->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (state->cq_len > state->sq_len) state->sq_len = state->cq_len;
+        state->cq_len = state->sq_len;
+    }
+    state->sq_ptr = mmap(NULL,state->sq_len,PROT_READ|PROT_WRITE,MAP_SHARED,
+                         state->ringfd,IORING_OFF_SQ_RING);
+    if (state->sq_ptr == MAP_FAILED) {
+        state->sq_ptr = NULL;
+        goto err;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        state->cq_ptr = state->sq_ptr;
+    } else {
+        state->cq_ptr = mmap(NULL,state->cq_len,PROT_READ|PROT_WRITE,
+                             MAP_SHARED,state->ringfd,IORING_OFF_CQ_RING);
+        if (state->cq_ptr == MAP_FAILED) {
+            state->cq_ptr = NULL;
+            goto err;
+        }
+    }
+    state->sqes_len = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqes_len,PROT_READ|PROT_WRITE,MAP_SHARED,
+                       state->ringfd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        goto err;
+    }
+
+    state->sq_head = (unsigned*)((char*)state->sq_ptr+p.sq_off.head);
+    state->sq_tail = (unsigned*)((char*)state->sq_ptr+p.sq_off.tail);
+    state->sq_mask = (unsigned*)((char*)state->sq_ptr+p.sq_off.ring_mask);
+    state->sq_array = (unsigned*)((char*)state->sq_ptr+p.sq_off.array);
+    state->cq_head = (unsigned*)((char*)state->cq_ptr+p.cq_off.head);
+    state->cq_tail = (unsigned*)((char*)state->cq_ptr+p.cq_off.tail);
+    state->cq_mask = (unsigned*)((char*)state->cq_ptr+p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cq_ptr+p.cq_off.cqes);
+
+    aeApiResizeArrays(state,0,eventLoop->setsize);
+    eventLoop->apidata = state;
+    return 0;
+
+err:
+    aeApiUnmap(state);
+    zfree(state);
+    return -1;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+
+    return aeApiResizeArrays(state,eventLoop->setsize,setsize);
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    aeApiUnmap(state);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->dirty);
+    zfree(state->isdirty);
+    zfree(state->io);
+    zfree(state->ioqueue);
+    zfree(state->iodone);
+    if (state->bufs) munmap(state->bufs,(size_t)AE_IO_BUFFERS*AE_IO_BUFSIZE);
+    zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    aeApiUpdatePoll(state,fd,mask|eventLoop->events[fd].mask);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    aeApiUpdatePoll(state,fd,eventLoop->events[fd].mask & (~delmask));
+}
+
+/* Queue the I/O operations waiting to be submitted, polling their fd first
+ * if needed. Reads waiting for a buffer stay queued until one is released.
+ * Returns the number of reads and writes queued. */
+static int aeApiIoSubmit(aeApiState *state) {
+    int j, n, queued = 0;
+
+    for (j = 0, n = 0; j < state->nioqueue; j++) {
+        int id = state->ioqueue[j];
+        aeApiIo *io = state->io+id;
+
+        if (io->proc == NULL) {
+            aeApiIoRelease(state,id);
+        } else if (io->events) {
+            if (aeApiUringQueue(state,IORING_OP_POLL_ADD,io->fd,0,io->events,
+                                aeApiIoData(state,id)) == -1)
+                state->ioqueue[n++] = id;
+            else
+                io->state = AE_URING_IO_POLL;
+        } else if (io->op == AE_IO_READ && io->buf == -1 &&
+                   (io->nbufs = aeApiIoTakeBuffers(state,1,&io->buf)) == 0) {
+            io->buf = -1;
+            state->ioqueue[n++] = id;
+        } else {
+            if (aeApiUringQueueIo(state,id) == -1) {
+                state->ioqueue[n++] = id;
+            } else {
+                io->state = AE_URING_IO_RUN;
+                if (io->op != AE_IO_FSYNC) queued++;
+            }
+        }
+    }
+    state->nioqueue = n;
+    return queued;
+}
+
+/* Reap the completions, adding the fired file events after the first
+ * 'numevents' ones. Returns the number of fired file events. */
+static int aeApiUringReap(aeEventLoop *eventLoop, int numevents) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail;
+
+    head = *state->cq_head;
+    tail = __atomic_load_n(state->cq_tail,__ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = state->cqes+(head & *state->cq_mask);
+        uint64_t data = cqe->user_data;
+        int fd = (int)(data & 0xffffffff), mask = 0;
+
+        head++;
+        if (data & AE_URING_REMOVE) continue;
+        if (data & AE_URING_IO) {
+            aeApiIoComplete(state,data,cqe->res);
+            continue;
+        }
+        if (fd >= eventLoop->setsize || state->armed[fd] == AE_NONE ||
+            state->gen[fd] != (uint32_t)(data >> 32)) continue;
+
+        /* The poll is one shot, arm it again before the next wait. */
+        state->armed[fd] = AE_NONE;
+        aeApiMarkDirty(state,fd);
+        if (cqe->res < 0) continue;
+        if (cqe->res & POLLIN) mask |= AE_READABLE;
+        if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+        if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+        if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cq_head,head,__ATOMIC_RELEASE);
+    return numevents;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int j, numevents;
+
+    /* Arm the polls of the fds that fired or changed mask. */
+    for (j = 0; j < state->ndirty; j++) {
+        int fd = state->dirty[j], mask = eventLoop->events[fd].mask;
+        unsigned events = 0;
+
+        state->isdirty[fd] = 0;
+        if (mask == AE_NONE || state->armed[fd] != AE_NONE) continue;
+        if (mask & AE_READABLE) events |= POLLIN;
+        if (mask & AE_WRITABLE) events |= POLLOUT;
+        if (aeApiUringQueue(state,IORING_OP_POLL_ADD,fd,0,events,
+                ((uint64_t)state->gen[fd] << 32) | (uint32_t)fd) == 0)
+            state->armed[fd] = mask;
+    }
+    state->ndirty = 0;
+    aeApiIoSubmit(state);
+
+    /* Submit and wait with a single system call. */
+    memset(&arg,0,sizeof(arg));
+    if (tvp) {
+        ts.tv_sec = tvp->tv_sec;
+        ts.tv_nsec = tvp->tv_usec*1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    aeApiUringEnter(state,aeApiUringPending(state),1,
+                    IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                    &arg,sizeof(arg));
+    numevents = aeApiUringReap(eventLoop,0);
+
+    /* The reads whose fd became readable, and the writes whose fd became
+     * writable, are submitted right away: the fd being ready they complete
+     * during the submission, so that their handlers are called in this same
+     * event loop iteration. */
+    if (aeApiIoSubmit(state)) {
+        aeApiUringEnter(state,aeApiUringPending(state),0,0,NULL,0);
+        numevents = aeApiUringReap(eventLoop,numevents);
+    }
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return "io_uring";
+}
@@ -58,6 +58,10 @@ void clusterDelNode(clusterNode *delnode);
 
 void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void clusterReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+int clusterElectionTimerProc(aeEventLoop *el, long long id, void *privdata);
+int clusterHeartbeatTimerProc(aeEventLoop *el, long long id, void *privdata);
+void clusterUpdateCommitIndex(void);
+static mstime_t clusterRandomElectionTimeout(void);
 void clusterDoBeforeSleep(int flags);
 
 /* -----------------------------------------------------------------------------
@@ -151,7 +155,10 @@ fmterr:
 }
 
 void initClusterConfig(void) {
+    server.cluster_groups = PREZ_CLUSTER_DEFAULT_GROUPS;
+    server.groups = NULL;
     server.cluster = zmalloc(sizeof(clusterState));
+    server.cluster->id = 0;
     server.cluster->myself = NULL;
     server.cluster->size = 1;
     server.cluster->stats_bus_messages_sent = 0;
@@ -162,7 +169,9 @@ void initClusterConfig(void) {
     return;
 }
 
-void clusterInit(void) {
+/* Initialize the state of the currently selected Raft group. */
+static void clusterInitGroup(void) {
+    char logname[64];
 
     server.cluster->nodes = dictCreate(&clusterNodesDictType,NULL); // 保存所有节点
     server.cluster->state = PREZ_FOLLOWER; // 开始只能是跟随者
@@ -175,24 +184,123 @@ void clusterInit(void) {
     server.cluster->commit_index = 0;
     server.cluster->last_applied = 0;
     server.cluster->votes_granted = 0;
-
-    server.cluster->log_filename = zstrdup(PREZ_DEFAULT_LOG_FILENAME);
+    server.cluster->todo_before_sleep = 0;
+    server.cluster->log_sync_seq = 0;
+    server.cluster->log_synced_seq = 0;
+    server.cluster->log_sync_index = 0;
+    server.cluster->log_sync_acks = listCreate();
+
+    /* Group 0 keeps the historical log file name. */
+    if (server.cluster->id == 0)
+        snprintf(logname,sizeof(logname),"%s",PREZ_DEFAULT_LOG_FILENAME);
+    else
+        snprintf(logname,sizeof(logname),PREZ_GROUP_LOG_FILENAME,
+                server.cluster->id);
+    server.cluster->log_filename = zstrdup(logname);
     server.cluster->log_entries = listCreate();
     server.cluster->log_max_entries_per_request = PREZ_LOG_MAX_ENTRIES_PER_REQUEST;
 
-    server.cluster->last_activity_time = mstime();
+    server.cluster->watch_history = server.watch_history_len ?
+        zmalloc(sizeof(watchEvent)*server.watch_history_len) : NULL;
+    server.cluster->watch_history_start = 0;
+    server.cluster->watch_history_count = 0;
+    server.cluster->watch_history_first = 1;
+    server.cluster->compact_index = 0;
+    server.cluster->compacting = 0;
+    server.cluster->compact_cursor = 0;
+    server.cluster->deleted_index = 0;
+    server.cluster->expire_pending_index = 0;
+    server.cluster->leases = dictCreate(&leasesDictType,NULL);
+    server.cluster->lease_keepalives = dictCreate(&sdsSetDictType,NULL);
+    server.cluster->locks = dictCreate(&leasesDictType,NULL);
+    server.cluster->id_blocks = dictCreate(&idBlocksDictType,NULL);
+
+    server.cluster->last_activity_time = monotonicMstime();
 
     /* Load or create a new nodes configuration. */
     if (clusterLoadConfig(server.cluster_configfile) == PREZ_ERR) {
         /* No configuration found. We will just use the random name provided
-         * by the createClusterNode() function. */
+         * by the createClusterNode() function, the same in every group as
+         * clusterLinkGroups() finds the nodes of a peer by name. */
+        char *name = server.cluster->id ? server.groups[0]->myself->name :
+                                          NULL;
+
         myself = server.cluster->myself =
-            createClusterNode(NULL,PREZ_NODE_MYSELF);//PREZ_NODE_MYSELF|PREZ_NODE_MASTER);
-        prezLog(PREZ_NOTICE,"No cluster configuration found, I'm %.40s",
-                myself->name);
+            createClusterNode(name,PREZ_NODE_MYSELF);//PREZ_NODE_MYSELF|PREZ_NODE_MASTER);
+        if (name == NULL)
+            prezLog(PREZ_NOTICE,"No cluster configuration found, I'm %.40s",
+                    myself->name);
         clusterAddNode(myself);
     }
 
+    /* Set myself->port to my listening port, we'll just need to discover
+     * the IP address via MEET messages. */
+    myself->port = server.port;
+
+    /* Load Log File */
+    if (loadLogFile() == PREZ_OK)
+        prezLog(PREZ_NOTICE, "Prez log %s loaded from file",
+                server.cluster->log_filename);
+    else if (errno != ENOENT) {
+        prezLog(PREZ_WARNING,"Fatal error loading the prez log: %s. Exiting.",strerror(errno));
+    }
+    server.cluster->current_term = logCurrentTerm();
+    myself->match_index = logCurrentIndex();
+
+    /* Arm the election timer. */
+    server.cluster->current_election_timeout = clusterRandomElectionTimeout();
+    server.cluster->election_timer = aeCreateTimeEvent(server.el,
+            server.cluster->current_election_timeout,
+            clusterElectionTimerProc, server.cluster, NULL);
+    if (server.cluster->election_timer == AE_ERR)
+        prezPanic("Can't create the cluster election timer.");
+}
+
+/* Every Raft group has its own clusterNode for a given peer: make all of
+ * them reference the group 0 node, that owns the link with the peer, and
+ * let the group 0 node reference the nodes of every group. */
+static void clusterLinkGroups(void) {
+    dictIterator *di;
+    dictEntry *de;
+    int j;
+
+    clusterSelectGroup(0);
+    for (j = 0; j < server.cluster_groups; j++) {
+        di = dictGetSafeIterator(server.groups[j]->nodes);
+        while((de = dictNext(di)) != NULL) {
+            clusterNode *node = dictGetVal(de);
+            clusterNode *bus = clusterLookupNode(node->name);
+
+            prezAssert(bus != NULL);
+            if (bus->group_nodes == NULL)
+                bus->group_nodes = zcalloc(sizeof(clusterNode*)*
+                        server.cluster_groups);
+            bus->group_nodes[j] = node;
+            node->bus = bus;
+        }
+        dictReleaseIterator(di);
+    }
+}
+
+void clusterInit(void) {
+    int j;
+
+    /* The configuration was loaded in the state of group 0, the other
+     * groups start from a copy of it. */
+    server.groups = zmalloc(sizeof(clusterState*)*server.cluster_groups);
+    server.groups[0] = server.cluster;
+    for (j = 1; j < server.cluster_groups; j++) {
+        server.groups[j] = zmalloc(sizeof(clusterState));
+        memcpy(server.groups[j],server.groups[0],sizeof(clusterState));
+        server.groups[j]->id = j;
+    }
+
+    for (j = 0; j < server.cluster_groups; j++) {
+        clusterSelectGroup(j);
+        clusterInitGroup();
+    }
+    clusterLinkGroups();
+
     /* We need a listening TCP port for our cluster messaging needs. */
     server.cfd_count = 0;
 
@@ -212,17 +320,16 @@ void clusterInit(void) {
                         "file event.");
         }
     }
-    /* Set myself->port to my listening port, we'll just need to discover
-     * the IP address via MEET messages. */
-    myself->port = server.port;
+    if (server.cluster_groups > 1)
+        prezLog(PREZ_NOTICE,"Keyspace partitioned in %d Raft groups",
+                server.cluster_groups);
+}
 
-    /* Load Log File */
-    if (loadLogFile() == PREZ_OK)
-        prezLog(PREZ_NOTICE, "Prez log loaded from file");
-    else if (errno != ENOENT) {
-        prezLog(PREZ_WARNING,"Fatal error loading the prez log: %s. Exiting.",strerror(errno));
-    }
-    server.cluster->current_term = logCurrentTerm();
+/* Make 'id' the current Raft group: server.cluster and myself will refer
+ * to the state of this group until another group is selected. */
+void clusterSelectGroup(int id) {
+    server.cluster = server.groups[id];
+    myself = server.cluster->myself;
 }
 
 /* -----------------------------------------------------------------------------
@@ -233,6 +340,13 @@ static int compareIndices(const void *a, const void *b) {
         return (*(long long*)a)-(*(long long*)b);
 }
 
+/* Return a randomized election timeout between election_timeout and twice
+ * its value, so that split votes are unlikely to happen again. */
+static mstime_t clusterRandomElectionTimeout(void) {
+    return server.cluster->election_timeout +
+        random() % server.cluster->election_timeout;
+}
+
 static void reverseIndices(long long *indices, int size) {
     int i,j=size-1;
     long long temp;
@@ -261,6 +375,24 @@ clusterLink *createClusterLink(clusterNode *node) {
  * This function will just make sure that the original node associated
  * with this link will have the 'link' field set to NULL. */
 void freeClusterLink(clusterLink *link) {
+    int j;
+
+    /* Forget the AppendEntries answers waiting for an fsync to be sent
+     * here. */
+    for (j = 0; j < server.cluster_groups; j++) {
+        list *acks = server.groups[j]->log_sync_acks;
+        listIter li;
+        listNode *ln;
+
+        listRewind(acks,&li);
+        while ((ln = listNext(&li)) != NULL) {
+            clusterSyncAck *ack = listNodeValue(ln);
+
+            if (ack->link != link) continue;
+            zfree(ack);
+            listDelNode(acks,ln);
+        }
+    }
     if (link->fd != -1) {
         aeDeleteFileEvent(server.el, link->fd, AE_WRITABLE);
         aeDeleteFileEvent(server.el, link->fd, AE_READABLE);
@@ -320,11 +452,27 @@ void clusterAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 clusterNode *createClusterNode(char *nodename, int flags) {
     clusterNode *node = zmalloc(sizeof(*node));
 
-    if (nodename)
-        memcpy(node->name, nodename, PREZ_CLUSTER_NAMELEN);
-    else
+    /* Names shorter than PREZ_CLUSTER_NAMELEN are zero padded, so that
+     * the same name always maps to the same node table key. */
+    memset(node->name, 0, PREZ_CLUSTER_NAMELEN);
+    if (nodename) {
+        /* 'nodename' may be the name of another node, not null terminated
+         * when it takes all the PREZ_CLUSTER_NAMELEN bytes. */
+        char *end = memchr(nodename, '\0', PREZ_CLUSTER_NAMELEN);
+        size_t len = end ? (size_t)(end-nodename) : PREZ_CLUSTER_NAMELEN;
+
+        memcpy(node->name, nodename, len);
+    } else
         getRandomHexChars(node->name, PREZ_CLUSTER_NAMELEN);
     node->ctime = mstime();
+    node->flags = flags;
+    node->last_activity_time = 0;
+    node->last_sent_entry = NULL;
+    node->next_index = 1;
+    node->match_index = 0;
+    node->heartbeat_timer = -1;
+    node->bus = node;
+    node->group_nodes = NULL;
     node->link = NULL;
     memset(node->ip,0,sizeof(node->ip));
     node->port = 0;
@@ -337,7 +485,10 @@ void freeClusterNode(clusterNode *n) {
     nodename = sdsnewlen(n->name, PREZ_CLUSTER_NAMELEN);
     prezAssert(dictDelete(server.cluster->nodes,nodename) == DICT_OK);
     sdsfree(nodename);
+    if (n->heartbeat_timer != -1)
+        aeDeleteTimeEvent(server.el, n->heartbeat_timer);
     if (n->link) freeClusterLink(n->link);
+    zfree(n->group_nodes);
     zfree(n);
 }
 
@@ -389,52 +540,133 @@ void clusterRenameNode(clusterNode *node, char *newname) {
     clusterAddNode(node);
 }
 
-void clusterProcessCommand(prezClient *c) {
-    logEntry entry;
-    long long commit_index;
-    int j;
-    sds cmdrepr = sdsnew("");
+/* -----------------------------------------------------------------------------
+ * Key space handling
+ * -------------------------------------------------------------------------- */
+
+/* We have 16384 hash slots. The hash slot of a given key is obtained
+ * as the least significant 14 bits of the crc16 of the key.
+ *
+ * However if the key contains the {...} pattern, only the part between
+ * { and } is hashed. This may be useful in the future to force certain
+ * keys to be in the same node (assuming no resharding is in progress). */
+unsigned int keyHashSlot(char *key, int keylen) {
+    int s, e; /* start-end indexes of { and } */
+
+    for (s = 0; s < keylen; s++)
+        if (key[s] == '{') break;
+
+    /* No '{' ? Hash the whole key. This is the base case. */
+    if (s == keylen) return crc16(key,keylen) & 0x3FFF;
+
+    /* '{' found? Check if we have the corresponding '}'. */
+    for (e = s+1; e < keylen; e++)
+        if (key[e] == '}') break;
+
+    /* No '}' or nothing betweeen {} ? Hash the whole key. */
+    if (e == keylen || e == s+1) return crc16(key,keylen) & 0x3FFF;
+
+    /* If we are here there is both a { and a } on its right. Hash
+     * what is in the middle between { and }. */
+    return crc16(key+s+1,e-s-1) & 0x3FFF;
+}
+
+/* Return the Raft group the key belongs to. Hash slots are spread across
+ * the groups in a round robin fashion. */
+int clusterKeyGroup(robj *key) {
+    return keyHashSlot(key->ptr,sdslen(key->ptr)) % server.cluster_groups;
+}
 
-    memset(&entry,0,sizeof(logEntry));
+/* Return the Raft group that should process the command, that is the
+ * group of its keys, or group 0 for commands without keys. If the keys
+ * belong to different groups -1 is returned. */
+int clusterCommandGroup(struct prezCommand *cmd, robj **argv, int argc) {
+    int *keys, numkeys, j, group = 0;
+
+    keys = getKeysFromCommand(cmd,argv,argc,&numkeys);
+    for (j = 0; j < numkeys; j++) {
+        int keygroup = clusterKeyGroup(argv[keys[j]]);
+
+        if (j == 0) {
+            group = keygroup;
+        } else if (keygroup != group) {
+            group = -1;
+            break;
+        }
+    }
+    getKeysFreeResult(keys);
+    return group;
+}
 
-    entry.index = logCurrentIndex()+1;
-    entry.term = server.cluster->current_term;
-    memcpy(entry.commandName,c->cmd->name,strlen(c->cmd->name)+1);
+/* Append a command to the log of the selected group. Returns the index of
+ * the entry, or 0 if the command is too long to be logged. */
+long long clusterLogCommand(struct prezCommand *cmd, robj **argv, int argc) {
+    long long index;
+    int j;
+    sds cmdrepr = sdsempty();
 
-    for (j=0;j<c->argc;j++) {
-        cmdrepr = sdscatprintf(cmdrepr,(char*)c->argv[j]->ptr,
-                sdslen(c->argv[j]->ptr));
-        if (j != c->argc-1)
-            cmdrepr = sdscatlen(cmdrepr," ",1);
+    /* The arguments are quoted, so that logApply() can split them back
+     * whatever they contain. */
+    for (j = 0; j < argc; j++) {
+        if (j) cmdrepr = sdscatlen(cmdrepr," ",1);
+        cmdrepr = sdscatrepr(cmdrepr,argv[j]->ptr,sdslen(argv[j]->ptr));
+    }
+    if (sdslen(cmdrepr) > PREZ_LOG_MAX_ENTRY_LEN ||
+        strlen(cmd->name) >= PREZ_COMMAND_NAMELEN)
+    {
+        sdsfree(cmdrepr);
+        return 0;
     }
-    sdscatlen(cmdrepr,"\n",1);
-    memcpy(entry.command,cmdrepr,sdslen(cmdrepr));
+
+    index = logCurrentIndex()+1;
+    logWriteEntry(index,server.cluster->current_term,cmd->name,
+                  cmdrepr,sdslen(cmdrepr));
     sdsfree(cmdrepr);
 
-    logWriteEntry(entry);
-    logSync();
+    /* The log is written and fsynced in clusterBeforeSleep(), once for all
+     * the entries and all the groups written in this event loop iteration,
+     * then the entry is accounted for our own vote and sent to the
+     * followers, see clusterLogSynced(). */
+    clusterDoBeforeSleep(CLUSTER_TODO_FSYNC_LOG);
+    return index;
+}
 
-    if(dictSize(server.cluster->nodes) == 1) {
-        commit_index = logCurrentIndex();
-        logCommitIndex(commit_index);
-        prezLog(PREZ_DEBUG,"clusterProcessCommand: cmtidx: %lld",
-                commit_index);
-    } else {
-        dictAdd(server.cluster->proc_clients,
-                sdsfromlonglong(entry.index),c);
+/* Append the write command of the client to the log of the selected group,
+ * and queue it in the client requests, reusing 'r' if the caller already
+ * queued it, until it is committed. Returns the request, or 'r' itself if
+ * the command can't be logged, in which case the client gets an error. */
+clientRequest *clusterProcessCommand(prezClient *c, clientRequest *r) {
+    long long index = clusterLogCommand(c->cmd,c->argv,c->argc);
+
+    if (index == 0) {
+        addReplyError(c,"Command too long to be logged");
+        return r;
     }
+    if (r == NULL) r = clientQueueRequest(c);
+    r->group = server.cluster->id;
+    r->index = index;
+    r->term = server.cluster->current_term;
+    dictAdd(server.cluster->proc_clients,sdsfromlonglong(index),r);
+    return r;
 }
 
 int clusterProcessPacket(clusterLink *link) {
     clusterMsg *hdr = (clusterMsg*) link->rcvbuf;
     uint32_t totlen = ntohl(hdr->totlen);
     uint16_t type = ntohs(hdr->type);
+    uint16_t group = ntohs(hdr->group);
+    clusterNode *sender;
 
-    server.cluster->stats_bus_messages_received++;
     /* Perform sanity checks */
     if (totlen < 16) return 1; /* At least signature, version, totlen, count. */
     if (ntohs(hdr->ver) != 0) return 1; /* Can't handle versions other than 0.*/
     if (totlen > sdslen(link->rcvbuf)) return 1;
+    if (group >= server.cluster_groups) return 1;
+
+    /* All the groups share the link, process the message in the context
+     * of the group it is about. */
+    clusterSelectGroup(group);
+    server.cluster->stats_bus_messages_received++;
 
     if (type == CLUSTERMSG_TYPE_VOTEREQUEST) { // 处理投票请求
         uint32_t explen;
@@ -452,15 +684,31 @@ int clusterProcessPacket(clusterLink *link) {
         clusterProcessRequestVote(link, hdr->data.requestvote.vote);
 
     } else if (type == CLUSTERMSG_TYPE_APPENDENTRIES) { // 添加日志请求
+        clusterMsgDataAppendEntries *ae = &hdr->data.appendentries.entries;
         uint32_t explen;
+        int count, j;
+
         explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
-        explen += (sizeof(clusterMsgDataAppendEntries) -
-                (sizeof(logEntry)*PREZ_LOG_MAX_ENTRIES_PER_REQUEST) +
-                (ntohs(hdr->data.appendentries.entries.log_entries_count)) *
-                sizeof(logEntry));
+        explen += offsetof(clusterMsgDataAppendEntries,log_entries);
+        if (totlen < explen) return 1;
+
+        /* Every entry must fit in the message, with a valid command name. */
+        count = ntohs(ae->log_entries_count);
+        for (j = 0; j < count; j++) {
+            clusterMsgLogEntry *e = (clusterMsgLogEntry*)
+                ((unsigned char*)hdr+explen);
+            uint32_t commandlen;
+
+            if (totlen-explen < offsetof(clusterMsgLogEntry,command)) return 1;
+            commandlen = ntohl(e->commandlen);
+            if (commandlen > PREZ_LOG_MAX_ENTRY_LEN ||
+                totlen-explen < CLUSTERMSG_LOG_ENTRY_LEN(commandlen) ||
+                memchr(e->commandName,'\0',PREZ_COMMAND_NAMELEN) == NULL)
+                return 1;
+            explen += CLUSTERMSG_LOG_ENTRY_LEN(commandlen);
+        }
         prezLog(PREZ_DEBUG,"AE Recv Req: log_count:%d, sizeof: %u",
-                ntohs(hdr->data.appendentries.entries.log_entries_count),
-                explen);
+                count, explen);
         if (totlen != explen) return 1;
 
         prezLog(PREZ_DEBUG,"AE Recv Req: %s, term: %lld, "
@@ -470,7 +718,7 @@ int clusterProcessPacket(clusterLink *link) {
                 hdr->data.appendentries.entries.prev_log_index,
                 hdr->data.appendentries.entries.leader_commit_index);
 
-        clusterProcessAppendEntries(link, hdr->data.appendentries.entries);
+        clusterProcessAppendEntries(link, &hdr->data.appendentries.entries);
 
     } else if (type == CLUSTERMSG_TYPE_VOTEREQUEST_RESP) { // 回复添加投票结果请求
         uint32_t explen;
@@ -492,16 +740,35 @@ int clusterProcessPacket(clusterLink *link) {
         explen += sizeof(clusterMsgDataResponseAppendEntries);
         if (totlen != explen) return 1;
 
+        sender = clusterLookupNode(hdr->sender);
+        if (sender == NULL) return 1;
         prezLog(PREZ_DEBUG,"AE Recv Rep: %s, "
                 "term: %lld, idx: %lld, cmtidx: %lld, ok: %d",
-                link->node->name,
+                sender->name,
                 hdr->data.responseappendentries.entries.term,
                 hdr->data.responseappendentries.entries.index,
                 hdr->data.responseappendentries.entries.commit_index,
                 hdr->data.responseappendentries.entries.ok);
 
-        clusterProcessResponseAppendEntries(link,
+        clusterProcessResponseAppendEntries(sender,
                 hdr->data.responseappendentries.entries);
+
+    } else if (type == CLUSTERMSG_TYPE_LEASE_KEEPALIVE) {
+        clusterMsgDataLeaseKeepalive *ka =
+            &hdr->data.leasekeepalive.keepalive;
+        uint32_t explen, j, count;
+
+        explen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
+        explen += sizeof(clusterMsgDataLeaseKeepalive) -
+                  sizeof(ka->ids);
+        if (totlen < explen) return 1;
+        count = ntohl(ka->count);
+        if (count > PREZ_LEASE_MAX_KEEPALIVES_PER_MSG ||
+            totlen != explen + count*sizeof(long long)) return 1;
+
+        /* Only the leader keeps the deadlines of the leases. */
+        if (server.cluster->state != PREZ_LEADER) return 1;
+        for (j = 0; j < count; j++) leaseRenew(ka->ids[j]);
     }
 
     return 1;
@@ -632,10 +899,10 @@ void clusterBroadcastMessage(void *buf, size_t len) {
     while((de = dictNext(di)) != NULL) {
         clusterNode *node = dictGetVal(de);
 
-        if (!node->link) continue;
+        if (!node->bus->link) continue;
         if (node->flags & (PREZ_NODE_MYSELF))
             continue;
-        clusterSendMessage(node->link,buf,len);
+        clusterSendMessage(node->bus->link,buf,len);
     }
     dictReleaseIterator(di);
 }
@@ -649,6 +916,7 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     hdr->sig[2] = 'm';
     hdr->sig[3] = 'b';
     hdr->type = htons(type);
+    hdr->group = htons(server.cluster->id);
     memcpy(hdr->sender,myself->name,PREZ_CLUSTER_NAMELEN);
     hdr->port = htons(server.port);
     /* Compute the message length for certain messages. */
@@ -706,7 +974,7 @@ void clusterProcessRequestVote(clusterLink *link, clusterMsgDataRequestVote vote
     server.cluster->voted_for = candidateid;
     prezLog(PREZ_DEBUG, "RV Recv Req: Grant Vote for %s.", candidateid);
     clusterSendResponseVote(link, GRANT_VOTE);
-    server.cluster->last_activity_time = mstime();
+    server.cluster->last_activity_time = monotonicMstime();
     return;
 
 deny_vote:
@@ -720,6 +988,10 @@ void clusterProcessResponseVote(clusterLink *link,
 
     if (vote.vote_granted && vote.term == server.cluster->current_term) {
         server.cluster->votes_granted++;
+        /* Don't wait for the next cron tick to take over. */
+        if (server.cluster->state == PREZ_CANDIDATE &&
+            server.cluster->votes_granted >= quorumSize)
+            clusterBecomeLeader();
         return;
     }
 
@@ -735,57 +1007,80 @@ void clusterProcessResponseVote(clusterLink *link,
     }
 }
 
+/* Answer an AppendEntries request of the leader once the log is synced up
+ * to the entries appended so far, see clusterLogSynced(). The answers are
+ * sent in order, so the ones not waiting for an fsync don't overtake the
+ * others either. */
+static void clusterAckAppendEntries(clusterLink *link, int ok) {
+    clusterSyncAck *ack;
+
+    ack = zmalloc(sizeof(*ack));
+    ack->link = link;
+    ack->ok = ok;
+    ack->seq = server.cluster->log_sync_seq;
+    if (server.cluster->todo_before_sleep & CLUSTER_TODO_FSYNC_LOG)
+        ack->seq++;
+    if (ack->seq == server.cluster->log_synced_seq) {
+        clusterSendResponseAppendEntries(link,ok);
+        zfree(ack);
+        return;
+    }
+    listAddNodeTail(server.cluster->log_sync_acks,ack);
+}
+
 void clusterProcessAppendEntries(clusterLink *link,
-        clusterMsgDataAppendEntries entries) {
+        clusterMsgDataAppendEntries *entries) {
 
-    if (entries.term < server.cluster->current_term) {
+    if (entries->term < server.cluster->current_term) {
         prezLog(PREZ_DEBUG, "AE Recv Req: Out of date term");
-        clusterSendResponseAppendEntries(link, PREZ_ERR);
+        clusterAckAppendEntries(link, PREZ_ERR);
         return;
     }
-    server.cluster->last_activity_time = mstime();
+    server.cluster->last_activity_time = monotonicMstime();
 
-    if (entries.term == server.cluster->current_term) {
+    if (entries->term == server.cluster->current_term) {
         if (server.cluster->state == PREZ_CANDIDATE) {
             server.cluster->state = PREZ_FOLLOWER;
         }
-        server.cluster->leader = zstrdup(entries.leaderid);
+        server.cluster->leader = zstrdup(entries->leaderid);
     } else {
         server.cluster->state = PREZ_FOLLOWER;
-        server.cluster->current_term = entries.term;
-        server.cluster->leader = zstrdup(entries.leaderid);
+        server.cluster->current_term = entries->term;
+        server.cluster->leader = zstrdup(entries->leaderid);
         server.cluster->voted_for = sdsempty();
     }
 
-    if (logVerifyAppend(entries.prev_log_index, entries.prev_log_term)) {
+    if (logVerifyAppend(entries->prev_log_index, entries->prev_log_term)) {
         prezLog(PREZ_DEBUG, "AE Recv Req: log verify error");
-        clusterSendResponseAppendEntries(link, PREZ_ERR);
+        clusterAckAppendEntries(link, PREZ_ERR);
         return;
     }
 
     if (logAppendEntries(entries)) {
         prezLog(PREZ_DEBUG, "AE Recv Req: log append entries error");
-        clusterSendResponseAppendEntries(link, PREZ_ERR);
+        clusterAckAppendEntries(link, PREZ_ERR);
         return;
     }
+    if (entries->log_entries_count)
+        clusterDoBeforeSleep(CLUSTER_TODO_FSYNC_LOG);
 
-    if (logCommitIndex(entries.leader_commit_index)) {
+    if (logCommitIndex(entries->leader_commit_index)) {
         prezLog(PREZ_DEBUG, "AE Recv Req: log commit entries error");
-        clusterSendResponseAppendEntries(link, PREZ_ERR);
+        clusterAckAppendEntries(link, PREZ_ERR);
         return;
     }
 
-    clusterSendResponseAppendEntries(link, PREZ_OK);
+    clusterAckAppendEntries(link, PREZ_OK);
 }
 
-void clusterProcessResponseAppendEntries(clusterLink *link,
+void clusterProcessResponseAppendEntries(clusterNode *node,
         clusterMsgDataResponseAppendEntries entries) {
-    clusterNode *node = link->node;
-
     if (entries.ok == PREZ_OK) {
         if (node->last_sent_entry) {
             node->next_index = node->last_sent_entry->log_entry.index+1;
             node->match_index = node->last_sent_entry->log_entry.index;
+            if (server.cluster->state == PREZ_LEADER)
+                clusterUpdateCommitIndex();
         }
     } else {
         if (entries.term > server.cluster->current_term) {
@@ -838,8 +1133,8 @@ void clusterSendResponseVote(clusterLink *link, int vote_granted) {
     clusterSendMessage(link,buf,ntohl(hdr->totlen));
 }
 
-void clusterSendHeartbeat(clusterLink *link) {
-    clusterSendAppendEntries(link);
+void clusterSendHeartbeat(clusterNode *node) {
+    clusterSendAppendEntries(node);
 }
 
 void clusterSendResponseAppendEntries(clusterLink *link, int ok) {
@@ -865,15 +1160,73 @@ void clusterSendResponseAppendEntries(clusterLink *link, int ok) {
     clusterSendMessage(link,buf,ntohl(hdr->totlen));
 }
 
+/* Forward the keep-alives of the leases of the selected group, collected
+ * since the previous call, to its leader, packing up to
+ * PREZ_LEASE_MAX_KEEPALIVES_PER_MSG of them in every message. They are
+ * dropped if the leader is unknown or not connected: the clients keep
+ * sending them every fraction of the TTL anyway. */
+void clusterSendLeaseKeepalives(void) {
+    unsigned char buf[sizeof(clusterMsg)];
+    clusterMsg *hdr = (clusterMsg*) buf;
+    clusterMsgDataLeaseKeepalive *ka = &hdr->data.leasekeepalive.keepalive;
+    char name[PREZ_CLUSTER_NAMELEN];
+    clusterNode *leader = NULL;
+    dictIterator *di;
+    dictEntry *de;
+    unsigned long left = dictSize(server.cluster->lease_keepalives);
+    uint32_t count = 0, totlen;
+
+    if (left == 0) return;
+    if (server.cluster->leader && server.cluster->leader[0]) {
+        size_t len = strlen(server.cluster->leader);
+
+        /* Node names are zero padded, see createClusterNode(). */
+        if (len > sizeof(name)) len = sizeof(name);
+        memset(name,0,sizeof(name));
+        memcpy(name,server.cluster->leader,len);
+        leader = clusterLookupNode(name);
+    }
+    if (leader && leader->bus->link) {
+        clusterBuildMessageHdr(hdr,CLUSTERMSG_TYPE_LEASE_KEEPALIVE);
+        di = dictGetIterator(server.cluster->lease_keepalives);
+        while((de = dictNext(di)) != NULL) {
+            sds id = dictGetKey(de);
+
+            string2ll(id,sdslen(id),&ka->ids[count++]);
+            left--;
+            if (count == PREZ_LEASE_MAX_KEEPALIVES_PER_MSG || left == 0) {
+                totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
+                totlen += sizeof(*ka)-sizeof(ka->ids)+count*sizeof(long long);
+                ka->count = htonl(count);
+                hdr->totlen = htonl(totlen);
+                clusterSendMessage(leader->bus->link,buf,totlen);
+                server.stat_lease_keepalives_forwarded += count;
+                count = 0;
+            }
+        }
+        dictReleaseIterator(di);
+    }
+    dictEmpty(server.cluster->lease_keepalives,NULL);
+}
+
 // 发送心跳给follower
-void clusterSendAppendEntries(clusterLink *link) {
+/* The entries are sent up to log_max_entries_per_request entries and
+ * PREZ_LOG_MAX_BYTES_PER_REQUEST bytes per message, but at least one. */
+void clusterSendAppendEntries(clusterNode *node) {
     unsigned char buf[sizeof(clusterMsg)];
     clusterMsg *hdr =  (clusterMsg*) buf;
-    clusterNode *node = link->node;
-    listNode *ln, *ln_next;
+    size_t hdrlen = sizeof(clusterMsg)-sizeof(union clusterMsgData)+
+                    offsetof(clusterMsgDataAppendEntries,log_entries);
+    clusterLink *link = node->bus->link;
+    listNode *ln;
     logEntryNode *le_node;
-    int logcount = 0, totlen;
+    int logcount = 0;
+    sds msg;
 
+    if (link == NULL) return;
+    /* Don't pile up more copies of the same entries on a link still busy
+     * sending the previous ones, the heartbeats would queue behind. */
+    if (sdslen(link->sndbuf) > PREZ_LOG_MAX_BYTES_PER_REQUEST) return;
     clusterBuildMessageHdr(hdr, CLUSTERMSG_TYPE_APPENDENTRIES);
     // 当前leader的期限
     hdr->data.appendentries.entries.term = server.cluster->current_term;
@@ -887,46 +1240,51 @@ void clusterSendAppendEntries(clusterLink *link) {
         server.cluster->commit_index;
     node->last_sent_entry = NULL;
 
+    /* The entries are appended after the fixed part of the message. */
+    msg = sdsnewlen(buf,hdrlen);
     if (logCurrentIndex() >= node->next_index) {
         ln = getLogNode(node->next_index);
         while(ln && logcount < server.cluster->log_max_entries_per_request) {
+            size_t commandlen, len;
+            clusterMsgLogEntry *e;
+
             le_node = listNodeValue(ln);
-            hdr->data.appendentries.entries.log_entries[logcount].term =
-                le_node->log_entry.term;
-            hdr->data.appendentries.entries.log_entries[logcount].index =
-                le_node->log_entry.index;
-            memcpy(hdr->data.appendentries.entries.log_entries[logcount].commandName,
-                    le_node->log_entry.commandName,
-                    strlen(le_node->log_entry.commandName));
-            memcpy(hdr->data.appendentries.entries.log_entries[logcount].command,
-                    le_node->log_entry.command,
-                    strlen(le_node->log_entry.command));
+            commandlen = sdslen(le_node->log_entry.command);
+            len = CLUSTERMSG_LOG_ENTRY_LEN(commandlen);
+            if (logcount &&
+                sdslen(msg)-hdrlen+len > PREZ_LOG_MAX_BYTES_PER_REQUEST)
+                break;
+
+            msg = sdsMakeRoomFor(msg,len);
+            e = (clusterMsgLogEntry*) (msg+sdslen(msg));
+            memset(e,0,len);
+            e->index = le_node->log_entry.index;
+            e->term = le_node->log_entry.term;
+            memcpy(e->commandName,le_node->log_entry.commandName,
+                   PREZ_COMMAND_NAMELEN);
+            e->commandlen = htonl(commandlen);
+            memcpy(e->command,le_node->log_entry.command,commandlen);
+            sdsIncrLen(msg,len);
             prezLog(PREZ_DEBUG,"AE Send Req: term:%lld, idx:%lld, cmd:%s, cmd:%s",
-                    hdr->data.appendentries.entries.log_entries[logcount].term,
-                    hdr->data.appendentries.entries.log_entries[logcount].index,
-                    hdr->data.appendentries.entries.log_entries[logcount].commandName,
-                    hdr->data.appendentries.entries.log_entries[logcount].command);
+                    le_node->log_entry.term,
+                    le_node->log_entry.index,
+                    le_node->log_entry.commandName,
+                    le_node->log_entry.command);
 
-            ln_next = listNextNode(ln);
             logcount++;
-            node->last_sent_entry = listNodeValue(ln);
-            ln = ln_next;
+            node->last_sent_entry = le_node;
+            ln = listNextNode(ln);
         }
     }
+    hdr = (clusterMsg*) msg;
     hdr->data.appendentries.entries.log_entries_count = htons(logcount);
+    hdr->totlen = htonl(sdslen(msg));
 
-    totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
-    totlen += (sizeof(clusterMsgDataAppendEntries) -
-            (sizeof(logEntry)*PREZ_LOG_MAX_ENTRIES_PER_REQUEST));
-    totlen += (sizeof(logEntry)*logcount);
-    hdr->totlen = htonl(totlen);
-
-    prezLog(PREZ_DEBUG, "AE Send Req: %s, logcount: %d, totlen: %d",
-            node->name,
-            ntohs(hdr->data.appendentries.entries.log_entries_count),
-            totlen);
+    prezLog(PREZ_DEBUG, "AE Send Req: %s, logcount: %d, totlen: %lu",
+            node->name, logcount, (unsigned long) sdslen(msg));
 
-    clusterSendMessage(link,buf,ntohl(hdr->totlen));
+    clusterSendMessage(link,(unsigned char*)msg,sdslen(msg));
+    sdsfree(msg);
 }
 
 void clusterUpdateCommitIndex(void) {
@@ -958,7 +1316,6 @@ void clusterUpdateCommitIndex(void) {
     if (commit_index > server.cluster->commit_index &&
         server.cluster->current_term == logGetTerm(commit_index))
     {
-        logSync();
         server.cluster->commit_index = commit_index;
         prezLog(PREZ_DEBUG, "Upd cmtidx: %lld",
                 commit_index);
@@ -966,9 +1323,222 @@ void clusterUpdateCommitIndex(void) {
     zfree(log_indices);
 }
 
-void clusterDoBeforeSleep(int flags)
+/* -----------------------------------------------------------------------------
+ * CLUSTER timers
+ * -------------------------------------------------------------------------- */
+
+/* Election timer. Instead of being polled by clusterCron() at server.hz,
+ * the election timeout is a time event of its own: when it fires and the
+ * last activity from a leader or candidate is older than the randomized
+ * timeout a new election is started, otherwise the timer is re-armed for
+ * the remaining time only. */
+int clusterElectionTimerProc(aeEventLoop *el, long long id, void *privdata) {
+    clusterState *group = privdata;
+    mstime_t elapsed;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(id);
+
+    clusterSelectGroup(group->id);
+    if (server.cluster->state == PREZ_LEADER) {
+        /* Keep the timer idle while we lead, so that it restarts counting
+         * from the time we step down. */
+        server.cluster->last_activity_time = monotonicMstime();
+        return server.cluster->current_election_timeout;
+    }
+
+    elapsed = monotonicMstime() - server.cluster->last_activity_time;
+    if (elapsed < server.cluster->current_election_timeout)
+        return server.cluster->current_election_timeout - elapsed;
+
+    clusterStartElection();
+    return server.cluster->current_election_timeout;
+}
+
+/* Heartbeat timer. It is armed for every peer as soon as we become the
+ * leader of a group, and sends AppendEntries every heartbeat_interval
+ * milliseconds regardless of server.hz. A single timer serves all the
+ * groups we lead, so that the heartbeats of all the groups are queued in
+ * the same link buffer and flushed with a single write. The timer removes
+ * itself once we are no longer the leader of any group. */
+int clusterHeartbeatTimerProc(aeEventLoop *el, long long id, void *privdata) {
+    clusterNode *bus = privdata;
+    int j, leading = 0;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(id);
+
+    for (j = 0; j < server.cluster_groups; j++) {
+        clusterNode *node = bus->group_nodes[j];
+
+        clusterSelectGroup(j);
+        if (server.cluster->state != PREZ_LEADER) continue;
+        leading++;
+        if (node && bus->link) {
+            node->last_activity_time = monotonicMstime();
+            clusterSendHeartbeat(node);
+        }
+    }
+    if (!leading) {
+        bus->heartbeat_timer = -1;
+        return AE_NOMORE;
+    }
+    return server.groups[0]->heartbeat_interval;
+}
+
+void clusterStartElection(void) {
+    server.cluster->last_activity_time = monotonicMstime();
+    server.cluster->current_election_timeout = clusterRandomElectionTimeout();
+    prezLog(PREZ_NOTICE, "Changing State to Candidate, group: %d, term: %lld",
+            server.cluster->id, server.cluster->current_term);
+
+    /* Change to Candidate State */
+    server.cluster->state = PREZ_CANDIDATE;
+    server.cluster->leader = sdsempty();
+
+    /* Vote for self */
+    server.cluster->voted_for = zstrdup(server.name);
+    server.cluster->votes_granted = 1;
+
+    /* Build Request Vote and Broadcast */
+    clusterSendRequestVote();
+
+    /* A single node cluster elects itself. */
+    if (server.cluster->votes_granted >= quorumSize)
+        clusterBecomeLeader();
+}
+
+void clusterBecomeLeader(void) {
+    long long last_log_index;
+    dictIterator *di;
+    dictEntry *de;
+
+    prezLog(PREZ_DEBUG, "nodes/quorum: %lu/%lu, "
+            "Changing State to Leader",
+            dictSize(server.cluster->nodes), quorumSize);
+    prezLog(PREZ_NOTICE, "Changing State to Leader, group: %d, term: %lld",
+           server.cluster->id, server.cluster->current_term);
+    server.cluster->state = PREZ_LEADER;
+    server.cluster->leader = zstrdup(server.name);
+    myself->match_index = logCurrentIndex();
+    leaseResetExpires();
+
+    last_log_index = logCurrentIndex();
+
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) { // 更新所以从节点信息
+        clusterNode *node = dictGetVal(de);
+
+        if (node->flags & (PREZ_NODE_MYSELF|PREZ_NODE_NOADDR)) continue;
+        node->next_index = last_log_index+1;
+        node->match_index = 0;
+        node->last_sent_entry = NULL;
+
+        /* Assert our leadership right away with the first heartbeat. */
+        clusterSendHeartbeat(node);
+        if (node->bus->heartbeat_timer == -1)
+            node->bus->heartbeat_timer = aeCreateTimeEvent(server.el,
+                    server.cluster->heartbeat_interval,
+                    clusterHeartbeatTimerProc, node->bus, NULL);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Send the entries appended in this event loop iteration to the followers
+ * of the current group right away, instead of waiting for the heartbeat.
+ * Followers that were already sent the last entry are skipped. */
+static void clusterReplicateNewEntries(void) {
+    long long last_index = logCurrentIndex();
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetSafeIterator(server.cluster->nodes);
+    while((de = dictNext(di)) != NULL) {
+        clusterNode *node = dictGetVal(de);
+
+        if (node->flags & (PREZ_NODE_MYSELF|PREZ_NODE_NOADDR)) continue;
+        if (node->last_sent_entry &&
+            node->last_sent_entry->log_entry.index >= last_index) continue;
+        clusterSendAppendEntries(node);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Apply the committed entries of the current group to the state machine. */
+static void clusterApplyCommitted(void) {
+    if (server.cluster->commit_index <= server.cluster->last_applied) return;
+    while (server.cluster->commit_index > server.cluster->last_applied) {
+        server.cluster->last_applied++;
+        logApply(server.cluster->last_applied);
+    }
+    watchNotifyClients(server.cluster->last_applied);
+    lockWakeWaiters();
+}
+
+/* Called once the log of the group 'clientData' is synced, or failed to, see
+ * clusterBeforeSleep(): the entries written before are accounted for our own
+ * vote, and the AppendEntries requests they came with are answered. */
+static void clusterLogSynced(aeEventLoop *el, int fd, void *clientData,
+                             char *buf, int res)
 {
-    return;
+    int id = server.cluster->id;
+    listNode *ln;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(fd);
+    PREZ_NOTUSED(buf);
+
+    clusterSelectGroup((long)clientData);
+    server.cluster->log_synced_seq++;
+    if (res == 0) {
+        myself->match_index = server.cluster->log_sync_index;
+        if (server.cluster->state == PREZ_LEADER) {
+            clusterUpdateCommitIndex();
+            clusterReplicateNewEntries();
+        }
+    } else {
+        prezLog(PREZ_WARNING,"Error syncing the prez log %s: %s",
+            server.cluster->log_filename, strerror(-res));
+    }
+
+    while ((ln = listFirst(server.cluster->log_sync_acks)) != NULL) {
+        clusterSyncAck *ack = listNodeValue(ln);
+
+        if (ack->seq > server.cluster->log_synced_seq) break;
+        clusterSendResponseAppendEntries(ack->link,
+            res == 0 ? ack->ok : PREZ_ERR);
+        zfree(ack);
+        listDelNode(server.cluster->log_sync_acks,ln);
+    }
+    clusterSelectGroup(id);
+}
+
+/* This function is called before the event handler returns to sleep for
+ * events. It is useful to perform operations that must be done ASAP in
+ * reaction to events fired but that are not safe to perform inside event
+ * handlers, or to perform potentially expansive tasks that we need to do
+ * a single time before replying to clients.
+ *
+ * Here the logs written in this event loop iteration are fsynced, once per
+ * group no matter how many entries were appended. The fsync is submitted to
+ * the event loop when it can perform it, see logSync(), and a group only
+ * has one in flight: the entries written meanwhile wait for the next one. */
+void clusterBeforeSleep(void) {
+    int j;
+
+    for (j = 0; j < server.cluster_groups; j++) {
+        clusterSelectGroup(j);
+        if (server.cluster->todo_before_sleep & CLUSTER_TODO_FSYNC_LOG &&
+            server.cluster->log_sync_seq == server.cluster->log_synced_seq)
+        {
+            server.cluster->todo_before_sleep &= ~CLUSTER_TODO_FSYNC_LOG;
+            server.cluster->log_sync_seq++;
+            server.cluster->log_sync_index = logCurrentIndex();
+            logSync(clusterLogSynced,(void*)(long)j);
+        }
+        clusterApplyCommitted();
+    }
+}
+
+void clusterDoBeforeSleep(int flags) {
+    server.cluster->todo_before_sleep |= flags;
 }
 
 /* -----------------------------------------------------------------------------
@@ -976,13 +1546,13 @@ void clusterDoBeforeSleep(int flags)
  * -------------------------------------------------------------------------- */
 
 void clusterCron(void) {
-    mstime_t now = mstime();
-    mstime_t election_timeout;
-    long long last_log_index;
     dictIterator *di;
     dictEntry *de;
+    int j;
 
-    /* Check if we have disconnected nodes and re-establish the connection. */
+    /* Check if we have disconnected nodes and re-establish the connection.
+     * Links are owned by the nodes of group 0 and shared by all groups. */
+    clusterSelectGroup(0);
     di = dictGetSafeIterator(server.cluster->nodes);
     while((de = dictNext(di)) != NULL) {
         clusterNode *node = dictGetVal(de);
@@ -1004,7 +1574,7 @@ void clusterCron(void) {
             link = createClusterLink(node);
             link->fd = fd;
             node->link = link;
-            node->last_activity_time = mstime();
+            node->last_activity_time = monotonicMstime();
             aeCreateFileEvent(server.el,link->fd,AE_READABLE,
                     clusterReadHandler,link);
 
@@ -1014,76 +1584,21 @@ void clusterCron(void) {
     }
     dictReleaseIterator(di);
 
-    /* Apply to state machine if possible */
-    while (server.cluster->commit_index > server.cluster->last_applied) {
-        server.cluster->last_applied++;
-        logApply(server.cluster->last_applied);
-    }
-
-    election_timeout = server.cluster->election_timeout + /* Fixed delay. */
-        random() % server.cluster->election_timeout; /* Random delay between 0
-                                                        and election_timeout ms */
-
-    // 候选人定时器超时
-    if (server.cluster->state != PREZ_LEADER &&
-            now - server.cluster->last_activity_time > election_timeout) {
-        server.cluster->last_activity_time = mstime();
-        prezLog(PREZ_NOTICE, "Changing State to Candidate, term: %lld",
-                server.cluster->current_term);
-
-        /* Change to Candidate State */
-        server.cluster->state = PREZ_CANDIDATE;
-        server.cluster->leader = sdsempty();
-
-        /* Vote for self */
-        server.cluster->voted_for = zstrdup(server.name);
-        server.cluster->votes_granted = 1;
+    for (j = 0; j < server.cluster_groups; j++) {
+        clusterSelectGroup(j);
 
-        /* Build Request Vote and Broadcast */
-        clusterSendRequestVote();
-    }
+        /* Apply to state machine if possible */
+        clusterApplyCommitted();
+        compactCycle();
 
-    /* Candidate */
-    if (server.cluster->state == PREZ_CANDIDATE) {
-        if (server.cluster->votes_granted >= quorumSize) { // 如果超过一半的节点投票, 那么成为leader
-            prezLog(PREZ_DEBUG, "nodes/quorum: %lu/%lu, "
-                    "Changing State to Leader",
-                    dictSize(server.cluster->nodes), quorumSize);
-            prezLog(PREZ_NOTICE, "Changing State to Leader, term: %lld",
-                   server.cluster->current_term);
-            server.cluster->state = PREZ_LEADER;
-            server.cluster->leader = zstrdup(server.name);
-
-            last_log_index = logCurrentIndex();
-
-            di = dictGetSafeIterator(server.cluster->nodes);
-            while((de = dictNext(di)) != NULL) { // 更新所以从节点信息
-                clusterNode *node = dictGetVal(de);
-
-                if (node->flags & (PREZ_NODE_MYSELF|PREZ_NODE_NOADDR)) continue;
-                node->next_index = last_log_index+1;
-                node->match_index = 0;
-            }
-        }
-    }
-
-    /* Leader */
-    // Send heartbeat to all peers
-    if (server.cluster->state == PREZ_LEADER) {
-        clusterUpdateCommitIndex();
-        di = dictGetSafeIterator(server.cluster->nodes);
-        while((de = dictNext(di)) != NULL) {
-            clusterNode *node = dictGetVal(de);
-
-            if (node->flags & (PREZ_NODE_MYSELF|PREZ_NODE_NOADDR)) continue;
-            if (node->link == NULL) continue;
-
-            if (mstime() - node->last_activity_time >
-                    server.cluster->heartbeat_interval) { // 如果到达发生心跳的时候
-                node->last_activity_time = mstime();
-                clusterSendHeartbeat(node->link); // 发送心跳包给从节点
-            }
+        /* Elections and heartbeats are driven by their own timers, see
+         * clusterElectionTimerProc() and clusterHeartbeatTimerProc(). */
+        if (server.cluster->state == PREZ_LEADER) {
+            clusterUpdateCommitIndex();
+            leaseExpireCron();
+            activeExpireCycle();
+        } else {
+            clusterSendLeaseKeepalives();
         }
-        dictReleaseIterator(di);
     }
 }
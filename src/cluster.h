@@ -39,16 +39,23 @@
  * prez cluster data structures, defines, exported API.
  *----------------------------------------------------------------------------*/
 
+#define PREZ_CLUSTER_SLOTS 16384
 #define PREZ_CLUSTER_OK 0          /* Everything looks ok */
 #define PREZ_CLUSTER_FAIL 1        /* The cluster can't work */
 #define PREZ_CLUSTER_NAMELEN 40    /* sha1 hex length */
 #define PREZ_COMMAND_NAMELEN 40
-#define PREZ_COMMAND_LEN 40
+#define PREZ_LOG_MAX_ENTRY_LEN (64*1024*1024) /* Quoted command arguments */
 #define PREZ_CLUSTER_PORT_INCR 10000 /* Cluster port = baseport + PORT_INCR */
 #define PREZ_CLUSTER_ELECTION_TIMEOUT  150 /* cluster election timeout of 150 ms */
 #define PREZ_CLUSTER_HEARTBEAT_INTERVAL 10 /* cluster node heartbeat interval of 10 ms */
 #define PREZ_DEFAULT_LOG_FILENAME "prezstore.log"
+#define PREZ_GROUP_LOG_FILENAME "prezstore-%d.log" /* Groups other than 0 */
 #define PREZ_LOG_MAX_ENTRIES_PER_REQUEST 50
+#define PREZ_LOG_MAX_BYTES_PER_REQUEST (1024*1024) /* Unless one entry is
+                                                      bigger than that */
+#define PREZ_CLUSTER_DEFAULT_GROUPS 1 /* Number of Raft groups */
+#define PREZ_CLUSTER_MAX_GROUPS 256
+#define PREZ_LEASE_MAX_KEEPALIVES_PER_MSG 1024
 
 #define PREZ_FOLLOWER 0
 #define PREZ_CANDIDATE 1
@@ -64,6 +71,10 @@
 #define CLUSTERMSG_TYPE_VOTEREQUEST_RESP 2
 #define CLUSTERMSG_TYPE_APPENDENTRIES 3
 #define CLUSTERMSG_TYPE_APPENDENTRIES_RESP 4
+#define CLUSTERMSG_TYPE_LEASE_KEEPALIVE 5   /* Follower -> leader keep-alives */
+
+/* clusterState todo_before_sleep flags. */
+#define CLUSTER_TODO_FSYNC_LOG (1<<0)
 
 #define DENY_VOTE 0
 #define GRANT_VOTE 1
@@ -81,7 +92,7 @@ typedef struct logEntry {
     long long index;
     long long term;
     char commandName[PREZ_COMMAND_NAMELEN];
-    char command[PREZ_COMMAND_LEN];
+    sds command;            /* Quoted arguments, see clusterLogCommand() */
 } logEntry;
 
 typedef struct logEntryNode {
@@ -100,6 +111,14 @@ typedef struct clusterLink {
     struct clusterNode *node;   /* Node related to this link if any, or NULL */
 } clusterLink;
 
+/* An answer to an AppendEntries request waiting for the fsync of the log,
+ * see clusterAckAppendEntries(). */
+typedef struct clusterSyncAck {
+    clusterLink *link;
+    int ok;
+    unsigned long long seq; /* Fsync of the log it waits for */
+} clusterSyncAck;
+
 struct clusterNode {
     char name[PREZ_CLUSTER_NAMELEN]; /* Node name */
     int flags;
@@ -110,6 +129,12 @@ struct clusterNode {
     logEntryNode *last_sent_entry;
     long long next_index;
     long long match_index;
+    long long heartbeat_timer; /* Heartbeat time event id, -1 if none */
+
+    /* Every Raft group has its own clusterNode for a given peer, but all
+     * the groups talk with the peer using the link of the group 0 node. */
+    struct clusterNode *bus;          /* Group 0 node owning the link */
+    struct clusterNode **group_nodes; /* Group 0 only: node of every group */
 
     char ip[PREZ_IP_STR_LEN];       /* Latest known IP address of this node */
     int port;                       /* Latest known port of this node */
@@ -118,6 +143,7 @@ struct clusterNode {
 typedef struct clusterNode clusterNode;
 
 typedef struct clusterState {
+    int id;               /* Raft group id */
     clusterNode *myself;  /* This node */
     //int state;          /* PREZ_CLUSTER_OK, PREZ_CLUSTER_FAIL, ... */
     int size;             /* Num of master nodes with at least one slot */
@@ -130,9 +156,11 @@ typedef struct clusterState {
     int votes_granted;
     mstime_t election_timeout;
     mstime_t heartbeat_interval;
-    mstime_t last_activity_time; /* Time of previous AppendEntries or VoteRequest */
+    mstime_t last_activity_time; /* Monotonic time of previous AppendEntries or VoteRequest */
+    mstime_t current_election_timeout; /* Randomized election timeout */
+    long long election_timer;    /* Election time event id */
     dict *synced_nodes;   /* Hash table of synced nodes name -> 1/0 */
-    dict *proc_clients;   /* Hash table of clients in processing -> index */
+    dict *proc_clients;   /* Log index -> client request waiting for it */
 
     // Persistent
     long long current_term; /* Retrieved from last log entry */
@@ -145,9 +173,33 @@ typedef struct clusterState {
     // Log Specific
     char *log_filename;
     int log_fd;
+    sds log_buf;            /* Entries not yet written to log_fd */
+    unsigned long long log_sync_seq;   /* Fsyncs of the log submitted */
+    unsigned long long log_synced_seq; /* Fsyncs of the log completed */
+    long long log_sync_index;   /* Last entry covered by the last fsync */
+    list *log_sync_acks;        /* AppendEntries waiting for an fsync */
     off_t log_current_size;
     long long log_max_entries_per_request;
 
+    long long compact_index;    /* Older key versions were dropped */
+    int compacting;             /* compactCycle() has still work to do */
+    unsigned long compact_cursor;
+    long long deleted_index;    /* Tombstones older than it were dropped */
+    long long expire_pending_index; /* Last entry deleting expired keys */
+
+    // Leases
+    dict *leases;               /* Lease id -> lease, see lease.c */
+    dict *lease_keepalives;     /* Leases to renew on the leader */
+    dict *locks;                /* Lock name -> lock, see lock.c */
+    dict *id_blocks;            /* Counter key -> block reserved by us */
+
+    // Watches
+    watchEvent *watch_history;  /* Ring of the last changes applied */
+    long watch_history_start;   /* Position of the oldest change */
+    long watch_history_count;
+    long long watch_history_first; /* Changes from this index on are all
+                                      in the history */
+
     int todo_before_sleep; /* Things to do in clusterBeforeSleep(). */
     long long stats_bus_messages_sent;  /* Num of msg sent via cluster bus. */
     long long stats_bus_messages_received; /* Num of msg rcvd via cluster bus.*/
@@ -166,6 +218,19 @@ typedef struct {
     int vote_granted;
 } clusterMsgDataResponseVote;
 
+/* The entries of an AppendEntries message are sent back to back, every one
+ * taking CLUSTERMSG_LOG_ENTRY_LEN(commandlen) bytes. */
+typedef struct {
+    long long index;
+    long long term;
+    char commandName[PREZ_COMMAND_NAMELEN];
+    uint32_t commandlen;
+    char command[8];    /* 'commandlen' bytes, 8 bytes just as placeholder. */
+} clusterMsgLogEntry;
+
+#define CLUSTERMSG_LOG_ENTRY_LEN(commandlen) \
+    ((offsetof(clusterMsgLogEntry,command)+(commandlen)+7) & ~(size_t)7)
+
 typedef struct {
     long long term;
     char leaderid[PREZ_CLUSTER_NAMELEN];
@@ -173,7 +238,7 @@ typedef struct {
     long long prev_log_term;
     long long leader_commit_index;
     uint16_t log_entries_count;
-    logEntry log_entries[PREZ_LOG_MAX_ENTRIES_PER_REQUEST];    //Array of N logEntry structures
+    clusterMsgLogEntry log_entries[1]; /* log_entries_count entries */
 } clusterMsgDataAppendEntries;
 
 typedef struct {
@@ -183,6 +248,11 @@ typedef struct {
     int ok;
 } clusterMsgDataResponseAppendEntries;
 
+typedef struct {
+    uint32_t count;
+    long long ids[PREZ_LEASE_MAX_KEEPALIVES_PER_MSG]; /* 'count' lease ids */
+} clusterMsgDataLeaseKeepalive;
+
 union clusterMsgData {
     /* VoteRequest */
     struct {
@@ -203,13 +273,18 @@ union clusterMsgData {
     struct {
         clusterMsgDataResponseAppendEntries entries;
     } responseappendentries;
+
+    /* Lease keep-alives */
+    struct {
+        clusterMsgDataLeaseKeepalive keepalive;
+    } leasekeepalive;
 };
 
 typedef struct {
     char sig[4];        /* Siganture "RCmb" (prez Cluster message bus). */
     uint32_t totlen;    /* Total length of this message */
     uint16_t ver;       /* Protocol version, currently set to 0. */
-    uint16_t notused0;  /* 2 bytes not used. */
+    uint16_t group;     /* Raft group the message is about. */
     uint16_t type;      /* Message type */
     uint16_t count;     /* Only used for some kind of messages. */
     char sender[PREZ_CLUSTER_NAMELEN]; /* Name of the sender node */
@@ -222,25 +297,35 @@ typedef struct {
 
 void clusterProcessRequestVote(clusterLink *link, clusterMsgDataRequestVote vote);
 void clusterProcessResponseVote(clusterLink *link, clusterMsgDataResponseVote vote);
-void clusterProcessAppendEntries(clusterLink *link, clusterMsgDataAppendEntries entries);
-void clusterProcessResponseAppendEntries(clusterLink *link, 
+void clusterProcessAppendEntries(clusterLink *link, clusterMsgDataAppendEntries *entries);
+void clusterProcessResponseAppendEntries(clusterNode *node,
         clusterMsgDataResponseAppendEntries entries);
-void clusterSendHeartbeat(clusterLink *link);
+void clusterSendHeartbeat(clusterNode *node);
 void clusterSendResponseVote(clusterLink *link, int vote_granted);
 void clusterSendRequestVote(void);
-void clusterSendAppendEntries(clusterLink *link);
+void clusterSendAppendEntries(clusterNode *node);
 void clusterSendResponseAppendEntries(clusterLink *link, int ok);
+void clusterSendLeaseKeepalives(void);
+void clusterStartElection(void);
+void clusterBecomeLeader(void);
+void clusterSelectGroup(int id);
+unsigned int keyHashSlot(char *key, int keylen);
+int clusterKeyGroup(robj *key);
+int clusterCommandGroup(struct prezCommand *cmd, robj **argv, int argc);
+long long clusterLogCommand(struct prezCommand *cmd, robj **argv, int argc);
 
 /* Log replication */
 int loadLogFile(void); 
 int logTruncate(long long index);
 sds catLogEntry(sds dst, int argc, robj **argv);
-int logWriteEntry(logEntry e);
-int logAppendEntries(clusterMsgDataAppendEntries entries);
+int logWriteEntry(long long index, long long term, char *commandName,
+                  char *command, size_t commandlen);
+int logAppendEntries(clusterMsgDataAppendEntries *entries);
 int logVerifyAppend(long long index, long long term);
 int logCommitIndex(long long index);
 int logApply(long long index);
-int logSync(void);
+int logFlush(void);
+void logSync(aeIoProc *proc, void *clientData);
 long long logCurrentIndex(void);
 long long logCurrentTerm(void);
 long long logGetTerm(long long index);
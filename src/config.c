@@ -116,6 +116,11 @@ void loadServerConfigFromString(char *config) {
             if (server.port < 0 || server.port > 65535) {
                 err = "Invalid port"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"binary-port") && argc == 2) {
+            server.binary_port = atoi(argv[1]);
+            if (server.binary_port < 0 || server.binary_port > 65535) {
+                err = "Invalid port"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"tcp-backlog") && argc == 2) {
             server.tcp_backlog = atoi(argv[1]);
             if (server.tcp_backlog < 0) {
@@ -138,6 +143,16 @@ void loadServerConfigFromString(char *config) {
             if (errno || server.unixsocketperm > 0777) {
                 err = "Invalid socket file permissions"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"shm-ring-size") && argc == 2) {
+            long long ll = memtoll(argv[1],NULL);
+
+            if (ll < 0 || ll > 1024*1024*1024 ||
+                (ll && (ll < PREZ_SHM_RING_SIZE_MIN || (ll & (ll-1)))))
+            {
+                err = "shm-ring-size must be 0 or a power of two between "
+                      "4kb and 1gb"; goto loaderr;
+            }
+            server.shm_ring_size = ll;
 #if 0
         } else if (!strcasecmp(argv[0],"save")) {
             if (argc == 3) {
@@ -217,6 +232,13 @@ void loadServerConfigFromString(char *config) {
             if (server.maxclients < 1) {
                 err = "Invalid max clients limit"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"io-threads") && argc == 2) {
+            server.io_threads_num = atoi(argv[1]);
+            if (server.io_threads_num < 1 ||
+                server.io_threads_num > PREZ_IO_THREADS_MAX)
+            {
+                err = "Invalid number of I/O threads"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"maxmemory") && argc == 2) {
             server.maxmemory = memtoll(argv[1],NULL);
         } else if (!strcasecmp(argv[0],"maxmemory-policy") && argc == 2) {
@@ -295,11 +317,26 @@ void loadServerConfigFromString(char *config) {
             if ((server.rdb_checksum = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
+#endif
         } else if (!strcasecmp(argv[0],"activerehashing") && argc == 2) {
             if ((server.activerehashing = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
             }
-#endif
+        } else if (!strcasecmp(argv[0],"activerehashing-budget") && argc == 2) {
+            server.activerehashing_budget = strtoll(argv[1],NULL,10);
+            if (server.activerehashing_budget <= 0) {
+                err = "Invalid activerehashing budget"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"watch-history-len") && argc == 2) {
+            server.watch_history_len = strtol(argv[1],NULL,10);
+            if (server.watch_history_len < 0) {
+                err = "Invalid watch history length"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"key-max-versions") && argc == 2) {
+            server.key_max_versions = strtol(argv[1],NULL,10);
+            if (server.key_max_versions < 1) {
+                err = "Invalid number of key versions"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"daemonize") && argc == 2) {
             if ((server.daemonize = yesnotoi(argv[1])) == -1) {
                 err = "argument must be 'yes' or 'no'"; goto loaderr;
@@ -433,6 +470,13 @@ void loadServerConfigFromString(char *config) {
             if (server.cluster->election_timeout <= 0) {
                 err = "cluster election timeout must be 1 or greater"; goto loaderr;
             }
+        } else if (!strcasecmp(argv[0],"cluster-groups") && argc == 2) {
+            server.cluster_groups = atoi(argv[1]);
+            if (server.cluster_groups < 1 ||
+                server.cluster_groups > PREZ_CLUSTER_MAX_GROUPS)
+            {
+                err = "Invalid number of cluster groups"; goto loaderr;
+            }
         } else if (!strcasecmp(argv[0],"cluster-heartbeat-interval") && argc == 2) {
             server.cluster->heartbeat_interval = strtoll(argv[1],NULL,10);
             if (server.cluster->heartbeat_interval <= 0) {
@@ -827,6 +871,14 @@ void configSetCommand(prezClient *c) {
         if (getLongLongFromObject(o,&ll) == PREZ_ERR || ll < 0) goto badfmt;
         server.latency_monitor_threshold = ll;
 #endif
+    } else if (!strcasecmp(c->argv[2]->ptr,"activerehashing")) {
+        int yn = yesnotoi(o->ptr);
+
+        if (yn == -1) goto badfmt;
+        server.activerehashing = yn;
+    } else if (!strcasecmp(c->argv[2]->ptr,"activerehashing-budget")) {
+        if (getLongLongFromObject(o,&ll) == PREZ_ERR || ll <= 0) goto badfmt;
+        server.activerehashing_budget = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"loglevel")) {
         if (!strcasecmp(o->ptr,"warning")) {
             server.verbosity = PREZ_WARNING;
@@ -966,13 +1018,19 @@ void configSetCommand(prezClient *c) {
         server.cluster_slave_validity_factor = ll;
 #endif
     } else if (!strcasecmp(c->argv[2]->ptr,"cluster-heartbeat-interval")) {
+        int j;
+
         if (getLongLongFromObject(o,&ll) == PREZ_ERR ||
             ll <= 0) goto badfmt;
-        server.cluster->heartbeat_interval = ll;
+        for (j = 0; j < server.cluster_groups; j++)
+            server.groups[j]->heartbeat_interval = ll;
     } else if (!strcasecmp(c->argv[2]->ptr,"cluster-election-timeout")) {
+        int j;
+
         if (getLongLongFromObject(o,&ll) == PREZ_ERR ||
             ll <= 0) goto badfmt;
-        server.cluster->election_timeout = ll;
+        for (j = 0; j < server.cluster_groups; j++)
+            server.groups[j]->election_timeout = ll;
     } else {
         addReplyErrorFormat(c,"Unsupported CONFIG parameter: %s",
             (char*)c->argv[2]->ptr);
@@ -1071,6 +1129,7 @@ void configGetCommand(prezClient *c) {
             server.slowlog_max_len);
 #endif
     config_get_numerical_field("port",server.port);
+    config_get_numerical_field("binary-port",server.binary_port);
     config_get_numerical_field("tcp-backlog",server.tcp_backlog);
 #if 0
     config_get_numerical_field("databases",server.dbnum);
@@ -1080,6 +1139,8 @@ void configGetCommand(prezClient *c) {
     config_get_numerical_field("repl-backlog-ttl",server.repl_backlog_time_limit);
 #endif
     config_get_numerical_field("maxclients",server.maxclients);
+    config_get_numerical_field("io-threads",server.io_threads_num);
+    config_get_numerical_field("shm-ring-size",server.shm_ring_size);
 #if 0
     config_get_numerical_field("watchdog-period",server.watchdog_period);
     config_get_numerical_field("slave-priority",server.slave_priority);
@@ -1089,6 +1150,12 @@ void configGetCommand(prezClient *c) {
     config_get_numerical_field("hz",server.hz);
     config_get_numerical_field("cluster-election-timeout",server.cluster->election_timeout);
     config_get_numerical_field("cluster-heartbeat-interval",server.cluster->heartbeat_interval);
+    config_get_numerical_field("cluster-groups",server.cluster_groups);
+    config_get_numerical_field("activerehashing-budget",
+            server.activerehashing_budget);
+    config_get_bool_field("activerehashing", server.activerehashing);
+    config_get_numerical_field("watch-history-len",server.watch_history_len);
+    config_get_numerical_field("key-max-versions",server.key_max_versions);
 #if 0
     config_get_numerical_field("cluster-node-timeout",server.cluster_node_timeout);
     config_get_numerical_field("cluster-migration-barrier",server.cluster_migration_barrier);
@@ -1109,7 +1176,6 @@ void configGetCommand(prezClient *c) {
     config_get_bool_field("daemonize", server.daemonize);
     config_get_bool_field("rdbcompression", server.rdb_compression);
     config_get_bool_field("rdbchecksum", server.rdb_checksum);
-    config_get_bool_field("activerehashing", server.activerehashing);
     config_get_bool_field("repl-disable-tcp-nodelay",
             server.repl_disable_tcp_nodelay);
     config_get_bool_field("repl-diskless-sync",
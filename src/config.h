@@ -70,6 +70,16 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* Test for eventfd(2), needed by the shared memory transport */
+#ifdef __linux__
+#define HAVE_EVENTFD 1
+#endif
+
+/* io_uring is opt-in, build with "make USE_IOURING=yes" */
+#if defined(__linux__) && defined(USE_IOURING)
+#define HAVE_IO_URING 1
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -28,6 +28,7 @@
  */
 
 #include "prez.h"
+#include "cluster.h"
 
 #include <signal.h>
 #include <ctype.h>
@@ -37,19 +38,27 @@
  *----------------------------------------------------------------------------*/
 
 robj *lookupKey(prezDb *db, robj *key) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
+    oadictEntry *de = oadictFind(db->dict,key->ptr);
     if (de) {
-        robj *val = dictGetVal(de);
-        return val;
+        keyVersion *v = oadictGetVal(de);
+        return v->val;
     } else {
         return NULL;
     }
 }
 
+/* Return the current version of the key, or NULL if it does not exist. */
+keyVersion *lookupKeyVersion(prezDb *db, robj *key) {
+    return oadictFetchValue(db->dict,key->ptr);
+}
+
+/* Keys past their deadline are hidden to the reads, while the writes,
+ * that must be deterministic, see them until the leader deletes them. */
 robj *lookupKeyRead(prezDb *db, robj *key) {
-    robj *val;
+    keyVersion *v = lookupKeyVersion(db,key);
+    robj *val = NULL;
 
-    val = lookupKey(db,key);
+    if (v && (v->expire == 0 || v->expire > mstime())) val = v->val;
     if (val == NULL)
         server.stat_keyspace_misses++;
     else
@@ -73,56 +82,1108 @@ robj *lookupKeyWriteOrReply(prezClient *c, robj *key, robj *reply) {
     return o;
 }
 
+/* The key of 'key' in db->expires and db->deleted_index: the group of the
+ * key, then the deadline or the index big endian, then the key itself. */
+static sds groupIndexKey(sds key, long long index) {
+    unsigned char buf[9];
+    uint64_t w = index;
+    int j;
+
+    buf[0] = keyHashSlot(key,sdslen(key)) % server.cluster_groups;
+    for (j = 8; j > 0; j--) {
+        buf[j] = w & 0xff;
+        w >>= 8;
+    }
+    return sdscatlen(sdsnewlen(buf,sizeof(buf)),key,sdslen(key));
+}
+
+/* Free the versions older than 'v'. Return 1 if what they tell of the
+ * keys deleted before 'v' was freed: a tombstone, or a version with a
+ * create index of 0, see trimKeyVersions(). */
+static int freeOlderKeyVersions(keyVersion *v) {
+    keyVersion *prev = v->prev;
+    int history = 0;
+
+    v->prev = NULL;
+    while (prev) {
+        keyVersion *next = prev->prev;
+
+        if (prev->val == NULL || prev->create_index == 0) history = 1;
+        if (prev->val) decrRefCount(prev->val);
+        zfree(prev);
+        prev = next;
+    }
+    return history;
+}
+
+/* Free all the versions of a key, starting from the current one. */
+void freeKeyVersions(keyVersion *v) {
+    freeOlderKeyVersions(v);
+    if (v->val) decrRefCount(v->val);
+    zfree(v);
+}
+
+/* Keep at most key-max-versions versions starting from 'v'. The oldest
+ * version kept tells when the key was created, unless the tombstone of a
+ * previous deletion is dropped: then its create index is set to 0, as
+ * nothing is known before it. */
+static void trimKeyVersions(keyVersion *v) {
+    keyVersion *oldest = v;
+    long j;
+
+    for (j = 1; j < server.key_max_versions && oldest->prev; j++)
+        oldest = oldest->prev;
+    if (freeOlderKeyVersions(oldest)) oldest->create_index = 0;
+}
+
+/* Remove the tombstone of 'key' from db->deleted, and return it. */
+static keyVersion *dbRemoveTombstone(prezDb *db, sds key) {
+    dictEntry *de = dictFind(db->deleted,key);
+    keyVersion *t;
+    sds ik;
+
+    if (de == NULL) return NULL;
+    t = dictGetVal(de);
+    ik = groupIndexKey(key,t->mod_index);
+    radixRemove(db->deleted_index,(unsigned char*)ik,sdslen(ik));
+    sdsfree(ik);
+    dictDelete(db->deleted,key);
+    return t;
+}
+
+static int oldestTombstoneCallback(void *privdata, unsigned char *key,
+                                   size_t len, void *value)
+{
+    PREZ_NOTUSED(value);
+    *(sds*)privdata = sdsnewlen(key+9,len-9);
+    return 0;
+}
+
+/* Drop the oldest tombstone of the group of 'key'. The reads before the
+ * deletion it recorded can't tell anymore if the key existed. */
+static void dbEvictTombstone(prezDb *db, sds key) {
+    unsigned char group = keyHashSlot(key,sdslen(key)) % server.cluster_groups;
+    keyVersion *t;
+    sds oldest = NULL;
+
+    radixWalkPrefix(db->deleted_index,&group,1,oldestTombstoneCallback,
+                    &oldest);
+    if (oldest == NULL) return;
+    t = dbRemoveTombstone(db,oldest);
+    if (t->mod_index > server.cluster->deleted_index)
+        server.cluster->deleted_index = t->mod_index;
+    freeKeyVersions(t);
+    sdsfree(oldest);
+}
+
 /* Add the key to the DB. It's up to the caller to increment the reference
- * counter of the value if needed.
+ * counter of the value if needed. The key is created by the log entry being
+ * applied.
  *
  * The program is aborted if the key already exists. */
 void dbAdd(prezDb *db, robj *key, robj *val) {
     sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
-
+    keyVersion *v = zmalloc(sizeof(*v));
+    keyVersion *t = dbRemoveTombstone(db,key->ptr);
+    int retval;
+
+    v->val = val;
+    v->create_index = v->mod_index = server.cluster->last_applied;
+    v->prev = NULL;
+    v->lease = 0;
+    v->expire = 0;
+    /* The versions before the deletion go on with the new ones. With a
+     * single version they can't: as when dropping the tombstone to make
+     * room, the reads before the deletion fail. */
+    if (t && server.key_max_versions > 1) {
+        v->prev = t;
+        trimKeyVersions(v);
+    } else if (t) {
+        if (t->mod_index > server.cluster->deleted_index)
+            server.cluster->deleted_index = t->mod_index;
+        freeKeyVersions(t);
+    }
+    retval = oadictAdd(db->dict, copy, v);
     prezAssertWithInfo(NULL,key,retval == PREZ_OK);
+    radixInsert(db->index,(unsigned char*)copy,sdslen(copy),v);
+    treeAddNode(db,copy);
  }
 
 /* Overwrite an existing key with a new value. Incrementing the reference
  * count of the new value is up to the caller.
  * This function does not modify the expire time of the existing key.
  *
+ * The old value is kept as the previous version of the key, and the oldest
+ * versions are dropped so that there are at most key-max-versions. The
+ * current version is modified in place, so that the ordered index, that
+ * references it, does not change.
+ *
  * The program is aborted if the key was not already present. */
 void dbOverwrite(prezDb *db, robj *key, robj *val) {
-    dictEntry *de = dictFind(db->dict,key->ptr);
-
-    prezAssertWithInfo(NULL,key,de != NULL);
-    dictReplace(db->dict, key->ptr, val);
+    keyVersion *v = lookupKeyVersion(db,key), *old;
+
+    prezAssertWithInfo(NULL,key,v != NULL);
+    if (server.key_max_versions > 1) {
+        old = zmalloc(sizeof(*old));
+        *old = *v;
+        v->prev = old;
+        trimKeyVersions(v);
+    } else {
+        decrRefCount(v->val);
+    }
+    v->val = val;
+    v->mod_index = server.cluster->last_applied;
 }
 
 /* High level Set operation. This function can be used in order to set
  * a key, whatever it was existing or not, to a new object.
  *
- * 1) The ref count of the value object is incremented.
+ * 1) The ref count of the value object is incremented, or the value is
+ *    copied if it lives in a client arena (see retainObject()).
+ * 2) The clients watching the key are notified (see touchWatchedKey()).
+ * 3) The key is detached from its lease, if any, and its expire is removed.
  */
 void setKey(prezDb *db, robj *key, robj *val) {
-    if (lookupKeyWrite(db,key) == NULL) {
+    keyVersion *v = lookupKeyVersion(db,key);
+
+    val = retainObject(val);
+    if (v == NULL) {
         dbAdd(db,key,val);
     } else {
+        if (v->lease) leaseDetachKey(key->ptr,v);
+        if (v->expire) removeExpire(db,key);
         dbOverwrite(db,key,val);
     }
-    incrRefCount(val);
+    touchWatchedKey(key->ptr);
 }
 
 int dbExists(prezDb *db, robj *key) {
-    return dictFind(db->dict,key->ptr) != NULL;
+    return oadictFind(db->dict,key->ptr) != NULL;
 }
 
-/* Delete a key, value, and associated expiration entry if any, from the DB */
+/* Delete a key, value, and associated expiration entry if any, from the DB.
+ *
+ * The versions of the key are kept behind a tombstone, a version without
+ * value, in db->deleted, so that GETAT still reads them. Past
+ * PREZ_DELETED_KEYS_MAX tombstones the oldest one of the group is dropped,
+ * and so are the ones COMPACT makes useless, see compactCycle(). */
 int dbDelete(prezDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
-        return 1;
+    keyVersion *v = lookupKeyVersion(db,key), *t, *old;
+    sds ik;
+
+    if (v == NULL) return 0;
+    if (v->lease) leaseDetachKey(key->ptr,v);
+    if (v->expire) removeExpire(db,key);
+    t = zmalloc(sizeof(*t));
+    t->val = NULL;
+    t->create_index = v->create_index;
+    t->mod_index = server.cluster->last_applied;
+    t->lease = 0;
+    t->expire = 0;
+    t->prev = NULL;
+    if (server.key_max_versions > 1) {
+        old = zmalloc(sizeof(*old));
+        *old = *v;
+        incrRefCount(old->val);
+        t->prev = old;
+        v->prev = NULL;
+    }
+    trimKeyVersions(t);
+
+    radixRemove(db->index,key->ptr,sdslen(key->ptr));
+    oadictDelete(db->dict,key->ptr);
+    treeDelNode(db,key->ptr);
+
+    if (dictSize(db->deleted) >= PREZ_DELETED_KEYS_MAX)
+        dbEvictTombstone(db,key->ptr);
+    ik = groupIndexKey(key->ptr,t->mod_index);
+    radixInsert(db->deleted_index,(unsigned char*)ik,sdslen(ik),NULL);
+    sdsfree(ik);
+    dictAdd(db->deleted,sdsdup(key->ptr),t);
+    touchWatchedKey(key->ptr);
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+ * API to get key arguments from commands
+ * ---------------------------------------------------------------------------*/
+
+/* The base case is to use the keys position as given in the command table
+ * (firstkey, lastkey, step). With a step greater than one, as in MSET, every
+ * key is followed by its arguments: a trailing key without them is not a
+ * key, and the command fails with a syntax error as it is applied. */
+int *getKeysUsingCommandTable(struct prezCommand *cmd,robj **argv, int argc, int *numkeys) {
+    int j, i = 0, last, *keys;
+    PREZ_NOTUSED(argv);
+
+    if (cmd->firstkey == 0) {
+        *numkeys = 0;
+        return NULL;
+    }
+    last = cmd->lastkey;
+    if (last < 0) last = argc+last;
+    if (cmd->lastkey < 0 && cmd->keystep > 1)
+        last = argc-cmd->keystep;
+    keys = zmalloc(sizeof(int)*((last - cmd->firstkey)+1));
+    for (j = cmd->firstkey; j <= last; j += cmd->keystep) {
+        prezAssert(j < argc);
+        keys[i++] = j;
+    }
+    *numkeys = i;
+    return keys;
+}
+
+/* Return all the arguments that are keys in the command passed via argc / argv.
+ *
+ * The command returns the positions of all the key arguments inside the array,
+ * so the actual return value is an heap allocated array of integers. The
+ * length of the array is returned by reference into *numkeys.
+ *
+ * 'cmd' must be point to the corresponding entry into the prezCommand
+ * table, according to the command name in argv[0].
+ *
+ * This function uses the command table if a command-specific helper function
+ * is not required, otherwise it calls the command-specific function. */
+int *getKeysFromCommand(struct prezCommand *cmd, robj **argv, int argc, int *numkeys) {
+    if (cmd->getkeys_proc) {
+        return cmd->getkeys_proc(cmd,argv,argc,numkeys);
+    } else {
+        return getKeysUsingCommandTable(cmd,argv,argc,numkeys);
+    }
+}
+
+/* COMPACT <index> [<key>]: the optional key selects the Raft group. */
+int *compactGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys) {
+    int *keys;
+    PREZ_NOTUSED(cmd);
+    PREZ_NOTUSED(argv);
+
+    if (argc != 3) {
+        *numkeys = 0;
+        return NULL;
+    }
+    keys = zmalloc(sizeof(int));
+    keys[0] = 2;
+    *numkeys = 1;
+    return keys;
+}
+
+/* Free the result of getKeysFromCommand. */
+void getKeysFreeResult(int *result) {
+    zfree(result);
+}
+
+/* -----------------------------------------------------------------------------
+ * Ordered keyspace
+ * ---------------------------------------------------------------------------*/
+
+/* The keys of a DB are also indexed in order by a radix tree, whose values
+ * are the same objects stored in the main dictionary. RANGE and PREFIX walk
+ * the tree, replying with the keys and values found as a flat array. */
+
+typedef struct rangeReply {
+    prezClient *c;
+    long limit;     /* Max keys to reply, -1 for no limit. */
+    long count;
+    mstime_t now;   /* Keys past their deadline are skipped. */
+} rangeReply;
+
+static int rangeReplyKey(void *privdata, unsigned char *key, size_t len,
+                         void *value)
+{
+    rangeReply *rr = privdata;
+    keyVersion *v = value;
+    robj *o = v->val;
+
+    if (rr->limit != -1 && rr->count == rr->limit) return 0;
+    if (v->expire && v->expire <= rr->now) return 1;
+    addReplyBulkCBuffer(rr->c,key,len);
+    if (o->type == PREZ_STRING)
+        addReplyBulk(rr->c,o);
+    else
+        addReply(rr->c,shared.nullbulk);
+    rr->count++;
+    return 1;
+}
+
+/* Parse the optional LIMIT <count> starting at argv[j]. */
+static int rangeParseLimit(prezClient *c, robj **argv, int argc, int j,
+                           long *limit)
+{
+    *limit = -1;
+    if (j == argc) return PREZ_OK;
+    if (argc-j != 2 || strcasecmp(argv[j]->ptr,"limit")) {
+        addReply(c,shared.syntaxerr);
+        return PREZ_ERR;
+    }
+    if (getLongFromObjectOrReply(c,argv[j+1],limit,NULL) != PREZ_OK)
+        return PREZ_ERR;
+    if (*limit < 0) {
+        addReplyError(c,"LIMIT can't be negative");
+        return PREZ_ERR;
+    }
+    return PREZ_OK;
+}
+
+/* RANGE <start> <end> [LIMIT <count>]
+ *
+ * Reply with the keys k such that start <= k < end, in order, each followed
+ * by its value. An empty <end> means no upper bound. */
+void rangeCommand(prezClient *c, robj **argv, int argc) {
+    radix *index = server.db[0].index;
+    sds start = argv[1]->ptr, end = argv[2]->ptr;
+    rangeReply rr;
+    void *replylen;
+
+    if (rangeParseLimit(c,argv,argc,3,&rr.limit) != PREZ_OK) return;
+    rr.c = c;
+    rr.count = 0;
+    rr.now = mstime();
+    replylen = addDeferredMultiBulkLength(c);
+    radixWalk(index,(unsigned char*)start,sdslen(start),
+              sdslen(end) ? (unsigned char*)end : NULL,sdslen(end),
+              rangeReplyKey,&rr);
+    setDeferredMultiBulkLength(c,replylen,rr.count*2);
+}
+
+/* PREFIX <prefix> [LIMIT <count>]
+ *
+ * Reply with the keys starting with <prefix>, in order, each followed by
+ * its value. */
+void prefixCommand(prezClient *c, robj **argv, int argc) {
+    radix *index = server.db[0].index;
+    sds prefix = argv[1]->ptr;
+    rangeReply rr;
+    void *replylen;
+
+    if (rangeParseLimit(c,argv,argc,2,&rr.limit) != PREZ_OK) return;
+    rr.c = c;
+    rr.count = 0;
+    rr.now = mstime();
+    replylen = addDeferredMultiBulkLength(c);
+    radixWalkPrefix(index,(unsigned char*)prefix,sdslen(prefix),
+                    rangeReplyKey,&rr);
+    setDeferredMultiBulkLength(c,replylen,rr.count*2);
+}
+
+/* -----------------------------------------------------------------------------
+ * Hierarchical namespace
+ * ---------------------------------------------------------------------------*/
+
+/* Keys like /services/foo/1 are also nodes of a tree, like the znodes of
+ * ZooKeeper, so that the children of a node are listed without scanning the
+ * keyspace. Db->tree maps the path of every node with children to the set
+ * of the names of its children.
+ *
+ * A node is in the tree when its path is a key, or when it has children:
+ * setting /a/b/c makes /a and /a/b nodes of the tree even if they are not
+ * keys, and they are removed once they have no children left. The root "/"
+ * is always a node. */
+
+/* Return the length of the path of the parent of the node, or -1 if the
+ * key is not the path of a node: paths start with "/", and have no empty
+ * names. */
+static long pathParentLen(const char *path, size_t len) {
+    size_t j;
+
+    if (len < 2 || path[0] != '/' || path[len-1] == '/') return -1;
+    for (j = 1; j < len; j++)
+        if (path[j] == '/' && path[j-1] == '/') return -1;
+    j = len-1;
+    while (path[j] != '/') j--;
+    return j ? (long)j : 1;
+}
+
+/* Return the name of the node, the last part of its path. */
+static sds pathName(sds path, long parentlen) {
+    long start = parentlen == 1 ? 1 : parentlen+1;
+
+    return sdsnewlen(path+start,sdslen(path)-start);
+}
+
+/* Link the node to its parent, and the parent to its own parent if it was
+ * not a node already, and so forth. */
+void treeAddNode(prezDb *db, sds path) {
+    sds node = sdsdup(path);
+    long plen;
+
+    while ((plen = pathParentLen(node,sdslen(node))) != -1) {
+        dictEntry *de;
+        dict *children;
+        sds name = pathName(node,plen);
+
+        sdsrange(node,0,plen-1);
+        de = dictFind(db->tree,node);
+        if (de) {
+            children = dictGetVal(de);
+        } else {
+            children = dictCreate(&sdsSetDictType,NULL);
+            dictAdd(db->tree,sdsdup(node),children);
+        }
+        if (dictAdd(children,name,NULL) != DICT_OK) {
+            /* Already linked, and so are its ancestors. */
+            sdsfree(name);
+            break;
+        }
+    }
+    sdsfree(node);
+}
+
+/* Called after the key at 'path' is deleted: unlink the node if it has
+ * no children, and then its ancestors left with no children that are not
+ * keys. */
+void treeDelNode(prezDb *db, sds path) {
+    sds node = sdsdup(path);
+    long plen;
+
+    while ((plen = pathParentLen(node,sdslen(node))) != -1) {
+        dictEntry *de;
+        dict *children;
+        sds name;
+
+        if (dictFind(db->tree,node) || oadictFind(db->dict,node)) break;
+        name = pathName(node,plen);
+        sdsrange(node,0,plen-1);
+        de = dictFind(db->tree,node);
+        if (de == NULL) {
+            sdsfree(name);
+            break;
+        }
+        children = dictGetVal(de);
+        dictDelete(children,name);
+        sdsfree(name);
+        if (dictSize(children)) break;
+        dictDelete(db->tree,node);
+    }
+    sdsfree(node);
+}
+
+/* GETCHILDREN <path>
+ *
+ * Reply with the names of the children of the node, in no particular order,
+ * or with a null multi bulk if the node does not exist. */
+void getchildrenCommand(prezClient *c, robj **argv, int argc) {
+    prezDb *db = &server.db[0];
+    sds path = argv[1]->ptr;
+    dictEntry *de = dictFind(db->tree,path);
+    PREZ_NOTUSED(argc);
+
+    if (de) {
+        dict *children = dictGetVal(de);
+        dictIterator *di = dictGetIterator(children);
+
+        addReplyMultiBulkLen(c,dictSize(children));
+        while((de = dictNext(di)) != NULL) {
+            sds name = dictGetKey(de);
+
+            addReplyBulkCBuffer(c,name,sdslen(name));
+        }
+        dictReleaseIterator(di);
+    } else if (!strcmp(path,"/") ||
+               (pathParentLen(path,sdslen(path)) != -1 &&
+                oadictFind(db->dict,path)))
+    {
+        addReply(c,shared.emptymultibulk);
+    } else {
+        addReply(c,shared.nullmultibulk);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Sequential keys
+ * ---------------------------------------------------------------------------*/
+
+/* Like the sequential znodes of ZooKeeper, CREATESEQ creates a key made of
+ * a prefix and of a number assigned as the entry is applied, so that the
+ * clients queueing up, or running for leader, get their place in line with
+ * a single write. The number is the index of the entry, zero padded so that
+ * the order of the keys is the one of the writes: it grows with every
+ * write of the Raft group, and is never reused, even once every key with
+ * the prefix is deleted.
+ *
+ * With more than one group the prefix must carry a hash tag, like
+ * "{jobs}/", so that the keys created belong to the group of the prefix. */
+
+#define PREZ_SEQ_DIGITS 20
+
+/* CREATESEQ <prefix> <value> [LEASE <id>]
+ *
+ * Set the key <prefix><number> and reply with it. With LEASE the key is
+ * attached to the lease, and deleted once it is revoked. */
+void createseqCommand(prezClient *c, robj **argv, int argc) {
+    sds prefix = argv[1]->ptr;
+    lease *l = NULL;
+    robj *key;
+
+    if (argc == 5 && !strcasecmp(argv[3]->ptr,"lease")) {
+        long long id;
+
+        if (getLongLongFromObjectOrReply(c,argv[4],&id,NULL) != PREZ_OK)
+            return;
+        if ((l = leaseLookupOrReply(c,id)) == NULL) return;
+    } else if (argc != 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    key = createObject(PREZ_STRING,sdscatprintf(sdsdup(prefix),"%0*lld",
+        PREZ_SEQ_DIGITS, server.cluster->last_applied));
+    if (clusterKeyGroup(key) != server.cluster->id) {
+        addReplyError(c,"CROSSGROUP The prefix needs a hash tag, so that "
+            "the keys created belong to its Raft group");
+        decrRefCount(key);
+        return;
+    }
+    setKey(&server.db[0],key,argv[2]);
+    if (l) leaseAttachKey(l,key);
+    addReplyBulk(c,key);
+    decrRefCount(key);
+}
+
+/* LOWESTCHILD <prefix>
+ *
+ * Reply with the lowest key starting with <prefix> and its value, that is
+ * the head of the queue, or the leader, if the keys were created by
+ * CREATESEQ. Reply with a null multi bulk if there is no such key. */
+void lowestchildCommand(prezClient *c, robj **argv, int argc) {
+    sds prefix = argv[1]->ptr;
+    rangeReply rr;
+    void *replylen;
+    PREZ_NOTUSED(argc);
+
+    rr.c = c;
+    rr.limit = 1;
+    rr.count = 0;
+    rr.now = mstime();
+    replylen = addDeferredMultiBulkLength(c);
+    radixWalkPrefix(server.db[0].index,(unsigned char*)prefix,sdslen(prefix),
+                    rangeReplyKey,&rr);
+    setDeferredMultiBulkLength(c,replylen,rr.count ? 2 : -1);
+}
+
+/* -----------------------------------------------------------------------------
+ * Versions
+ * ---------------------------------------------------------------------------*/
+
+/* Every key carries the log index of the entry that created it and of the
+ * one that set its value, and up to key-max-versions values with the ones
+ * they replaced, so that GETAT can read many keys as they were at the same
+ * index while the writes go on.
+ *
+ * Indexes are the ones of the log of the Raft group of the key. Deleted
+ * keys keep their versions behind a tombstone, see dbDelete(). COMPACT,
+ * logged like the writes, drops the versions of the keys of a group that
+ * are older than an index, and makes the reads before it fail. */
+
+/* Set '*vp' to the version of the key that was current at 'index': NULL
+ * if the key did not exist then, a tombstone if it was deleted. Return
+ * PREZ_ERR if the version existed but was already dropped. */
+static int keyVersionAt(prezDb *db, robj *key, long long index,
+                        keyVersion **vp)
+{
+    keyVersion *v = lookupKeyVersion(db,key), *oldest;
+
+    *vp = NULL;
+    if (v == NULL) {
+        dictEntry *de = dictFind(db->deleted,key->ptr);
+
+        if (de == NULL) return PREZ_OK;
+        v = dictGetVal(de);
+    }
+    for (oldest = v; v; v = v->prev) {
+        if (v->mod_index <= index) {
+            *vp = v;
+            return PREZ_OK;
+        }
+        oldest = v;
+    }
+    /* The oldest version, unless dropped, was the one creating the key. */
+    return index >= oldest->create_index ? PREZ_ERR : PREZ_OK;
+}
+
+/* GETREV <key>
+ *
+ * Reply with the value of the key, the index that created it and the one
+ * that set the value, or with a null multi bulk if the key does not
+ * exist. */
+void getrevCommand(prezClient *c, robj **argv, int argc) {
+    keyVersion *v = lookupKeyVersion(&server.db[0],argv[1]);
+    PREZ_NOTUSED(argc);
+
+    if (v == NULL) {
+        addReply(c,shared.nullmultibulk);
+        return;
+    }
+    addReplyMultiBulkLen(c,3);
+    addReplyBulk(c,v->val);
+    addReplyLongLong(c,v->create_index);
+    addReplyLongLong(c,v->mod_index);
+}
+
+/* GETAT <index> <key> [<key> ...]
+ *
+ * Reply with the values the keys had once the log entry at <index> was
+ * applied. The keys must belong to the same Raft group. */
+void getatCommand(prezClient *c, robj **argv, int argc) {
+    long long index;
+    clusterState *g;
+    int j, group = clusterKeyGroup(argv[2]);
+
+    if (getLongLongFromObjectOrReply(c,argv[1],&index,NULL) != PREZ_OK)
+        return;
+    for (j = 3; j < argc; j++) {
+        if (clusterKeyGroup(argv[j]) != group) {
+            addReplyError(c,"CROSSGROUP Keys in request don't hash to the same Raft group");
+            return;
+        }
+    }
+    g = server.groups[group];
+    if (index > g->last_applied) {
+        addReplyErrorFormat(c,"The index %lld is not applied yet, the last "
+            "applied index is %lld", index, g->last_applied);
+        return;
+    }
+    if (index < g->compact_index) {
+        addReplyErrorFormat(c,"COMPACTED The versions before index %lld "
+            "were compacted", g->compact_index);
+        return;
+    }
+    if (index < g->deleted_index) {
+        addReplyErrorFormat(c,"COMPACTED The deletions before index %lld "
+            "were dropped", g->deleted_index);
+        return;
+    }
+
+    /* Check first that none of the versions was dropped, not to leave
+     * the client with a partial reply. */
+    for (j = 2; j < argc; j++) {
+        keyVersion *v;
+
+        if (keyVersionAt(&server.db[0],argv[j],index,&v) == PREZ_ERR) {
+            addReplyErrorFormat(c,"COMPACTED The version of '%s' at index "
+                "%lld was dropped", (char*)argv[j]->ptr, index);
+            return;
+        }
+    }
+    addReplyMultiBulkLen(c,argc-2);
+    for (j = 2; j < argc; j++) {
+        keyVersion *v;
+
+        keyVersionAt(&server.db[0],argv[j],index,&v);
+        if (v && v->val)
+            addReplyBulk(c,v->val);
+        else
+            addReply(c,shared.nullbulk);
+    }
+}
+
+typedef struct compactState {
+    prezDb *db;
+    int group;
+    long long index;
+} compactState;
+
+static void compactScanCallback(void *privdata, const oadictEntry *de) {
+    compactState *cs = privdata;
+    sds key = oadictGetKey(de);
+    keyVersion *v = oadictGetVal(de), *newer = NULL;
+
+    if (keyHashSlot(key,sdslen(key)) % server.cluster_groups !=
+        (unsigned int)cs->group) return;
+    for (; v; newer = v, v = v->prev) {
+        if (v->mod_index <= cs->index) {
+            /* The reads from the index on find the key missing before
+             * the newer version anyway: drop the tombstone too. */
+            if (v->val == NULL) v = newer;
+            freeOlderKeyVersions(v);
+            break;
+        }
+    }
+}
+
+typedef struct compactTombstonesState {
+    sds *keys;
+    int numkeys;
+} compactTombstonesState;
+
+static int compactTombstonesCallback(void *privdata, unsigned char *key,
+                                     size_t len, void *value)
+{
+    compactTombstonesState *ts = privdata;
+    PREZ_NOTUSED(value);
+
+    ts->keys[ts->numkeys++] = sdsnewlen(key+9,len-9);
+    return ts->numkeys < PREZ_COMPACT_CYCLE_SCANS;
+}
+
+/* Called for every group by every node every cron cycle, to do the work
+ * of the last COMPACT applied by small steps: scan up to
+ * PREZ_COMPACT_CYCLE_SCANS buckets of the keyspace dropping the versions
+ * of the keys of the group, then drop as many tombstones older than the
+ * index. The tombstones more recent keep their versions until then. */
+void compactCycle(void) {
+    prezDb *db = &server.db[0];
+    clusterState *g = server.cluster;
+    compactTombstonesState ts;
+    compactState cs;
+    unsigned char end[9];
+    uint64_t w;
+    int j;
+
+    if (!g->compacting) return;
+    cs.db = db;
+    cs.group = g->id;
+    cs.index = g->compact_index;
+    for (j = 0; j < PREZ_COMPACT_CYCLE_SCANS; j++) {
+        g->compact_cursor = oadictScan(db->dict,g->compact_cursor,
+                                       compactScanCallback,&cs);
+        if (g->compact_cursor == 0) break;
+    }
+    if (g->compact_cursor) return;
+
+    /* Tombstones are indexed by the index of the deletion. */
+    w = g->compact_index+1;
+    end[0] = g->id;
+    for (j = 8; j > 0; j--) {
+        end[j] = w & 0xff;
+        w >>= 8;
+    }
+    ts.keys = zmalloc(sizeof(sds)*PREZ_COMPACT_CYCLE_SCANS);
+    ts.numkeys = 0;
+    radixWalk(db->deleted_index,end,1,end,9,compactTombstonesCallback,&ts);
+    for (j = 0; j < ts.numkeys; j++) {
+        freeKeyVersions(dbRemoveTombstone(db,ts.keys[j]));
+        sdsfree(ts.keys[j]);
+    }
+    if (ts.numkeys < PREZ_COMPACT_CYCLE_SCANS) g->compacting = 0;
+    zfree(ts.keys);
+}
+
+/* COMPACT <index> [<key>]
+ *
+ * Drop the versions older than <index> of the keys of the Raft group of
+ * <key>, or of group 0. The reads before <index> fail right away, while
+ * the versions are dropped by compactCycle(), not to stall the apply of
+ * the log scanning the keyspace. */
+void compactCommand(prezClient *c, robj **argv, int argc) {
+    long long index;
+    PREZ_NOTUSED(argc);
+
+    if (getLongLongFromObjectOrReply(c,argv[1],&index,NULL) != PREZ_OK)
+        return;
+    if (index > server.cluster->last_applied) {
+        addReplyError(c,"Can't compact after the last applied index");
+        return;
+    }
+    if (index > server.cluster->compact_index) {
+        server.cluster->compact_index = index;
+        server.cluster->compact_cursor = 0;
+        server.cluster->compacting = 1;
+    }
+    addReply(c,shared.ok);
+}
+
+/* -----------------------------------------------------------------------------
+ * Expires
+ * ---------------------------------------------------------------------------*/
+
+/* A key with a TTL carries the unix time in milliseconds it expires at.
+ * The deadlines in the log are absolute: EXPIRE, PEXPIRE, EXPIREAT and SET
+ * EX / PX are rewritten as PEXPIREAT and SET PXAT before being logged, see
+ * rewriteExpireCommand(), so that every node applies the same deadline.
+ *
+ * db->expires indexes the keys with a TTL by Raft group and deadline, so
+ * that the leader of a group finds the expired keys without scanning the
+ * keyspace. Every cron cycle it logs EXPIRED entries deleting them in
+ * batches, see activeExpireCycle(). Until then reads hide the expired keys,
+ * while writes, that must not depend on the clock of the node, still see
+ * them. */
+
+int removeExpire(prezDb *db, robj *key) {
+    keyVersion *v = lookupKeyVersion(db,key);
+    sds ik;
+
+    if (v == NULL || v->expire == 0) return 0;
+    ik = groupIndexKey(key->ptr,v->expire);
+    radixRemove(db->expires,(unsigned char*)ik,sdslen(ik));
+    sdsfree(ik);
+    v->expire = 0;
+    return 1;
+}
+
+/* Set the deadline of an existing key. Deadlines in the past make the key
+ * expire right away. */
+void setExpire(prezDb *db, robj *key, long long when) {
+    keyVersion *v = lookupKeyVersion(db,key);
+    sds ik;
+
+    prezAssertWithInfo(NULL,key,v != NULL);
+    removeExpire(db,key);
+    if (when < 1) when = 1; /* 0 is for no expire. */
+    ik = groupIndexKey(key->ptr,when);
+    radixInsert(db->expires,(unsigned char*)ik,sdslen(ik),NULL);
+    sdsfree(ik);
+    v->expire = when;
+}
+
+/* Return the expire time of the specified key, or -1 if no expire
+ * is associated with this key (i.e. the key is non volatile) */
+long long getExpire(prezDb *db, robj *key) {
+    keyVersion *v = lookupKeyVersion(db,key);
+
+    return (v && v->expire) ? v->expire : -1;
+}
+
+/* Turn the relative times of the expire commands of the client into
+ * absolute deadlines, before the command is queued and logged:
+ *
+ *   EXPIRE / PEXPIRE / EXPIREAT <key> <time> -> PEXPIREAT <key> <ms>
+ *   SET ... EX / PX <time>                   -> SET ... PXAT <ms>
+ *
+ * Times that are not integers are left alone, to fail the same way on
+ * every node. */
+void rewriteExpireCommand(prezClient *c) {
+    char *name = c->argv[0]->ptr, buf[32];
+    long long now = mstime(), n;
+    robj *o;
+    int j;
+
+    if (c->argc == 3 && (!strcasecmp(name,"expire") ||
+                         !strcasecmp(name,"pexpire") ||
+                         !strcasecmp(name,"expireat")))
+    {
+        if (!string2ll(c->argv[2]->ptr,sdslen(c->argv[2]->ptr),&n)) return;
+        if (!strcasecmp(name,"expire")) n = now+n*1000;
+        else if (!strcasecmp(name,"pexpire")) n = now+n;
+        else n *= 1000;
+        o = createStringObject("pexpireat",9);
+        rewriteClientCommandArgument(c,0,o);
+        decrRefCount(o);
+        o = createStringObject(buf,ll2string(buf,sizeof(buf),n));
+        rewriteClientCommandArgument(c,2,o);
+        decrRefCount(o);
+    } else if (!strcasecmp(name,"set")) {
+        for (j = 3; j+1 < c->argc; j += 2) {
+            char *opt = c->argv[j]->ptr;
+
+            if (strcasecmp(opt,"ex") && strcasecmp(opt,"px")) continue;
+            if (!string2ll(c->argv[j+1]->ptr,sdslen(c->argv[j+1]->ptr),&n) ||
+                n <= 0) continue;
+            n = !strcasecmp(opt,"ex") ? now+n*1000 : now+n;
+            o = createStringObject("pxat",4);
+            rewriteClientCommandArgument(c,j,o);
+            decrRefCount(o);
+            o = createStringObject(buf,ll2string(buf,sizeof(buf),n));
+            rewriteClientCommandArgument(c,j+1,o);
+            decrRefCount(o);
+        }
+    }
+}
+
+/* This is the generic command implementation for EXPIRE, PEXPIRE, EXPIREAT
+ * and PEXPIREAT. Because the commad second argument may be relative or absolute
+ * the "basetime" argument is used to signal what the base time is (either 0
+ * for *AT variants of the command, or the current time for relative expires).
+ *
+ * unit is either UNIT_SECONDS or UNIT_MILLISECONDS, and is only used for
+ * the argv[2] parameter. The basetime is always specified in milliseconds.
+ *
+ * Only PEXPIREAT is logged with a valid time, see rewriteExpireCommand(). */
+void expireGenericCommand(prezClient *c, robj **argv, long long basetime,
+                          int unit)
+{
+    robj *key = argv[1], *param = argv[2];
+    long long when; /* unix time in milliseconds when the key will expire. */
+
+    if (getLongLongFromObjectOrReply(c, param, &when, NULL) != PREZ_OK)
+        return;
+
+    if (unit == UNIT_SECONDS) when *= 1000;
+    when += basetime;
+
+    /* No key, return zero. */
+    if (lookupKeyWrite(&server.db[0],key) == NULL) {
+        addReply(c,shared.czero);
+        return;
+    }
+    setExpire(&server.db[0],key,when);
+    addReply(c,shared.cone);
+}
+
+void expireCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    expireGenericCommand(c,argv,mstime(),UNIT_SECONDS);
+}
+
+void expireatCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    expireGenericCommand(c,argv,0,UNIT_SECONDS);
+}
+
+void pexpireCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    expireGenericCommand(c,argv,mstime(),UNIT_MILLISECONDS);
+}
+
+void pexpireatCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    expireGenericCommand(c,argv,0,UNIT_MILLISECONDS);
+}
+
+void ttlGenericCommand(prezClient *c, robj *key, int output_ms) {
+    long long expire, ttl = -1;
+
+    /* If the key does not exist at all, return -2 */
+    if (lookupKeyRead(&server.db[0],key) == NULL) {
+        addReplyLongLong(c,-2);
+        return;
+    }
+    /* The key exists. Return -1 if it has no expire, or the actual
+     * TTL value otherwise. */
+    expire = getExpire(&server.db[0],key);
+    if (expire != -1) {
+        ttl = expire-mstime();
+        if (ttl < 0) ttl = 0;
+    }
+    if (ttl == -1) {
+        addReplyLongLong(c,-1);
     } else {
-        return 0;
+        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
+    }
+}
+
+void ttlCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    ttlGenericCommand(c,argv[1],0);
+}
+
+void pttlCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    ttlGenericCommand(c,argv[1],1);
+}
+
+void persistCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    addReply(c,removeExpire(&server.db[0],argv[1]) ? shared.cone :
+                                                     shared.czero);
+}
+
+/* EXPIRED <time> <key> [<key> ...]
+ *
+ * Delete the keys that expire at <time> or before it. Logged by the leader
+ * for the keys it found expired, and applied the same way on every node
+ * whatever the clock says: a key that got a new deadline, or no deadline,
+ * in the meantime is left alone. Reply with the number of keys deleted. */
+void expiredCommand(prezClient *c, robj **argv, int argc) {
+    long long now;
+    int deleted = 0, j;
+
+    if (getLongLongFromObjectOrReply(c,argv[1],&now,NULL) != PREZ_OK)
+        return;
+    for (j = 2; j < argc; j++) {
+        keyVersion *v = lookupKeyVersion(&server.db[0],argv[j]);
+
+        if (v && v->expire && v->expire <= now) {
+            dbDelete(&server.db[0],argv[j]);
+            server.stat_expiredkeys++;
+            deleted++;
+        }
+    }
+    addReplyLongLong(c,deleted);
+}
+
+typedef struct expireCycleState {
+    sds *keys;
+    int numkeys;
+} expireCycleState;
+
+static int expireCycleCallback(void *privdata, unsigned char *key,
+                               size_t len, void *value)
+{
+    expireCycleState *es = privdata;
+    PREZ_NOTUSED(value);
+
+    key += 9;
+    len -= 9;
+    /* A key too long for an EXPIRED entry of its own would be found again
+     * every cycle: skip it without counting it. The SET that gave it a TTL
+     * was longer, so only a smaller PREZ_LOG_MAX_ENTRY_LEN after a restart
+     * gets here. */
+    if (len > (PREZ_LOG_MAX_ENTRY_LEN-64)/4) {
+        sds repr = sdscatrepr(sdsempty(),(char*)key,len);
+        int toolong = sdslen(repr) > PREZ_LOG_MAX_ENTRY_LEN-64;
+
+        sdsfree(repr);
+        if (toolong) {
+            prezLog(PREZ_WARNING,"Expired key of %lu bytes too long to be "
+                    "logged, not deleted", (unsigned long) len);
+            return 1;
+        }
+    }
+    es->keys[es->numkeys++] = sdsnewlen(key,len);
+    return es->numkeys < PREZ_EXPIRE_CYCLE_KEYS;
+}
+
+/* Called by the leader of the selected group every cron cycle: log the
+ * deletion of up to PREZ_EXPIRE_CYCLE_KEYS expired keys, usually with a
+ * single entry. Nothing is logged while the entries logged by
+ * the previous cycle are not applied, not to delete the same keys twice. */
+void activeExpireCycle(void) {
+    prezDb *db = &server.db[0];
+    struct prezCommand *cmd;
+    expireCycleState es;
+    unsigned char start[1], end[9];
+    long long now = mstime();
+    uint64_t w = now+1;
+    robj **argv;
+    char buf[32];
+    size_t len;
+    int argc, j;
+
+    if (radixSize(db->expires) == 0 ||
+        server.cluster->expire_pending_index > server.cluster->last_applied)
+        return;
+
+    start[0] = end[0] = server.cluster->id;
+    for (j = 8; j > 0; j--) {
+        end[j] = w & 0xff;
+        w >>= 8;
     }
+    es.keys = zmalloc(sizeof(sds)*PREZ_EXPIRE_CYCLE_KEYS);
+    es.numkeys = 0;
+    radixWalk(db->expires,start,1,end,9,expireCycleCallback,&es);
+    if (es.numkeys == 0) {
+        zfree(es.keys);
+        return;
+    }
+
+    /* The keys usually all go in one entry. clusterLogCommand() quotes
+     * them, so a key takes at most 4 bytes per byte plus the quotes and
+     * a space: past PREZ_LOG_MAX_ENTRY_LEN the keys go in more entries. */
+    argv = zmalloc(sizeof(robj*)*(es.numkeys+2));
+    argv[0] = createStringObject("expired",7);
+    argv[1] = createStringObject(buf,ll2string(buf,sizeof(buf),now));
+    cmd = lookupCommand(argv[0]->ptr);
+    len = 64;
+    argc = 2;
+    for (j = 0; j <= es.numkeys; j++) {
+        size_t klen = j < es.numkeys ? sdslen(es.keys[j])*4+3 : 0;
+
+        if (argc > 2 && (j == es.numkeys || len+klen > PREZ_LOG_MAX_ENTRY_LEN)) {
+            long long index = clusterLogCommand(cmd,argv,argc);
+
+            if (index) server.cluster->expire_pending_index = index;
+            while (argc > 2) decrRefCount(argv[--argc]);
+            len = 64;
+        }
+        if (j < es.numkeys) {
+            argv[argc++] = createObject(PREZ_STRING,es.keys[j]);
+            len += klen;
+        }
+    }
+    decrRefCount(argv[0]);
+    decrRefCount(argv[1]);
+    zfree(argv);
+    zfree(es.keys);
 }
 
 #if 0
@@ -706,270 +1767,6 @@ void moveCommand(prezClient *c) {
     addReply(c,shared.cone);
 }
 
-/*-----------------------------------------------------------------------------
- * Expires API
- *----------------------------------------------------------------------------*/
-
-int removeExpire(prezDb *db, robj *key) {
-    /* An expire may only be removed if there is a corresponding entry in the
-     * main dict. Otherwise, the key will never be freed. */
-    prezAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
-}
-
-void setExpire(prezDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
-
-    /* Reuse the sds from the main dict in the expire dict */
-    kde = dictFind(db->dict,key->ptr);
-    prezAssertWithInfo(NULL,key,kde != NULL);
-    de = dictReplaceRaw(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
-}
-
-/* Return the expire time of the specified key, or -1 if no expire
- * is associated with this key (i.e. the key is non volatile) */
-long long getExpire(prezDb *db, robj *key) {
-    dictEntry *de;
-
-    /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
-
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    prezAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
-}
-
-/* Propagate expires into slaves and the AOF file.
- * When a key expires in the master, a DEL operation for this key is sent
- * to all the slaves and the AOF file if enabled.
- *
- * This way the key expiry is centralized in one place, and since both
- * AOF and the master->slave link guarantee operation ordering, everything
- * will be consistent even if we allow write operations against expiring
- * keys. */
-void propagateExpire(prezDb *db, robj *key) {
-    robj *argv[2];
-
-    argv[0] = shared.del;
-    argv[1] = key;
-    incrRefCount(argv[0]);
-    incrRefCount(argv[1]);
-
-    if (server.aof_state != PREZ_AOF_OFF)
-        feedAppendOnlyFile(server.delCommand,db->id,argv,2);
-    replicationFeedSlaves(server.slaves,db->id,argv,2);
-
-    decrRefCount(argv[0]);
-    decrRefCount(argv[1]);
-}
-
-int expireIfNeeded(prezDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
-    mstime_t now;
-
-    if (when < 0) return 0; /* No expire for this key */
-
-    /* Don't expire anything while loading. It will be done later. */
-    if (server.loading) return 0;
-
-    /* If we are in the context of a Lua script, we claim that time is
-     * blocked to when the Lua script started. This way a key can expire
-     * only the first time it is accessed and not in the middle of the
-     * script execution, making propagation to slaves / AOF consistent.
-     * See issue #1525 on Github for more information. */
-    now = server.lua_caller ? server.lua_time_start : mstime();
-
-    /* If we are running in the context of a slave, return ASAP:
-     * the slave key expiration is controlled by the master that will
-     * send us synthesized DEL operations for expired keys.
-     *
-     * Still we try to return the right information to the caller,
-     * that is, 0 if we think the key should be still valid, 1 if
-     * we think the key is expired at this time. */
-    if (server.masterhost != NULL) return now > when;
-
-    /* Return when this key has not expired */
-    if (now <= when) return 0;
-
-    /* Delete the key */
-    server.stat_expiredkeys++;
-    propagateExpire(db,key);
-    notifyKeyspaceEvent(PREZ_NOTIFY_EXPIRED,
-        "expired",key,db->id);
-    return dbDelete(db,key);
-}
-
-/*-----------------------------------------------------------------------------
- * Expires Commands
- *----------------------------------------------------------------------------*/
-
-/* This is the generic command implementation for EXPIRE, PEXPIRE, EXPIREAT
- * and PEXPIREAT. Because the commad second argument may be relative or absolute
- * the "basetime" argument is used to signal what the base time is (either 0
- * for *AT variants of the command, or the current time for relative expires).
- *
- * unit is either UNIT_SECONDS or UNIT_MILLISECONDS, and is only used for
- * the argv[2] parameter. The basetime is always specified in milliseconds. */
-void expireGenericCommand(prezClient *c, long long basetime, int unit) {
-    robj *key = c->argv[1], *param = c->argv[2];
-    long long when; /* unix time in milliseconds when the key will expire. */
-
-    if (getLongLongFromObjectOrReply(c, param, &when, NULL) != PREZ_OK)
-        return;
-
-    if (unit == UNIT_SECONDS) when *= 1000;
-    when += basetime;
-
-    /* No key, return zero. */
-    if (lookupKeyRead(c->db,key) == NULL) {
-        addReply(c,shared.czero);
-        return;
-    }
-
-    /* EXPIRE with negative TTL, or EXPIREAT with a timestamp into the past
-     * should never be executed as a DEL when load the AOF or in the context
-     * of a slave instance.
-     *
-     * Instead we take the other branch of the IF statement setting an expire
-     * (possibly in the past) and wait for an explicit DEL from the master. */
-    if (when <= mstime() && !server.loading && !server.masterhost) {
-        robj *aux;
-
-        prezAssertWithInfo(c,key,dbDelete(c->db,key));
-        server.dirty++;
-
-        /* Replicate/AOF this as an explicit DEL. */
-        aux = createStringObject("DEL",3);
-        rewriteClientCommandVector(c,2,aux,key);
-        decrRefCount(aux);
-        signalModifiedKey(c->db,key);
-        notifyKeyspaceEvent(PREZ_NOTIFY_GENERIC,"del",key,c->db->id);
-        addReply(c, shared.cone);
-        return;
-    } else {
-        setExpire(c->db,key,when);
-        addReply(c,shared.cone);
-        signalModifiedKey(c->db,key);
-        notifyKeyspaceEvent(PREZ_NOTIFY_GENERIC,"expire",key,c->db->id);
-        server.dirty++;
-        return;
-    }
-}
-
-void expireCommand(prezClient *c) {
-    expireGenericCommand(c,mstime(),UNIT_SECONDS);
-}
-
-void expireatCommand(prezClient *c) {
-    expireGenericCommand(c,0,UNIT_SECONDS);
-}
-
-void pexpireCommand(prezClient *c) {
-    expireGenericCommand(c,mstime(),UNIT_MILLISECONDS);
-}
-
-void pexpireatCommand(prezClient *c) {
-    expireGenericCommand(c,0,UNIT_MILLISECONDS);
-}
-
-void ttlGenericCommand(prezClient *c, int output_ms) {
-    long long expire, ttl = -1;
-
-    /* If the key does not exist at all, return -2 */
-    if (lookupKeyRead(c->db,c->argv[1]) == NULL) {
-        addReplyLongLong(c,-2);
-        return;
-    }
-    /* The key exists. Return -1 if it has no expire, or the actual
-     * TTL value otherwise. */
-    expire = getExpire(c->db,c->argv[1]);
-    if (expire != -1) {
-        ttl = expire-mstime();
-        if (ttl < 0) ttl = 0;
-    }
-    if (ttl == -1) {
-        addReplyLongLong(c,-1);
-    } else {
-        addReplyLongLong(c,output_ms ? ttl : ((ttl+500)/1000));
-    }
-}
-
-void ttlCommand(prezClient *c) {
-    ttlGenericCommand(c, 0);
-}
-
-void pttlCommand(prezClient *c) {
-    ttlGenericCommand(c, 1);
-}
-
-void persistCommand(prezClient *c) {
-    dictEntry *de;
-
-    de = dictFind(c->db->dict,c->argv[1]->ptr);
-    if (de == NULL) {
-        addReply(c,shared.czero);
-    } else {
-        if (removeExpire(c->db,c->argv[1])) {
-            addReply(c,shared.cone);
-            server.dirty++;
-        } else {
-            addReply(c,shared.czero);
-        }
-    }
-}
-
-/* -----------------------------------------------------------------------------
- * API to get key arguments from commands
- * ---------------------------------------------------------------------------*/
-
-/* The base case is to use the keys position as given in the command table
- * (firstkey, lastkey, step). */
-int *getKeysUsingCommandTable(struct prezCommand *cmd,robj **argv, int argc, int *numkeys) {
-    int j, i = 0, last, *keys;
-    PREZ_NOTUSED(argv);
-
-    if (cmd->firstkey == 0) {
-        *numkeys = 0;
-        return NULL;
-    }
-    last = cmd->lastkey;
-    if (last < 0) last = argc+last;
-    keys = zmalloc(sizeof(int)*((last - cmd->firstkey)+1));
-    for (j = cmd->firstkey; j <= last; j += cmd->keystep) {
-        prezAssert(j < argc);
-        keys[i++] = j;
-    }
-    *numkeys = i;
-    return keys;
-}
-
-/* Return all the arguments that are keys in the command passed via argc / argv.
- *
- * The command returns the positions of all the key arguments inside the array,
- * so the actual return value is an heap allocated array of integers. The
- * length of the array is returned by reference into *numkeys.
- *
- * 'cmd' must be point to the corresponding entry into the prezCommand
- * table, according to the command name in argv[0].
- *
- * This function uses the command table if a command-specific helper function
- * is not required, otherwise it calls the command-specific function. */
-int *getKeysFromCommand(struct prezCommand *cmd, robj **argv, int argc, int *numkeys) {
-    if (cmd->getkeys_proc) {
-        return cmd->getkeys_proc(cmd,argv,argc,numkeys);
-    } else {
-        return getKeysUsingCommandTable(cmd,argv,argc,numkeys);
-    }
-}
-
-/* Free the result of getKeysFromCommand. */
-void getKeysFreeResult(int *result) {
-    zfree(result);
-}
-
 /* Helper function to extract keys from following commands:
  * ZUNIONSTORE <destkey> <num-keys> <key> <key> ... <key> <options>
  * ZINTERSTORE <destkey> <num-keys> <key> <key> ... <key> <options> */
@@ -1071,91 +1868,4 @@ int *sortGetKeys(struct prezCommand *cmd, robj **argv, int argc, int *numkeys) {
     return keys;
 }
 
-/* Slot to Key API. This is used by prez Cluster in order to obtain in
- * a fast way a key that belongs to a specified hash slot. This is useful
- * while rehashing the cluster. */
-void slotToKeyAdd(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-
-    zslInsert(server.cluster->slots_to_keys,hashslot,key);
-    incrRefCount(key);
-}
-
-void slotToKeyDel(robj *key) {
-    unsigned int hashslot = keyHashSlot(key->ptr,sdslen(key->ptr));
-
-    zslDelete(server.cluster->slots_to_keys,hashslot,key);
-}
-
-void slotToKeyFlush(void) {
-    zslFree(server.cluster->slots_to_keys);
-    server.cluster->slots_to_keys = zslCreate();
-}
-
-unsigned int getKeysInSlot(unsigned int hashslot, robj **keys, unsigned int count) {
-    zskiplistNode *n;
-    zrangespec range;
-    int j = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
-
-    n = zslFirstInRange(server.cluster->slots_to_keys, &range);
-    while(n && n->score == hashslot && count--) {
-        keys[j++] = n->obj;
-        n = n->level[0].forward;
-    }
-    return j;
-}
-
-/* Remove all the keys in the specified hash slot.
- * The number of removed items is returned. */
-unsigned int delKeysInSlot(unsigned int hashslot) {
-    zskiplistNode *n;
-    zrangespec range;
-    int j = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
-
-    n = zslFirstInRange(server.cluster->slots_to_keys, &range);
-    while(n && n->score == hashslot) {
-        robj *key = n->obj;
-        n = n->level[0].forward; /* Go to the next item before freeing it. */
-        incrRefCount(key); /* Protect the object while freeing it. */
-        dbDelete(&server.db[0],key);
-        decrRefCount(key);
-        j++;
-    }
-    return j;
-}
-
-unsigned int countKeysInSlot(unsigned int hashslot) {
-    zskiplist *zsl = server.cluster->slots_to_keys;
-    zskiplistNode *zn;
-    zrangespec range;
-    int rank, count = 0;
-
-    range.min = range.max = hashslot;
-    range.minex = range.maxex = 0;
-
-    /* Find first element in range */
-    zn = zslFirstInRange(zsl, &range);
-
-    /* Use rank of first element, if any, to determine preliminary count */
-    if (zn != NULL) {
-        rank = zslGetRank(zsl, zn->score, zn->obj);
-        count = (zsl->length - (rank - 1));
-
-        /* Find last element in range */
-        zn = zslLastInRange(zsl, &range);
-
-        /* Use rank of last element, if any, to determine the actual count */
-        if (zn != NULL) {
-            rank = zslGetRank(zsl, zn->score, zn->obj);
-            count -= (zsl->length - rank);
-        }
-    }
-    return count;
-}
 #endif
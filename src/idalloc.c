@@ -0,0 +1,125 @@
+/* ID allocation.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "cluster.h"
+
+/* IDALLOC hands out unique IDs from a counter key, without a log entry for
+ * every call. The counter is the highest ID reserved so far: a logged
+ * IDALLOC moves it forward by a whole block, replies with the first IDs of
+ * the block, and leaves the rest of it to the node that logged the command,
+ * the leader. The following IDALLOC of the key are served from the block
+ * right away by processCommand(), until the block runs out, or the key is
+ * written by anything else than the IDALLOC that reserved it.
+ *
+ * A block is only known to the node that reserved it, and the counter only
+ * grows past it, so a node serving IDs from its block, even an old leader
+ * that doesn't know it was replaced, never hands out an ID another node
+ * could. The IDs left in the blocks of old leaders are lost: IDs are
+ * unique, and increasing on every leader, but not contiguous. */
+
+/* Parse IDALLOC <key> <count> [BLOCK <size>]. The size of the block is
+ * part of the command, so that every node moves the counter by the same
+ * amount. */
+static int idallocParse(prezClient *c, robj **argv, int argc,
+                        long long *count, long long *block)
+{
+    *block = PREZ_IDALLOC_BLOCK_SIZE;
+    if (argc != 3 && (argc != 5 || strcasecmp(argv[3]->ptr,"block"))) {
+        addReply(c,shared.syntaxerr);
+        return PREZ_ERR;
+    }
+    if (getLongLongFromObjectOrReply(c,argv[2],count,NULL) != PREZ_OK ||
+        (argc == 5 &&
+         getLongLongFromObjectOrReply(c,argv[4],block,NULL) != PREZ_OK))
+        return PREZ_ERR;
+    if (*count <= 0 || *block <= 0) {
+        addReplyError(c,"The count and the block size must be positive");
+        return PREZ_ERR;
+    }
+    if (*block < *count) *block = *count;
+    return PREZ_OK;
+}
+
+/* Serve the IDALLOC of the client from the block of the key, reserved by
+ * the leader of the selected group. Returns 1 if the client got its reply,
+ * 0 if the command has to be logged to reserve a new block. */
+int idallocFromBlock(prezClient *c) {
+    dictEntry *de = dictFind(server.cluster->id_blocks,c->argv[1]->ptr);
+    long long count, block;
+    keyVersion *v;
+    idBlock *b;
+
+    if (de == NULL) return 0;
+    if (idallocParse(NULL,c->argv,c->argc,&count,&block) != PREZ_OK)
+        return 0;
+    b = dictGetVal(de);
+    v = lookupKeyVersion(&server.db[0],c->argv[1]);
+    if (v == NULL || v->mod_index != b->index) {
+        /* The counter was written since: the block may no longer be
+         * above it. */
+        dictDelete(server.cluster->id_blocks,c->argv[1]->ptr);
+        return 0;
+    }
+    if (b->last-b->next+1 < count) return 0;
+    addReplyLongLong(c,b->next);
+    b->next += count;
+    if (b->next > b->last)
+        dictDelete(server.cluster->id_blocks,c->argv[1]->ptr);
+    server.stat_idalloc_from_block++;
+    return 1;
+}
+
+/* IDALLOC <key> <count> [BLOCK <size>]
+ *
+ * Allocate <count> IDs, and reply with the first one: the IDs are the
+ * <count> integers starting from it. A new block of <size> IDs, 10000 by
+ * default, is reserved when the block of the leader can't serve the
+ * request. */
+void idallocCommand(prezClient *c, robj **argv, int argc) {
+    long long count, block, last;
+    sds key = argv[1]->ptr;
+
+    if (idallocParse(c,argv,argc,&count,&block) != PREZ_OK) return;
+    if (incrKey(c,argv[1],block,&last) != PREZ_OK) return;
+
+    /* Only the node that logged the command has a client to reply to,
+     * and keeps the rest of the block. */
+    if (c && block > count) {
+        idBlock *b = zmalloc(sizeof(*b));
+
+        b->next = last-block+count+1;
+        b->last = last;
+        b->index = server.cluster->last_applied;
+        dictDelete(server.cluster->id_blocks,key);
+        dictAdd(server.cluster->id_blocks,sdsdup(key),b);
+    }
+    addReplyLongLong(c,last-block+1);
+}
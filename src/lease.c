@@ -0,0 +1,312 @@
+/* Leases.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "cluster.h"
+
+/* Leases give keys the lifetime of a client session, like the ephemeral
+ * nodes of ZooKeeper. A client grants a lease with a TTL, attaches keys to
+ * it with SET ... LEASE <id>, and keeps it alive with LEASEKEEPALIVE: a
+ * single keep-alive per session, whatever the number of its keys. When
+ * the client stops sending them the lease expires, and all its keys are
+ * deleted.
+ *
+ * Leases are part of the state of a Raft group: they are granted and
+ * revoked by log entries. The id of a lease is the index of the entry
+ * granting it, with the group in the bits from PREZ_LEASE_GROUP_SHIFT up,
+ * so that ids are unique across groups. The keys attached to a lease must
+ * belong to its group, that is the group of the optional key of
+ * LEASEGRANT, or group 0.
+ *
+ * Expiration is decided by the leader alone: it keeps the deadline of
+ * every lease, and once a deadline passes it logs LEASEREVOKE, a single
+ * entry deleting all the keys of the lease as it is applied on every node.
+ * A new leader restarts the deadlines of all the leases from the TTL, so a
+ * lease never expires earlier than its TTL from the last keep-alive.
+ *
+ * Keep-alives are not logged. The leader renews the lease right away,
+ * while a follower collects the leases renewed by its clients, and sends
+ * them to the leader in batches every cron cycle (see
+ * clusterSendLeaseKeepalives()), so that many sessions cost a few bus
+ * messages rather than log writes. The TTL should be well above the cron
+ * period and the election timeout. */
+
+/* Lookup a lease of the group 'g'. */
+static lease *leaseLookupGroup(clusterState *g, long long id) {
+    sds key = sdsfromlonglong(id);
+    lease *l = dictFetchValue(g->leases,key);
+
+    sdsfree(key);
+    return l;
+}
+
+/* Lookup a lease of the selected group. */
+lease *leaseLookup(long long id) {
+    return leaseLookupGroup(server.cluster,id);
+}
+
+/* Reply with an error and return 1 if the lease 'id' belongs to a group
+ * other than the selected one. */
+static int leaseOfOtherGroup(prezClient *c, long long id) {
+    unsigned long long g = leaseIdGroup(id);
+
+    if (g == (unsigned) server.cluster->id ||
+        g >= (unsigned) server.cluster_groups) return 0;
+    addReplyError(c,"CROSSGROUP The lease belongs to another Raft group");
+    return 1;
+}
+
+/* Lookup the lease a command of the selected group attaches something to,
+ * replying with an error if it doesn't exist or belongs to another group. */
+lease *leaseLookupOrReply(prezClient *c, long long id) {
+    lease *l;
+
+    if (leaseOfOtherGroup(c,id)) return NULL;
+    if ((l = leaseLookup(id)) == NULL) addReplyError(c,"No such lease");
+    return l;
+}
+
+/* Attach an existing key to the lease. */
+void leaseAttachKey(lease *l, robj *key) {
+    keyVersion *v = lookupKeyVersion(&server.db[0],key);
+    sds copy = sdsdup(key->ptr);
+
+    v->lease = l->id;
+    if (dictAdd(l->keys,copy,NULL) != DICT_OK) sdsfree(copy);
+}
+
+/* Detach the key, whose current version is 'v', from its lease. */
+void leaseDetachKey(sds key, keyVersion *v) {
+    lease *l = leaseLookupGroup(server.groups[leaseIdGroup(v->lease)],v->lease);
+
+    if (l) dictDelete(l->keys,key);
+    v->lease = 0;
+}
+
+/* Delete the keys of the lease, release its locks and free it. */
+static void leaseRevoke(lease *l) {
+    dictIterator *di;
+    dictEntry *de;
+    sds id;
+
+    /* Keys are detached first, so that dbDelete() doesn't touch the set
+     * we are iterating. */
+    di = dictGetIterator(l->keys);
+    while((de = dictNext(di)) != NULL) {
+        robj key;
+        keyVersion *v;
+
+        initStaticStringObject(key,dictGetKey(de));
+        v = lookupKeyVersion(&server.db[0],&key);
+        if (v) {
+            v->lease = 0;
+            dbDelete(&server.db[0],&key);
+        }
+    }
+    dictReleaseIterator(di);
+    dictRelease(l->keys);
+    lockReleaseLease(l);
+    dictRelease(l->locks);
+
+    id = sdsfromlonglong(l->id);
+    dictDelete(server.cluster->leases,id);
+    sdsfree(id);
+    zfree(l);
+}
+
+/* Extend the lease of the selected group by its TTL. Called on the leader
+ * for the keep-alives of its clients and of the followers. */
+void leaseRenew(long long id) {
+    lease *l = leaseLookup(id);
+
+    if (l && !l->revoking) l->expire = monotonicMstime()+l->ttl;
+}
+
+/* Restart the deadlines of all the leases of the selected group, as we
+ * become its leader. */
+void leaseResetExpires(void) {
+    mstime_t now = monotonicMstime();
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetIterator(server.cluster->leases);
+    while((de = dictNext(di)) != NULL) {
+        lease *l = dictGetVal(de);
+
+        l->expire = now+l->ttl;
+        l->revoking = 0;
+    }
+    dictReleaseIterator(di);
+    dictEmpty(server.cluster->lease_keepalives,NULL);
+}
+
+/* Called by the leader of the selected group every cron cycle: log the
+ * revoke of the leases past their deadline. */
+void leaseExpireCron(void) {
+    struct prezCommand *cmd;
+    mstime_t now;
+    dictIterator *di;
+    dictEntry *de;
+    robj *argv[2];
+
+    if (dictSize(server.cluster->leases) == 0) return;
+    argv[0] = createStringObject("leaserevoke",11);
+    cmd = lookupCommand(argv[0]->ptr);
+    now = monotonicMstime();
+    di = dictGetIterator(server.cluster->leases);
+    while((de = dictNext(di)) != NULL) {
+        lease *l = dictGetVal(de);
+        char buf[32];
+
+        if (l->revoking || l->expire > now) continue;
+        argv[1] = createStringObject(buf,ll2string(buf,sizeof(buf),l->id));
+        if (clusterLogCommand(cmd,argv,2)) {
+            l->revoking = 1;
+            server.stat_expired_leases++;
+        }
+        decrRefCount(argv[1]);
+    }
+    dictReleaseIterator(di);
+    decrRefCount(argv[0]);
+}
+
+/* LEASEGRANT <ttl> [<key>], LEASEREVOKE <id> [<key>]: the optional key
+ * selects the Raft group. */
+int *leaseGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys) {
+    int *keys;
+    PREZ_NOTUSED(cmd);
+    PREZ_NOTUSED(argv);
+
+    if (argc != 3) {
+        *numkeys = 0;
+        return NULL;
+    }
+    keys = zmalloc(sizeof(int));
+    keys[0] = 2;
+    *numkeys = 1;
+    return keys;
+}
+
+/* LEASEGRANT <ttl> [<key>]
+ *
+ * Grant a lease expiring <ttl> milliseconds after the last keep-alive, and
+ * reply with its id. */
+void leasegrantCommand(prezClient *c, robj **argv, int argc) {
+    long long ttl;
+    lease *l;
+
+    if (argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,argv[1],&ttl,NULL) != PREZ_OK)
+        return;
+    if (ttl <= 0) {
+        addReplyError(c,"invalid TTL");
+        return;
+    }
+    l = zmalloc(sizeof(*l));
+    l->id = ((long long)server.cluster->id << PREZ_LEASE_GROUP_SHIFT) |
+            server.cluster->last_applied;
+    l->ttl = ttl;
+    l->expire = monotonicMstime()+ttl;
+    l->revoking = 0;
+    l->keys = dictCreate(&sdsSetDictType,NULL);
+    l->locks = dictCreate(&sdsSetDictType,NULL);
+    dictAdd(server.cluster->leases,sdsfromlonglong(l->id),l);
+    addReplyLongLong(c,l->id);
+}
+
+/* LEASEREVOKE <id> [<key>]
+ *
+ * Revoke the lease deleting its keys. Reply with 1 if the lease existed,
+ * 0 otherwise. */
+void leaserevokeCommand(prezClient *c, robj **argv, int argc) {
+    long long id;
+    lease *l;
+
+    if (argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,argv[1],&id,NULL) != PREZ_OK)
+        return;
+    if (leaseOfOtherGroup(c,id)) return;
+    if ((l = leaseLookup(id)) == NULL) {
+        addReply(c,shared.czero);
+        return;
+    }
+    leaseRevoke(l);
+    addReply(c,shared.cone);
+}
+
+/* LEASEKEEPALIVE <id> [<key>]
+ *
+ * Renew the lease, and reply with its TTL. It can be sent to any node,
+ * followers forward it to the leader. The group is the one of the id, the
+ * optional key must belong to it. */
+void leasekeepaliveCommand(prezClient *c, robj **argv, int argc) {
+    clusterState *g;
+    long long id;
+    lease *l;
+
+    if (argc > 3) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (getLongLongFromObjectOrReply(c,argv[1],&id,NULL) != PREZ_OK)
+        return;
+    if (leaseIdGroup(id) >= (unsigned) server.cluster_groups) {
+        addReplyError(c,"No such lease");
+        return;
+    }
+    g = server.groups[leaseIdGroup(id)];
+    if (argc == 3 && clusterKeyGroup(argv[2]) != g->id) {
+        addReplyError(c,"CROSSGROUP The lease belongs to another Raft group");
+        return;
+    }
+    if ((l = leaseLookupGroup(g,id)) == NULL ||
+        (g->state == PREZ_LEADER && l->revoking))
+    {
+        addReplyError(c,"No such lease");
+        return;
+    }
+    if (g->state == PREZ_LEADER) {
+        l->expire = monotonicMstime()+l->ttl;
+    } else if (g->leader && g->leader[0]) {
+        sds key = sdsfromlonglong(id);
+
+        if (dictAdd(g->lease_keepalives,key,NULL) != DICT_OK) sdsfree(key);
+    } else {
+        addReplyError(c,"CLUSTERDOWN Leader not elected");
+        return;
+    }
+    addReplyLongLong(c,l->ttl);
+}
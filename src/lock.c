@@ -0,0 +1,247 @@
+/* Locks.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "cluster.h"
+
+/* Locks let clients take turns without polling a key, and racing to write
+ * it once it changes. LOCK <name> <lease> takes the lock for the lease, or
+ * queues the lease behind the other waiters of the lock, and blocks the
+ * client until its turn comes. UNLOCK hands the lock to the waiter at the
+ * head of the queue, the only one woken: a handoff costs one log entry and
+ * one reply, whatever the number of waiters.
+ *
+ * Locks are part of the state of the Raft group of their name, and are
+ * decided as the LOCK and UNLOCK entries are applied, so that every node
+ * agrees on the owner and on the queue. The lease must belong to the same
+ * group, see LEASEGRANT. When the lease is revoked, or expires, its locks
+ * are released and its waits canceled, so a client that died doesn't hold
+ * a lock forever.
+ *
+ * Every grant comes with a fencing token, the index of the entry granting
+ * the lock: the LOCK itself, or the UNLOCK or LEASEREVOKE of the previous
+ * owner. Tokens only grow, so a resource can reject the writes of an owner
+ * that lost the lock, sent with a token lower than one it already saw.
+ *
+ * A waiting client is only known to the node it is connected to: its
+ * request stays blocked in the queue of the client, and the waiter points
+ * to it. Once the batch of entries is applied, the node replies to the
+ * waiters that got the lock, see lockWakeWaiters(). */
+
+/* Lookup a lock of the selected group. */
+static lock *lockLookup(sds name) {
+    return dictFetchValue(server.cluster->locks,name);
+}
+
+/* Return the node of the waiters of the lock that holds the lease, or
+ * NULL if the lease isn't waiting. */
+static listNode *lockFindWaiter(lock *lk, long long owner) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(lk->waiters,&li);
+    while((ln = listNext(&li)) != NULL) {
+        lockWaiter *w = listNodeValue(ln);
+
+        if (w->owner == owner) return ln;
+    }
+    return NULL;
+}
+
+/* The waiter got the lock with 'token', or its wait was canceled if the
+ * token is 0. Free it, unless a client of ours waits, in which case the
+ * waiter is replied and freed by lockWakeWaiters(). */
+static void lockWakeWaiter(lockWaiter *w, long long token) {
+    w->token = token;
+    if (w->request) listAddNodeTail(server.lock_wakeups,w);
+    else zfree(w);
+}
+
+/* The owner left the lock: grant it to the waiter at the head of the queue,
+ * with the index of the entry being applied as token, or delete the lock
+ * if nobody waits for it. */
+static void lockHandoff(lock *lk) {
+    listNode *ln = listFirst(lk->waiters);
+    lockWaiter *w;
+
+    if (ln == NULL) {
+        listRelease(lk->waiters);
+        dictDelete(server.cluster->locks,lk->name); /* Frees the name. */
+        zfree(lk);
+        return;
+    }
+    w = listNodeValue(ln);
+    listDelNode(lk->waiters,ln);
+    lk->owner = w->owner;
+    lk->token = server.cluster->last_applied;
+    server.stat_lock_handoffs++;
+    lockWakeWaiter(w,lk->token);
+}
+
+/* Release the lock if the lease holds it, or cancel its wait. Returns 1 if
+ * the lease held or waited for the lock, 0 otherwise. */
+static int lockRemoveOwner(lock *lk, long long owner) {
+    listNode *ln;
+
+    if (lk->owner == owner) {
+        lockHandoff(lk);
+        return 1;
+    }
+    if ((ln = lockFindWaiter(lk,owner)) == NULL) return 0;
+    lockWakeWaiter(listNodeValue(ln),0);
+    listDelNode(lk->waiters,ln);
+    return 1;
+}
+
+/* Release the locks of the lease of the selected group, and cancel its
+ * waits, as the lease is revoked. */
+void lockReleaseLease(lease *l) {
+    dictIterator *di;
+    dictEntry *de;
+
+    di = dictGetIterator(l->locks);
+    while((de = dictNext(di)) != NULL) {
+        lock *lk = lockLookup(dictGetKey(de));
+
+        if (lk) lockRemoveOwner(lk,l->id);
+    }
+    dictReleaseIterator(di);
+}
+
+/* Reply to the blocked clients whose wait ended. Called once a batch of
+ * log entries is applied. */
+void lockWakeWaiters(void) {
+    while (listLength(server.lock_wakeups)) {
+        listNode *ln = listFirst(server.lock_wakeups);
+        lockWaiter *w = listNodeValue(ln);
+
+        listDelNode(server.lock_wakeups,ln);
+        if (w->request) {
+            clientUnblockRequest(w->request, w->token ?
+                sdscatprintf(sdsempty(),":%lld\r\n",w->token) :
+                sdsnew("$-1\r\n"));
+        }
+        zfree(w);
+    }
+}
+
+/* LOCK <name> <lease>
+ *
+ * Take the lock for the lease, and reply with the fencing token. If the
+ * lock is taken the client blocks, queued behind the other waiters, until
+ * it gets the lock, or gets a null reply if the lease is revoked or UNLOCK
+ * cancels the wait. Taking a lock the lease already holds replies with the
+ * token it got. */
+void lockCommand(prezClient *c, robj **argv, int argc) {
+    sds name = argv[1]->ptr;
+    long long id;
+    lease *l;
+    lock *lk;
+    lockWaiter *w;
+    PREZ_NOTUSED(argc);
+
+    if (getLongLongFromObjectOrReply(c,argv[2],&id,NULL) != PREZ_OK)
+        return;
+    if ((l = leaseLookupOrReply(c,id)) == NULL) return;
+    if ((lk = lockLookup(name)) == NULL) {
+        lk = zmalloc(sizeof(*lk));
+        lk->name = sdsdup(name);
+        lk->owner = id;
+        lk->token = server.cluster->last_applied;
+        lk->waiters = listCreate();
+        dictAdd(server.cluster->locks,lk->name,lk);
+        dictAdd(l->locks,sdsdup(name),NULL);
+        addReplyLongLong(c,lk->token);
+        return;
+    }
+    if (lk->owner == id) {
+        addReplyLongLong(c,lk->token);
+        return;
+    }
+    if (dictFind(l->locks,name)) {
+        addReplyError(c,"The lease already waits for the lock");
+        return;
+    }
+    w = zmalloc(sizeof(*w));
+    w->owner = id;
+    w->token = 0;
+    w->request = NULL;
+    if (c) {
+        /* Writes are executed on behalf of their queued request. */
+        prezAssertWithInfo(c,NULL,c->request != NULL);
+        w->request = c->request;
+        w->request->waiter = w;
+    }
+    listAddNodeTail(lk->waiters,w);
+    dictAdd(l->locks,sdsdup(name),NULL);
+}
+
+/* UNLOCK <name> <lease>
+ *
+ * Release the lock held by the lease, handing it to the next waiter, or
+ * cancel the wait of the lease. Reply with 1 if the lease held or waited
+ * for the lock, 0 otherwise. */
+void unlockCommand(prezClient *c, robj **argv, int argc) {
+    sds name = argv[1]->ptr;
+    long long id;
+    lease *l;
+    lock *lk;
+    PREZ_NOTUSED(argc);
+
+    if (getLongLongFromObjectOrReply(c,argv[2],&id,NULL) != PREZ_OK)
+        return;
+    if ((lk = lockLookup(name)) == NULL || (l = leaseLookup(id)) == NULL ||
+        !lockRemoveOwner(lk,id))
+    {
+        addReply(c,shared.czero);
+        return;
+    }
+    dictDelete(l->locks,name);
+    addReply(c,shared.cone);
+}
+
+/* LOCKOWNER <name>
+ *
+ * Reply with the lease holding the lock, its fencing token and the number
+ * of waiters, or with a null multi bulk if nobody holds the lock. */
+void lockownerCommand(prezClient *c, robj **argv, int argc) {
+    clusterState *g = server.groups[clusterKeyGroup(argv[1])];
+    lock *lk = dictFetchValue(g->locks,argv[1]->ptr);
+    PREZ_NOTUSED(argc);
+
+    if (lk == NULL) {
+        addReply(c,shared.nullmultibulk);
+        return;
+    }
+    addReplyMultiBulkLen(c,3);
+    addReplyLongLong(c,lk->owner);
+    addReplyLongLong(c,lk->token);
+    addReplyLongLong(c,listLength(lk->waiters));
+}
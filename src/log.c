@@ -63,6 +63,8 @@ int loadLogFile(void) {
     FILE *fp;
     struct prez_stat sb;
 
+    server.cluster->log_buf = sdsempty();
+
     server.cluster->log_fd = open(server.cluster->log_filename,
             O_WRONLY|O_APPEND|O_CREAT,0644);
     if (server.cluster->log_fd == -1) {
@@ -105,7 +107,7 @@ int loadLogFile(void) {
         if (argc < 1) goto fmterr;
         loglen = strlen(buf);
 
-        entry = zmalloc(sizeof(*entry));
+        entry = zcalloc(sizeof(*entry));
         for (j = 0; j < argc; j++) {
             if (fgets(buf,sizeof(buf),fp) == NULL) goto readerr;
             if (buf[0] != '$') goto fmterr;
@@ -123,20 +125,24 @@ int loadLogFile(void) {
                     if (!ok) goto readerr;
                     break;
                 case LOG_TYPE_COMMANDNAME:
-                    memcpy(entry->log_entry.commandName, argsds,
-                            sizeof(entry->log_entry.commandName));
+                    if (len >= sizeof(entry->log_entry.commandName))
+                        goto fmterr;
+                    memcpy(entry->log_entry.commandName,argsds,len);
                     break;
                 case LOG_TYPE_COMMAND:
-                    memcpy(entry->log_entry.command, argsds,
-                            sizeof(entry->log_entry.command));
+                    entry->log_entry.command = argsds;
+                    argsds = NULL;
                     break;
                 default:
                     goto fmterr;
                     break;
             }
+            sdsfree(argsds);
             if (fread(buf,2,1,fp) == 0) goto fmterr; /* discard CRLF */
             loglen  += 2;
         }
+        if (entry->log_entry.command == NULL)
+            entry->log_entry.command = sdsempty();
         entry->position = server.cluster->log_current_size;
         server.cluster->log_current_size += loglen;
 
@@ -188,14 +194,19 @@ int logTruncate(long long index) {
     listIter li;
 
     if (index < logLength) {
+        logFlush();
         entry = getLogEntry(index);
         ftruncate(server.cluster->log_fd, entry->position);
         server.cluster->log_current_size = entry->position;
+        /* An fsync in flight doesn't cover the entries replacing these. */
+        if (server.cluster->log_sync_index >= index)
+            server.cluster->log_sync_index = index-1;
         listRewind(server.cluster->log_entries, &li);
         li.next = getLogNode(index);
         while ((ln = listNext(&li)) != NULL) {
             logEntryNode *le = listNodeValue(ln);
             listDelNode(server.cluster->log_entries,ln);
+            sdsfree(le->log_entry.command);
             zfree(le);
         }
     }
@@ -227,54 +238,59 @@ sds catLogEntry(sds dst, int argc, robj **argv) {
     return dst;
 }
 
-int logWriteEntry(logEntry e) {
-    ssize_t nwritten;
+/* Append the entry at 'index' to the log, unless it's already there. The
+ * command is copied, it doesn't need to be null terminated. */
+int logWriteEntry(long long index, long long term, char *commandName,
+                  char *command, size_t commandlen)
+{
     robj *argv[4];
     sds buf = sdsempty();
     logEntryNode *en;
 
     if (logLength > 0) {
-        en = getLogEntry(e.index);
+        en = getLogEntry(index);
         if (en) {
-            if (en->log_entry.index == e.index && en->log_entry.term == e.term) {
+            if (en->log_entry.index == index && en->log_entry.term == term) {
+                sdsfree(buf);
                 return PREZ_OK;
-            } else if (e.term != en->log_entry.term &&
-                    e.index == en->log_entry.index) {
+            } else if (term != en->log_entry.term &&
+                    index == en->log_entry.index) {
                 prezLog(PREZ_NOTICE, "Conflict detected, truncate"
                         "new term:%lld index:%lld, last term:%lld",
-                        e.term, e.index, en->log_entry.term);
-                logTruncate(e.index);
+                        term, index, en->log_entry.term);
+                logTruncate(index);
             }
         }
     }
 
     /* Persist to log */
-    argv[0] = createStringObjectFromLongLong(e.index);
-    argv[1] = createStringObjectFromLongLong(e.term);
-    argv[2] = createStringObject(e.commandName,strlen(e.commandName));
-    argv[3] = createStringObject(e.command,strlen(e.command));
+    argv[0] = createStringObjectFromLongLong(index);
+    argv[1] = createStringObjectFromLongLong(term);
+    argv[2] = createStringObject(commandName,strlen(commandName));
+    argv[3] = createStringObject(command,commandlen);
     buf = catLogEntry(buf, 4, argv);
     decrRefCount(argv[0]);
     decrRefCount(argv[1]);
     decrRefCount(argv[2]);
     decrRefCount(argv[3]);
-    nwritten = write(server.cluster->log_fd,buf,sdslen(buf));
-    if (nwritten != (signed)sdslen(buf)) {
-        prezLog(PREZ_NOTICE,"log write incomplete");
-    }
+    /* The entries appended in an event loop iteration are written with a
+     * single write(2) by logFlush(). */
+    server.cluster->log_buf = sdscatlen(server.cluster->log_buf,
+                                        buf,sdslen(buf));
 
     /* Append to log list */
     en = zmalloc(sizeof(*en));
     memset(en,0,sizeof(*en));
-    en->log_entry.index = e.index;
-    en->log_entry.term = e.term;
-    memcpy(en->log_entry.commandName, e.commandName,strlen(e.commandName));
-    memcpy(en->log_entry.command, e.command,strlen(e.command));
+    en->log_entry.index = index;
+    en->log_entry.term = term;
+    memcpy(en->log_entry.commandName,commandName,strlen(commandName));
+    en->log_entry.command = sdsnewlen(command,commandlen);
     en->position = server.cluster->log_current_size;
     server.cluster->log_current_size += sdslen(buf);
+    sdsfree(buf);
     prezLog(PREZ_DEBUG,"logWriteEntry: term:%lld/%lld index:%lld len:%lu",
             en->log_entry.term,
-            e.term,
+            term,
             en->log_entry.index,
             logLength);
     listAddNodeTail(server.cluster->log_entries,en);
@@ -282,19 +298,24 @@ int logWriteEntry(logEntry e) {
     return PREZ_OK;
 }
 
-int logAppendEntries(clusterMsgDataAppendEntries entries) {
-    int i=0;
-    logEntry *e;
+/* Append the entries of an AppendEntries message, already validated by
+ * clusterProcessPacket(). They are synced by clusterBeforeSleep(). */
+int logAppendEntries(clusterMsgDataAppendEntries *entries) {
+    unsigned char *p = (unsigned char*) entries->log_entries;
+    int i;
+
+    for(i=0;i<ntohs(entries->log_entries_count);i++) {
+        clusterMsgLogEntry *e = (clusterMsgLogEntry*) p;
+        uint32_t commandlen = ntohl(e->commandlen);
 
-    e = (logEntry*) entries.log_entries;
-    for(i=0;i<ntohs(entries.log_entries_count);i++) {
-        if(logWriteEntry(entries.log_entries[i])) {
+        if(logWriteEntry(e->index,e->term,e->commandName,e->command,
+                         commandlen))
+        {
             prezLog(PREZ_NOTICE, "log write error");
             return PREZ_ERR;
         }
-        e++;
+        p += CLUSTERMSG_LOG_ENTRY_LEN(commandlen);
     }
-    if(fsync(server.cluster->log_fd) == -1) return PREZ_ERR;
     return PREZ_OK;
 }
 
@@ -310,56 +331,85 @@ int logCommitIndex(long long leader_commit_index) {
 
 int logApply(long long index) {
     int i,argc;
-    sds *argv;
+    sds *argv, key;
     robj **oargv;
     struct prezCommand *cmd;
-    prezClient *c;
+    clientRequest *r;
 
     logEntryNode *entry = getLogEntry(index);
 
     if (!entry) return PREZ_OK;
 
-    /* Process command which is what commit is really about */
-    if (server.cluster->state == PREZ_LEADER &&
-            (c = dictFetchValue(server.cluster->proc_clients,
-                                sdsfromlonglong(index)))) {
-        call(c);
-        dictDelete(server.cluster->proc_clients,
-                sdsfromlonglong(index));
-        return PREZ_OK;
+    /* If a client waits for this entry execute the command on its behalf,
+     * unless another leader overwrote the entry it was waiting for. */
+    key = sdsfromlonglong(index);
+    r = dictFetchValue(server.cluster->proc_clients,key);
+    if (r) dictDelete(server.cluster->proc_clients,key);
+    sdsfree(key);
+    if (r) {
+        int ok = r->term == entry->log_entry.term;
+
+        clientRequestCommitted(r,ok);
+        if (ok) return PREZ_OK;
     }
+
     argv = sdssplitargs(entry->log_entry.command,&argc);
     if (argv == NULL) return PREZ_OK;
     oargv = zmalloc(sizeof(robj*)*argc);
-    for(i=0;i<argc;i++) {
-        if (sdslen(argv[i])) {
-            oargv[i] = createObject(PREZ_STRING,argv[i]);
-        } else {
-            sdsfree(argv[i]);
-        }
-    }
+    for(i=0;i<argc;i++)
+        oargv[i] = createObject(PREZ_STRING,argv[i]);
     zfree(argv);
-    cmd = lookupCommand(oargv[0]->ptr);
+    cmd = argc ? lookupCommand(oargv[0]->ptr) : NULL;
     if (!cmd) {
         prezLog(PREZ_NOTICE,"unknown command '%s'",
-                (char*)oargv[0]->ptr);
-        return PREZ_OK;
+                argc ? (char*)oargv[0]->ptr : "");
     } else if ((cmd->arity > 0 && cmd->arity != argc) ||
             (argc < -cmd->arity)) {
         prezLog(PREZ_NOTICE,"wrong number of arguments for '%s' command",
                 cmd->name);
-        return PREZ_OK;
+    } else {
+        cmd->proc(NULL,oargv,argc);
     }
-    cmd->proc(NULL,oargv,argc);
     for(i=0;i<argc;i++) decrRefCount(oargv[i]);
+    zfree(oargv);
     return PREZ_OK;
 }
 
-int logSync(void) {
-    if(fsync(server.cluster->log_fd) == -1) return PREZ_ERR;
+/* Write the buffered entries to the log file. */
+int logFlush(void) {
+    sds buf = server.cluster->log_buf;
+    size_t pos = 0;
+
+    while (pos < sdslen(buf)) {
+        ssize_t nwritten = write(server.cluster->log_fd,buf+pos,
+                                 sdslen(buf)-pos);
+        if (nwritten == -1) {
+            if (errno == EINTR) continue;
+            prezLog(PREZ_WARNING,"Error writing the prez log %s: %s",
+                server.cluster->log_filename, strerror(errno));
+            sdsrange(buf,pos,-1);
+            return PREZ_ERR;
+        }
+        pos += nwritten;
+    }
+    sdsclear(buf);
     return PREZ_OK;
 }
 
+/* Write the buffered entries to the log and fsync it, then call 'proc' with
+ * zero or a negative errno value: from the event loop once the fsync is done
+ * if the event loop can submit it, otherwise right away. */
+void logSync(aeIoProc *proc, void *clientData) {
+    int fd = server.cluster->log_fd;
+
+    if (logFlush() == PREZ_ERR) {
+        proc(server.el,fd,clientData,NULL,-errno);
+        return;
+    }
+    if (aeSubmitFsync(server.el,fd,proc,clientData) != AE_ERR) return;
+    proc(server.el,fd,clientData,NULL,fsync(fd) == -1 ? -errno : 0);
+}
+
 long long logCurrentIndex(void) {
     listNode *ln;
     logEntryNode *entry;
@@ -32,10 +32,18 @@
  */
 
 #include "prez.h"
+#include "cluster.h"
+#include "resp.h"
+#include "shm.h"
+#include "endianconv.h"
 #include <sys/uio.h>
 #include <math.h>
 
 static void setProtocolError(prezClient *c, int pos);
+static void freeClientRequest(clientRequest *r);
+static void clientReleaseReplyBuffer(prezClient *c);
+static void clientSubmitRead(prezClient *c);
+static void clientSubmitWrite(prezClient *c);
 
 /* To evaluate the output buffer size of a client we need to get size of
  * allocated objects, however we can't used zmalloc_size() directly on sds
@@ -90,22 +98,40 @@ prezClient *createClient(int fd) {
     c->id = server.next_client_id++;
     c->fd = fd;
     c->name = NULL;
+    c->flags = 0;
     c->bufpos = 0;
+    c->buf_usable_size = 0;
+    c->buf = NULL;
     c->querybuf = sdsempty();
     c->querybuf_peak = 0;
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->shm = NULL;
+    c->shm_attached = NULL;
+    c->arena = NULL;
+    c->arena_used = 0;
+    c->parsed = NULL;
+    c->parsed_len = c->parsed_size = 0;
     c->cmd = c->lastcmd = NULL;
     c->multibulklen = 0;
     c->bulklen = -1;
     c->sentlen = 0;
+    c->reply_sent = 0;
+    c->io_read = -1;
+    c->io_write = -1;
     c->ctime = c->lastinteraction = server.unixtime;
     c->authenticated = 0;
     c->reply = listCreate();
     c->reply_bytes = 0;
     c->obuf_soft_limit_reached_time = 0;
     c->peerid = NULL;
+    c->requests = listCreate();
+    c->watched_keys = NULL;
+    c->watched_prefixes = NULL;
+    c->watch_events = NULL;
+    c->watch_notify_node = NULL;
+    c->request = NULL;
     listSetFreeMethod(c->reply,decrRefCountVoid);
     listSetDupMethod(c->reply,dupClientReplyValue);
     if (fd != -1) listAddNodeTail(server.clients,c);
@@ -127,13 +153,34 @@ prezClient *createClient(int fd) {
  * data to the clients output buffers. If the function returns PREZ_ERR no
  * data should be appended to the output buffers. */
 int prepareClientToWrite(prezClient *c) {
-    if (c->fd <= 0) return PREZ_ERR; /* Fake client */
-    if (c->bufpos == 0 && listLength(c->reply) == 0 &&
-            aeCreateFileEvent(server.el, c->fd, AE_WRITABLE,
-                sendReplyToClient, c) == AE_ERR) return PREZ_ERR;
+    /* Fake client, or no client at all: the followers apply the writes
+     * of the log without one. */
+    if (c == NULL || c->fd <= 0) return PREZ_ERR;
+
+    /* A client owned by an I/O thread can only get protocol errors here,
+     * the main thread arranges for them to be written once the thread
+     * is done with the client. */
+    if (c->flags & PREZ_PENDING_READ) return PREZ_OK;
+    if (!clientHasPendingReplies(c)) clientInstallWriteHandler(c);
     return PREZ_OK;
 }
 
+/* Return true if the specified client has pending reply buffers to write to
+ * the socket. */
+int clientHasPendingReplies(prezClient *c) {
+    return c->bufpos || listLength(c->reply) > c->reply_sent;
+}
+
+/* Queue the client to have its output buffers written directly before the
+ * event loop sleeps again, see handleClientsWithPendingWrites(). This way
+ * most replies don't need a write handler, that is only installed when the
+ * socket buffer is full. */
+void clientInstallWriteHandler(prezClient *c) {
+    if (c->flags & PREZ_PENDING_WRITE) return;
+    c->flags |= PREZ_PENDING_WRITE;
+    listAddNodeTail(server.clients_pending_write,c);
+}
+
 /* Create a duplicate of the last object in the reply list when
  * it is not exclusively owned by the reply list. */
 robj *dupLastObjectIfNeeded(list *reply) {
@@ -150,21 +197,95 @@ robj *dupLastObjectIfNeeded(list *reply) {
     return listNodeValue(ln);
 }
 
+/* -----------------------------------------------------------------------------
+ * Reply buffers pool
+ *
+ * Most clients are idle most of the time, so the output buffer is not part
+ * of the client structure: a buffer is taken from the pool with the first
+ * reply, and given back once written. Buffers come in a few sizes, from
+ * PREZ_REPLY_BUFFER_MIN to PREZ_REPLY_CHUNK_BYTES growing 4 times every
+ * time, and a client first gets the smallest one, moving to the next size
+ * when it is full. The pool is only used by the main thread.
+ * -------------------------------------------------------------------------- */
+
+#define REPLY_BUFFER_SIZES 3
+
+static struct {
+    int len;
+    char *bufs[PREZ_REPLY_BUFFER_POOL];
+} replyBufferPool[REPLY_BUFFER_SIZES];
+
+static size_t replyBufferSize(int j) {
+    return (size_t)PREZ_REPLY_BUFFER_MIN << (j*2);
+}
+
+static char *replyBufferGet(int j) {
+    if (replyBufferPool[j].len)
+        return replyBufferPool[j].bufs[--replyBufferPool[j].len];
+    return zmalloc(replyBufferSize(j));
+}
+
+static void replyBufferPut(char *buf, size_t size) {
+    int j = 0;
+
+    while (replyBufferSize(j) != size) j++;
+    if (replyBufferPool[j].len < PREZ_REPLY_BUFFER_POOL)
+        replyBufferPool[j].bufs[replyBufferPool[j].len++] = buf;
+    else
+        zfree(buf);
+}
+
+/* Make room for 'needed' bytes in the output buffer of the client, moving
+ * the pending data to a bigger buffer if needed. Returns PREZ_ERR if the
+ * buffer can't grow that much. */
+static int clientGrowReplyBuffer(prezClient *c, size_t needed) {
+    char *buf;
+    int j;
+
+    for (j = 0; j < REPLY_BUFFER_SIZES; j++)
+        if (replyBufferSize(j) >= needed) break;
+    if (j == REPLY_BUFFER_SIZES) return PREZ_ERR;
+
+    buf = replyBufferGet(j);
+    if (c->buf) {
+        memcpy(buf,c->buf,c->bufpos);
+        replyBufferPut(c->buf,c->buf_usable_size);
+    }
+    c->buf = buf;
+    c->buf_usable_size = replyBufferSize(j);
+    return PREZ_OK;
+}
+
+/* Give back the output buffer of the client to the pool, unless it still
+ * has data to write. */
+static void clientReleaseReplyBuffer(prezClient *c) {
+    if (c->buf == NULL || c->bufpos > 0) return;
+    replyBufferPut(c->buf,c->buf_usable_size);
+    c->buf = NULL;
+    c->buf_usable_size = 0;
+}
+
 /* -----------------------------------------------------------------------------
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
 int _addReplyToBuffer(prezClient *c, char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->bufpos;
-
     if (c->flags & PREZ_CLOSE_AFTER_REPLY) return PREZ_OK;
 
+    /* Captured replies only go to the list, see clientSwapReply(). */
+    if (c->flags & PREZ_REPLY_CAPTURE) return PREZ_ERR;
+
     /* If there already are entries in the reply list, we cannot
      * add anything more to the static buffer. */
     if (listLength(c->reply) > 0) return PREZ_ERR;
 
-    /* Check that the buffer has enough space available for this string. */
-    if (len > available) return PREZ_ERR;
+    /* Check that the buffer has enough space available for this string,
+     * or can grow enough. Clients owned by an I/O thread can't use the
+     * pool. */
+    if (c->bufpos+len > c->buf_usable_size &&
+        (c->flags & PREZ_PENDING_READ ||
+         clientGrowReplyBuffer(c,c->bufpos+len) == PREZ_ERR))
+        return PREZ_ERR;
 
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
@@ -177,8 +298,7 @@ void _addReplyObjectToList(prezClient *c, robj *o) {
     if (c->flags & PREZ_CLOSE_AFTER_REPLY) return;
 
     if (listLength(c->reply) == 0) {
-        incrRefCount(o);
-        listAddNodeTail(c->reply,o);
+        listAddNodeTail(c->reply,retainObject(o));
         c->reply_bytes += getStringObjectSdsUsedMemory(o);
     } else {
         tail = listNodeValue(listLast(c->reply));
@@ -193,8 +313,7 @@ void _addReplyObjectToList(prezClient *c, robj *o) {
             tail->ptr = sdscatlen(tail->ptr,o->ptr,sdslen(o->ptr));
             c->reply_bytes += zmalloc_size_sds(tail->ptr);
         } else {
-            incrRefCount(o);
-            listAddNodeTail(c->reply,o);
+            listAddNodeTail(c->reply,retainObject(o));
             c->reply_bytes += getStringObjectSdsUsedMemory(o);
         }
     }
@@ -288,15 +407,14 @@ void addReply(prezClient *c, robj *obj) {
         /* Optimization: if there is room in the static buffer for 32 bytes
          * (more than the max chars a 64 bit integer can take as string) we
          * avoid decoding the object and go for the lower level approach. */
-        if (listLength(c->reply) == 0 && (sizeof(c->buf) - c->bufpos) >= 32) {
+        if (listLength(c->reply) == 0) {
             char buf[32];
             int len;
 
             len = ll2string(buf,sizeof(buf),(long)obj->ptr);
             if (_addReplyToBuffer(c,buf,len) == PREZ_OK)
                 return;
-            /* else... continue with the normal code path, but should never
-             * happen actually since we verified there is room. */
+            /* else... continue with the normal code path. */
         }
         obj = getDecodedObject(obj);
         if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != PREZ_OK)
@@ -327,6 +445,27 @@ void addReplyString(prezClient *c, char *s, size_t len) {
         _addReplyStringToList(c,s,len);
 }
 
+/* Add the header of a binary protocol reply frame, that must be followed by
+ * 'len' bytes of RESP reply. */
+static void addReplyBinaryHeader(prezClient *c, uint64_t reqid, size_t len) {
+    char hdr[PREZ_BINARY_HDR_LEN];
+    uint32_t framelen = htonl((uint32_t)(len+8));
+
+    reqid = htonu64(reqid);
+    memcpy(hdr,&framelen,4);
+    memcpy(hdr+4,&reqid,8);
+    addReplyString(c,hdr,sizeof(hdr));
+}
+
+/* Add a message that does not reply to a request, like the notifications
+ * of watched keys. Binary protocol clients get it framed with the ID
+ * PREZ_BINARY_PUSH_ID. */
+void addReplyPush(prezClient *c, sds s) {
+    if (c->flags & PREZ_BINARY)
+        addReplyBinaryHeader(c,PREZ_BINARY_PUSH_ID,sdslen(s));
+    addReplySds(c,s);
+}
+
 void addReplyErrorLength(prezClient *c, char *s, size_t len) {
     addReplyString(c,"-ERR ",5);
     addReplyString(c,s,len);
@@ -529,7 +668,12 @@ void addReplyBulkLongLong(prezClient *c, long long ll) {
 void copyClientOutputBuffer(prezClient *dst, prezClient *src) {
     listRelease(dst->reply);
     dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
+    dst->bufpos = 0;
+    clientReleaseReplyBuffer(dst);
+    if (src->bufpos) {
+        clientGrowReplyBuffer(dst,src->bufpos);
+        memcpy(dst->buf,src->buf,src->bufpos);
+    }
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
 }
@@ -561,6 +705,7 @@ static void acceptCommonHandler(int fd, int flags) {
     }
     server.stat_numconnections++;
     c->flags |= flags;
+    clientSubmitRead(c);
 }
 
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -602,12 +747,79 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+void acceptBinaryHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    int cport, cfd, max = MAX_ACCEPTS_PER_CALL;
+    char cip[PREZ_IP_STR_LEN];
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(mask);
+    PREZ_NOTUSED(privdata);
+
+    while(max--) {
+        cfd = anetTcpAccept(server.neterr, fd, cip, sizeof(cip), &cport);
+        if (cfd == ANET_ERR) {
+            if (errno != EWOULDBLOCK)
+                prezLog(PREZ_WARNING,
+                    "Accepting client connection: %s", server.neterr);
+            return;
+        }
+        prezLog(PREZ_VERBOSE,"Accepted binary protocol %s:%d", cip, cport);
+        acceptCommonHandler(cfd,PREZ_BINARY);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Client arena
+ *
+ * The argv array of the command being parsed and its small arguments are
+ * allocated in a per client arena, that is reset once the command is
+ * executed, saving a few zmalloc() / zfree() pairs per command. Arguments
+ * that must outlive the command, like the value stored by SET, are copied
+ * to the heap by retainObject(). What doesn't fit in the arena goes to the
+ * heap as usual.
+ * -------------------------------------------------------------------------- */
+
+static void *clientArenaAlloc(prezClient *c, size_t size) {
+    void *p;
+
+    size = (size+sizeof(void*)-1) & ~(sizeof(void*)-1);
+    if (c->arena_used+size > PREZ_ARENA_SIZE) return NULL;
+    if (c->arena == NULL) c->arena = zmalloc(PREZ_ARENA_SIZE);
+    p = c->arena+c->arena_used;
+    c->arena_used += size;
+    return p;
+}
+
+static void clientFreeArgvArray(prezClient *c) {
+    if (c->argv && (c->arena == NULL || (char*)c->argv < c->arena ||
+                    (char*)c->argv >= c->arena+PREZ_ARENA_SIZE))
+        zfree(c->argv);
+    c->argv = NULL;
+}
+
+/* Setup the argv array of the client for a command of 'argc' arguments. */
+static void clientCreateArgv(prezClient *c, int argc) {
+    clientFreeArgvArray(c);
+    c->argv = clientArenaAlloc(c,sizeof(robj*)*argc);
+    if (c->argv == NULL) c->argv = zmalloc(sizeof(robj*)*argc);
+}
+
+/* Create a string object for an argument of the command being parsed. */
+static robj *clientCreateArgument(prezClient *c, char *ptr, size_t len) {
+    void *mem;
+
+    if (len <= PREZ_ARENA_ARG_MAX &&
+        (mem = clientArenaAlloc(c,embeddedStringObjectSize(len))) != NULL)
+        return initEmbeddedStringObject(mem,ptr,len,PREZ_ARENA_REFCOUNT);
+    return createStringObject(ptr,len);
+}
+
 static void freeClientArgv(prezClient *c) {
     int j;
     for (j = 0; j < c->argc; j++)
         decrRefCount(c->argv[j]);
     c->argc = 0;
     c->cmd = NULL;
+    c->arena_used = 0;
 }
 
 #if 0
@@ -673,15 +885,13 @@ void freeClient(prezClient *c) {
     /* Free the query buffer */
     sdsfree(c->querybuf);
     c->querybuf = NULL;
+    /* UNWATCH all the keys */
+    unwatchAllKeys(c);
 #if 0
     /* Deallocate structures used to block on blocking ops. */
     if (c->flags & PREZ_BLOCKED) unblockClient(c);
     dictRelease(c->bpop.keys);
 
-    /* UNWATCH all the keys */
-    unwatchAllKeys(c);
-    listRelease(c->watched_keys);
-
     /* Unsubscribe from all the pubsub channels */
     pubsubUnsubscribeAllChannels(c,0);
     pubsubUnsubscribeAllPatterns(c,0);
@@ -693,11 +903,34 @@ void freeClient(prezClient *c) {
     if (c->fd != -1) {
         aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
         aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
+        if (c->io_read != -1) aeCancelIo(server.el,c->io_read);
+        if (c->io_write != -1) aeCancelIo(server.el,c->io_write);
         close(c->fd);
     }
+    if (c->shm || c->shm_attached) shmDetach(c);
     listRelease(c->reply);
+    c->bufpos = 0;
+    clientReleaseReplyBuffer(c);
     freeClientArgv(c);
 
+    /* Forget the queued requests. The writes waiting to be committed are
+     * applied anyway, just without a client to reply to. */
+    while (listLength(c->requests)) {
+        clientRequest *r;
+
+        ln = listFirst(c->requests);
+        r = listNodeValue(ln);
+        if (r->index != -1 && !r->done) {
+            sds key = sdsfromlonglong(r->index);
+
+            dictDelete(server.groups[r->group]->proc_clients,key);
+            sdsfree(key);
+        }
+        freeClientRequest(r);
+        listDelNode(c->requests,ln);
+    }
+    listRelease(c->requests);
+
     /* Remove from the list of clients */
     if (c->fd != -1) {
         ln = listSearchKey(server.clients,c);
@@ -738,6 +971,18 @@ void freeClient(prezClient *c) {
     if (c->flags & PREZ_MASTER) replicationHandleMasterDisconnection();
 #endif
 
+    /* Remove the client from the I/O threads queues. */
+    if (c->flags & PREZ_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read,c);
+        prezAssert(ln != NULL);
+        listDelNode(server.clients_pending_read,ln);
+    }
+    if (c->flags & PREZ_PENDING_WRITE) {
+        ln = listSearchKey(server.clients_pending_write,c);
+        prezAssert(ln != NULL);
+        listDelNode(server.clients_pending_write,ln);
+    }
+
     /* If this client was scheduled for async freeing we need to remove it
      * from the queue. */
     if (c->flags & PREZ_CLOSE_ASAP) {
@@ -749,8 +994,10 @@ void freeClient(prezClient *c) {
     /* Release other dynamically allocated client structure fields,
      * and finally release the client structure itself. */
     if (c->name) decrRefCount(c->name);
-    zfree(c->argv);
+    clientFreeArgvArray(c);
     //freeClientMultiState(c);
+    zfree(c->arena);
+    zfree(c->parsed);
     sdsfree(c->peerid);
     zfree(c);
 }
@@ -776,50 +1023,113 @@ void freeClientsInAsyncFreeQueue(void) {
     }
 }
 
-void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    prezClient *c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    size_t objmem;
-    robj *o;
-    PREZ_NOTUSED(el);
-    PREZ_NOTUSED(mask);
+/* Remove 'nwritten' bytes from the head of the client output buffers, that
+ * is the static buffer first, and then the reply list. Empty objects at the
+ * head of the list are consumed as well.
+ *
+ * The objects of the list can be shared with other clients, like shared.ok
+ * or the values of the keys, so the written ones are only counted in
+ * c->reply_sent: I/O threads must not touch their refcount. The main thread
+ * frees them with clientFreeSentReplies(). */
+static void consumeClientReplies(prezClient *c, size_t nwritten) {
+    listNode *ln;
 
-    while(c->bufpos > 0 || listLength(c->reply)) {
-        if (c->bufpos > 0) {
-            nwritten = write(fd,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
+    if (c->bufpos > 0) {
+        size_t left = c->bufpos-c->sentlen;
+
+        if (nwritten < left) {
             c->sentlen += nwritten;
-            totwritten += nwritten;
+            return;
+        }
+        nwritten -= left;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+    ln = c->reply_sent ? listIndex(c->reply,c->reply_sent) :
+                         listFirst(c->reply);
+    for (; ln; ln = listNextNode(ln)) {
+        robj *o = listNodeValue(ln);
+        size_t left = sdslen(o->ptr)-c->sentlen;
 
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if (c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o->ptr);
-            objmem = getStringObjectSdsUsedMemory(o);
-
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->reply_bytes -= objmem;
-                continue;
-            }
+        if (nwritten < left) {
+            c->sentlen += nwritten;
+            return;
+        }
+        nwritten -= left;
+        c->reply_sent++;
+        c->sentlen = 0;
+    }
+}
+
+/* Free the objects of the reply list written by consumeClientReplies(). */
+static void clientFreeSentReplies(prezClient *c) {
+    while (c->reply_sent) {
+        listNode *ln = listFirst(c->reply);
+
+        c->reply_bytes -= getStringObjectSdsUsedMemory(listNodeValue(ln));
+        listDelNode(c->reply,ln);
+        c->reply_sent--;
+    }
+}
+
+/* Fill 'iov' with the output buffers of the client not written yet, at most
+ * PREZ_IOV_MAX of them, setting '*bytes' to their total length. Returns the
+ * number of iovecs. */
+static int clientReplyIov(prezClient *c, struct iovec *iov, size_t *bytes) {
+    size_t offset = c->sentlen;
+    unsigned long j;
+    int iovcnt = 0;
+    listIter li;
+    listNode *ln;
+
+    *bytes = 0;
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf+c->sentlen;
+        iov[iovcnt].iov_len = c->bufpos-c->sentlen;
+        *bytes += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    listRewind(c->reply,&li);
+    for (j = 0; j < c->reply_sent; j++) listNext(&li);
+    while(iovcnt < PREZ_IOV_MAX && (ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+        size_t objlen = sdslen(o->ptr);
+
+        if (objlen == offset) continue; /* Empty, consumed anyway. */
+        iov[iovcnt].iov_base = ((char*)o->ptr)+offset;
+        iov[iovcnt].iov_len = objlen-offset;
+        *bytes += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+    return iovcnt;
+}
 
-            nwritten = write(fd, ((char*)o->ptr)+c->sentlen,objlen-c->sentlen);
+/* Write the client output buffers to the socket, until the kernel buffer is
+ * full or PREZ_MAX_WRITE_PER_EVENT bytes were sent. Both the static buffer
+ * and the reply list are sent with a single writev(2) when possible.
+ * Returns PREZ_ERR on write errors, in which case the client should be freed.
+ *
+ * The event loop is not touched, so this is safe to call from I/O threads. */
+static int writeToClient(prezClient *c) {
+    struct iovec iov[PREZ_IOV_MAX];
+    ssize_t nwritten = 0;
+    size_t totwritten = 0;
+
+    while(clientHasPendingReplies(c)) {
+        size_t iovbytes;
+        int iovcnt = clientReplyIov(c,iov,&iovbytes);
+
+        if (iovcnt) {
+            nwritten = c->shm ? shmWritev(c->shm,iov,iovcnt) :
+                                writev(c->fd,iov,iovcnt);
             if (nwritten <= 0) break;
-            c->sentlen += nwritten;
             totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                c->reply_bytes -= objmem;
-            }
         }
+        consumeClientReplies(c,iovcnt ? nwritten : 0);
+
+        /* A short write means the socket buffer is full. */
+        if ((size_t)nwritten < iovbytes) break;
+
         /* Note that we avoid to send more than PREZ_MAX_WRITE_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -832,15 +1142,10 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
             (server.maxmemory == 0 ||
              zmalloc_used_memory() < server.maxmemory)) break;
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            prezLog(PREZ_VERBOSE,
-                "Error writing to client: %s", strerror(errno));
-            freeClient(c);
-            return;
-        }
+    if (nwritten == -1 && errno != EAGAIN) {
+        prezLog(PREZ_VERBOSE,
+            "Error writing to client: %s", strerror(errno));
+        return PREZ_ERR;
     }
     if (totwritten > 0) {
         /* For clients representing masters we don't count sending data
@@ -849,8 +1154,22 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
          * We just rely on data / pings received for timeout detection. */
         if (!(c->flags & PREZ_MASTER)) c->lastinteraction = server.unixtime;
     }
-    if (c->bufpos == 0 && listLength(c->reply) == 0) {
-        c->sentlen = 0;
+    return PREZ_OK;
+}
+
+void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    prezClient *c = privdata;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(fd);
+    PREZ_NOTUSED(mask);
+
+    if (writeToClient(c) == PREZ_ERR) {
+        freeClient(c);
+        return;
+    }
+    clientFreeSentReplies(c);
+    clientReleaseReplyBuffer(c);
+    if (!clientHasPendingReplies(c)) {
         aeDeleteFileEvent(server.el,c->fd,AE_WRITABLE);
 
         /* Close connection after entire reply has been sent. */
@@ -858,6 +1177,53 @@ void sendReplyToClient(aeEventLoop *el, int fd, void *privdata, int mask) {
     }
 }
 
+/* Handler of the writes submitted by clientSubmitWrite(). */
+static void clientWriteDone(aeEventLoop *el, int fd, void *privdata,
+                            char *buf, int res)
+{
+    prezClient *c = privdata;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(fd);
+    PREZ_NOTUSED(buf);
+
+    c->io_write = -1;
+    if (res < 0) {
+        prezLog(PREZ_VERBOSE,
+            "Error writing to client: %s", strerror(-res));
+        freeClient(c);
+        return;
+    }
+    consumeClientReplies(c,res);
+    clientFreeSentReplies(c);
+    clientReleaseReplyBuffer(c);
+    if (!(c->flags & PREZ_MASTER)) c->lastinteraction = server.unixtime;
+    clientSubmitWrite(c);
+}
+
+/* Write the output buffers of a PREZ_IO_SUBMIT client with a write submitted
+ * to the event loop, that copies a bounded part of them, unless a
+ * write is already in flight: its handler submits the next one. When the
+ * event loop has no I/O buffer to spare the write handler is installed
+ * instead. */
+static void clientSubmitWrite(prezClient *c) {
+    struct iovec iov[PREZ_IOV_MAX];
+    size_t iovbytes;
+    int iovcnt;
+
+    if (c->io_write != -1 || aeGetFileEvents(server.el,c->fd) & AE_WRITABLE)
+        return;
+    if (!clientHasPendingReplies(c)) {
+        if (c->flags & PREZ_CLOSE_AFTER_REPLY) freeClient(c);
+        return;
+    }
+    iovcnt = clientReplyIov(c,iov,&iovbytes);
+    c->io_write = aeSubmitWritev(server.el,c->fd,iov,iovcnt,
+                                 clientWriteDone,c);
+    if (c->io_write == AE_ERR &&
+        aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+            sendReplyToClient,c) == AE_ERR) freeClientAsync(c);
+}
+
 /* resetClient prepare the client to process the next command */
 void resetClient(prezClient *c) {
     //prezCommandProc *prevcmd = c->cmd ? c->cmd->proc : NULL;
@@ -875,6 +1241,208 @@ void resetClient(prezClient *c) {
 
 }
 
+/* -----------------------------------------------------------------------------
+ * Queued requests
+ *
+ * A client can pipeline many writes: each one is logged right away and
+ * queued in c->requests until committed, and the commands following it are
+ * queued as well, so that the replies are sent in the order the commands
+ * were received. See processCommand().
+ * -------------------------------------------------------------------------- */
+
+/* Queue a request for the command of the client at the tail of its queue.
+ * The request takes its own references to the arguments. */
+clientRequest *clientQueueRequest(prezClient *c) {
+    clientRequest *r = zmalloc(sizeof(*r));
+    int j;
+
+    r->client = c;
+    r->argv = zmalloc(sizeof(robj*)*c->argc);
+    r->argc = c->argc;
+    for (j = 0; j < c->argc; j++)
+        r->argv[j] = retainObject(c->argv[j]);
+    r->cmd = c->cmd;
+    r->reqid = c->reqid;
+    r->group = 0;
+    r->index = -1;
+    r->term = 0;
+    r->done = 0;
+    r->waiter = NULL;
+    r->reply = NULL;
+    r->reply_bytes = 0;
+    listAddNodeTail(c->requests,r);
+    return r;
+}
+
+static void freeClientRequest(clientRequest *r) {
+    int j;
+
+    /* The lock waiter stays queued, without a client to reply to. */
+    if (r->waiter) r->waiter->request = NULL;
+    for (j = 0; j < r->argc; j++)
+        decrRefCount(r->argv[j]);
+    zfree(r->argv);
+    if (r->reply) listRelease(r->reply);
+    zfree(r);
+}
+
+/* Swap the reply list of the client with the one of the request: the replies
+ * added between two calls are captured by the request, to be sent when all
+ * the requests before it were replied. */
+void clientSwapReply(prezClient *c, clientRequest *r) {
+    list *reply = c->reply;
+    unsigned long reply_bytes = c->reply_bytes;
+
+    if (r->reply == NULL) {
+        r->reply = listCreate();
+        listSetFreeMethod(r->reply,decrRefCountVoid);
+        listSetDupMethod(r->reply,dupClientReplyValue);
+    }
+    c->reply = r->reply;
+    c->reply_bytes = r->reply_bytes;
+    r->reply = reply;
+    r->reply_bytes = reply_bytes;
+    c->flags ^= PREZ_REPLY_CAPTURE;
+}
+
+/* Execute the command of the request. The command the client may be in the
+ * middle of reading is left untouched. */
+static void clientExecuteRequest(prezClient *c, clientRequest *r, int capture) {
+    robj **argv = c->argv;
+    int argc = c->argc;
+    struct prezCommand *cmd = c->cmd;
+
+    c->argv = r->argv;
+    c->argc = r->argc;
+    c->cmd = r->cmd;
+    c->request = r;
+    if (capture) clientSwapReply(c,r);
+    c->cmd->proc(c,c->argv,c->argc);
+    if (capture) clientSwapReply(c,r);
+    c->request = NULL;
+    c->argv = argv;
+    c->argc = argc;
+    c->cmd = cmd;
+    /* A LOCK waiting for its turn is done once it gets the lock. */
+    if (r->waiter == NULL) r->done = 1;
+}
+
+/* Reply to the requests at the head of the queue: the ones already executed,
+ * and the reads that were waiting for the writes before them. Stops at the
+ * first write not committed yet. */
+static void clientReleaseRequests(prezClient *c) {
+    while (listLength(c->requests)) {
+        listNode *ln = listFirst(c->requests);
+        clientRequest *r = listNodeValue(ln);
+
+        if (!r->done) {
+            if (r->index != -1) break;
+            clientExecuteRequest(c,r,0);
+        } else if (r->reply) {
+            listIter li;
+            listNode *rn;
+
+            listRewind(r->reply,&li);
+            while ((rn = listNext(&li)) != NULL)
+                addReply(c,listNodeValue(rn));
+        }
+        listDelNode(c->requests,ln);
+        freeClientRequest(r);
+    }
+}
+
+/* Send the reply of a done request to a binary protocol client, framed
+ * with the request ID. */
+static void clientReplyBinaryRequest(prezClient *c, clientRequest *r) {
+    size_t len = 0;
+    listIter li;
+    listNode *rn;
+
+    if (r->reply) {
+        listRewind(r->reply,&li);
+        while ((rn = listNext(&li)) != NULL)
+            len += sdslen(((robj*)listNodeValue(rn))->ptr);
+    }
+    addReplyBinaryHeader(c,r->reqid,len);
+    if (r->reply) {
+        listRewind(r->reply,&li);
+        while ((rn = listNext(&li)) != NULL)
+            addReply(c,listNodeValue(rn));
+    }
+}
+
+/* Reply to the done requests of a binary protocol client, wherever they
+ * are in the queue: the requests IDs let the client match them. */
+static void clientReleaseBinaryRequests(prezClient *c) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(c->requests,&li);
+    while ((ln = listNext(&li)) != NULL) {
+        clientRequest *r = listNodeValue(ln);
+
+        if (!r->done) continue;
+        clientReplyBinaryRequest(c,r);
+        listDelNode(c->requests,ln);
+        freeClientRequest(r);
+    }
+}
+
+/* Called by processCommand() once the queued request of the command was
+ * processed. Writes that were not logged, because of an error, are done.
+ * The reads of binary protocol clients are executed right away, without
+ * waiting for the writes before them, and replied together with whatever
+ * else is done; the reads of the other clients wait for their turn. */
+void clientRequestProcessed(clientRequest *r, int read) {
+    prezClient *c = r->client;
+
+    if (!(c->flags & PREZ_BINARY)) {
+        if (!read && r->index == -1) r->done = 1;
+        return;
+    }
+    if (read) clientExecuteRequest(c,r,1);
+    else if (r->index == -1) r->done = 1;
+    clientReleaseBinaryRequests(c);
+}
+
+/* Called when the log entry of a queued write is applied. If 'ok' is false
+ * the entry was overwritten by the one of another leader, and the client
+ * gets an error instead. Writes are executed right away, in log order, but
+ * replied only after the requests preceding them. */
+void clientRequestCommitted(clientRequest *r, int ok) {
+    prezClient *c = r->client;
+    int binary = c->flags & PREZ_BINARY;
+    int head = !binary && listNodeValue(listFirst(c->requests)) == r;
+
+    if (ok) {
+        clientExecuteRequest(c,r,!head);
+    } else {
+        if (!head) clientSwapReply(c,r);
+        addReplySds(c,sdsnew(
+            "-LEADERCHANGED The write was overwritten by a new leader\r\n"));
+        if (!head) clientSwapReply(c,r);
+        r->done = 1;
+    }
+    if (binary) clientReleaseBinaryRequests(c);
+    else if (head) clientReleaseRequests(c);
+}
+
+/* Reply to a request its command blocked, see lockCommand(), and release
+ * it in turn. */
+void clientUnblockRequest(clientRequest *r, sds reply) {
+    prezClient *c = r->client;
+    int binary = c->flags & PREZ_BINARY;
+    int head = !binary && listNodeValue(listFirst(c->requests)) == r;
+
+    r->waiter = NULL;
+    if (!head) clientSwapReply(c,r);
+    addReplySds(c,reply);
+    if (!head) clientSwapReply(c,r);
+    r->done = 1;
+    if (binary) clientReleaseBinaryRequests(c);
+    else if (head) clientReleaseRequests(c);
+}
+
 int processInlineBuffer(prezClient *c) {
     char *newline;
     int argc, j;
@@ -920,8 +1488,7 @@ int processInlineBuffer(prezClient *c) {
     sdsrange(c->querybuf,querylen+2,-1);
 
     /* Setup argv array on client structure */
-    if (c->argv) zfree(c->argv);
-    c->argv = zmalloc(sizeof(robj*)*argc);
+    clientCreateArgv(c,argc);
 
     /* Create prez objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -991,8 +1558,7 @@ int processMultibulkBuffer(prezClient *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
+        clientCreateArgv(c,c->multibulklen);
     }
 
     prezAssertWithInfo(c,NULL,c->multibulklen > 0);
@@ -1069,7 +1635,7 @@ int processMultibulkBuffer(prezClient *c) {
                 pos = 0;
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+pos,c->bulklen);
+                    clientCreateArgument(c,c->querybuf+pos,c->bulklen);
                 pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1087,7 +1653,148 @@ int processMultibulkBuffer(prezClient *c) {
     return PREZ_ERR;
 }
 
+/* Binary protocol, spoken by the clients connected to the binary-port.
+ * Every request is a frame, integers in network byte order:
+ *
+ *   uint32 length of the rest of the frame
+ *   uint64 request ID, chosen by the client
+ *   uint32 number of arguments, then for every argument:
+ *     uint32 length of the argument
+ *     the argument bytes
+ *
+ * Every reply is a frame with the length, the ID of the request and the
+ * RESP reply. Requests are not replied in order: reads as soon as they are
+ * executed, writes once committed, so that many operations can be in flight
+ * on the same connection. Protocol errors are replied with ID zero, and the
+ * connection is closed. */
+static void setBinaryProtocolError(prezClient *c, char *err) {
+    sds s = sdscatprintf(sdsempty(),"-ERR Protocol error: %s\r\n",err);
+
+    addReplyBinaryHeader(c,0,sdslen(s));
+    addReplySds(c,s);
+    setProtocolError(c,0);
+}
+
+/* Read a 32 bit integer in network byte order. */
+static uint32_t binaryGetLen(const char *p) {
+    uint32_t v;
+
+    memcpy(&v,p,4);
+    return ntohl(v);
+}
+
+int processBinaryBuffer(prezClient *c) {
+    const char *p = c->querybuf;
+    size_t qblen = sdslen(c->querybuf), framelen, pos;
+    uint32_t argc, len, j;
+    uint64_t reqid;
+
+    if (qblen < 4) return PREZ_ERR;
+    framelen = binaryGetLen(p);
+    if (framelen < PREZ_BINARY_HDR_LEN ||
+        framelen > server.client_max_querybuf_len)
+    {
+        setBinaryProtocolError(c,"invalid frame length");
+        return PREZ_ERR;
+    }
+    if (qblen < framelen+4) return PREZ_ERR;
+
+    memcpy(&reqid,p+4,8);
+    c->reqid = ntohu64(reqid);
+    argc = binaryGetLen(p+12);
+    if (argc == 0 || argc > PREZ_BINARY_MAX_ARGS ||
+        argc > (framelen-PREZ_BINARY_HDR_LEN)/4)
+    {
+        setBinaryProtocolError(c,"invalid number of arguments");
+        return PREZ_ERR;
+    }
+
+    /* The frame is complete: every argument must fit in it. */
+    clientCreateArgv(c,argc);
+    pos = PREZ_BINARY_HDR_LEN+4;
+    for (j = 0; j < argc; j++) {
+        if (framelen+4-pos < 4) break;
+        len = binaryGetLen(p+pos);
+        pos += 4;
+        if (framelen+4-pos < len) break;
+        c->argv[c->argc++] = clientCreateArgument(c,(char*)p+pos,len);
+        pos += len;
+    }
+    if (j != argc || pos != framelen+4) {
+        freeClientArgv(c);
+        setBinaryProtocolError(c,"invalid argument length");
+        return PREZ_ERR;
+    }
+    sdsrange(c->querybuf,pos,-1);
+    return PREZ_OK;
+}
+
+/* Fast path for pipelines of small multibulk commands: the lines of the
+ * whole query buffer are located in a single vectorized pass (see resp.c),
+ * the commands are parsed from this index and executed one after the other,
+ * and the query buffer is trimmed just once at the end. Whatever the fast
+ * path can't handle, from a partial command to a protocol error, is left to
+ * processMultibulkBuffer(). */
+static void processMultibulkPipeline(prezClient *c) {
+    respIndex idx;
+    respArg args[RESP_MAX_ARGS];
+    size_t pos = 0;
+    int argc, j;
+
+    if (c->reqtype) return;
+    respIndexInit(&idx,c->querybuf,sdslen(c->querybuf));
+    while (!(c->flags & (PREZ_BLOCKED|PREZ_CLOSE_AFTER_REPLY))) {
+        argc = respParseCommand(&idx,&pos,args,RESP_MAX_ARGS,
+                                PREZ_MBULK_BIG_ARG);
+        if (argc == 0) break;
+
+        clientCreateArgv(c,argc);
+        for (j = 0; j < argc; j++)
+            c->argv[j] = clientCreateArgument(c,c->querybuf+args[j].off,
+                                              args[j].len);
+        c->argc = argc;
+        if (processCommand(c) != PREZ_OK) break;
+        resetClient(c);
+    }
+    if (pos) sdsrange(c->querybuf,pos,-1);
+}
+
+/* Execute the commands located by parseClientPipeline(), then drop them
+ * from the query buffer. */
+static void processParsedCommands(prezClient *c) {
+    size_t j = 0, pos = 0;
+    int argc, i;
+
+    while (j < c->parsed_len &&
+           !(c->flags & (PREZ_BLOCKED|PREZ_CLOSE_AFTER_REPLY))) {
+        argc = c->parsed[j].off;
+        pos = c->parsed[j].len;
+        clientCreateArgv(c,argc);
+        for (i = 0; i < argc; i++) {
+            respArg *a = c->parsed+j+1+i;
+
+            c->argv[i] = clientCreateArgument(c,c->querybuf+a->off,a->len);
+        }
+        c->argc = argc;
+        j += 1+argc;
+        if (processCommand(c) != PREZ_OK) break;
+        resetClient(c);
+    }
+    c->parsed_len = 0;
+    if (pos) sdsrange(c->querybuf,pos,-1);
+}
+
 void processInputBuffer(prezClient *c) {
+    /* Execute first the commands an I/O thread already parsed, if any. */
+    if (c->parsed_len) processParsedCommands(c);
+    if (c->flags & PREZ_PENDING_COMMAND) {
+        c->flags &= ~PREZ_PENDING_COMMAND;
+        if (processCommand(c) == PREZ_OK)
+            resetClient(c);
+    }
+    if (c->argc == 0 && !(c->flags & PREZ_BINARY))
+        processMultibulkPipeline(c);
+
     /* Keep processing while there is something in the input buffer */
     while(sdslen(c->querybuf)) {
 #if 0
@@ -1104,7 +1811,9 @@ void processInputBuffer(prezClient *c) {
 
         /* Determine request type when unknown. */
         if (!c->reqtype) {
-            if (c->querybuf[0] == '*') {
+            if (c->flags & PREZ_BINARY) {
+                c->reqtype = PREZ_REQ_BINARY;
+            } else if (c->querybuf[0] == '*') {
                 c->reqtype = PREZ_REQ_MULTIBULK;
             } else {
                 c->reqtype = PREZ_REQ_INLINE;
@@ -1115,6 +1824,8 @@ void processInputBuffer(prezClient *c) {
             if (processInlineBuffer(c) != PREZ_OK) break;
         } else if (c->reqtype == PREZ_REQ_MULTIBULK) {
             if (processMultibulkBuffer(c) != PREZ_OK) break;
+        } else if (c->reqtype == PREZ_REQ_BINARY) {
+            if (processBinaryBuffer(c) != PREZ_OK) break;
         } else {
             prezPanic("Unknown request type");
         }
@@ -1130,15 +1841,10 @@ void processInputBuffer(prezClient *c) {
     }
 }
 
-void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
-    prezClient *c = (prezClient*) privdata;
-    int nread, readlen;
-    size_t qblen;
-    PREZ_NOTUSED(el);
-    PREZ_NOTUSED(mask);
+/* Return how many bytes to read for the client. */
+static int clientReadLen(prezClient *c) {
+    int readlen = PREZ_IOBUF_LEN;
 
-    server.current_client = c;
-    readlen = PREZ_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
      * that is large enough, try to maximize the probability that the query
      * buffer contains exactly the SDS string representing the object, even
@@ -1152,43 +1858,140 @@ void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
 
         if (remaining < readlen) readlen = remaining;
     }
+    return readlen;
+}
+
+/* Account for 'nread' bytes just read at the end of the query buffer.
+ * Returns 'nread', or -1 if the client should be freed. */
+static int clientQueryRead(prezClient *c, int nread) {
+    sdsIncrLen(c->querybuf,nread);
+    c->lastinteraction = server.unixtime;
+    //if (c->flags & PREZ_MASTER) c->reploff += nread;
+    if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
+        sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
+
+        bytes = sdscatrepr(bytes,c->querybuf,64);
+        prezLog(PREZ_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
+        sdsfree(ci);
+        sdsfree(bytes);
+        return -1;
+    }
+    return nread;
+}
+
+/* Read from the client socket into the query buffer. Returns the number of
+ * bytes read, that is zero when the socket had nothing to read, or -1 when
+ * the client should be freed.
+ *
+ * The event loop is not touched, so this is safe to call from I/O threads. */
+static int readFromClient(prezClient *c) {
+    int nread, readlen = clientReadLen(c);
+    size_t qblen;
 
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
-    nread = read(fd, c->querybuf+qblen, readlen);
+    if (c->shm) {
+        nread = shmRead(c->shm,c->querybuf+qblen,readlen);
+        if (nread == 0) return 0;
+    } else {
+        nread = read(c->fd, c->querybuf+qblen, readlen);
+    }
     if (nread == -1) {
-        if (errno == EAGAIN) {
-            nread = 0;
-        } else {
-            prezLog(PREZ_VERBOSE, "Reading from client: %s",strerror(errno));
-            freeClient(c);
-            return;
-        }
+        if (errno == EAGAIN) return 0;
+        prezLog(PREZ_VERBOSE, "Reading from client: %s",strerror(errno));
+        return -1;
     } else if (nread == 0) {
         prezLog(PREZ_VERBOSE, "Client closed connection");
+        return -1;
+    }
+    return clientQueryRead(c,nread);
+}
+
+/* Handler of the reads submitted by clientSubmitRead(): 'buf' is only
+ * valid during the call, so the data is copied to the query buffer. */
+static void clientReadDone(aeEventLoop *el, int fd, void *privdata,
+                           char *buf, int res)
+{
+    prezClient *c = privdata;
+    size_t qblen;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(fd);
+
+    c->io_read = -1;
+    if (res <= 0) {
+        if (res == 0)
+            prezLog(PREZ_VERBOSE, "Client closed connection");
+        else
+            prezLog(PREZ_VERBOSE, "Reading from client: %s",strerror(-res));
         freeClient(c);
         return;
     }
-    if (nread) {
-        sdsIncrLen(c->querybuf,nread);
-        c->lastinteraction = server.unixtime;
-        //if (c->flags & PREZ_MASTER) c->reploff += nread;
-    } else {
-        server.current_client = NULL;
+    qblen = sdslen(c->querybuf);
+    if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
+    c->querybuf = sdsMakeRoomFor(c->querybuf,res);
+    memcpy(c->querybuf+qblen,buf,res);
+    if (clientQueryRead(c,res) == -1) {
+        freeClient(c);
         return;
     }
-    if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
-        sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
+    server.current_client = c;
+    processInputBuffer(c);
+    server.current_client = NULL;
+    clientSubmitRead(c);
+}
+
+/* Read the queries of a socket client with reads submitted to the event
+ * loop, and write its replies the same way, see clientSubmitWrite(), when
+ * the event loop can perform them: this way the reads and writes of all the
+ * clients and the wait for more events take a single system call. Not with
+ * I/O threads, that read and write the sockets themselves. Otherwise, or
+ * if the read can't be submitted, the socket is read once readable by
+ * readQueryFromClient(). */
+static void clientSubmitRead(prezClient *c) {
+    if (server.io_threads_num > 1) return;
+    c->io_read = aeSubmitRead(server.el,c->fd,clientReadLen(c),
+                              clientReadDone,c);
+    if (c->io_read != AE_ERR) {
+        if (!(c->flags & PREZ_IO_SUBMIT)) {
+            aeDeleteFileEvent(server.el,c->fd,AE_READABLE);
+            c->flags |= PREZ_IO_SUBMIT;
+        }
+    } else if (c->flags & PREZ_IO_SUBMIT) {
+        c->flags &= ~PREZ_IO_SUBMIT;
+        if (aeCreateFileEvent(server.el,c->fd,AE_READABLE,
+                readQueryFromClient,c) == AE_ERR) freeClientAsync(c);
+    }
+}
 
-        bytes = sdscatrepr(bytes,c->querybuf,64);
-        prezLog(PREZ_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
-        sdsfree(ci);
-        sdsfree(bytes);
+void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask) {
+    prezClient *c = (prezClient*) privdata;
+    int nread;
+    PREZ_NOTUSED(el);
+    PREZ_NOTUSED(fd);
+    PREZ_NOTUSED(mask);
+
+    /* The doorbell of a shared memory client also means there is room
+     * for the replies that didn't fit in the ring. */
+    if (c->shm && clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+
+    /* With I/O threads just queue the client, the read and the parsing
+     * happen in handleClientsWithPendingReads() before sleeping again. */
+    if (server.io_threads_num > 1) {
+        if (!(c->flags & PREZ_PENDING_READ)) {
+            c->flags |= PREZ_PENDING_READ;
+            listAddNodeTail(server.clients_pending_read,c);
+        }
+        return;
+    }
+
+    server.current_client = c;
+    nread = readFromClient(c);
+    if (nread == -1) {
         freeClient(c);
         return;
     }
-    processInputBuffer(c);
+    if (nread) processInputBuffer(c);
     server.current_client = NULL;
 }
 
@@ -1292,6 +2095,8 @@ sds catClientInfoString(sds s, prezClient *client) {
     *p++ = '\0';
 
     emask = client->fd == -1 ? 0 : aeGetFileEvents(server.el,client->fd);
+    if (client->io_read != -1) emask |= AE_READABLE;
+    if (client->io_write != -1) emask |= AE_WRITABLE;
     p = events;
     if (emask & AE_READABLE) *p++ = 'r';
     if (emask & AE_WRITABLE) *p++ = 'w';
@@ -1457,8 +2262,7 @@ void clientCommand(prezClient *c) {
             }
         }
         if (c->name) decrRefCount(c->name);
-        c->name = c->argv[2];
-        incrRefCount(c->name);
+        c->name = retainObject(c->argv[2]);
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"getname") && c->argc == 2) {
         if (c->name)
@@ -1499,7 +2303,7 @@ void rewriteClientCommandVector(prezClient *c, int argc, ...) {
      * sure that if the same objects are reused in the new vector the
      * refcount gets incremented before it gets decremented. */
     for (j = 0; j < c->argc; j++) decrRefCount(c->argv[j]);
-    zfree(c->argv);
+    clientFreeArgvArray(c);
     /* Replace argv and argc with our new versions. */
     c->argv = argv;
     c->argc = argc;
@@ -1515,13 +2319,12 @@ void rewriteClientCommandArgument(prezClient *c, int i, robj *newval) {
 
     prezAssertWithInfo(c,NULL,i < c->argc);
     oldval = c->argv[i];
-    c->argv[i] = newval;
-    incrRefCount(newval);
+    c->argv[i] = retainObject(newval);
     decrRefCount(oldval);
 
     /* If this is the command name make sure to fix c->cmd. */
     if (i == 0) {
-        //FIXME:c->cmd = lookupCommandOrOriginal(c->argv[0]->ptr);
+        c->cmd = lookupCommand(c->argv[0]->ptr);
         prezAssertWithInfo(c,NULL,c->cmd != NULL);
     }
 }
@@ -1738,3 +2541,284 @@ int processEventsWhileBlocked(void) {
     }
     return count;
 }
+
+/* -----------------------------------------------------------------------------
+ * Threaded I/O
+ *
+ * With io-threads greater than one the read and write handlers only queue the
+ * clients. Before sleeping the main thread splits the queues among itself and
+ * the I/O threads, that read and parse the complete commands of every client,
+ * or write its replies, and waits for them to finish. The commands are then
+ * executed by the main thread, so nothing else needs to be thread safe:
+ * while the threads run the main thread only touches its own share of clients.
+ *
+ * The clients are handed over through the 'pending' counter of every thread
+ * alone: the main thread sets it, the thread clears it once done, and both
+ * spin on it. A thread finding nothing to do for a while parks itself on a
+ * condition variable, that the main thread signals only if 'parked' is set.
+ * -------------------------------------------------------------------------- */
+
+#define IO_THREADS_OP_READ 0
+#define IO_THREADS_OP_WRITE 1
+#define IO_THREADS_SPIN 1000000 /* Checks of 'pending' before parking. */
+
+typedef struct ioThread {
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    list *clients;          /* Clients assigned to this thread. */
+    int op;                 /* IO_THREADS_OP_READ or IO_THREADS_OP_WRITE. */
+    unsigned long pending;  /* Non zero while the thread owns its clients. */
+    int parked;             /* The thread waits on 'cond'. */
+} ioThread;
+
+/* Slot zero is the main thread, that has no pthread of its own. */
+static ioThread io_threads[PREZ_IO_THREADS_MAX];
+
+/* Locate the arguments of all the complete commands of a pipeline of small
+ * multibulk commands, like processMultibulkPipeline() does, in c->parsed:
+ * every command is an entry with the number of arguments as 'off' and the
+ * end of the command in the query buffer as 'len', then the arguments.
+ * Returns the number of commands found. */
+static int parseClientPipeline(prezClient *c) {
+    respIndex idx;
+    respArg args[RESP_MAX_ARGS];
+    size_t pos = 0;
+    int argc, count = 0;
+
+    respIndexInit(&idx,c->querybuf,sdslen(c->querybuf));
+    while ((argc = respParseCommand(&idx,&pos,args,RESP_MAX_ARGS,
+                                    PREZ_MBULK_BIG_ARG)) != 0) {
+        if (c->parsed_len+1+argc > c->parsed_size) {
+            c->parsed_size = (c->parsed_len+1+argc)*2;
+            c->parsed = zrealloc(c->parsed,sizeof(respArg)*c->parsed_size);
+        }
+        c->parsed[c->parsed_len].off = argc;
+        c->parsed[c->parsed_len].len = pos;
+        memcpy(c->parsed+c->parsed_len+1,args,sizeof(respArg)*argc);
+        c->parsed_len += 1+argc;
+        count++;
+    }
+    return count;
+}
+
+/* Parse the commands in the query buffer, so that the main thread only has
+ * to execute them: all the complete ones of a pipeline of small multibulk
+ * commands, or else the next one. Clients in the middle of a command, or
+ * with replies not yet written, are left to processInputBuffer(). */
+static void parseClientQuery(prezClient *c) {
+    int ret;
+
+    if (c->argc || !sdslen(c->querybuf) || clientHasPendingReplies(c) ||
+        c->flags & (PREZ_BLOCKED|PREZ_CLOSE_AFTER_REPLY)) return;
+
+    if (!c->reqtype && !(c->flags & PREZ_BINARY) &&
+        parseClientPipeline(c)) return;
+
+    if (!c->reqtype) {
+        if (c->flags & PREZ_BINARY)
+            c->reqtype = PREZ_REQ_BINARY;
+        else
+            c->reqtype = (c->querybuf[0] == '*') ? PREZ_REQ_MULTIBULK :
+                                                   PREZ_REQ_INLINE;
+    }
+    if (c->reqtype == PREZ_REQ_INLINE)
+        ret = processInlineBuffer(c);
+    else if (c->reqtype == PREZ_REQ_BINARY)
+        ret = processBinaryBuffer(c);
+    else
+        ret = processMultibulkBuffer(c);
+    if (ret != PREZ_OK) return;
+
+    /* Multibulk processing could see a <= 0 length. */
+    if (c->argc == 0)
+        resetClient(c);
+    else
+        c->flags |= PREZ_PENDING_COMMAND;
+}
+
+static void ioHandleClient(prezClient *c, int op) {
+    if (op == IO_THREADS_OP_WRITE) {
+        if (writeToClient(c) == PREZ_ERR) c->flags |= PREZ_IO_ERROR;
+    } else {
+        int nread = readFromClient(c);
+
+        if (nread == -1)
+            c->flags |= PREZ_IO_ERROR;
+        else if (nread)
+            parseClientQuery(c);
+    }
+}
+
+static void ioThreadHandleClients(ioThread *t, int op) {
+    while (listLength(t->clients)) {
+        listNode *ln = listFirst(t->clients);
+
+        ioHandleClient(listNodeValue(ln),op);
+        listDelNode(t->clients,ln);
+    }
+}
+
+static void *ioThreadMain(void *arg) {
+    ioThread *t = arg;
+    long j;
+
+    while(1) {
+        for (j = 0; j < IO_THREADS_SPIN; j++)
+            if (__atomic_load_n(&t->pending,__ATOMIC_ACQUIRE)) break;
+        if (j == IO_THREADS_SPIN) {
+            /* Setting 'parked' before checking 'pending' again, while the
+             * main thread sets 'pending' before checking 'parked', makes
+             * sure one of the two sees the other. */
+            pthread_mutex_lock(&t->lock);
+            __atomic_store_n(&t->parked,1,__ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&t->pending,__ATOMIC_SEQ_CST) == 0)
+                pthread_cond_wait(&t->cond,&t->lock);
+            __atomic_store_n(&t->parked,0,__ATOMIC_RELAXED);
+            pthread_mutex_unlock(&t->lock);
+        }
+        ioThreadHandleClients(t,t->op);
+        __atomic_store_n(&t->pending,0,__ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void initThreadedIO(void) {
+    int j;
+
+    for (j = 0; j < server.io_threads_num; j++) {
+        ioThread *t = io_threads+j;
+
+        t->clients = listCreate();
+        t->pending = 0;
+        t->parked = 0;
+        if (j == 0) continue;
+        pthread_mutex_init(&t->lock,NULL);
+        pthread_cond_init(&t->cond,NULL);
+        if (pthread_create(&t->tid,NULL,ioThreadMain,t) != 0) {
+            prezLog(PREZ_WARNING,"Fatal: Can't initialize I/O threads.");
+            exit(1);
+        }
+    }
+    if (server.io_threads_num > 1)
+        prezLog(PREZ_NOTICE,"Started %d I/O threads",
+            server.io_threads_num-1);
+}
+
+/* Split the clients among the I/O threads and the main thread, and return
+ * once all of them were handled. */
+static void ioThreadsRun(list *clients, int op) {
+    int nthreads = server.io_threads_num, j = 0;
+    listIter li;
+    listNode *ln;
+
+    /* Waking up the threads is not worth it for a handful of clients. */
+    if (listLength(clients) < (unsigned long)nthreads*2) {
+        listRewind(clients,&li);
+        while((ln = listNext(&li)) != NULL)
+            ioHandleClient(listNodeValue(ln),op);
+        return;
+    }
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li)) != NULL)
+        listAddNodeTail(io_threads[j++ % nthreads].clients,listNodeValue(ln));
+
+    for (j = 1; j < nthreads; j++) {
+        ioThread *t = io_threads+j;
+
+        if (listLength(t->clients) == 0) continue;
+        t->op = op;
+        __atomic_store_n(&t->pending,listLength(t->clients),__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&t->parked,__ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&t->lock);
+            pthread_cond_signal(&t->cond);
+            pthread_mutex_unlock(&t->lock);
+        }
+    }
+    ioThreadHandleClients(io_threads,op);
+    for (j = 1; j < nthreads; j++) {
+        while (__atomic_load_n(&io_threads[j].pending,__ATOMIC_ACQUIRE))
+            ;
+    }
+}
+
+/* Read and parse the queries of the clients queued by readQueryFromClient(),
+ * then execute the commands. Called before sleeping in the event loop.
+ * Returns the number of clients processed. */
+int handleClientsWithPendingReads(void) {
+    int processed = listLength(server.clients_pending_read);
+
+    if (processed == 0) return 0;
+    ioThreadsRun(server.clients_pending_read,IO_THREADS_OP_READ);
+
+    while (listLength(server.clients_pending_read)) {
+        listNode *ln = listFirst(server.clients_pending_read);
+        prezClient *c = listNodeValue(ln);
+
+        c->flags &= ~PREZ_PENDING_READ;
+        listDelNode(server.clients_pending_read,ln);
+        if (c->flags & PREZ_IO_ERROR) {
+            freeClient(c);
+            continue;
+        }
+        server.current_client = c;
+        processInputBuffer(c);
+        server.current_client = NULL;
+
+        /* Protocol errors were added by the thread without queueing the
+         * client for writing. */
+        if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+    }
+    return processed;
+}
+
+/* Write the replies of the clients queued by clientInstallWriteHandler(),
+ * with the I/O threads when enabled. Called before sleeping in the event loop.
+ * Clients that could not be written completely get the write handler
+ * installed. Returns the number of clients processed. */
+int handleClientsWithPendingWrites(void) {
+    int processed = listLength(server.clients_pending_write);
+    listIter li;
+    listNode *ln;
+
+    if (processed == 0) return 0;
+
+    /* The clients with I/O submitted to the event loop, there are no I/O
+     * threads then, submit their writes. */
+    listRewind(server.clients_pending_write,&li);
+    while((ln = listNext(&li)) != NULL) {
+        prezClient *c = listNodeValue(ln);
+
+        if (!(c->flags & PREZ_IO_SUBMIT) && c->io_write == -1) continue;
+        c->flags &= ~PREZ_PENDING_WRITE;
+        listDelNode(server.clients_pending_write,ln);
+        clientSubmitWrite(c);
+    }
+    ioThreadsRun(server.clients_pending_write,IO_THREADS_OP_WRITE);
+
+    while (listLength(server.clients_pending_write)) {
+        prezClient *c;
+
+        ln = listFirst(server.clients_pending_write);
+        c = listNodeValue(ln);
+        c->flags &= ~PREZ_PENDING_WRITE;
+        listDelNode(server.clients_pending_write,ln);
+        clientFreeSentReplies(c);
+        if (c->flags & PREZ_IO_ERROR) {
+            freeClient(c);
+            continue;
+        }
+        clientReleaseReplyBuffer(c);
+        if (clientHasPendingReplies(c)) {
+            /* Shared memory clients ring the doorbell when they make room
+             * in the ring, see shmWritev(). */
+            if (c->shm) continue;
+            if (aeCreateFileEvent(server.el,c->fd,AE_WRITABLE,
+                    sendReplyToClient,c) == AE_ERR) freeClientAsync(c);
+        } else if (c->flags & PREZ_CLOSE_AFTER_REPLY) {
+            freeClient(c);
+        }
+    }
+    return processed;
+}
@@ -0,0 +1,695 @@
+/* Open addressing hash tables.
+ *
+ * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The chained tables of dict.c cost an allocated dictEntry per element, and
+ * a lookup follows the bucket pointer, then the entry, then the key. Here
+ * the entries are stored in the table itself, next to an array holding a
+ * control byte per slot:
+ *
+ *   EMPTY     never used since the table was created.
+ *   DELETED   a tombstone, the slot was used and its entry deleted.
+ *   0..127    the slot is used, the byte holds 7 bits of the hash of the key.
+ *
+ * The slots are probed a group of OADICT_GROUP_SIZE at a time: the control
+ * bytes of a group are compared with the 7 bits of the hash of the key in a
+ * single SSE2 instruction, so that keys are only compared for the few slots
+ * that match. The probe sequence starts at the group selected by the other
+ * bits of the hash, the "home" group of the key, and goes on with the next
+ * groups until one with an EMPTY slot is found.
+ *
+ * Like in dict.c there are two tables while rehashing, and the entries are
+ * moved incrementally a group at a time. Moved entries leave tombstones in
+ * the old table, so that the probe sequences of the entries not moved yet
+ * are preserved. */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+
+#include "oadict.h"
+#include "zmalloc.h"
+
+#if !defined(OADICT_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define OADICT_SSE2
+#endif
+
+#define OADICT_EMPTY ((int8_t)-128)
+#define OADICT_DELETED ((int8_t)-2)
+
+/* The low 7 bits of the hash are stored in the control byte, the others
+ * select the home group. With 32 bit hashes this leaves 25 bits, that is
+ * enough for 512 millions slots. */
+#define oadictH1(h) ((unsigned long)((h) >> 7))
+#define oadictH2(h) ((int8_t)((h) & 0x7f))
+
+#define oadictCapacity(ht) ((ht)->groups*OADICT_GROUP_SIZE)
+
+/* Used and deleted slots are kept under 7/8 of the capacity, so that there
+ * is always an EMPTY slot to end a probe sequence. */
+#define oadictMaxFill(ht) (oadictCapacity(ht)-oadictCapacity(ht)/8)
+
+/* -------------------------- group matching -------------------------------- */
+
+/* Return a mask with the bit N set if the control byte N of the group is
+ * 'tag'. */
+static unsigned int groupMatch(const int8_t *ctrl, int8_t tag) {
+#ifdef OADICT_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return (unsigned int)
+        _mm_movemask_epi8(_mm_cmpeq_epi8(group,_mm_set1_epi8(tag)));
+#else
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < OADICT_GROUP_SIZE; j++)
+        if (ctrl[j] == tag) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+/* Return a mask of the used slots of the group: the control bytes of EMPTY
+ * and DELETED slots are the only ones with the high bit set. */
+static unsigned int groupMatchUsed(const int8_t *ctrl) {
+#ifdef OADICT_SSE2
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return ~(unsigned int)_mm_movemask_epi8(group) & 0xffff;
+#else
+    unsigned int mask = 0;
+    int j;
+
+    for (j = 0; j < OADICT_GROUP_SIZE; j++)
+        if (ctrl[j] >= 0) mask |= 1U << j;
+    return mask;
+#endif
+}
+
+#define groupMatchEmpty(ctrl) groupMatch(ctrl,OADICT_EMPTY)
+#define groupMatchFree(ctrl) (~groupMatchUsed(ctrl) & 0xffff)
+
+/* Count trailing zeros of a non zero word. */
+static int groupFirst(unsigned int mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int n = 0;
+
+    while (!(mask & 1)) {
+        mask >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+/* -------------------------- private prototypes ---------------------------- */
+
+static int _oadictExpandIfNeeded(oadict *d);
+
+/* ----------------------------- API implementation ------------------------- */
+
+static void _oadictReset(oadictht *ht) {
+    ht->ctrl = NULL;
+    ht->slots = NULL;
+    ht->groups = 0;
+    ht->used = 0;
+    ht->deleted = 0;
+}
+
+/* Allocate the slots and the control bytes of a table in a single block. */
+static void _oadictInitTable(oadictht *ht, unsigned long groups) {
+    unsigned long slots = groups*OADICT_GROUP_SIZE;
+
+    ht->slots = zmalloc((sizeof(oadictEntry)+1)*slots);
+    ht->ctrl = (int8_t*)(ht->slots+slots);
+    memset(ht->ctrl,OADICT_EMPTY,slots);
+    ht->groups = groups;
+    ht->used = 0;
+    ht->deleted = 0;
+}
+
+/* Create a new hash table */
+oadict *oadictCreate(dictType *type, void *privDataPtr) {
+    oadict *d = zmalloc(sizeof(*d));
+
+    _oadictReset(&d->ht[0]);
+    _oadictReset(&d->ht[1]);
+    d->type = type;
+    d->privdata = privDataPtr;
+    d->rehashidx = -1;
+    return d;
+}
+
+/* Return the number of groups of the smallest table that can hold 'size'
+ * entries. */
+static unsigned long _oadictGroupsFor(unsigned long size) {
+    unsigned long groups = 1;
+
+    while (groups*OADICT_GROUP_SIZE-groups*OADICT_GROUP_SIZE/8 < size &&
+           groups < LONG_MAX/(OADICT_GROUP_SIZE*2))
+        groups *= 2;
+    return groups;
+}
+
+/* Create a table that can hold 'size' entries, and start moving the entries
+ * to it if the dict is not empty. A table of the same size can be created
+ * to get rid of the tombstones. */
+int oadictExpand(oadict *d, unsigned long size) {
+    oadictht n;
+    unsigned long groups;
+
+    if (oadictIsRehashing(d) || d->ht[0].used > size)
+        return DICT_ERR;
+
+    if (size < OADICT_HT_INITIAL_SIZE) size = OADICT_HT_INITIAL_SIZE;
+    groups = _oadictGroupsFor(size);
+    if (groups == d->ht[0].groups && d->ht[0].deleted == 0)
+        return DICT_ERR;
+
+    _oadictInitTable(&n,groups);
+
+    /* Is this the first initialization? If so it's not really a rehashing
+     * we just set the first hash table so that it can accept keys. */
+    if (d->ht[0].groups == 0) {
+        d->ht[0] = n;
+        return DICT_OK;
+    }
+
+    /* Prepare a second hash table for incremental rehashing */
+    d->ht[1] = n;
+    d->rehashidx = 0;
+    return DICT_OK;
+}
+
+/* Return the index of the slot holding 'key' in the table, or -1. */
+static long _oadictFindSlot(oadict *d, oadictht *ht, const void *key,
+                            unsigned int h)
+{
+    unsigned long mask, g, probes;
+    int8_t tag = oadictH2(h);
+
+    if (ht->groups == 0) return -1;
+    mask = ht->groups-1;
+    g = oadictH1(h) & mask;
+    for (probes = 0; probes < ht->groups; probes++) {
+        int8_t *ctrl = ht->ctrl+g*OADICT_GROUP_SIZE;
+        unsigned int match = groupMatch(ctrl,tag);
+
+        while (match) {
+            unsigned long idx = g*OADICT_GROUP_SIZE+groupFirst(match);
+
+            if (dictCompareKeys(d,key,ht->slots[idx].key)) return idx;
+            match &= match-1;
+        }
+        if (groupMatchEmpty(ctrl)) break;
+        g = (g+1) & mask;
+    }
+    return -1;
+}
+
+/* Search both the tables: return the index of the slot holding 'key' and
+ * set '*table' to its table, or return -1. */
+static long _oadictLookup(oadict *d, const void *key, unsigned int h,
+                          oadictht **table)
+{
+    long idx;
+
+    if ((idx = _oadictFindSlot(d,&d->ht[0],key,h)) != -1) {
+        *table = &d->ht[0];
+        return idx;
+    }
+    if (oadictIsRehashing(d) &&
+        (idx = _oadictFindSlot(d,&d->ht[1],key,h)) != -1)
+    {
+        *table = &d->ht[1];
+        return idx;
+    }
+    return -1;
+}
+
+/* Take the first free slot of the probe sequence of 'h'. The key must not
+ * be in the table already, and the table must be under its max fill. */
+static oadictEntry *_oadictInsertSlot(oadictht *ht, unsigned int h) {
+    unsigned long mask = ht->groups-1, g = oadictH1(h) & mask;
+
+    while (1) {
+        unsigned int match = groupMatchFree(ht->ctrl+g*OADICT_GROUP_SIZE);
+
+        if (match) {
+            unsigned long idx = g*OADICT_GROUP_SIZE+groupFirst(match);
+
+            if (ht->ctrl[idx] == OADICT_DELETED) ht->deleted--;
+            ht->ctrl[idx] = oadictH2(h);
+            ht->used++;
+            return ht->slots+idx;
+        }
+        g = (g+1) & mask;
+    }
+}
+
+/* Release a slot. Probe sequences only go past groups without EMPTY slots,
+ * so if the group of the slot has one, no probe sequence goes through it and
+ * the slot can be EMPTY again instead of a tombstone. */
+static void _oadictClearSlot(oadictht *ht, unsigned long idx) {
+    int8_t *ctrl = ht->ctrl+(idx & ~(unsigned long)(OADICT_GROUP_SIZE-1));
+
+    if (groupMatchEmpty(ctrl)) {
+        ht->ctrl[idx] = OADICT_EMPTY;
+    } else {
+        ht->ctrl[idx] = OADICT_DELETED;
+        ht->deleted++;
+    }
+    ht->used--;
+}
+
+/* Performs N steps of incremental rehashing, every step moving the entries
+ * of a group. Returns 1 if there are still keys to move from the old to the
+ * new hash table, otherwise 0 is returned. Like dictRehash() at most N*10
+ * empty groups are visited. */
+int oadictRehash(oadict *d, int n) {
+    oadictht *t0 = &d->ht[0], *t1 = &d->ht[1];
+    int empty_visits = n*10;
+
+    if (!oadictIsRehashing(d)) return 0;
+
+    while(n-- && t0->used != 0) {
+        unsigned int match;
+
+        /* The groups before rehashidx are empty, so there is a used slot
+         * at or after rehashidx as long as used != 0. */
+        while (!(match = groupMatchUsed(t0->ctrl+
+                                        d->rehashidx*OADICT_GROUP_SIZE)))
+        {
+            d->rehashidx++;
+            if (--empty_visits == 0) return 1;
+        }
+        while (match) {
+            unsigned long idx = d->rehashidx*OADICT_GROUP_SIZE+
+                                groupFirst(match);
+            oadictEntry *de = t0->slots+idx;
+
+            *_oadictInsertSlot(t1,dictHashKey(d,de->key)) = *de;
+            _oadictClearSlot(t0,idx);
+            match &= match-1;
+        }
+        d->rehashidx++;
+    }
+
+    /* Check if we already rehashed the whole table... */
+    if (t0->used == 0) {
+        zfree(t0->slots);
+        *t0 = *t1;
+        _oadictReset(t1);
+        d->rehashidx = -1;
+        return 0;
+    }
+
+    /* More to rehash... */
+    return 1;
+}
+
+static long long oadictTimeInMicroseconds(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+/* Rehash for about 'us' microseconds, checking the time every 10 groups.
+ * Returns the number of rehash steps performed. */
+int oadictRehashMicroseconds(oadict *d, long long us) {
+    long long start = oadictTimeInMicroseconds();
+    int rehashes = 0;
+
+    while(oadictRehash(d,10)) {
+        rehashes += 10;
+        if (oadictTimeInMicroseconds()-start > us) break;
+    }
+    return rehashes;
+}
+
+/* Every lookup and update moves a group, so that the rehashing completes
+ * even if no background rehashing is performed. */
+static void _oadictRehashStep(oadict *d) {
+    oadictRehash(d,1);
+}
+
+/* Add an element to the target hash table */
+int oadictAdd(oadict *d, void *key, void *val) {
+    oadictht *ht;
+    oadictEntry *de;
+    unsigned int h;
+
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+
+    h = dictHashKey(d,key);
+    if (_oadictLookup(d,key,h,&ht) != -1) return DICT_ERR;
+    if (_oadictExpandIfNeeded(d) == DICT_ERR) return DICT_ERR;
+
+    /* While rehashing new entries only go to the new table. */
+    ht = oadictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
+    de = _oadictInsertSlot(ht,h);
+    oadictSetKey(d,de,key);
+    oadictSetVal(d,de,val);
+    return DICT_OK;
+}
+
+/* Add an element, discarding the old if the key already exists.
+ * Return 1 if the key was added from scratch, 0 if there was already an
+ * element with such key and oadictReplace() just performed a value update
+ * operation. */
+int oadictReplace(oadict *d, void *key, void *val) {
+    oadictEntry *de, auxentry;
+
+    if (oadictAdd(d,key,val) == DICT_OK)
+        return 1;
+    de = oadictFind(d,key);
+    /* Set the new value and free the old one. Note that it is important
+     * to do that in this order, as the value may just be exactly the same
+     * as the previous one. */
+    auxentry = *de;
+    oadictSetVal(d,de,val);
+    oadictFreeVal(d,&auxentry);
+    return 0;
+}
+
+/* Search and remove an element */
+int oadictDelete(oadict *d, const void *key) {
+    oadictht *ht;
+    oadictEntry *de;
+    long idx;
+
+    if (oadictSize(d) == 0) return DICT_ERR;
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+
+    idx = _oadictLookup(d,key,dictHashKey(d,key),&ht);
+    if (idx == -1) return DICT_ERR;
+    de = ht->slots+idx;
+    oadictFreeKey(d,de);
+    oadictFreeVal(d,de);
+    _oadictClearSlot(ht,idx);
+    return DICT_OK;
+}
+
+/* Destroy an entire table */
+static void _oadictClear(oadict *d, oadictht *ht, void(callback)(void *)) {
+    unsigned long j, slots = oadictCapacity(ht);
+
+    for (j = 0; j < slots && ht->used > 0; j++) {
+        oadictEntry *de = ht->slots+j;
+
+        if (callback && (j & 65535) == 0) callback(d->privdata);
+        if (ht->ctrl[j] < 0) continue;
+        oadictFreeKey(d,de);
+        oadictFreeVal(d,de);
+        ht->used--;
+    }
+    zfree(ht->slots);
+    _oadictReset(ht);
+}
+
+/* Clear & Release the hash table */
+void oadictRelease(oadict *d) {
+    _oadictClear(d,&d->ht[0],NULL);
+    _oadictClear(d,&d->ht[1],NULL);
+    zfree(d);
+}
+
+oadictEntry *oadictFind(oadict *d, const void *key) {
+    oadictht *ht;
+    long idx;
+
+    if (oadictSize(d) == 0) return NULL;
+    if (oadictIsRehashing(d)) _oadictRehashStep(d);
+
+    idx = _oadictLookup(d,key,dictHashKey(d,key),&ht);
+    return (idx == -1) ? NULL : ht->slots+idx;
+}
+
+void *oadictFetchValue(oadict *d, const void *key) {
+    oadictEntry *de = oadictFind(d,key);
+
+    return de ? oadictGetVal(de) : NULL;
+}
+
+/* Resize the table to the minimal size that contains all the elements,
+ * dropping the tombstones as well. */
+int oadictResize(oadict *d) {
+    if (oadictIsRehashing(d)) return DICT_ERR;
+    return oadictExpand(d,d->ht[0].used);
+}
+
+void oadictEmpty(oadict *d, void(callback)(void*)) {
+    _oadictClear(d,&d->ht[0],callback);
+    _oadictClear(d,&d->ht[1],callback);
+    d->rehashidx = -1;
+}
+
+/* ------------------------- private functions ------------------------------ */
+
+/* Expand the hash table if needed */
+static int _oadictExpandIfNeeded(oadict *d) {
+    oadictht *ht;
+
+    /* The new table is sized for twice the entries of the old one, but the
+     * writes may go faster than the rehash steps: if it gets full, finish
+     * moving the entries, and grow it in turn. */
+    if (oadictIsRehashing(d)) {
+        ht = &d->ht[1];
+        if (ht->used+ht->deleted < oadictMaxFill(ht)) return DICT_OK;
+        while (oadictRehash(d,100));
+    }
+
+    /* If the hash table is empty expand it to the initial size. */
+    ht = &d->ht[0];
+    if (ht->groups == 0) return oadictExpand(d,OADICT_HT_INITIAL_SIZE);
+
+    /* A table full of tombstones gets a new table of the same size. */
+    if (ht->used+ht->deleted < oadictMaxFill(ht)) return DICT_OK;
+    return oadictExpand(d,ht->used*2);
+}
+
+/* Function to reverse bits. Algorithm from:
+ * http://graphics.stanford.edu/~seander/bithacks.html#ReverseParallel */
+static unsigned long rev(unsigned long v) {
+    unsigned long s = 8 * sizeof(v); // bit size; must be power of 2
+    unsigned long mask = ~0;
+    while ((s >>= 1) > 0) {
+        mask ^= (mask << s);
+        v = ((v >> s) & mask) | ((v << s) & ~mask);
+    }
+    return v;
+}
+
+/* Emit the entries whose home group is 'g'. Their probe sequences end at the
+ * first group with an EMPTY slot, so they can't be after it. */
+static void _oadictScanGroup(oadict *d, oadictht *ht, unsigned long g,
+                             oadictScanFunction *fn, void *privdata)
+{
+    unsigned long mask = ht->groups-1, home = g, probes;
+
+    for (probes = 0; probes < ht->groups; probes++) {
+        int8_t *ctrl = ht->ctrl+g*OADICT_GROUP_SIZE;
+        unsigned int match = groupMatchUsed(ctrl);
+
+        while (match) {
+            oadictEntry *de = ht->slots+g*OADICT_GROUP_SIZE+groupFirst(match);
+
+            if ((oadictH1(dictHashKey(d,de->key)) & mask) == home)
+                fn(privdata,de);
+            match &= match-1;
+        }
+        if (groupMatchEmpty(ctrl)) break;
+        g = (g+1) & mask;
+    }
+}
+
+/* oadictScan() is used to iterate over the elements of a dictionary, with
+ * the same guarantees of dictScan(): all the elements present from the start
+ * to the end of the iteration are returned, some possibly more than once.
+ *
+ * The cursor works the same way, see dictScan() in dict.c. What it walks is
+ * not the slots but the home groups: the group an element would be in if
+ * there were no collisions. Like the buckets of dict.c they are the low bits
+ * of the hash, so a home group of a table maps to the home groups of a larger
+ * table that share its bits. Scanning a home group means emitting, among the
+ * entries of its probe sequence, the ones that really have it as home. */
+unsigned long oadictScan(oadict *d, unsigned long v, oadictScanFunction *fn,
+                         void *privdata)
+{
+    oadictht *t0, *t1;
+    unsigned long m0, m1;
+
+    if (oadictSize(d) == 0) return 0;
+
+    if (!oadictIsRehashing(d)) {
+        t0 = &(d->ht[0]);
+        m0 = t0->groups-1;
+
+        /* Emit entries at cursor */
+        _oadictScanGroup(d,t0,v & m0,fn,privdata);
+    } else {
+        t0 = &d->ht[0];
+        t1 = &d->ht[1];
+
+        /* Make sure t0 is the smaller and t1 is the bigger table */
+        if (t0->groups > t1->groups) {
+            t0 = &d->ht[1];
+            t1 = &d->ht[0];
+        }
+
+        m0 = t0->groups-1;
+        m1 = t1->groups-1;
+
+        /* Emit entries at cursor */
+        _oadictScanGroup(d,t0,v & m0,fn,privdata);
+
+        /* Iterate over indices in larger table that are the expansion
+         * of the index pointed to by the cursor in the smaller table */
+        do {
+            /* Emit entries at cursor */
+            _oadictScanGroup(d,t1,v & m1,fn,privdata);
+
+            /* Increment bits not covered by the smaller mask */
+            v = (((v | m0) + 1) & ~m0) | (v & m0);
+
+            /* Continue while bits covered by mask difference is non-zero */
+        } while (v & (m0 ^ m1));
+    }
+
+    /* Set unmasked bits so incrementing the reversed cursor
+     * operates on the masked bits of the smaller table */
+    v |= ~m0;
+
+    /* Increment the reverse cursor */
+    v = rev(v);
+    v++;
+    v = rev(v);
+
+    return v;
+}
+
+#ifdef OADICT_BENCHMARK_MAIN
+#include <sys/time.h>
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* dict.c asserts are reported by the server. */
+void _prezAssert(char *estr, char *file, int line) {
+    fprintf(stderr,"=== ASSERTION FAILED === %s:%d '%s'\n",file,line,estr);
+}
+
+static unsigned int benchHash(const void *key) {
+    return dictGenHashFunction(key,strlen(key));
+}
+
+static int benchCompare(void *privdata, const void *key1, const void *key2) {
+    DICT_NOTUSED(privdata);
+    return strcmp(key1,key2) == 0;
+}
+
+static dictType benchDictType = {
+    benchHash, NULL, NULL, benchCompare, NULL, NULL
+};
+
+static void benchScan(void *privdata, const oadictEntry *de) {
+    DICT_NOTUSED(de);
+    (*(unsigned long*)privdata)++;
+}
+
+int main(int argc, char **argv) {
+    long count = argc > 1 ? atol(argv[1]) : 1000000, j;
+    char **keys = malloc(sizeof(char*)*count);
+    unsigned long scanned = 0, cursor = 0;
+    size_t mem;
+    long long start;
+    dict *d;
+    oadict *od;
+
+    for (j = 0; j < count; j++) {
+        keys[j] = malloc(24);
+        snprintf(keys[j],24,"key:%ld",j);
+    }
+
+    /* Only the tables are accounted, the keys are not allocated with
+     * zmalloc(). */
+    mem = zmalloc_used_memory();
+    d = dictCreate(&benchDictType,NULL);
+    start = ustime();
+    for (j = 0; j < count; j++) dictAdd(d,keys[j],keys[j]);
+    while (dictIsRehashing(d)) dictRehash(d,100);
+    printf("dict:   add %.1f ns/key, ",
+        (double)(ustime()-start)*1000/count);
+    start = ustime();
+    for (j = 0; j < count; j++)
+        if (dictFind(d,keys[(j*7919)%count]) == NULL) return 1;
+    printf("find %.1f ns/key, %.1f bytes/key\n",
+        (double)(ustime()-start)*1000/count,
+        (double)(zmalloc_used_memory()-mem)/count);
+    dictRelease(d);
+
+    mem = zmalloc_used_memory();
+    od = oadictCreate(&benchDictType,NULL);
+    start = ustime();
+    for (j = 0; j < count; j++) oadictAdd(od,keys[j],keys[j]);
+    while (oadictIsRehashing(od)) oadictRehash(od,100);
+    printf("oadict: add %.1f ns/key, ",
+        (double)(ustime()-start)*1000/count);
+    start = ustime();
+    for (j = 0; j < count; j++)
+        if (oadictFind(od,keys[(j*7919)%count]) == NULL) return 1;
+    printf("find %.1f ns/key, %.1f bytes/key\n",
+        (double)(ustime()-start)*1000/count,
+        (double)(zmalloc_used_memory()-mem)/count);
+
+    /* Delete half of the keys, then scan: every key left must be seen. */
+    for (j = 0; j < count; j += 2) oadictDelete(od,keys[j]);
+    do {
+        cursor = oadictScan(od,cursor,benchScan,&scanned);
+    } while (cursor);
+    if (scanned < oadictSize(od)) {
+        printf("Scan missed keys!\n");
+        return 1;
+    }
+    oadictRelease(od);
+    return 0;
+}
+#endif
@@ -0,0 +1,115 @@
+/* Open addressing hash tables.
+ *
+ * Copyright (c) 2006-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include "dict.h"
+
+#ifndef __OADICT_H
+#define __OADICT_H
+
+/* Slots are probed a group at a time, see oadict.c. */
+#define OADICT_GROUP_SIZE 16
+
+/* This is the initial size, in slots, of every hash table */
+#define OADICT_HT_INITIAL_SIZE OADICT_GROUP_SIZE
+
+/* Entries are stored in the table itself. The pointer returned by
+ * oadictFind() is only valid until the next call modifying the dict. */
+typedef struct oadictEntry {
+    void *key;
+    void *val;
+} oadictEntry;
+
+typedef struct oadictht {
+    int8_t *ctrl;           /* A control byte per slot: see oadict.c. */
+    oadictEntry *slots;
+    unsigned long groups;   /* Power of two, or zero if not allocated. */
+    unsigned long used;
+    unsigned long deleted;  /* Tombstones, slots that can't end a probe. */
+} oadictht;
+
+/* Keys and values are handled by a dictType like dict.c ones. */
+typedef struct oadict {
+    dictType *type;
+    void *privdata;
+    oadictht ht[2];
+    long rehashidx; /* Next group of ht[0] to move, -1 if not rehashing. */
+} oadict;
+
+typedef void (oadictScanFunction)(void *privdata, const oadictEntry *de);
+
+/* ------------------------------- Macros ------------------------------------*/
+#define oadictFreeVal(d, entry) \
+    if ((d)->type->valDestructor) \
+        (d)->type->valDestructor((d)->privdata, (entry)->val)
+
+#define oadictSetVal(d, entry, _val_) do { \
+    if ((d)->type->valDup) \
+        (entry)->val = (d)->type->valDup((d)->privdata, _val_); \
+    else \
+        (entry)->val = (_val_); \
+} while(0)
+
+#define oadictFreeKey(d, entry) \
+    if ((d)->type->keyDestructor) \
+        (d)->type->keyDestructor((d)->privdata, (entry)->key)
+
+#define oadictSetKey(d, entry, _key_) do { \
+    if ((d)->type->keyDup) \
+        (entry)->key = (d)->type->keyDup((d)->privdata, _key_); \
+    else \
+        (entry)->key = (_key_); \
+} while(0)
+
+#define oadictGetKey(de) ((de)->key)
+#define oadictGetVal(de) ((de)->val)
+#define oadictSlots(d) \
+    (((d)->ht[0].groups+(d)->ht[1].groups)*OADICT_GROUP_SIZE)
+#define oadictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
+#define oadictTombstones(d) ((d)->ht[0].deleted+(d)->ht[1].deleted)
+#define oadictIsRehashing(d) ((d)->rehashidx != -1)
+
+/* API */
+oadict *oadictCreate(dictType *type, void *privDataPtr);
+int oadictExpand(oadict *d, unsigned long size);
+int oadictAdd(oadict *d, void *key, void *val);
+int oadictReplace(oadict *d, void *key, void *val);
+int oadictDelete(oadict *d, const void *key);
+void oadictRelease(oadict *d);
+oadictEntry *oadictFind(oadict *d, const void *key);
+void *oadictFetchValue(oadict *d, const void *key);
+int oadictResize(oadict *d);
+void oadictEmpty(oadict *d, void(callback)(void*));
+int oadictRehash(oadict *d, int n);
+int oadictRehashMicroseconds(oadict *d, long long us);
+unsigned long oadictScan(oadict *d, unsigned long v, oadictScanFunction *fn,
+                         void *privdata);
+
+#endif /* __OADICT_H */
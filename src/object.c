@@ -58,13 +58,22 @@ robj *createRawStringObject(char *ptr, size_t len) {
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
 robj *createEmbeddedStringObject(char *ptr, size_t len) {
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr)+len+1);
+    return initEmbeddedStringObject(zmalloc(embeddedStringObjectSize(len)),
+                                    ptr,len,1);
+}
+
+/* Initialize an embedded string object in 'mem', that must be at least
+ * embeddedStringObjectSize(len) bytes. */
+robj *initEmbeddedStringObject(void *mem, char *ptr, size_t len,
+                               int refcount)
+{
+    robj *o = mem;
     struct sdshdr *sh = (void*)(o+1);
 
     o->type = PREZ_STRING;
     o->encoding = PREZ_ENCODING_EMBSTR;
     o->ptr = sh+1;
-    o->refcount = 1;
+    o->refcount = refcount;
     o->lru = LRU_CLOCK();
 
     sh->len = len;
@@ -283,10 +292,15 @@ void freeHashObject(robj *o) {
 #endif
 
 void incrRefCount(robj *o) {
+    if (o->refcount == PREZ_ARENA_REFCOUNT)
+        prezPanic("incrRefCount against an arena object, use retainObject()");
     o->refcount++;
 }
 
+/* Objects in a client arena are released all together once the command
+ * is executed, see clientCreateArgument(). */
 void decrRefCount(robj *o) {
+    if (o->refcount == PREZ_ARENA_REFCOUNT) return;
     if (o->refcount <= 0) prezPanic("decrRefCount against refcount <= 0");
     if (o->refcount == 1) {
         switch(o->type) {
@@ -305,6 +319,15 @@ void decrRefCount(robj *o) {
     }
 }
 
+/* Return a reference to 'o' that can be kept after the current command,
+ * that is 'o' itself with its refcount incremented, or a copy if 'o' lives
+ * in a client arena. */
+robj *retainObject(robj *o) {
+    if (o->refcount == PREZ_ARENA_REFCOUNT) return dupStringObject(o);
+    incrRefCount(o);
+    return o;
+}
+
 /* This variant of decrRefCount() gets its argument as void, and is useful
  * as free method in data structures that expect a 'void free_object(void*)'
  * prototype for the free method. */
@@ -98,7 +98,44 @@ struct prezCommand *commandTable;
 struct prezCommand prezCommandTable[] = {
     {"get",getCommand,2,"r",0,NULL,1,1,1,0,0},
     {"set",setCommand,-3,"w",0,NULL,1,1,1,0,0},
-    {"config",configCommand,-2,"art",0,NULL,0,0,0,0,0}
+    {"mset",msetCommand,-3,"w",0,NULL,1,-1,2,0,0},
+    {"mget",mgetCommand,-2,"r",0,NULL,1,-1,1,0,0},
+    {"del",delCommand,-2,"w",0,NULL,1,-1,1,0,0},
+    {"config",configCommand,-2,"art",0,NULL,0,0,0,0,0},
+    {"shmattach",shmattachCommand,1,"r",0,NULL,0,0,0,0,0},
+    {"info",infoCommand,-1,"rt",0,NULL,0,0,0,0,0},
+    {"range",rangeCommand,-3,"r",0,NULL,0,0,0,0,0},
+    {"prefix",prefixCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"getchildren",getchildrenCommand,2,"r",0,NULL,0,0,0,0,0},
+    {"createseq",createseqCommand,-3,"w",0,NULL,1,1,1,0,0},
+    {"lowestchild",lowestchildCommand,2,"r",0,NULL,0,0,0,0,0},
+    {"watch",watchCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"pwatch",pwatchCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"unwatch",unwatchCommand,-1,"r",0,NULL,0,0,0,0,0},
+    {"punwatch",punwatchCommand,-1,"r",0,NULL,0,0,0,0,0},
+    {"getrev",getrevCommand,2,"r",0,NULL,1,1,1,0,0},
+    {"getat",getatCommand,-3,"r",0,NULL,2,-1,1,0,0},
+    {"compact",compactCommand,-2,"w",0,compactGetKeys,0,0,0,0,0},
+    {"txn",txnCommand,-3,"w",0,txnGetKeys,0,0,0,0,0},
+    {"leasegrant",leasegrantCommand,-2,"w",0,leaseGetKeys,0,0,0,0,0},
+    {"leaserevoke",leaserevokeCommand,-2,"w",0,leaseGetKeys,0,0,0,0,0},
+    {"leasekeepalive",leasekeepaliveCommand,-2,"r",0,NULL,0,0,0,0,0},
+    {"incr",incrCommand,2,"w",0,NULL,1,1,1,0,0},
+    {"decr",decrCommand,2,"w",0,NULL,1,1,1,0,0},
+    {"incrby",incrbyCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"decrby",decrbyCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"idalloc",idallocCommand,-3,"w",0,NULL,1,1,1,0,0},
+    {"lock",lockCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"unlock",unlockCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"lockowner",lockownerCommand,2,"r",0,NULL,1,1,1,0,0},
+    {"expire",expireCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"expireat",expireatCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"pexpire",pexpireCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"pexpireat",pexpireatCommand,3,"w",0,NULL,1,1,1,0,0},
+    {"ttl",ttlCommand,2,"r",0,NULL,1,1,1,0,0},
+    {"pttl",pttlCommand,2,"r",0,NULL,1,1,1,0,0},
+    {"persist",persistCommand,2,"w",0,NULL,1,1,1,0,0},
+    {"expired",expiredCommand,-3,"w",0,NULL,2,-1,1,0,0}
 };
 
 /* Return the UNIX time in microseconds */
@@ -117,6 +154,12 @@ long long mstime(void) {
     return ustime()/1000;
 }
 
+/* Return the time in milliseconds from a monotonic clock. Use it to measure
+ * timeouts, that must not be affected by changes of the system clock. */
+long long monotonicMstime(void) {
+    return aeMonotonicUs()/1000;
+}
+
 /*====================== Hash table type implementation  ==================== */
 
 /* This is a hash table type that uses the SDS dynamic strings library as
@@ -152,6 +195,34 @@ void dictSdsDestructor(void *privdata, void *val)
     sdsfree(val);
 }
 
+void dictKeyVersionDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    freeKeyVersions(val);
+}
+
+void dictListDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    listRelease((list*)val);
+}
+
+void dictDictDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    dictRelease((dict*)val);
+}
+
+void dictZfreeDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    zfree(val);
+}
+
 void dictPrezObjectDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
@@ -200,14 +271,80 @@ dictType clusterProcClientsDictType = {
     NULL                        /* val destructor */
 };
 
-/* Db->dict, keys are sds strings, vals are Prez objects. */
+/* Db->tree, paths of nodes -> dict of the names of their children. */
+dictType treeDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictDictDestructor          /* val destructor */
+};
+
+/* Sets of sds strings, like the names of the children of a node. */
+dictType sdsSetDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Keylist hash table type has unencoded prez objects as keys and
+ * lists as values. It's used for watched keys, sds string -> list of
+ * clients. */
+dictType keylistDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictListDestructor          /* val destructor */
+};
+
+/* Leases and locks of a Raft group, sds string (id or name) -> lease or
+ * lock. They are freed when revoked or released. */
+dictType leasesDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* ID blocks reserved by the leader of a Raft group, sds string (counter
+ * key) -> idBlock, see idalloc.c. */
+dictType idBlocksDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    dictZfreeDestructor         /* val destructor */
+};
+
+/* Db->deleted, keys are sds strings, vals are the tombstones of the keys,
+ * freed by the caller. */
+dictType deletedDictType = {
+    dictSdsHash,                /* hash function */
+    NULL,                       /* key dup */
+    NULL,                       /* val dup */
+    dictSdsKeyCompare,          /* key compare */
+    dictSdsDestructor,          /* key destructor */
+    NULL                        /* val destructor */
+};
+
+/* Db->dict, an oadict: keys are sds strings, vals are the versions of
+ * the keys. */
 dictType dbDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
     dictSdsDestructor,          /* key destructor */
-    dictPrezObjectDestructor   /* val destructor */
+    dictKeyVersionDestructor    /* val destructor */
 };
 
 
@@ -273,6 +410,58 @@ void updateCachedTime(void) {
 
 /*====================== Cron Handling  ==================== */
 
+/* The keyspace table grows as needed but is never shrunk by the updates, so
+ * after a mass delete it is resized here. It is also rebuilt when full of
+ * tombstones, that make the probe sequences of missing keys longer. */
+int htNeedsResize(oadict *dict) {
+    unsigned long size = oadictSlots(dict), used = oadictSize(dict);
+
+    return size > OADICT_HT_INITIAL_SIZE &&
+           (used*100/size < PREZ_HT_MINFILL ||
+            oadictTombstones(dict) > size/4);
+}
+
+/* If the percentage of used slots in the keyspace table reaches
+ * PREZ_HT_MINFILL we resize it to save memory. The new table is filled
+ * incrementally, like after a growth. */
+void tryResizeHashTables(int dbid) {
+    oadict *d = server.db[dbid].dict;
+
+    if (!oadictIsRehashing(d) && htNeedsResize(d) &&
+        oadictResize(d) == DICT_OK)
+        server.stat_keyspace_resizes++;
+}
+
+/* The keyspace table is rehashed a group per lookup or update, so an idle
+ * or read mostly server could keep two tables, and lookups probing both,
+ * for a long time. Use up to activerehashing-budget microseconds per cron
+ * call to move the entries. Returns 1 if some rehashing was performed. */
+int incrementallyRehash(int dbid) {
+    oadict *d = server.db[dbid].dict;
+    long long start;
+
+    if (!oadictIsRehashing(d)) return 0;
+    start = ustime();
+    server.stat_active_rehash_steps +=
+        oadictRehashMicroseconds(d,server.activerehashing_budget);
+    server.stat_active_rehash_time += ustime()-start;
+    return 1;
+}
+
+/* Resize and rehash the keyspace tables. The budget is spent on the first
+ * table that needs rehashing. */
+void databasesCron(void) {
+    int j;
+
+    for (j = 0; j < server.dbnum; j++)
+        tryResizeHashTables(j);
+
+    if (server.activerehashing) {
+        for (j = 0; j < server.dbnum; j++)
+            if (incrementallyRehash(j)) break;
+    }
+}
+
 /* This is our timer interrupt, called server.hz times per second.
  * Here is where we do a number of things that need to be done asynchronously.
  * For instance:
@@ -295,9 +484,31 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Run the Prez Cluster cron. */
     clusterCron();
 
+    /* Resize and rehash the keyspace. */
+    databasesCron();
+
+    /* Close clients that need to be closed asynchronous */
+    freeClientsInAsyncFreeQueue();
+
     return 1000/server.hz;
 }
 
+/* This function gets called every time Prez is entering the
+ * main loop of the event driven library, that is, before to sleep
+ * for ready file descriptors. */
+void beforeSleep(struct aeEventLoop *eventLoop) {
+    PREZ_NOTUSED(eventLoop);
+
+    /* Execute the commands of the clients the I/O threads read. */
+    handleClientsWithPendingReads();
+
+    /* Sync the logs and apply the committed entries. */
+    clusterBeforeSleep();
+
+    /* Write the replies produced in this iteration. */
+    handleClientsWithPendingWrites();
+}
+
 void createPidFile(void) {
     /* Try to write the pid file in a best-effort way. */
     FILE *fp = fopen(server.pidfile,"w");
@@ -352,10 +563,10 @@ void setGenericCommand(prezClient *c, robj *key, robj *val) {
     addReply(c,shared.ok);
 }
 
-int getGenericCommand(prezClient *c) {
+int getGenericCommand(prezClient *c, robj *key) {
     robj *o;
 
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL)
+    if ((o = lookupKeyReadOrReply(c,key,shared.nullbulk)) == NULL)
         return PREZ_OK;
 
     if (o->type != PREZ_STRING) {
@@ -368,14 +579,282 @@ int getGenericCommand(prezClient *c) {
 }
 
 void getCommand(prezClient *c, robj **argv, int argc) {
-    prezLog(PREZ_DEBUG, "getCommand");
-    getGenericCommand(c);
+    PREZ_NOTUSED(argc);
+    getGenericCommand(c,argv[1]);
 }
 
+/* SET <key> <value> [EX <seconds> | PX <milliseconds> | PXAT <unix-ms>]
+ *                   [LEASE <id>]
+ *
+ * With LEASE the key is attached to the lease, and deleted when the lease
+ * is revoked. Setting the key again without it detaches the key, and
+ * removes its expire. EX and PX are logged as PXAT, see
+ * rewriteExpireCommand(). */
 void setCommand(prezClient *c, robj **argv, int argc) {
-    //prezLog(PREZ_DEBUG, "setCommand");
-    if (argc != 3) addReply(c,shared.syntaxerr);
-    setGenericCommand(c,argv[1],argv[2]);
+    long long when = 0, n;
+    lease *l = NULL;
+    int j;
+
+    for (j = 3; j < argc; j += 2) {
+        char *opt = argv[j]->ptr;
+
+        if (j+1 == argc) {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+        if (getLongLongFromObjectOrReply(c,argv[j+1],&n,NULL) != PREZ_OK)
+            return;
+        if (!strcasecmp(opt,"lease")) {
+            if ((l = leaseLookupOrReply(c,n)) == NULL) return;
+        } else if (!strcasecmp(opt,"ex") || !strcasecmp(opt,"px") ||
+                   !strcasecmp(opt,"pxat"))
+        {
+            if (n <= 0) {
+                addReplyError(c,"invalid expire time in SET");
+                return;
+            }
+            if (!strcasecmp(opt,"ex")) when = mstime()+n*1000;
+            else if (!strcasecmp(opt,"px")) when = mstime()+n;
+            else when = n;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+    setKey(&server.db[0],argv[1],argv[2]);
+    if (when) setExpire(&server.db[0],argv[1],when);
+    if (l) leaseAttachKey(l,argv[1]);
+    addReply(c,shared.ok);
+}
+
+/* MSET <key> <value> [<key> <value> ...]
+ *
+ * The keys must belong to the same Raft group: all of them are set by the
+ * same log entry, which holds thousands of keys as long as the quoted
+ * command fits in PREZ_LOG_MAX_ENTRY_LEN. */
+void msetCommand(prezClient *c, robj **argv, int argc) {
+    int j;
+
+    if ((argc % 2) == 0) {
+        addReplyError(c,"wrong number of arguments for MSET");
+        return;
+    }
+    for (j = 1; j < argc; j += 2)
+        setKey(&server.db[0],argv[j],argv[j+1]);
+    addReply(c,shared.ok);
+}
+
+void mgetCommand(prezClient *c, robj **argv, int argc) {
+    int j;
+
+    addReplyMultiBulkLen(c,argc-1);
+    for (j = 1; j < argc; j++) {
+        robj *o = lookupKeyRead(&server.db[0],argv[j]);
+
+        if (o == NULL || o->type != PREZ_STRING)
+            addReply(c,shared.nullbulk);
+        else
+            addReplyBulk(c,o);
+    }
+}
+
+/* DEL <key> [<key> ...]
+ *
+ * Reply with the number of keys deleted. Like MSET the keys must belong to
+ * the same Raft group. */
+void delCommand(prezClient *c, robj **argv, int argc) {
+    int deleted = 0, j;
+
+    for (j = 1; j < argc; j++)
+        deleted += dbDelete(&server.db[0],argv[j]);
+    addReplyLongLong(c,deleted);
+}
+
+/* Add 'incr' to the integer value of the key, or to 0 if the key does not
+ * exist, and set '*value' to the result. Unlike SET the key keeps its
+ * lease and its expire. On error the client gets the reply, and PREZ_ERR
+ * is returned. */
+int incrKey(prezClient *c, robj *key, long long incr, long long *value) {
+    prezDb *db = &server.db[0];
+    robj *o = lookupKeyWrite(db,key), *new;
+    long long oldvalue = 0;
+    char buf[32];
+
+    if (o != NULL) {
+        if (o->type != PREZ_STRING) {
+            addReply(c,shared.wrongtypeerr);
+            return PREZ_ERR;
+        }
+        if (getLongLongFromObjectOrReply(c,o,&oldvalue,NULL) != PREZ_OK)
+            return PREZ_ERR;
+    }
+    if ((incr < 0 && oldvalue < 0 && incr < (LLONG_MIN-oldvalue)) ||
+        (incr > 0 && oldvalue > 0 && incr > (LLONG_MAX-oldvalue))) {
+        addReplyError(c,"increment or decrement would overflow");
+        return PREZ_ERR;
+    }
+    *value = oldvalue+incr;
+    new = createStringObject(buf,ll2string(buf,sizeof(buf),*value));
+    if (o != NULL)
+        dbOverwrite(db,key,new);
+    else
+        dbAdd(db,key,new);
+    touchWatchedKey(key->ptr);
+    return PREZ_OK;
+}
+
+static void incrDecrCommand(prezClient *c, robj *key, long long incr) {
+    long long value;
+
+    if (incrKey(c,key,incr,&value) == PREZ_OK) addReplyLongLong(c,value);
+}
+
+void incrCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    incrDecrCommand(c,argv[1],1);
+}
+
+void decrCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argc);
+    incrDecrCommand(c,argv[1],-1);
+}
+
+void incrbyCommand(prezClient *c, robj **argv, int argc) {
+    long long incr;
+    PREZ_NOTUSED(argc);
+
+    if (getLongLongFromObjectOrReply(c,argv[2],&incr,NULL) != PREZ_OK) return;
+    incrDecrCommand(c,argv[1],incr);
+}
+
+void decrbyCommand(prezClient *c, robj **argv, int argc) {
+    long long incr;
+    PREZ_NOTUSED(argc);
+
+    if (getLongLongFromObjectOrReply(c,argv[2],&incr,NULL) != PREZ_OK) return;
+    if (incr == LLONG_MIN) {
+        addReplyError(c,"decrement would overflow");
+        return;
+    }
+    incrDecrCommand(c,argv[1],-incr);
+}
+
+/* Create the string returned by the INFO command. */
+sds genPrezInfoString(char *section) {
+    sds info = sdsempty();
+    int allsections, defsections, sections = 0, j;
+
+    allsections = strcasecmp(section,"all") == 0;
+    defsections = strcasecmp(section,"default") == 0;
+
+    /* Server */
+    if (allsections || defsections || !strcasecmp(section,"server")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Server\r\n"
+            "prez_version:%s\r\n"
+            "process_id:%ld\r\n"
+            "tcp_port:%d\r\n"
+            "binary_port:%d\r\n"
+            "uptime_in_seconds:%jd\r\n"
+            "hz:%d\r\n",
+            PREZ_VERSION,
+            (long) getpid(),
+            server.port,
+            server.binary_port,
+            (intmax_t)(server.unixtime-server.stat_starttime),
+            server.hz);
+    }
+
+    /* Clients */
+    if (allsections || defsections || !strcasecmp(section,"clients")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Clients\r\n"
+            "connected_clients:%lu\r\n"
+            "watched_keys:%lu\r\n"
+            "watched_prefixes:%llu\r\n",
+            listLength(server.clients),
+            dictSize(server.watched_keys),
+            (unsigned long long) radixSize(server.watched_prefixes));
+    }
+
+    /* Memory */
+    if (allsections || defsections || !strcasecmp(section,"memory")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Memory\r\n"
+            "used_memory:%zu\r\n",
+            zmalloc_used_memory());
+    }
+
+    /* Stats */
+    if (allsections || defsections || !strcasecmp(section,"stats")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info,
+            "# Stats\r\n"
+            "total_connections_received:%lld\r\n"
+            "rejected_connections:%lld\r\n"
+            "keyspace_hits:%lld\r\n"
+            "keyspace_misses:%lld\r\n"
+            "active_rehashing:%d\r\n"
+            "active_rehash_steps:%lld\r\n"
+            "active_rehash_time_us:%lld\r\n"
+            "keyspace_resizes:%lld\r\n"
+            "watch_notifications:%lld\r\n"
+            "expired_keys:%lld\r\n"
+            "expired_leases:%lld\r\n"
+            "lease_keepalives_forwarded:%lld\r\n"
+            "lock_handoffs:%lld\r\n"
+            "idalloc_from_block:%lld\r\n",
+            server.stat_numconnections,
+            server.stat_rejected_conn,
+            server.stat_keyspace_hits,
+            server.stat_keyspace_misses,
+            server.activerehashing,
+            server.stat_active_rehash_steps,
+            server.stat_active_rehash_time,
+            server.stat_keyspace_resizes,
+            server.stat_watch_notifications,
+            server.stat_expiredkeys,
+            server.stat_expired_leases,
+            server.stat_lease_keepalives_forwarded,
+            server.stat_lock_handoffs,
+            server.stat_idalloc_from_block);
+    }
+
+    /* Key space */
+    if (allsections || defsections || !strcasecmp(section,"keyspace")) {
+        if (sections++) info = sdscat(info,"\r\n");
+        info = sdscatprintf(info, "# Keyspace\r\n");
+        for (j = 0; j < server.dbnum; j++) {
+            oadict *d = server.db[j].dict;
+
+            info = sdscatprintf(info,
+                "db%d:keys=%lu,expires=%llu,deleted=%lu,slots=%lu,"
+                "tombstones=%lu,rehashing=%d,index_nodes=%llu\r\n",
+                j, oadictSize(d),
+                (unsigned long long) radixSize(server.db[j].expires),
+                dictSize(server.db[j].deleted),
+                oadictSlots(d), oadictTombstones(d),
+                oadictIsRehashing(d),
+                (unsigned long long) server.db[j].index->numnodes);
+        }
+    }
+    return info;
+}
+
+void infoCommand(prezClient *c, robj **argv, int argc) {
+    char *section = argc == 2 ? argv[1]->ptr : "default";
+    sds info;
+
+    if (argc > 2) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    info = genPrezInfoString(section);
+    addReplyBulkCBuffer(c,info,sdslen(info));
+    sdsfree(info);
 }
 
 /* ====================== Commands lookup and execution ===================== */
@@ -402,39 +881,78 @@ void call(prezClient *c) {
  * processCommand() execute the command or prepare the
  * server for a bulk read from the client.
  *
+ * Writes are appended to the log of their group and queued in the client
+ * requests until committed, so a client can have many of them in flight.
+ * While writes are queued the commands following them are queued too, so
+ * that the replies are sent in order: the errors are captured right away,
+ * the reads are executed once the requests before them were replied.
+ * Binary protocol clients always queue their requests, that are replied
+ * out of order as soon as they are done, see clientRequestProcessed().
+ *
  * If 1 is returned the client is still alive and valid and
  * other operations can be performed by the caller. Otherwise
  * if 0 is returned the client was destroyed (i.e. after QUIT). */
 int processCommand(prezClient *c) {
+    clientRequest *r = NULL;
+    int capture = 0, read = 0;
+
+    /* Relative expire times become absolute deadlines before the command
+     * is queued and logged. */
+    rewriteExpireCommand(c);
+
+    if (listLength(c->requests) || c->flags & PREZ_BINARY) {
+        r = clientQueueRequest(c);
+        clientSwapReply(c,r);
+        capture = 1;
+    }
+
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
     c->cmd = c->lastcmd = lookupCommand(c->argv[0]->ptr);
     if (!c->cmd) {
         addReplyErrorFormat(c,"unknown command '%s'",
             (char*)c->argv[0]->ptr);
-        return PREZ_OK;
     } else if ((c->cmd->arity > 0 && c->cmd->arity != c->argc) ||
                (c->argc < -c->cmd->arity)) {
         addReplyErrorFormat(c,"wrong number of arguments for '%s' command",
             c->cmd->name);
-        return PREZ_OK;
-    }
-    if (c->cmd->flags & PREZ_CMD_WRITE) {
-        if (server.cluster->state == PREZ_CANDIDATE) {
-            addReplySds(c,sdscatprintf(sdsempty(),
-                        "-%s\r\n","CLUSTERDOWN Leader not elected.Command not accepted"));
-            return PREZ_OK;
-        } else if (server.cluster->state == PREZ_FOLLOWER) {
-            addReplySds(c,sdscatprintf(sdsempty(),
-                        "-%s %s\r\n","ASK", server.cluster->leader));
-            return PREZ_OK;
+    } else if (c->flags & PREZ_WATCH_MODE && !watchModeCommand(c->cmd)) {
+        addReplyError(c,"only (P)WATCH / (P)UNWATCH allowed in this context");
+    } else if (c->cmd->flags & PREZ_CMD_WRITE) {
+        int group = clusterCommandGroup(c->cmd,c->argv,c->argc);
+
+        if (group == -1) {
+            addReplyError(c,"CROSSGROUP Keys in request don't hash to the same Raft group");
+        } else {
+            clusterSelectGroup(group);
+            if (server.cluster->state == PREZ_CANDIDATE) {
+                addReplySds(c,sdscatprintf(sdsempty(),
+                            "-%s\r\n","CLUSTERDOWN Leader not elected.Command not accepted"));
+            } else if (server.cluster->state == PREZ_FOLLOWER) {
+                addReplySds(c,sdscatprintf(sdsempty(),
+                            "-%s %s\r\n","ASK", server.cluster->leader));
+            } else if (c->cmd->proc == idallocCommand &&
+                       idallocFromBlock(c)) {
+                /* Served from the block reserved by this leader. */
+            } else {
+                r = clusterProcessCommand(c,r);
+            }
         }
+    } else {
+        /* Watch mode starts as soon as WATCH is received, even if it is
+         * queued behind writes, see watchModeCommand(). */
+        if ((c->cmd->proc == watchCommand || c->cmd->proc == pwatchCommand)
+            && !(c->flags & PREZ_BINARY)) c->flags |= PREZ_WATCH_MODE;
+        read = 1;
+    }
 
-        clusterProcessCommand(c);
-        /* Fake ERR so that the client doesn't get reset */
-        return PREZ_ERR;
+    if (capture) clientSwapReply(c,r);
+    if (r == NULL) {
+        if (read) call(c);
     } else {
-        call(c);
+        /* The request was queued before the command was looked up. */
+        r->cmd = c->cmd;
+        clientRequestProcessed(r,read);
     }
     return PREZ_OK;
 }
@@ -586,6 +1104,15 @@ void resetServerStats(void) {
     server.stat_keyspace_misses = 0;
     server.stat_keyspace_hits = 0;
     server.stat_rejected_conn = 0;
+    server.stat_active_rehash_steps = 0;
+    server.stat_active_rehash_time = 0;
+    server.stat_keyspace_resizes = 0;
+    server.stat_watch_notifications = 0;
+    server.stat_expiredkeys = 0;
+    server.stat_expired_leases = 0;
+    server.stat_lock_handoffs = 0;
+    server.stat_idalloc_from_block = 0;
+    server.stat_lease_keepalives_forwarded = 0;
 }
 
 
@@ -604,9 +1131,21 @@ void initServer() {
     server.pid = getpid();
     server.clients = listCreate();
     server.clients_to_close = listCreate();
+    server.clients_pending_read = listCreate();
+    server.clients_pending_write = listCreate();
+    server.watched_keys = dictCreate(&keylistDictType,NULL);
+    server.watched_prefixes = radixNew();
+    server.watch_notify = listCreate();
+    server.lock_wakeups = listCreate();
     createSharedObjects();
     adjustOpenFilesLimit();
     server.el = aeCreateEventLoop(server.maxclients+PREZ_EVENTLOOP_FDSET_INCR);
+    if (server.el == NULL) {
+        prezLog(PREZ_WARNING,
+            "Failed creating the event loop (%s). Error message: '%s'",
+            aeGetApiName(), strerror(errno));
+        exit(1);
+    }
     server.db = zmalloc(sizeof(prezDb)*server.dbnum);
 
 
@@ -627,17 +1166,28 @@ void initServer() {
         anetNonBlock(NULL,server.sofd);
     }
 
+    /* Open the TCP listening socket for the binary protocol clients. */
+    if (server.binary_port != 0 &&
+        listenToPort(server.binary_port,server.bfd,&server.bfd_count) == PREZ_ERR)
+        exit(1);
+
     /* Abort if there are no listening sockets at all. */
-    if (server.ipfd_count == 0 && server.sofd < 0) {
+    if (server.ipfd_count == 0 && server.sofd < 0 && server.bfd_count == 0) {
         prezLog(PREZ_WARNING, "Configured to not listen anywhere, exiting.");
         exit(1);
     }
 
     /* Create the Prez databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
-        server.db[j].dict = dictCreate(&dbDictType,NULL);
+        server.db[j].dict = oadictCreate(&dbDictType,NULL);
+        server.db[j].index = radixNew();
+        server.db[j].tree = dictCreate(&treeDictType,NULL);
+        server.db[j].expires = radixNew();
+        server.db[j].deleted = dictCreate(&deletedDictType,NULL);
+        server.db[j].deleted_index = radixNew();
         server.db[j].id = j;
     }
+    server.stat_starttime = time(NULL);
     resetServerStats();
 
     /* Create the serverCron() time event, that's our main way to process
@@ -657,10 +1207,19 @@ void initServer() {
                     "Unrecoverable error creating server.ipfd file event.");
             }
     }
+    for (j = 0; j < server.bfd_count; j++) {
+        if (aeCreateFileEvent(server.el, server.bfd[j], AE_READABLE,
+            acceptBinaryHandler,NULL) == AE_ERR)
+            {
+                prezPanic(
+                    "Unrecoverable error creating server.bfd file event.");
+            }
+    }
     if (server.sofd > 0 && aeCreateFileEvent(server.el,server.sofd,AE_READABLE,
         acceptUnixHandler,NULL) == AE_ERR) prezPanic("Unrecoverable error creating server.sofd file event.");
 
     clusterInit();
+    initThreadedIO();
 }
 
 /* This function will try to raise the max number of open files accordingly to
@@ -780,12 +1339,20 @@ void initServerConfig() {
     server.bindaddr_count = 0;
     server.unixsocket = NULL;
     server.unixsocketperm = PREZ_DEFAULT_UNIX_SOCKET_PERM;
+    server.shm_ring_size = PREZ_DEFAULT_SHM_RING_SIZE;
     server.ipfd_count = 0;
     server.sofd = -1;
+    server.binary_port = PREZ_DEFAULT_BINARY_PORT;
+    server.bfd_count = 0;
     server.dbnum = PREZ_DEFAULT_DBNUM;
     server.verbosity = PREZ_DEFAULT_VERBOSITY;
     server.maxidletime = PREZ_MAXIDLETIME;
+    server.activerehashing = PREZ_DEFAULT_ACTIVE_REHASHING;
+    server.activerehashing_budget = PREZ_DEFAULT_ACTIVE_REHASHING_BUDGET;
+    server.watch_history_len = PREZ_DEFAULT_WATCH_HISTORY_LEN;
+    server.key_max_versions = PREZ_DEFAULT_KEY_MAX_VERSIONS;
     server.tcpkeepalive = PREZ_DEFAULT_TCP_KEEPALIVE;
+    server.io_threads_num = PREZ_DEFAULT_IO_THREADS;
     server.client_max_querybuf_len = PREZ_MAX_QUERYBUF_LEN;
     server.logfile = zstrdup(PREZ_DEFAULT_LOGFILE);
     server.syslog_enabled = PREZ_DEFAULT_SYSLOG_ENABLED;
@@ -882,7 +1449,10 @@ int main(int argc, char **argv) {
         prezLog(PREZ_NOTICE,"The server is now ready to accept connections on port %d", server.port);
     if (server.sofd > 0)
         prezLog(PREZ_NOTICE,"The server is now ready to accept connections at %s", server.unixsocket);
+    if (server.bfd_count > 0)
+        prezLog(PREZ_NOTICE,"The server is now ready to accept binary protocol connections on port %d", server.binary_port);
 
+    aeSetBeforeSleepProc(server.el,beforeSleep);
     aeMain(server.el);
     aeDeleteEventLoop(server.el);
     return 0;
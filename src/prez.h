@@ -60,6 +60,8 @@ typedef long long mstime_t; /* millisecond time type. */
 #include "ae.h"      
 #include "sds.h"     
 #include "dict.h"    
+#include "oadict.h"
+#include "radix.h"
 #include "adlist.h"  
 #include "zmalloc.h" 
 #include "anet.h"    
@@ -93,10 +95,21 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PREZ_PRE_PSYNC (1<<16)   /* Instance don't understand PSYNC. */
 #define PREZ_READONLY (1<<17)    /* Cluster client is in read-only state. */
 #define PREZ_PUBSUB (1<<18)      /* Client is in Pub/Sub mode. */
+#define PREZ_PENDING_READ (1<<19)    /* Queued for reading by the I/O threads */
+#define PREZ_PENDING_WRITE (1<<20)   /* Output to write before sleeping */
+#define PREZ_PENDING_COMMAND (1<<21) /* Command parsed by an I/O thread */
+#define PREZ_IO_ERROR (1<<22)        /* An I/O thread hit a socket error */
+#define PREZ_REPLY_CAPTURE (1<<23)   /* Replies go to a queued request */
+#define PREZ_BINARY (1<<24)          /* Client speaks the binary protocol */
+#define PREZ_WATCH_NOTIFY (1<<25)    /* Client has changed keys to notify */
+#define PREZ_WATCH_MODE (1<<26)      /* Client is in watch mode */
+#define PREZ_IO_SUBMIT (1<<27)  /* Reads and writes submitted to the event
+                                   loop, see clientSubmitRead(). */
 
 /* Client request types */
 #define PREZ_REQ_INLINE 1
 #define PREZ_REQ_MULTIBULK 2
+#define PREZ_REQ_BINARY 3
 
 /* Log levels */
 #define PREZ_DEBUG 0
@@ -138,6 +151,24 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PREZ_DEFAULT_DAEMONIZE 0
 #define PREZ_DEFAULT_UNIX_SOCKET_PERM 0
 #define PREZ_DEFAULT_TCP_KEEPALIVE 0
+#define PREZ_DEFAULT_IO_THREADS 1
+#define PREZ_DEFAULT_SHM_RING_SIZE 0 /* Shared memory transport disabled */
+#define PREZ_DEFAULT_BINARY_PORT 0   /* Binary protocol disabled */
+#define PREZ_DEFAULT_ACTIVE_REHASHING 1
+#define PREZ_DEFAULT_ACTIVE_REHASHING_BUDGET 1000 /* Microseconds per cron */
+#define PREZ_DEFAULT_WATCH_HISTORY_LEN 10000 /* Changes kept for every group */
+#define PREZ_DEFAULT_KEY_MAX_VERSIONS 4 /* Values kept for every key */
+#define PREZ_EXPIRE_CYCLE_KEYS 1000  /* Expired keys logged per cron cycle */
+#define PREZ_COMPACT_CYCLE_SCANS 1000 /* Keyspace scan steps per cron cycle */
+#define PREZ_DELETED_KEYS_MAX 10000  /* Tombstones kept per DB */
+#define PREZ_IDALLOC_BLOCK_SIZE 10000 /* IDs reserved by IDALLOC */
+#define PREZ_HT_MINFILL 10           /* Minimal hash table fill 10% */
+#define PREZ_BINARY_HDR_LEN 12       /* Frame length and request ID */
+#define PREZ_BINARY_PUSH_ID UINT64_MAX /* ID of frames not replying to a
+                                          request, like notifications */
+#define PREZ_BINARY_MAX_ARGS (1024*1024)
+#define PREZ_SHM_RING_SIZE_MIN 4096
+#define PREZ_IO_THREADS_MAX 128
 #define PREZ_DEFAULT_LOGFILE ""
 #define PREZ_DEFAULT_SYSLOG_ENABLED 0
 #define PREZ_DEFAULT_MAXMEMORY 0
@@ -156,14 +187,23 @@ typedef long long mstime_t; /* millisecond time type. */
 #define PREZ_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PREZ_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PREZ_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define PREZ_REPLY_BUFFER_MIN  1024 /* Smallest pooled output buffer */
+#define PREZ_REPLY_BUFFER_POOL 64 /* Free output buffers kept per size */
 #define PREZ_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PREZ_MBULK_BIG_ARG     (1024*32)
+#define PREZ_IOV_MAX           64 /* Max iovecs of a single reply writev */
+#define PREZ_ARENA_SIZE        1024 /* Per client arena for small arguments */
+#define PREZ_ARENA_ARG_MAX     64 /* Max length of an argument in the arena */
 
 /* When configuring the prez eventloop, we setup it so that the total number
  * of file descriptors we can handle are server.maxclients + RESERVED_FDS + FDSET_INCR
  * that is our safety margin. */
 #define PREZ_EVENTLOOP_FDSET_INCR (PREZ_MIN_RESERVED_FDS+96)
 
+/* Units */
+#define UNIT_SECONDS 0
+#define UNIT_MILLISECONDS 1
+
 /* Command flags. Please check the command table defined in the prez.c file
  * for more information about the meaning of every flag. */
 #define PREZ_CMD_WRITE 1                   /* "w" flag */
@@ -227,6 +267,14 @@ typedef struct prezObject {
     void *ptr;
 } robj;
 
+/* Refcount of the objects allocated in a client arena, that can't be
+ * retained with incrRefCount(). */
+#define PREZ_ARENA_REFCOUNT INT_MAX
+
+/* Size of an embedded string object of 'len' bytes. */
+#define embeddedStringObjectSize(len) \
+    (sizeof(robj)+sizeof(struct sdshdr)+(len)+1)
+
 /* Macro used to obtain the current LRU clock.
  * If the current resolution is lower than the frequency we refresh the
  * LRU clock (as it should be in production servers) we return the
@@ -277,26 +325,121 @@ typedef struct prezClient {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size */
     int argc;
     robj **argv;
+    struct shmTransport *shm; /* Shared memory transport of the client. */
+    struct shmTransport *shm_attached; /* Transport attached by SHMATTACH. */
+    char *arena;            /* Bump allocator for argv and small arguments,
+                               reset once the command is executed. */
+    size_t arena_used;
+    struct respArg *parsed; /* Commands parsed by an I/O thread, see
+                               parseClientQuery(). */
+    size_t parsed_len, parsed_size;
     struct prezCommand *cmd, *lastcmd;
     int reqtype;
+    uint64_t reqid;         /* Request ID of a binary protocol command. */
     int multibulklen;       /* number of multi bulk arguments left to read */
     long bulklen;           /* length of bulk argument in multi bulk request */
     list *reply;
     unsigned long reply_bytes; /* Tot bytes of objects in reply list */
+    unsigned long reply_sent; /* Objects of the reply list already written,
+                                 see consumeClientReplies(). */
     int sentlen;            /* Amount of bytes already sent in the current
                                buffer or object being sent. */
+    long long io_read;      /* aeSubmitRead() in flight, -1 if none. */
+    long long io_write;     /* aeSubmitWritev() in flight, -1 if none. */
     time_t ctime;           /* Client creation time */
     time_t lastinteraction; /* time of the last interaction, used for timeout */
     time_t obuf_soft_limit_reached_time;
     int flags;              
     int authenticated;      /* when requirepass is non-NULL */
     sds peerid;             /* Cached peer ID. */
-
-    /* Response buffer */
+    list *requests;         /* Requests waiting to be replied, in order. */
+    dict *watched_keys;     /* Keys watched by WATCH, or NULL. */
+    dict *watched_prefixes; /* Prefixes watched by PWATCH, or NULL. */
+    dict *watch_events;     /* Changed keys to notify, or NULL. */
+    listNode *watch_notify_node; /* Node in server.watch_notify, or NULL. */
+    struct clientRequest *request; /* Request being executed, or NULL. */
+
+    /* Response buffer, taken from a pool on the first reply and given back
+     * once written, see clientGrowReplyBuffer(). */
     int bufpos;
-    char buf[PREZ_REPLY_CHUNK_BYTES];
+    size_t buf_usable_size; /* Size of buf, zero if there is none. */
+    char *buf;
 } prezClient;
 
+/* A request of a client that can't be replied yet, because it is a write
+ * waiting to be committed, or because it follows one. Requests are replied
+ * in the order they were received: a request executed before the ones
+ * preceding it gets its reply captured, and sent once its turn comes. */
+typedef struct clientRequest {
+    prezClient *client;
+    robj **argv;
+    int argc;
+    struct prezCommand *cmd;
+    uint64_t reqid;         /* Binary protocol request ID. */
+    int group;              /* Raft group of the logged write. */
+    long long index;        /* Log index of the write, or -1 if not logged. */
+    long long term;         /* Term the write was logged with. */
+    int done;               /* Executed, the reply is in 'reply'. */
+    struct lockWaiter *waiter; /* Blocked waiting for a lock, or NULL. */
+    list *reply;            /* Captured reply objects. */
+    unsigned long reply_bytes;
+} clientRequest;
+
+/* The values of the keyspace. The current version of a key is the first of
+ * the list of its versions, from the newest, see dbOverwrite(). */
+typedef struct keyVersion {
+    robj *val;                  /* NULL for a tombstone, see dbDelete(). */
+    long long create_index;     /* Log index of the entry creating the key. */
+    long long mod_index;        /* Log index of the entry setting 'val'. */
+    struct keyVersion *prev;    /* The value replaced, or NULL. */
+    long long lease;            /* Lease the key is attached to, or 0. */
+    long long expire;           /* Unix time in ms the key expires at, or 0. */
+} keyVersion;
+
+/* A lease of a Raft group, see lease.c. The keys attached to it are
+ * deleted when it is revoked. */
+#define PREZ_LEASE_GROUP_SHIFT 48   /* Lease ids carry their group */
+#define leaseIdGroup(id) ((unsigned long long)(id) >> PREZ_LEASE_GROUP_SHIFT)
+
+typedef struct lease {
+    long long id;           /* Group, and log index of the entry granting
+                               the lease, see leasegrantCommand(). */
+    long long ttl;          /* Milliseconds. */
+    mstime_t expire;        /* Monotonic time the leader revokes it at. */
+    int revoking;           /* The leader logged its revoke. */
+    dict *keys;             /* Keys attached to the lease. */
+    dict *locks;            /* Locks held or waited for, see lock.c. */
+} lease;
+
+/* A lock of a Raft group, held by a lease, see lock.c. */
+typedef struct lock {
+    sds name;
+    long long owner;        /* Lease holding the lock. */
+    long long token;        /* Log index of the entry granting it. */
+    list *waiters;          /* Waiting leases, in FIFO order. */
+} lock;
+
+/* A lease waiting for a lock. */
+typedef struct lockWaiter {
+    long long owner;        /* Lease waiting for the lock. */
+    long long token;        /* Token of the grant, 0 if the wait ended. */
+    struct clientRequest *request; /* Blocked LOCK of a client of ours. */
+} lockWaiter;
+
+/* IDs reserved by the leader of a Raft group, see idalloc.c. */
+typedef struct idBlock {
+    long long next;         /* Next ID to hand out. */
+    long long last;         /* Last ID of the block. */
+    long long index;        /* Log index of the entry reserving it. */
+} idBlock;
+
+/* A change of a key, kept in the watch history of the Raft group of the
+ * key, see watch.c. */
+typedef struct watchEvent {
+    long long index;        /* Log index of the entry that changed the key. */
+    sds key;
+} watchEvent;
+
 struct sharedObjectsStruct {
     robj *crlf, *ok, *err, *emptybulk, *czero, *cone, *cnegone, *pong, *space,
     *colon, *nullbulk, *nullmultibulk, *queued,
@@ -318,7 +461,12 @@ extern clientBufferLimitsConfig clientBufferLimitsDefaults[PREZ_CLIENT_TYPE_COUN
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct prezDb {
-    dict *dict;                 /* The keyspace for this DB */
+    oadict *dict;               /* The keyspace for this DB */
+    radix *index;               /* The keys of the DB in order */
+    dict *tree;                 /* Path -> names of the node children */
+    radix *expires;             /* Keys with a TTL by group and deadline */
+    dict *deleted;              /* Deleted key -> its tombstone */
+    radix *deleted_index;       /* Tombstones by group and index */
     int id;                     /* Database ID */
 } prezDb;
 
@@ -345,14 +493,21 @@ struct prezServer {
     int bindaddr_count;         /* Number of addresses in server.bindaddr[] */
     char *unixsocket;           /* UNIX socket path */
     mode_t unixsocketperm;      /* UNIX socket permission */
+    size_t shm_ring_size;       /* SHMATTACH rings size, 0 if disabled */
     int ipfd[PREZ_BINDADDR_MAX]; /* TCP socket file descriptors */
     int ipfd_count;             /* Used slots in ipfd[] */
     int sofd;                   /* Unix socket file descriptor */
+    int binary_port;            /* Binary protocol listening port */
+    int bfd[PREZ_BINDADDR_MAX]; /* Binary protocol socket file descriptors */
+    int bfd_count;              /* Used slots in bfd[] */
     int cport;                  /* Cluster listening port */
     int cfd[PREZ_BINDADDR_MAX]; /* Cluster bus listening socket */
     int cfd_count;              /* Used slots in cfd[] */
     list *clients;              /* List of active clients */
     list *clients_to_close;     /* Clients to close asynchronously */
+    list *clients_pending_read; /* Clients to read with the I/O threads */
+    list *clients_pending_write;/* Clients to write before sleeping */
+    int io_threads_num;         /* Number of I/O threads, main included */
     prezClient *current_client; /* Current client, only used on crash report */
     char neterr[ANET_ERR_LEN];   /* Error buffer for anet.c */
     dict *migrate_cached_sockets;/* MIGRATE cached sockets */
@@ -364,10 +519,24 @@ struct prezServer {
     long long stat_rejected_conn;   /* Clients rejected because of maxclients */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
     long long stat_keyspace_misses; /* Number of failed lookups of keys */
+    long long stat_active_rehash_steps; /* Groups moved by the cron rehash */
+    long long stat_active_rehash_time;  /* Microseconds of cron rehash */
+    long long stat_keyspace_resizes;    /* Keyspace tables shrunk by the cron */
+    long long stat_watch_notifications; /* Messages sent to watching clients */
+    long long stat_expired_leases;  /* Leases revoked by the leader */
+    long long stat_lock_handoffs;   /* Locks granted to a waiter */
+    long long stat_idalloc_from_block; /* IDALLOC served without logging */
+    long long stat_expiredkeys;     /* Number of expired keys deleted */
+    long long stat_lease_keepalives_forwarded; /* Keep-alives sent to leaders */
     /* Configuration */
     int verbosity;                  /* Loglevel in prez.conf */
     int maxidletime;                /* Client timeout in seconds */
     int tcpkeepalive;               /* Set SO_KEEPALIVE if non-zero. */
+    int activerehashing;            /* Incremental rehash in serverCron() */
+    long long activerehashing_budget; /* Microseconds of rehash per cron */
+    long watch_history_len;         /* Changes kept to resume watches */
+    long key_max_versions;          /* Values kept for every key, current
+                                       one included */
     size_t client_max_querybuf_len; /* Limit for client query buffer length */
     int dbnum;                      /* Total number of configured DBs */
     int daemonize;                  /* True if running as a daemon */
@@ -389,7 +558,14 @@ struct prezServer {
      /* Cluster */
     mstime_t cluster_node_timeout; /* Cluster node timeout. */
     char *cluster_configfile; /* Cluster auto-generated config file name. */
-    struct clusterState *cluster;  /* State of the cluster */
+    struct clusterState *cluster;  /* State of the selected Raft group */
+    struct clusterState **groups;  /* State of every Raft group */
+    int cluster_groups;            /* Number of Raft groups */
+    /* Watches */
+    dict *watched_keys;         /* Key -> list of the clients watching it */
+    radix *watched_prefixes;    /* Prefix -> list of the clients watching it */
+    list *watch_notify;         /* Clients with changed keys to notify */
+    list *lock_wakeups;         /* Lock waiters to reply to, see lock.c */
 
      /* Assert & bug reporting */
     char *assert_failed;
@@ -425,6 +601,12 @@ extern struct prezServer server;
 extern struct sharedObjectsStruct shared;
 extern dictType clusterNodesDictType;
 extern dictType clusterProcClientsDictType;
+extern dictType treeDictType;
+extern dictType sdsSetDictType;
+extern dictType deletedDictType;
+extern dictType keylistDictType;
+extern dictType leasesDictType;
+extern dictType idBlocksDictType;
 
 /*-----------------------------------------------------------------------------
  * Functions prototypes
@@ -433,8 +615,10 @@ extern dictType clusterProcClientsDictType;
 /* Utils */
 long long ustime(void);
 long long mstime(void);
+long long monotonicMstime(void);
 void getRandomHexChars(char *p, unsigned int len);
 uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+uint16_t crc16(const char *buf, int len);
 void exitFromChild(int retcode);
 
 void loadServerConfig(char *filename, char *options);
@@ -450,10 +634,22 @@ void addReply(prezClient *c, robj *obj);
 void *addDeferredMultiBulkLength(prezClient *c);
 void setDeferredMultiBulkLength(prezClient *c, void *node, long length);
 void addReplySds(prezClient *c, sds s);
+void addReplyPush(prezClient *c, sds s);
 void processInputBuffer(prezClient *c);
 void acceptTcpHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void acceptBinaryHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 void readQueryFromClient(aeEventLoop *el, int fd, void *privdata, int mask);
+int clientHasPendingReplies(prezClient *c);
+clientRequest *clientQueueRequest(prezClient *c);
+void clientSwapReply(prezClient *c, clientRequest *r);
+void clientUnblockRequest(clientRequest *r, sds reply);
+void clientRequestCommitted(clientRequest *r, int ok);
+void clientRequestProcessed(clientRequest *r, int read);
+void clientInstallWriteHandler(prezClient *c);
+void initThreadedIO(void);
+int handleClientsWithPendingReads(void);
+int handleClientsWithPendingWrites(void);
 void addReplyBulk(prezClient *c, robj *obj);
 void addReplyBulkCString(prezClient *c, char *s);
 void addReplyBulkCBuffer(prezClient *c, void *p, size_t len);
@@ -493,6 +689,7 @@ int processEventsWhileBlocked(void);
 void decrRefCount(robj *o);
 void decrRefCountVoid(void *o);
 void incrRefCount(robj *o);
+robj *retainObject(robj *o);
 robj *resetRefCount(robj *obj);
 void freeStringObject(robj *o);
 void freeListObject(robj *o);
@@ -501,6 +698,8 @@ void freeZsetObject(robj *o);
 void freeHashObject(robj *o);
 robj *createObject(int type, void *ptr);
 robj *createStringObject(char *ptr, size_t len);
+robj *initEmbeddedStringObject(void *mem, char *ptr, size_t len,
+                               int refcount);
 robj *createRawStringObject(char *ptr, size_t len);
 robj *createEmbeddedStringObject(char *ptr, size_t len);
 robj *dupStringObject(robj *o);
@@ -558,15 +757,28 @@ void resetServerStats(void);
 void adjustOpenFilesLimit(void);
 
 /* Command Prototypes */
+void setGenericCommand(prezClient *c, robj *key, robj *val);
+int getGenericCommand(prezClient *c, robj *key);
 void getCommand(prezClient *c, robj **argv, int argc);
 void setCommand(prezClient *c, robj **argv, int argc);
+void msetCommand(prezClient *c, robj **argv, int argc);
+void mgetCommand(prezClient *c, robj **argv, int argc);
+void delCommand(prezClient *c, robj **argv, int argc);
+int incrKey(prezClient *c, robj *key, long long incr, long long *value);
+void incrCommand(prezClient *c, robj **argv, int argc);
+void decrCommand(prezClient *c, robj **argv, int argc);
+void incrbyCommand(prezClient *c, robj **argv, int argc);
+void decrbyCommand(prezClient *c, robj **argv, int argc);
 void configCommand(prezClient *c, robj **argv, int argc);
+void shmattachCommand(prezClient *c, robj **argv, int argc);
+void infoCommand(prezClient *c, robj **argv, int argc);
 
 /* Cluster */
 void initClusterConfig(void);
 void clusterInit(void);
 void clusterCron(void);
-void clusterProcessCommand(prezClient *c);
+clientRequest *clusterProcessCommand(prezClient *c, clientRequest *r);
+void clusterBeforeSleep(void);
 
 /* Debugging stuff */
 void _prezAssertWithInfo(prezClient *c, robj *o, char *estr, char *file, int line);
@@ -584,10 +796,79 @@ robj *lookupKeyRead(prezDb *db, robj *key);
 robj *lookupKeyWrite(prezDb *db, robj *key);
 robj *lookupKeyReadOrReply(prezClient *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(prezClient *c, robj *key, robj *reply);
+keyVersion *lookupKeyVersion(prezDb *db, robj *key);
+void freeKeyVersions(keyVersion *v);
 void dbAdd(prezDb *db, robj *key, robj *val);
 void dbOverwrite(prezDb *db, robj *key, robj *val);
 void setKey(prezDb *db, robj *key, robj *val);
 int dbExists(prezDb *db, robj *key);
 int dbDelete(prezDb *db, robj *key);
+int *getKeysFromCommand(struct prezCommand *cmd, robj **argv, int argc, int *numkeys);
+void getKeysFreeResult(int *result);
+int *compactGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys);
+void treeAddNode(prezDb *db, sds path);
+void treeDelNode(prezDb *db, sds path);
+int removeExpire(prezDb *db, robj *key);
+void setExpire(prezDb *db, robj *key, long long when);
+long long getExpire(prezDb *db, robj *key);
+void rewriteExpireCommand(prezClient *c);
+void activeExpireCycle(void);
+void compactCycle(void);
+
+/* Commands prototypes, db.c */
+void rangeCommand(prezClient *c, robj **argv, int argc);
+void prefixCommand(prezClient *c, robj **argv, int argc);
+void getchildrenCommand(prezClient *c, robj **argv, int argc);
+void createseqCommand(prezClient *c, robj **argv, int argc);
+void lowestchildCommand(prezClient *c, robj **argv, int argc);
+void getrevCommand(prezClient *c, robj **argv, int argc);
+void getatCommand(prezClient *c, robj **argv, int argc);
+void compactCommand(prezClient *c, robj **argv, int argc);
+void expireCommand(prezClient *c, robj **argv, int argc);
+void expireatCommand(prezClient *c, robj **argv, int argc);
+void pexpireCommand(prezClient *c, robj **argv, int argc);
+void pexpireatCommand(prezClient *c, robj **argv, int argc);
+void ttlCommand(prezClient *c, robj **argv, int argc);
+void pttlCommand(prezClient *c, robj **argv, int argc);
+void persistCommand(prezClient *c, robj **argv, int argc);
+void expiredCommand(prezClient *c, robj **argv, int argc);
+
+/* watch.c -- Watching keys for changes */
+void touchWatchedKey(sds key);
+void unwatchAllKeys(prezClient *c);
+void watchNotifyClients(long long index);
+int watchModeCommand(struct prezCommand *cmd);
+void watchCommand(prezClient *c, robj **argv, int argc);
+void pwatchCommand(prezClient *c, robj **argv, int argc);
+void unwatchCommand(prezClient *c, robj **argv, int argc);
+void punwatchCommand(prezClient *c, robj **argv, int argc);
+
+/* lease.c -- Leases */
+lease *leaseLookup(long long id);
+lease *leaseLookupOrReply(prezClient *c, long long id);
+void leaseAttachKey(lease *l, robj *key);
+void leaseDetachKey(sds key, keyVersion *v);
+void leaseRenew(long long id);
+void leaseResetExpires(void);
+void leaseExpireCron(void);
+int *leaseGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys);
+void leasegrantCommand(prezClient *c, robj **argv, int argc);
+void leaserevokeCommand(prezClient *c, robj **argv, int argc);
+void leasekeepaliveCommand(prezClient *c, robj **argv, int argc);
+
+/* lock.c -- Locks */
+void lockReleaseLease(lease *l);
+void lockWakeWaiters(void);
+void lockCommand(prezClient *c, robj **argv, int argc);
+void unlockCommand(prezClient *c, robj **argv, int argc);
+void lockownerCommand(prezClient *c, robj **argv, int argc);
+
+/* idalloc.c -- ID allocation */
+int idallocFromBlock(prezClient *c);
+void idallocCommand(prezClient *c, robj **argv, int argc);
+
+/* txn.c -- Conditional transactions */
+int *txnGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys);
+void txnCommand(prezClient *c, robj **argv, int argc);
 
 #endif
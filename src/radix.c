@@ -0,0 +1,444 @@
+/* Compressed radix tree.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The hash table of the keyspace can't answer "all the keys starting with
+ * /services/foo/" without visiting every key. The tree keeps the keys in
+ * order: a range of keys is found descending a single path, and walking the
+ * keys of the range in order costs the nodes visited, that is about the
+ * number of keys returned, since the nodes that are not keys branch.
+ *
+ * Nodes are resized copying them, so every function changing a node takes
+ * the pointer to the link from the parent (or to the head) and updates it. */
+
+#include "fmacros.h"
+
+#include <string.h>
+
+#include "radix.h"
+#include "zmalloc.h"
+
+#define RADIX_STACK_STATIC_ITEMS 32
+
+/* Offset of the array of children pointers from the start of the node. */
+static size_t radixChildrenOffset(size_t edgelen, size_t numchildren) {
+    size_t off = sizeof(radixNode)+edgelen+numchildren;
+    return (off+sizeof(void*)-1) & ~(sizeof(void*)-1);
+}
+
+#define radixNodeSize(edgelen,numchildren) \
+    (radixChildrenOffset(edgelen,numchildren)+sizeof(void*)*(numchildren))
+#define radixFirstBytes(n) ((n)->data+(n)->edgelen)
+#define radixChildren(n) \
+    ((radixNode**)((char*)(n)+radixChildrenOffset((n)->edgelen,(n)->numchildren)))
+
+/* Allocate a node with the specified edge and room for 'numchildren'
+ * children, that the caller must fill. */
+static radixNode *radixNewNode(unsigned char *edge, size_t edgelen,
+                               size_t numchildren)
+{
+    radixNode *n = zmalloc(radixNodeSize(edgelen,numchildren));
+
+    n->iskey = 0;
+    n->edgelen = edgelen;
+    n->numchildren = numchildren;
+    n->value = NULL;
+    if (edgelen) memcpy(n->data,edge,edgelen);
+    return n;
+}
+
+/* Return the index of the child whose edge starts with 'c', or the
+ * index where it should be inserted if there is no such child. */
+static int radixChildIndex(radixNode *n, unsigned char c, int *found) {
+    unsigned char *fb = radixFirstBytes(n);
+    int lo = 0, hi = n->numchildren;
+
+    while (lo < hi) {
+        int mid = (lo+hi)/2;
+
+        if (fb[mid] < c) lo = mid+1;
+        else hi = mid;
+    }
+    if (found) *found = lo < (int)n->numchildren && fb[lo] == c;
+    return lo;
+}
+
+/* Return a copy of 'n' with a different edge, freeing 'n'. The edge may
+ * point inside 'n' itself. */
+static radixNode *radixSetEdge(radixNode *n, unsigned char *edge,
+                               size_t edgelen)
+{
+    radixNode *nn = radixNewNode(edge,edgelen,n->numchildren);
+
+    nn->iskey = n->iskey;
+    nn->value = n->value;
+    memcpy(radixFirstBytes(nn),radixFirstBytes(n),n->numchildren);
+    memcpy(radixChildren(nn),radixChildren(n),sizeof(void*)*n->numchildren);
+    zfree(n);
+    return nn;
+}
+
+/* Return a copy of 'n' with 'child' added in order, freeing 'n'. */
+static radixNode *radixAddChild(radixNode *n, radixNode *child) {
+    int idx = radixChildIndex(n,child->data[0],NULL);
+    radixNode *nn = radixNewNode(n->data,n->edgelen,n->numchildren+1);
+    unsigned char *fb = radixFirstBytes(n), *nfb = radixFirstBytes(nn);
+    radixNode **cp = radixChildren(n), **ncp = radixChildren(nn);
+
+    nn->iskey = n->iskey;
+    nn->value = n->value;
+    memcpy(nfb,fb,idx);
+    memcpy(ncp,cp,sizeof(void*)*idx);
+    nfb[idx] = child->data[0];
+    ncp[idx] = child;
+    memcpy(nfb+idx+1,fb+idx,n->numchildren-idx);
+    memcpy(ncp+idx+1,cp+idx,sizeof(void*)*(n->numchildren-idx));
+    zfree(n);
+    return nn;
+}
+
+/* Return a copy of 'n' without the child at 'idx', freeing 'n'. */
+static radixNode *radixRemoveChild(radixNode *n, int idx) {
+    radixNode *nn = radixNewNode(n->data,n->edgelen,n->numchildren-1);
+    unsigned char *fb = radixFirstBytes(n), *nfb = radixFirstBytes(nn);
+    radixNode **cp = radixChildren(n), **ncp = radixChildren(nn);
+
+    nn->iskey = n->iskey;
+    nn->value = n->value;
+    memcpy(nfb,fb,idx);
+    memcpy(ncp,cp,sizeof(void*)*idx);
+    memcpy(nfb+idx,fb+idx+1,n->numchildren-idx-1);
+    memcpy(ncp+idx,cp+idx+1,sizeof(void*)*(n->numchildren-idx-1));
+    zfree(n);
+    return nn;
+}
+
+/* Merge 'n', that is not a key and has a single child, with the child. */
+static radixNode *radixMerge(radix *rt, radixNode *n) {
+    radixNode *child = radixChildren(n)[0];
+    radixNode *nn = radixNewNode(n->data,n->edgelen+child->edgelen,
+                                 child->numchildren);
+
+    memcpy(nn->data+n->edgelen,child->data,child->edgelen);
+    nn->iskey = child->iskey;
+    nn->value = child->value;
+    memcpy(radixFirstBytes(nn),radixFirstBytes(child),child->numchildren);
+    memcpy(radixChildren(nn),radixChildren(child),
+           sizeof(void*)*child->numchildren);
+    zfree(child);
+    zfree(n);
+    rt->numnodes--;
+    return nn;
+}
+
+radix *radixNew(void) {
+    radix *rt = zmalloc(sizeof(*rt));
+
+    rt->head = radixNewNode(NULL,0,0);
+    rt->numele = 0;
+    rt->numnodes = 1;
+    return rt;
+}
+
+static void radixFreeNode(radixNode *n) {
+    radixNode **cp = radixChildren(n);
+    uint32_t j;
+
+    for (j = 0; j < n->numchildren; j++) radixFreeNode(cp[j]);
+    zfree(n);
+}
+
+void radixFree(radix *rt) {
+    radixFreeNode(rt->head);
+    zfree(rt);
+}
+
+/* Add the key, or update its value if it already exists. Return 1 if the
+ * key was added, 0 if updated. */
+int radixInsert(radix *rt, unsigned char *s, size_t len, void *value) {
+    radixNode **link = &rt->head, *n = rt->head;
+    size_t i = 0;
+
+    while (i < len) {
+        radixNode **clink, *child, *mid;
+        size_t j = 0;
+        int idx, found;
+
+        idx = radixChildIndex(n,s[i],&found);
+        if (!found) {
+            radixNode *leaf = radixNewNode(s+i,len-i,0);
+
+            leaf->iskey = 1;
+            leaf->value = value;
+            *link = radixAddChild(n,leaf);
+            rt->numnodes++;
+            rt->numele++;
+            return 1;
+        }
+        clink = &radixChildren(n)[idx];
+        child = *clink;
+        while (j < child->edgelen && i+j < len && child->data[j] == s[i+j])
+            j++;
+        if (j < child->edgelen) {
+            /* Split the edge: the common prefix becomes a new node, with
+             * the rest of the old edge as its single child. */
+            mid = radixNewNode(child->data,j,1);
+            child = radixSetEdge(child,child->data+j,child->edgelen-j);
+            radixFirstBytes(mid)[0] = child->data[0];
+            radixChildren(mid)[0] = child;
+            *clink = child = mid;
+            rt->numnodes++;
+        }
+        link = clink;
+        n = child;
+        i += j;
+    }
+    if (n->iskey) {
+        n->value = value;
+        return 0;
+    }
+    n->iskey = 1;
+    n->value = value;
+    rt->numele++;
+    return 1;
+}
+
+/* Remove the key. Return 1 if the key was removed, 0 if not found. */
+int radixRemove(radix *rt, unsigned char *s, size_t len) {
+    radixNode **static_stack[RADIX_STACK_STATIC_ITEMS];
+    radixNode ***stack = static_stack;
+    radixNode **link = &rt->head, *n = rt->head;
+    size_t i = 0, depth = 0, maxdepth = RADIX_STACK_STATIC_ITEMS;
+    int idx, found, retval = 0;
+
+    /* Find the node remembering the links of its ancestors. */
+    while (i < len) {
+        radixNode *child;
+
+        idx = radixChildIndex(n,s[i],&found);
+        if (!found) goto cleanup;
+        child = radixChildren(n)[idx];
+        if (child->edgelen > len-i ||
+            memcmp(child->data,s+i,child->edgelen) != 0) goto cleanup;
+        if (depth == maxdepth) {
+            maxdepth *= 2;
+            if (stack == static_stack) {
+                stack = zmalloc(sizeof(*stack)*maxdepth);
+                memcpy(stack,static_stack,sizeof(static_stack));
+            } else {
+                stack = zrealloc(stack,sizeof(*stack)*maxdepth);
+            }
+        }
+        stack[depth++] = link;
+        link = &radixChildren(n)[idx];
+        n = child;
+        i += child->edgelen;
+    }
+    if (!n->iskey) goto cleanup;
+
+    n->iskey = 0;
+    n->value = NULL;
+    rt->numele--;
+    retval = 1;
+    if (n == rt->head) goto cleanup;
+
+    /* A leaf is removed from its parent, that may be left with a single
+     * child. Either way the node to compress is the last one on the path. */
+    if (n->numchildren == 0) {
+        radixNode *parent;
+
+        link = stack[--depth];
+        parent = *link;
+        idx = radixChildIndex(parent,n->data[0],NULL);
+        zfree(n);
+        rt->numnodes--;
+        *link = n = radixRemoveChild(parent,idx);
+    }
+    if (n != rt->head && !n->iskey && n->numchildren == 1)
+        *link = radixMerge(rt,n);
+
+cleanup:
+    if (stack != static_stack) zfree(stack);
+    return retval;
+}
+
+/* Return 1 and set '*value' if the key exists, otherwise return 0. */
+int radixFind(radix *rt, unsigned char *s, size_t len, void **value) {
+    radixNode *n = rt->head;
+    size_t i = 0;
+
+    while (i < len) {
+        radixNode *child;
+        int idx, found;
+
+        idx = radixChildIndex(n,s[i],&found);
+        if (!found) return 0;
+        child = radixChildren(n)[idx];
+        if (child->edgelen > len-i ||
+            memcmp(child->data,s+i,child->edgelen) != 0) return 0;
+        n = child;
+        i += child->edgelen;
+    }
+    if (!n->iskey) return 0;
+    if (value) *value = n->value;
+    return 1;
+}
+
+/* ------------------------------- Iteration ---------------------------------*/
+
+typedef struct radixWalker {
+    unsigned char *start, *end;
+    size_t startlen, endlen;
+    radixWalkFunction *fn;
+    void *privdata;
+    unsigned char *key;     /* Key of the current node. */
+    size_t len, size;
+    int stop;
+} radixWalker;
+
+static int radixCompare(unsigned char *a, size_t alen, unsigned char *b,
+                        size_t blen)
+{
+    int cmp = memcmp(a,b,alen < blen ? alen : blen);
+
+    if (cmp) return cmp;
+    return alen < blen ? -1 : (alen > blen);
+}
+
+/* Visit 'n', whose key is w->key, and its children in order. 'onstart' is
+ * true when the key is a prefix of the start of the range, so that the
+ * children before the start must be skipped. */
+static void radixWalkNode(radixWalker *w, radixNode *n, int onstart) {
+    radixNode **cp = radixChildren(n);
+    uint32_t j = 0;
+
+    /* Keys are visited in order, and the keys of the children are greater
+     * than the key of the node: once past the end there is nothing left. */
+    if (w->end && radixCompare(w->key,w->len,w->end,w->endlen) >= 0) {
+        w->stop = 1;
+        return;
+    }
+    if (onstart && w->len < w->startlen) {
+        j = radixChildIndex(n,w->start[w->len],NULL);
+    } else {
+        onstart = 0;
+        if (n->iskey && !w->fn(w->privdata,w->key,w->len,n->value)) {
+            w->stop = 1;
+            return;
+        }
+    }
+
+    for (; j < n->numchildren && !w->stop; j++) {
+        radixNode *child = cp[j];
+        int childonstart = 0;
+
+        if (onstart) {
+            size_t left = w->startlen-w->len;
+            size_t cmplen = child->edgelen < left ? child->edgelen : left;
+            int cmp = memcmp(child->data,w->start+w->len,cmplen);
+
+            if (cmp < 0) continue;
+            childonstart = (cmp == 0 && child->edgelen <= left);
+            onstart = 0;
+        }
+        if (w->len+child->edgelen > w->size) {
+            w->size = (w->len+child->edgelen)*2;
+            w->key = zrealloc(w->key,w->size);
+        }
+        memcpy(w->key+w->len,child->data,child->edgelen);
+        w->len += child->edgelen;
+        radixWalkNode(w,child,childonstart);
+        w->len -= child->edgelen;
+    }
+}
+
+/* Call 'fn' for the keys 'k' with start <= k < end, in order. A NULL
+ * 'end' means no upper bound. */
+void radixWalk(radix *rt, unsigned char *start, size_t startlen,
+               unsigned char *end, size_t endlen,
+               radixWalkFunction *fn, void *privdata)
+{
+    radixWalker w;
+
+    w.start = start;
+    w.startlen = start ? startlen : 0;
+    w.end = end;
+    w.endlen = endlen;
+    w.fn = fn;
+    w.privdata = privdata;
+    w.size = 64;
+    w.key = zmalloc(w.size);
+    w.len = 0;
+    w.stop = 0;
+    radixWalkNode(&w,rt->head,1);
+    zfree(w.key);
+}
+
+/* Call 'fn' for the keys starting with 'prefix', in order. The keys with
+ * the prefix are the range [prefix, next), where 'next' is the prefix with
+ * its last byte that is not 0xff incremented, and the following removed. */
+void radixWalkPrefix(radix *rt, unsigned char *prefix, size_t len,
+                     radixWalkFunction *fn, void *privdata)
+{
+    unsigned char *next = NULL;
+    size_t nextlen = len;
+
+    while (nextlen && prefix[nextlen-1] == 0xff) nextlen--;
+    if (nextlen) {
+        next = zmalloc(nextlen);
+        memcpy(next,prefix,nextlen);
+        next[nextlen-1]++;
+    }
+    radixWalk(rt,prefix,len,next,nextlen,fn,privdata);
+    zfree(next);
+}
+
+/* Call 'fn' for the keys that are a prefix of 's', 's' itself included,
+ * from the shortest. They are all on the path of 's'. */
+void radixWalkPrefixesOf(radix *rt, unsigned char *s, size_t len,
+                         radixWalkFunction *fn, void *privdata)
+{
+    radixNode *n = rt->head;
+    size_t i = 0;
+
+    while (1) {
+        radixNode *child;
+        int idx, found;
+
+        if (n->iskey && !fn(privdata,s,i,n->value)) return;
+        if (i == len) return;
+        idx = radixChildIndex(n,s[i],&found);
+        if (!found) return;
+        child = radixChildren(n)[idx];
+        if (child->edgelen > len-i ||
+            memcmp(child->data,s+i,child->edgelen) != 0) return;
+        n = child;
+        i += child->edgelen;
+    }
+}
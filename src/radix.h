@@ -0,0 +1,81 @@
+/* Compressed radix tree.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RADIX_H
+#define __RADIX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Every node but the head is reached through an edge labeled with one or
+ * more bytes: the key of a node is the concatenation of the edges from the
+ * head. Nodes that are not keys have at least two children, so that chains
+ * of single children are always compressed into a single edge.
+ *
+ * The data of a node holds, in order:
+ *
+ *   - The 'edgelen' bytes of the edge leading to the node.
+ *   - The first byte of the edge of every child, sorted.
+ *   - Padding to align the pointers.
+ *   - The pointers to the children, in the same order. */
+typedef struct radixNode {
+    uint32_t iskey:1;       /* The key of the node is in the tree. */
+    uint32_t edgelen:31;
+    uint32_t numchildren;
+    void *value;
+    unsigned char data[];
+} radixNode;
+
+typedef struct radix {
+    radixNode *head;
+    uint64_t numele;
+    uint64_t numnodes;
+} radix;
+
+/* Called for every key walked, in order. Returning 0 stops the walk. */
+typedef int (radixWalkFunction)(void *privdata, unsigned char *key,
+                                size_t len, void *value);
+
+#define radixSize(rt) ((rt)->numele)
+
+radix *radixNew(void);
+void radixFree(radix *rt);
+int radixInsert(radix *rt, unsigned char *s, size_t len, void *value);
+int radixRemove(radix *rt, unsigned char *s, size_t len);
+int radixFind(radix *rt, unsigned char *s, size_t len, void **value);
+void radixWalk(radix *rt, unsigned char *start, size_t startlen,
+               unsigned char *end, size_t endlen,
+               radixWalkFunction *fn, void *privdata);
+void radixWalkPrefix(radix *rt, unsigned char *prefix, size_t len,
+                     radixWalkFunction *fn, void *privdata);
+void radixWalkPrefixesOf(radix *rt, unsigned char *s, size_t len,
+                         radixWalkFunction *fn, void *privdata);
+
+#endif
@@ -0,0 +1,297 @@
+/* Vectorized scanning of RESP requests.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* The multibulk parser of networking.c looks for the \r\n ending every line
+ * of a request with strchr(), one line at a time. For pipelines of small
+ * commands it is cheaper to locate all the \r\n of the query buffer in a
+ * single pass, 16 or 32 bytes at a time with SSE2 or AVX2, and to parse the
+ * commands from the resulting index of line offsets.
+ *
+ * The index also contains the \r\n found inside bulk payloads: they are
+ * skipped by respNextLine(), as the parser always asks for the first line
+ * ending after the current position. */
+
+#include <stdint.h>
+#include "resp.h"
+
+#if !defined(RESP_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define RESP_VECTOR_SIZE 32
+#elif !defined(RESP_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define RESP_VECTOR_SIZE 16
+#endif
+
+#ifdef RESP_VECTOR_SIZE
+/* Return a mask with the bit N set if p[N] is \r and p[N+1] is \n. Reads
+ * RESP_VECTOR_SIZE+1 bytes. */
+static uint32_t respMatchCRLF(const char *p) {
+#if RESP_VECTOR_SIZE == 32
+    __m256i cr = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p),
+                                   _mm256_set1_epi8('\r'));
+    __m256i lf = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p+1)),
+                                   _mm256_set1_epi8('\n'));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(cr,lf));
+#else
+    __m128i cr = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p),
+                                _mm_set1_epi8('\r'));
+    __m128i lf = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p+1)),
+                                _mm_set1_epi8('\n'));
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(cr,lf));
+#endif
+}
+
+/* Count trailing zeros of a non zero 32 bit word. */
+static int respCtz32(uint32_t v) {
+#if defined(__GNUC__)
+    return __builtin_ctz(v);
+#else
+    int n = 0;
+
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+#endif
+
+/* Store in 'offsets' the offset of the \r of every \r\n of buf[start..len-1],
+ * up to 'max' of them, and return how many were stored. '*end' is set to the
+ * offset where the scan stopped: all the \r\n starting before it were
+ * stored. */
+size_t respScanLines(const char *buf, size_t len, size_t start,
+                     size_t *offsets, size_t max, size_t *end)
+{
+    size_t i = start, n = 0;
+
+    if (max == 0) {
+        *end = start;
+        return 0;
+    }
+#ifdef RESP_VECTOR_SIZE
+    while (i+RESP_VECTOR_SIZE < len) {
+        uint32_t mask = respMatchCRLF(buf+i);
+
+        while (mask) {
+            size_t j = i+respCtz32(mask);
+
+            offsets[n++] = j;
+            if (n == max) {
+                *end = j+1;
+                return n;
+            }
+            mask &= mask-1;
+        }
+        i += RESP_VECTOR_SIZE;
+    }
+#endif
+    for (; i+1 < len; i++) {
+        if (buf[i] == '\r' && buf[i+1] == '\n') {
+            offsets[n++] = i;
+            if (n == max) {
+                *end = i+1;
+                return n;
+            }
+        }
+    }
+    *end = len;
+    return n;
+}
+
+void respIndexInit(respIndex *idx, const char *buf, size_t len) {
+    idx->buf = buf;
+    idx->len = len;
+    idx->scanned = 0;
+    idx->cur = 0;
+    idx->count = 0;
+}
+
+/* Return the offset of the first \r\n at or after 'pos', or -1 if there is
+ * none. Positions must be asked in increasing order. */
+long long respNextLine(respIndex *idx, size_t pos) {
+    while (1) {
+        while (idx->cur < idx->count) {
+            if (idx->offsets[idx->cur] >= pos)
+                return idx->offsets[idx->cur];
+            idx->cur++;
+        }
+        if (idx->scanned >= idx->len) return -1;
+        idx->count = respScanLines(idx->buf,idx->len,
+            pos > idx->scanned ? pos : idx->scanned,
+            idx->offsets,RESP_INDEX_SIZE,&idx->scanned);
+        idx->cur = 0;
+    }
+}
+
+/* Parse a non negative length of at most 18 digits, the common case of
+ * string2ll(). Return 1 on success, 0 otherwise. */
+int respParseLen(const char *s, size_t slen, long long *value) {
+    long long v = 0;
+    size_t j;
+
+    if (slen == 0 || slen > 18 || (s[0] == '0' && slen != 1)) return 0;
+    for (j = 0; j < slen; j++) {
+        if (s[j] < '0' || s[j] > '9') return 0;
+        v = v*10+(s[j]-'0');
+    }
+    *value = v;
+    return 1;
+}
+
+/* Parse the multibulk command starting at '*pos' of the indexed buffer,
+ * storing its arguments in 'argv'. On success the number of arguments is
+ * returned and '*pos' is set past the command. Zero is returned, and '*pos'
+ * left untouched, if the command is not complete yet or is not a small
+ * well formed one: more than 'maxargs' arguments, an argument of 'maxbulk'
+ * bytes or more, or a protocol error. The caller then falls back to the
+ * generic parser. */
+int respParseCommand(respIndex *idx, size_t *pos, respArg *argv, int maxargs,
+                     size_t maxbulk)
+{
+    const char *buf = idx->buf;
+    size_t len = idx->len, p = *pos;
+    long long nl, count, ll;
+    int j;
+
+    if (p >= len || buf[p] != '*') return 0;
+    if ((nl = respNextLine(idx,p)) == -1 ||
+        !respParseLen(buf+p+1,nl-p-1,&count) ||
+        count <= 0 || count > maxargs) return 0;
+    p = nl+2;
+
+    for (j = 0; j < count; j++) {
+        if (p >= len || buf[p] != '$') return 0;
+        if ((nl = respNextLine(idx,p)) == -1 ||
+            !respParseLen(buf+p+1,nl-p-1,&ll) ||
+            (size_t)ll >= maxbulk) return 0;
+        p = nl+2;
+        if (len-p < (size_t)ll+2) return 0;
+        argv[j].off = p;
+        argv[j].len = ll;
+        p += ll+2;
+    }
+    *pos = p;
+    return count;
+}
+
+#ifdef RESP_BENCHMARK_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* The line by line parsing of processMultibulkBuffer(), including the
+ * trimming of the query buffer after every command. */
+static size_t parseStrchr(char *buf, size_t len) {
+    size_t args = 0;
+
+    while (len) {
+        char *p = buf, *nl;
+        long long count, ll;
+
+        nl = strchr(p,'\r');
+        respParseLen(p+1,nl-p-1,&count);
+        p = nl+2;
+        while (count--) {
+            nl = strchr(p,'\r');
+            respParseLen(p+1,nl-p-1,&ll);
+            p = nl+2+ll+2;
+            args++;
+        }
+        len -= p-buf;
+        memmove(buf,p,len+1);
+    }
+    return args;
+}
+
+static size_t parseIndexed(char *buf, size_t len) {
+    respIndex idx;
+    respArg argv[RESP_MAX_ARGS];
+    size_t pos = 0, args = 0;
+    int argc;
+
+    respIndexInit(&idx,buf,len);
+    while ((argc = respParseCommand(&idx,&pos,argv,RESP_MAX_ARGS,
+                                    1024*32)) > 0)
+        args += argc;
+    return args;
+}
+
+int main(int argc, char **argv) {
+    int commands = argc > 1 ? atoi(argv[1]) : 1000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    size_t len = 0, args = 0;
+    char *buf, *copy;
+    long long start, strchr_us = 0, indexed_us = 0;
+    int j;
+
+    buf = malloc((size_t)commands*64+1);
+    copy = malloc((size_t)commands*64+1);
+    for (j = 0; j < commands; j++)
+        len += sprintf(buf+len,"*3\r\n$3\r\nSET\r\n$%d\r\nkey:%06d\r\n$3\r\nbar\r\n",
+            10,j%1000000);
+
+    for (j = 0; j < rounds; j++) {
+        memcpy(copy,buf,len+1);
+        start = ustime();
+        args += parseStrchr(copy,len);
+        strchr_us += ustime()-start;
+
+        start = ustime();
+        args -= parseIndexed(buf,len);
+        indexed_us += ustime()-start;
+    }
+    if (args != 0) {
+        printf("Mismatch between the two parsers!\n");
+        return 1;
+    }
+    printf("%d commands x %d rounds (%d bytes vectors)\n", commands, rounds,
+#ifdef RESP_VECTOR_SIZE
+        RESP_VECTOR_SIZE
+#else
+        1
+#endif
+    );
+    printf("strchr:  %.1f ns/command\n",
+        (double)strchr_us*1000/((double)commands*rounds));
+    printf("indexed: %.1f ns/command\n",
+        (double)indexed_us*1000/((double)commands*rounds));
+    return 0;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __RESP_H
+#define __RESP_H
+
+#include <stddef.h>
+
+#define RESP_INDEX_SIZE 256 /* Line offsets collected by a single scan. */
+#define RESP_MAX_ARGS 16    /* Max arguments of a command in the fast path. */
+
+/* Index of the lines of a buffer: the offsets of its \r\n, collected
+ * RESP_INDEX_SIZE at a time. */
+typedef struct respIndex {
+    const char *buf;
+    size_t len;
+    size_t scanned;     /* Bytes of buf already scanned. */
+    size_t cur;         /* First entry of offsets not consumed yet. */
+    size_t count;       /* Entries in offsets. */
+    size_t offsets[RESP_INDEX_SIZE];
+} respIndex;
+
+/* An argument of a parsed command, as a range of the buffer. */
+typedef struct respArg {
+    size_t off;
+    size_t len;
+} respArg;
+
+size_t respScanLines(const char *buf, size_t len, size_t start,
+                     size_t *offsets, size_t max, size_t *end);
+void respIndexInit(respIndex *idx, const char *buf, size_t len);
+long long respNextLine(respIndex *idx, size_t pos);
+int respParseLen(const char *s, size_t slen, long long *value);
+int respParseCommand(respIndex *idx, size_t *pos, respArg *argv, int maxargs,
+                     size_t maxbulk);
+
+#endif
@@ -739,23 +739,34 @@ void sdsfreesplitres(sds *tokens, int count) {
  * After the call, the modified sds string is no longer valid and all the
  * references must be substituted with the new pointer returned by the call. */
 sds sdscatrepr(sds s, const char *p, size_t len) {
+    const char *end = p+len, *hex = "0123456789abcdef";
+    char esc[4];
+
+    s = sdsMakeRoomFor(s,len+2);
     s = sdscatlen(s,"\"",1);
-    while(len--) {
+    while(p < end) {
+        const char *run = p;
+
+        /* Characters not needing escapes are appended a run at a time. */
+        while(p < end && *p != '\\' && *p != '"' && isprint((unsigned char)*p))
+            p++;
+        if (p > run) s = sdscatlen(s,run,p-run);
+        if (p == end) break;
+
+        esc[0] = '\\';
         switch(*p) {
         case '\\':
-        case '"':
-            s = sdscatprintf(s,"\\%c",*p);
-            break;
+        case '"': esc[1] = *p; s = sdscatlen(s,esc,2); break;
         case '\n': s = sdscatlen(s,"\\n",2); break;
         case '\r': s = sdscatlen(s,"\\r",2); break;
         case '\t': s = sdscatlen(s,"\\t",2); break;
         case '\a': s = sdscatlen(s,"\\a",2); break;
         case '\b': s = sdscatlen(s,"\\b",2); break;
         default:
-            if (isprint(*p))
-                s = sdscatprintf(s,"%c",*p);
-            else
-                s = sdscatprintf(s,"\\x%02x",(unsigned char)*p);
+            esc[1] = 'x';
+            esc[2] = hex[(unsigned char)*p >> 4];
+            esc[3] = hex[(unsigned char)*p & 0xf];
+            s = sdscatlen(s,esc,4);
             break;
         }
         p++;
@@ -863,7 +874,11 @@ sds *sdssplitargs(const char *line, int *argc) {
                         /* unterminated quotes */
                         goto err;
                     } else {
-                        current = sdscatlen(current,p,1);
+                        const char *run = p;
+
+                        /* Append the whole run of plain characters. */
+                        while(*(p+1) && *(p+1) != '\\' && *(p+1) != '"') p++;
+                        current = sdscatlen(current,run,p-run+1);
                     }
                 } else if (insq) {
                     if (*p == '\\' && *(p+1) == '\'') {
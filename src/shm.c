@@ -0,0 +1,333 @@
+/* Shared memory transport for co-located clients, see shm.h.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "shm.h"
+
+#ifdef HAVE_EVENTFD
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
+
+/* -----------------------------------------------------------------------------
+ * Rings
+ * -------------------------------------------------------------------------- */
+
+/* Append up to 'len' bytes of 'buf' to the ring, returning how many were
+ * written. 'data' is the data of the ring, 'size' bytes.
+ *
+ * The other side can write the whole header, so 'head' and 'tail' are
+ * loaded once and checked before use: -1 is returned if the ring holds
+ * more than 'size' bytes. */
+ssize_t shmRingWrite(shmRing *r, char *data, size_t size, const char *buf,
+                     size_t len)
+{
+    uint64_t head = __atomic_load_n(&r->head,__ATOMIC_RELAXED);
+    uint64_t tail = __atomic_load_n(&r->tail,__ATOMIC_ACQUIRE);
+    size_t off = head & (size-1), first;
+
+    if (head-tail > size) return -1;
+    if (len > size-(head-tail)) len = size-(head-tail);
+    first = (size-off < len) ? size-off : len;
+    memcpy(data+off,buf,first);
+    memcpy(data,buf+first,len-first);
+    __atomic_store_n(&r->head,head+len,__ATOMIC_SEQ_CST);
+    return len;
+}
+
+/* Consume up to 'len' bytes of the ring into 'buf', returning how many were
+ * read, or -1 if the ring holds more than 'size' bytes. */
+ssize_t shmRingRead(shmRing *r, char *data, size_t size, char *buf,
+                    size_t len)
+{
+    uint64_t tail = __atomic_load_n(&r->tail,__ATOMIC_RELAXED);
+    uint64_t head = __atomic_load_n(&r->head,__ATOMIC_ACQUIRE);
+    size_t off = tail & (size-1), first;
+
+    if (head-tail > size) return -1;
+    if (len > head-tail) len = head-tail;
+    first = (size-off < len) ? size-off : len;
+    memcpy(buf,data+off,first);
+    memcpy(buf+first,data,len-first);
+    __atomic_store_n(&r->tail,tail+len,__ATOMIC_SEQ_CST);
+    return len;
+}
+
+#ifdef HAVE_EVENTFD
+static void shmNotify(int fd) {
+    uint64_t one = 1;
+
+    if (write(fd,&one,sizeof(one)) == -1) {
+        /* The counter can't overflow in practice, nothing to do. */
+    }
+}
+
+/* -----------------------------------------------------------------------------
+ * Server side of the transport, used by readFromClient() and writeToClient()
+ * in place of read(2) and writev(2). Safe to call from I/O threads.
+ * -------------------------------------------------------------------------- */
+
+/* Read the requests of the client. Returns the number of bytes read, zero
+ * if there was nothing to read, or -1 with errno set to EPROTO if the
+ * client corrupted the ring, in which case it must be detached. The size
+ * of the rings is the one of the transport: the copy in the header is
+ * for the client, and can't be trusted. */
+ssize_t shmRead(shmTransport *t, char *buf, size_t len) {
+    shmHeader *h = t->hdr;
+    uint64_t count;
+    ssize_t nread;
+
+    /* Reset the doorbell before looking at the ring, so that requests added
+     * from now on ring it again. */
+    if (read(t->req_fd,&count,sizeof(count)) == -1 && errno != EAGAIN)
+        return -1;
+    nread = shmRingRead(&h->req,shmRequestData(h),t->ring_size,buf,len);
+    if (nread == -1) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* More than we could read: the fd must stay readable. */
+    if (__atomic_load_n(&h->req.head,__ATOMIC_ACQUIRE) != h->req.tail)
+        shmNotify(t->req_fd);
+    if (nread && __atomic_load_n(&h->req.waiting,__ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&h->req.waiting,0,__ATOMIC_SEQ_CST);
+        shmNotify(t->rep_fd);
+    }
+    return nread;
+}
+
+/* Write the replies to the client. Returns the number of bytes written, or
+ * -1 with errno set to EAGAIN if the ring is full. The client rings the
+ * doorbell once it made room. If the client corrupted the ring -1 is
+ * returned with errno set to EPROTO. */
+ssize_t shmWritev(shmTransport *t, const struct iovec *iov, int iovcnt) {
+    shmHeader *h = t->hdr;
+    char *data = shmRequestData(h)+t->ring_size;
+    size_t written = 0, wanted = 0, skip;
+    int j, retry = 1;
+
+    for (j = 0; j < iovcnt; j++) wanted += iov[j].iov_len;
+    while(1) {
+        skip = written;
+        for (j = 0; j < iovcnt; j++) {
+            size_t len = iov[j].iov_len;
+            ssize_t n;
+
+            if (skip >= len) {
+                skip -= len;
+                continue;
+            }
+            n = shmRingWrite(&h->rep,data,t->ring_size,
+                             (char*)iov[j].iov_base+skip,len-skip);
+            if (n == -1) {
+                errno = EPROTO;
+                return -1;
+            }
+            written += n;
+            if ((size_t)n < len-skip) break;
+            skip = 0;
+        }
+        if (written == wanted || !retry) break;
+
+        /* The ring is full. Ask for the doorbell, then try again in case
+         * the client made room before seeing the request. */
+        __atomic_store_n(&h->rep.waiting,1,__ATOMIC_SEQ_CST);
+        retry = 0;
+    }
+    if (written == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    shmNotify(t->rep_fd);
+    return written;
+}
+
+/* Release the transport of the client, called by freeClient() for both the
+ * client using the rings and the Unix socket client that attached them. */
+void shmDetach(prezClient *c) {
+    shmTransport *t;
+
+    if (c->shm_attached) {
+        /* The owner is gone: close the transport as well. */
+        t = c->shm_attached;
+        c->shm_attached = NULL;
+        t->owner = NULL;
+        freeClientAsync(t->client);
+        return;
+    }
+    t = c->shm;
+    c->shm = NULL;
+    if (t->owner) t->owner->shm_attached = NULL;
+    munmap(t->hdr,t->maplen);
+    close(t->rep_fd);
+    zfree(t);
+}
+
+/* Send the reply of SHMATTACH with the fds of the transport. */
+static int shmSendFds(prezClient *c, int *fds, int count) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(sizeof(int)*3)];
+        struct cmsghdr align;
+    } u;
+    char *ok = "+OK\r\n";
+
+    memset(&msg,0,sizeof(msg));
+    memset(&u,0,sizeof(u));
+    iov.iov_base = ok;
+    iov.iov_len = strlen(ok);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int)*count);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int)*count);
+    memcpy(CMSG_DATA(cmsg),fds,sizeof(int)*count);
+    return (sendmsg(c->fd,&msg,0) == (ssize_t)iov.iov_len) ?
+        PREZ_OK : PREZ_ERR;
+}
+
+/* SHMATTACH
+ *
+ * Create a shared memory transport for the Unix socket client, see shm.h.
+ * The reply is sent right away with the fds of the transport, so the
+ * command can't be pipelined. */
+void shmattachCommand(prezClient *c, robj **argv, int argc) {
+    shmTransport *t;
+    prezClient *sc;
+    size_t maplen;
+    void *map = MAP_FAILED;
+    int fds[3] = {-1,-1,-1};
+    PREZ_NOTUSED(argv);
+    PREZ_NOTUSED(argc);
+
+    if (server.shm_ring_size == 0) {
+        addReplyError(c,"The shared memory transport is disabled");
+        return;
+    }
+    if (!(c->flags & PREZ_UNIX_SOCKET) || c->shm || c->shm_attached) {
+        addReplyError(c,"SHMATTACH is only allowed on the Unix socket");
+        return;
+    }
+    if (listLength(c->requests) || clientHasPendingReplies(c)) {
+        addReplyError(c,"SHMATTACH can't be pipelined");
+        return;
+    }
+
+    maplen = sizeof(shmHeader)+server.shm_ring_size*2;
+    if ((fds[0] = syscall(SYS_memfd_create,"prez-shm",0)) == -1 ||
+        ftruncate(fds[0],maplen) == -1 ||
+        (map = mmap(NULL,maplen,PROT_READ|PROT_WRITE,MAP_SHARED,fds[0],0))
+            == MAP_FAILED ||
+        (fds[1] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+        (fds[2] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) == -1)
+    {
+        addReplyErrorFormat(c,"Can't create the transport: %s",
+            strerror(errno));
+        goto cleanup;
+    }
+    memset(map,0,sizeof(shmHeader));
+    ((shmHeader*)map)->magic = SHM_MAGIC;
+    ((shmHeader*)map)->ring_size = server.shm_ring_size;
+
+    /* From now on the eventfds are owned by the client and the transport. */
+    if ((sc = createClient(fds[1])) == NULL) {
+        addReplyErrorFormat(c,"Can't create the transport: %s",
+            strerror(errno));
+        fds[1] = -1;
+        goto cleanup;
+    }
+    sc->flags |= PREZ_UNIX_SOCKET;
+    t = zmalloc(sizeof(*t));
+    t->hdr = map;
+    t->maplen = maplen;
+    t->ring_size = server.shm_ring_size;
+    t->req_fd = fds[1];
+    t->rep_fd = fds[2];
+    t->client = sc;
+    t->owner = c;
+    sc->shm = t;
+    c->shm_attached = t;
+
+    if (shmSendFds(c,fds,3) == PREZ_ERR) {
+        prezLog(PREZ_VERBOSE,"Error sending the shared memory fds: %s",
+            strerror(errno));
+        c->shm_attached = NULL;
+        t->owner = NULL;
+        freeClient(sc);
+        freeClientAsync(c);
+    }
+    close(fds[0]);
+    return;
+
+cleanup:
+    if (map != MAP_FAILED) munmap(map,maplen);
+    if (fds[0] != -1) close(fds[0]);
+    if (fds[1] != -1) close(fds[1]);
+    if (fds[2] != -1) close(fds[2]);
+}
+
+#else /* !HAVE_EVENTFD */
+
+ssize_t shmRead(shmTransport *t, char *buf, size_t len) {
+    PREZ_NOTUSED(t);
+    PREZ_NOTUSED(buf);
+    PREZ_NOTUSED(len);
+    errno = ENOTSUP;
+    return -1;
+}
+
+ssize_t shmWritev(shmTransport *t, const struct iovec *iov, int iovcnt) {
+    PREZ_NOTUSED(t);
+    PREZ_NOTUSED(iov);
+    PREZ_NOTUSED(iovcnt);
+    errno = ENOTSUP;
+    return -1;
+}
+
+void shmDetach(prezClient *c) {
+    c->shm = NULL;
+    c->shm_attached = NULL;
+}
+
+void shmattachCommand(prezClient *c, robj **argv, int argc) {
+    PREZ_NOTUSED(argv);
+    PREZ_NOTUSED(argc);
+    addReplyError(c,"SHMATTACH is not supported on this platform");
+}
+
+#endif
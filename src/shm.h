@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __SHM_H
+#define __SHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Shared memory transport for clients running on the same host.
+ *
+ * A client connected to the Unix socket sends SHMATTACH: the reply, "+OK",
+ * comes with three file descriptors (SCM_RIGHTS):
+ *
+ *   1) A memory file holding a shmHeader followed by the data of the
+ *      request ring and then the data of the reply ring, ring_size bytes
+ *      each.
+ *   2) The eventfd the client writes to after adding requests.
+ *   3) The eventfd the server writes to after adding replies.
+ *
+ * From then on RESP requests are written to the request ring, and replies
+ * read from the reply ring. The Unix socket connection, that can still be
+ * used for other commands, must be kept open: once it is closed the
+ * transport is released.
+ *
+ * Rings are single producer, single consumer. 'head' and 'tail' count the
+ * bytes written and read since the ring was created. The consumer of a ring
+ * that finds it empty waits on the eventfd of the producer. A producer that
+ * finds the ring full sets 'waiting', and waits on the eventfd of the
+ * consumer: after advancing 'tail', the consumer checks 'waiting' and, if
+ * set, clears it and writes its eventfd. */
+
+#define SHM_MAGIC 0x314d4853005a4552ULL /* "REZ\0SHM1" */
+
+typedef struct shmRing {
+    uint64_t head;          /* Written by the producer. */
+    char pad1[56];
+    uint64_t tail;          /* Written by the consumer. */
+    uint32_t waiting;       /* The producer waits for room. */
+    char pad2[52];
+} shmRing;
+
+typedef struct shmHeader {
+    uint64_t magic;
+    uint64_t ring_size;     /* Bytes of data of every ring, power of two. */
+    char pad[48];
+    shmRing req;            /* Client to server. */
+    shmRing rep;            /* Server to client. */
+} shmHeader;
+
+#define shmRequestData(h) ((char*)((h)+1))
+#define shmReplyData(h) (shmRequestData(h)+(h)->ring_size)
+
+ssize_t shmRingWrite(shmRing *r, char *data, size_t size, const char *buf,
+                     size_t len);
+ssize_t shmRingRead(shmRing *r, char *data, size_t size, char *buf,
+                    size_t len);
+
+/* Server side state of an attached transport. */
+typedef struct shmTransport {
+    shmHeader *hdr;
+    size_t maplen;
+    size_t ring_size;           /* Never read back from the header. */
+    int req_fd;                 /* Client eventfd, the fd of the client. */
+    int rep_fd;                 /* Server eventfd. */
+    struct prezClient *client;  /* Client reading from the rings. */
+    struct prezClient *owner;   /* Unix socket client that attached it. */
+} shmTransport;
+
+ssize_t shmRead(shmTransport *t, char *buf, size_t len);
+ssize_t shmWritev(shmTransport *t, const struct iovec *iov, int iovcnt);
+void shmDetach(struct prezClient *c);
+
+#endif
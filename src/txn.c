@@ -0,0 +1,230 @@
+/* Conditional transactions.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "cluster.h"
+
+/* TXN compares some keys and, depending on the outcome, runs one of two
+ * lists of operations, like the transactions of etcd:
+ *
+ *   TXN <numcompares> [<key> <target> <op> <value> ...]
+ *       <numsuccess> [<operation> ...] [<numfailure> <operation> ...]
+ *
+ * The target of a compare is VALUE, the value of the key, CREATE, the
+ * index that created the key, or MOD, the index that set its value. The
+ * op is one of = != < >. A key that does not exist has CREATE and MOD 0
+ * and no value, that is only different from any other value. The
+ * operations are SET <key> <value>, DEL <key> and GET <key>.
+ *
+ * The whole transaction is a single log entry, evaluated as it is applied,
+ * so nothing can change the keys between the compares and the operations,
+ * and a recipe that needs many writes costs a single commit. The keys must
+ * belong to the same Raft group.
+ *
+ * The reply is the outcome of the compares, 1 if they all succeeded, and
+ * the replies of the operations that were run. */
+
+#define TXN_CMP_VALUE 0
+#define TXN_CMP_CREATE 1
+#define TXN_CMP_MOD 2
+
+#define TXN_OP_EQ 0
+#define TXN_OP_NE 1
+#define TXN_OP_LT 2
+#define TXN_OP_GT 3
+
+/* Position of the sections of a parsed TXN in its arguments. */
+typedef struct txnSections {
+    int cmp, numcmp;        /* First compare and number of compares. */
+    int success, numsuccess;
+    int failure, numfailure;
+} txnSections;
+
+static int txnCompareTarget(robj *o) {
+    if (!strcasecmp(o->ptr,"value")) return TXN_CMP_VALUE;
+    if (!strcasecmp(o->ptr,"create")) return TXN_CMP_CREATE;
+    if (!strcasecmp(o->ptr,"mod")) return TXN_CMP_MOD;
+    return -1;
+}
+
+static int txnCompareOp(robj *o) {
+    if (!strcmp(o->ptr,"=")) return TXN_OP_EQ;
+    if (!strcmp(o->ptr,"!=")) return TXN_OP_NE;
+    if (!strcmp(o->ptr,"<")) return TXN_OP_LT;
+    if (!strcmp(o->ptr,">")) return TXN_OP_GT;
+    return -1;
+}
+
+/* Return the number of arguments of the operation, or 0 if unknown. */
+static int txnOperationArity(robj *o) {
+    if (!strcasecmp(o->ptr,"set")) return 3;
+    if (!strcasecmp(o->ptr,"del") || !strcasecmp(o->ptr,"get")) return 2;
+    return 0;
+}
+
+/* Parse the count at argv[*j] and the 'count' operations following it,
+ * advancing *j past them. */
+static int txnParseOperations(robj **argv, int argc, int *j, int *first,
+                              int *count)
+{
+    long long n;
+    int i;
+
+    if (*j >= argc ||
+        !string2ll(argv[*j]->ptr,sdslen(argv[*j]->ptr),&n) ||
+        n < 0 || n > argc) return PREZ_ERR;
+    *first = ++(*j);
+    *count = n;
+    for (i = 0; i < n; i++) {
+        int arity;
+
+        if (*j >= argc || (arity = txnOperationArity(argv[*j])) == 0 ||
+            *j+arity > argc) return PREZ_ERR;
+        *j += arity;
+    }
+    return PREZ_OK;
+}
+
+/* Check the syntax of the TXN and find its sections. */
+static int txnParse(robj **argv, int argc, txnSections *s) {
+    long long n;
+    int j = 1, i;
+
+    if (!string2ll(argv[1]->ptr,sdslen(argv[1]->ptr),&n) ||
+        n < 0 || n > argc/4) return PREZ_ERR;
+    s->cmp = 2;
+    s->numcmp = n;
+    for (i = 0, j = s->cmp; i < s->numcmp; i++, j += 4) {
+        int target;
+
+        if (j+4 > argc) return PREZ_ERR;
+        target = txnCompareTarget(argv[j+1]);
+        if (target == -1 || txnCompareOp(argv[j+2]) == -1) return PREZ_ERR;
+        if (target != TXN_CMP_VALUE &&
+            !string2ll(argv[j+3]->ptr,sdslen(argv[j+3]->ptr),&n))
+            return PREZ_ERR;
+    }
+    if (txnParseOperations(argv,argc,&j,&s->success,&s->numsuccess)
+        != PREZ_OK) return PREZ_ERR;
+    if (j == argc) {
+        s->failure = j;
+        s->numfailure = 0;
+        return PREZ_OK;
+    }
+    if (txnParseOperations(argv,argc,&j,&s->failure,&s->numfailure)
+        != PREZ_OK) return PREZ_ERR;
+    return j == argc ? PREZ_OK : PREZ_ERR;
+}
+
+/* The keys of the compares and of the operations. A TXN with a syntax
+ * error has no keys: it is refused by txnCommand() as it is applied. */
+int *txnGetKeys(struct prezCommand *cmd,robj **argv, int argc, int *numkeys) {
+    txnSections s;
+    int *keys, i, j, n = 0;
+    PREZ_NOTUSED(cmd);
+
+    *numkeys = 0;
+    if (txnParse(argv,argc,&s) != PREZ_OK) return NULL;
+    keys = zmalloc(sizeof(int)*(s.numcmp+s.numsuccess+s.numfailure));
+    for (i = 0, j = s.cmp; i < s.numcmp; i++, j += 4)
+        keys[n++] = j;
+    for (i = 0, j = s.success; i < s.numsuccess; i++) {
+        keys[n++] = j+1;
+        j += txnOperationArity(argv[j]);
+    }
+    for (i = 0, j = s.failure; i < s.numfailure; i++) {
+        keys[n++] = j+1;
+        j += txnOperationArity(argv[j]);
+    }
+    *numkeys = n;
+    return keys;
+}
+
+/* Evaluate the compare at argv[0..3]. */
+static int txnCompare(robj **argv) {
+    keyVersion *v = lookupKeyVersion(&server.db[0],argv[0]);
+    int target = txnCompareTarget(argv[1]);
+    int op = txnCompareOp(argv[2]);
+    long long n, cur = 0;
+    int cmp;
+
+    if (target == TXN_CMP_VALUE) {
+        if (v == NULL) return op == TXN_OP_NE;
+        cmp = compareStringObjects(v->val,argv[3]);
+    } else {
+        string2ll(argv[3]->ptr,sdslen(argv[3]->ptr),&n);
+        if (v) cur = target == TXN_CMP_CREATE ? v->create_index :
+                                                v->mod_index;
+        cmp = cur < n ? -1 : (cur > n);
+    }
+    switch(op) {
+    case TXN_OP_EQ: return cmp == 0;
+    case TXN_OP_NE: return cmp != 0;
+    case TXN_OP_LT: return cmp < 0;
+    default: return cmp > 0;
+    }
+}
+
+/* Run 'count' operations starting at argv[0], replying to each one. */
+static void txnRunOperations(prezClient *c, robj **argv, int count) {
+    int i;
+
+    addReplyMultiBulkLen(c,count);
+    for (i = 0; i < count; i++) {
+        if (!strcasecmp(argv[0]->ptr,"set")) {
+            setGenericCommand(c,argv[1],argv[2]);
+        } else if (!strcasecmp(argv[0]->ptr,"del")) {
+            addReply(c,dbDelete(&server.db[0],argv[1]) ? shared.cone :
+                                                         shared.czero);
+        } else {
+            getGenericCommand(c,argv[1]);
+        }
+        argv += txnOperationArity(argv[0]);
+    }
+}
+
+void txnCommand(prezClient *c, robj **argv, int argc) {
+    txnSections s;
+    int i, ok = 1;
+
+    if (txnParse(argv,argc,&s) != PREZ_OK) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    for (i = 0; i < s.numcmp && ok; i++)
+        ok = txnCompare(argv+s.cmp+i*4);
+
+    addReplyMultiBulkLen(c,2);
+    addReply(c,ok ? shared.cone : shared.czero);
+    if (ok)
+        txnRunOperations(c,argv+s.success,s.numsuccess);
+    else
+        txnRunOperations(c,argv+s.failure,s.numfailure);
+}
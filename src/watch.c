@@ -0,0 +1,410 @@
+/* Watching keys for changes.
+ *
+ * Copyright (c) 2009-2012, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "prez.h"
+#include "cluster.h"
+
+/* Watches let clients learn about changed keys without polling them. WATCH
+ * watches keys, and PWATCH every key starting with a prefix.
+ * server.watched_keys maps every watched key to the list of the clients
+ * watching it. server.watched_prefixes holds the watched prefixes, each one
+ * with its list of clients, in a radix tree: the prefixes of a changed key
+ * are all on the path of the key.
+ *
+ * Keys are touched as the log entries are applied, on the leader and on the
+ * followers alike. A touched key is added to the set of changed keys of the
+ * clients watching it, so that a key changed many times is notified once.
+ * Once the batch of entries is applied every client is sent a single
+ * message with all its changed keys:
+ *
+ *   *3 "watch" <index of the last entry applied> *<count> <key> ...
+ *
+ * Like SUBSCRIBE, WATCH and PWATCH put the client in watch mode, where only
+ * (P)WATCH and (P)UNWATCH are accepted until nothing is watched anymore:
+ * their replies are never arrays, so the messages can't be mistaken for
+ * them. Binary protocol clients get the messages in frames of their own,
+ * see addReplyPush(), and have no watch mode.
+ *
+ * The clients watching a key or a prefix are in a list, and the watches of
+ * a client keep their node in it, so that unwatching takes constant time,
+ * as does taking the client out of server.watch_notify.
+ *
+ * Every Raft group also keeps its last watch-history-len changes, tagged
+ * with their log index, so that a client reconnecting can resume watching
+ * with FROMINDEX <index>, the index of the last notification it got: the
+ * keys changed after it are notified right away. If some of the changes
+ * are no longer in the history the command fails, and the client has to
+ * read the keys again. With more than one group the index is the one of
+ * the group of the keys, so prefixes, that span every group, can't be
+ * resumed. */
+
+/* Start watching 'key', or the keys starting with it if 'prefix' is
+ * true. Watching the same key again does nothing. */
+static void watchAdd(prezClient *c, sds key, int prefix) {
+    dict **watched = prefix ? &c->watched_prefixes : &c->watched_keys;
+    list *clients;
+    void *aux;
+
+    if (*watched == NULL) *watched = dictCreate(&sdsSetDictType,NULL);
+    if (dictFind(*watched,key)) return;
+
+    if (prefix) {
+        if (radixFind(server.watched_prefixes,(unsigned char*)key,
+                      sdslen(key),&aux)) {
+            clients = aux;
+        } else {
+            clients = listCreate();
+            radixInsert(server.watched_prefixes,(unsigned char*)key,
+                        sdslen(key),clients);
+        }
+    } else {
+        clients = dictFetchValue(server.watched_keys,key);
+        if (clients == NULL) {
+            clients = listCreate();
+            dictAdd(server.watched_keys,sdsdup(key),clients);
+        }
+    }
+    listAddNodeTail(clients,c);
+    dictAdd(*watched,sdsdup(key),listLast(clients));
+}
+
+/* Stop watching 'key', or the keys starting with it if 'prefix' is true.
+ * Return 0 if it was not watched. */
+static int watchRemove(prezClient *c, sds key, int prefix) {
+    dict *watched = prefix ? c->watched_prefixes : c->watched_keys;
+    dictEntry *de;
+    list *clients;
+    void *aux;
+
+    if (watched == NULL || (de = dictFind(watched,key)) == NULL) return 0;
+
+    if (prefix) {
+        radixFind(server.watched_prefixes,(unsigned char*)key,sdslen(key),
+                  &aux);
+        clients = aux;
+    } else {
+        clients = dictFetchValue(server.watched_keys,key);
+    }
+    prezAssertWithInfo(c,NULL,clients != NULL);
+    listDelNode(clients,dictGetVal(de));
+    if (listLength(clients) == 0) {
+        if (prefix) {
+            radixRemove(server.watched_prefixes,(unsigned char*)key,
+                        sdslen(key));
+            listRelease(clients);
+        } else {
+            dictDelete(server.watched_keys,key);
+        }
+    }
+    dictDelete(watched,key);
+    return 1;
+}
+
+/* Stop watching all the keys, or all the prefixes if 'prefix' is true. */
+static void watchRemoveAll(prezClient *c, int prefix) {
+    dict *watched = prefix ? c->watched_prefixes : c->watched_keys;
+    dictIterator *di;
+    dictEntry *de;
+
+    if (watched == NULL) return;
+    di = dictGetSafeIterator(watched);
+    while((de = dictNext(di)) != NULL)
+        watchRemove(c,dictGetKey(de),prefix);
+    dictReleaseIterator(di);
+}
+
+/* Called when the client is freed. */
+void unwatchAllKeys(prezClient *c) {
+    watchRemoveAll(c,0);
+    watchRemoveAll(c,1);
+    if (c->watched_keys) dictRelease(c->watched_keys);
+    if (c->watched_prefixes) dictRelease(c->watched_prefixes);
+    if (c->watch_events) dictRelease(c->watch_events);
+    if (c->flags & PREZ_WATCH_NOTIFY)
+        listDelNode(server.watch_notify,c->watch_notify_node);
+}
+
+/* Add the key to the changed keys of the clients. */
+static void touchWatchingClients(list *clients, sds key) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(clients,&li);
+    while((ln = listNext(&li)) != NULL) {
+        prezClient *c = listNodeValue(ln);
+
+        if (c->watch_events == NULL)
+            c->watch_events = dictCreate(&sdsSetDictType,NULL);
+        if (dictFind(c->watch_events,key) == NULL)
+            dictAdd(c->watch_events,sdsdup(key),NULL);
+        if (!(c->flags & PREZ_WATCH_NOTIFY)) {
+            c->flags |= PREZ_WATCH_NOTIFY;
+            listAddNodeTail(server.watch_notify,c);
+            c->watch_notify_node = listLast(server.watch_notify);
+        }
+    }
+}
+
+static int touchWatchedPrefix(void *privdata, unsigned char *prefix,
+                              size_t len, void *value)
+{
+    PREZ_NOTUSED(prefix);
+    PREZ_NOTUSED(len);
+    touchWatchingClients(value,privdata);
+    return 1;
+}
+
+/* Add the change of the key to the history of the selected group, that
+ * is applying the entry at 'index'. The oldest change is dropped if the
+ * history is full. */
+static void watchHistoryAdd(long long index, sds key) {
+    clusterState *g = server.cluster;
+    watchEvent *e;
+
+    if (server.watch_history_len == 0) {
+        g->watch_history_first = index+1;
+        return;
+    }
+    if (g->watch_history_count == server.watch_history_len) {
+        e = g->watch_history+g->watch_history_start;
+        g->watch_history_first = e->index+1;
+        sdsfree(e->key);
+        g->watch_history_start =
+            (g->watch_history_start+1) % server.watch_history_len;
+        g->watch_history_count--;
+    }
+    e = g->watch_history+((g->watch_history_start+g->watch_history_count) %
+                          server.watch_history_len);
+    e->index = index;
+    e->key = sdsdup(key);
+    g->watch_history_count++;
+}
+
+/* Return the 'pos'-th change of the history of 'g', from the oldest. */
+static watchEvent *watchHistoryGet(clusterState *g, long pos) {
+    return g->watch_history+((g->watch_history_start+pos) %
+                             server.watch_history_len);
+}
+
+/* Called every time a key of the DB is changed, while applying the log
+ * entries of the selected group. */
+void touchWatchedKey(sds key) {
+    watchHistoryAdd(server.cluster->last_applied,key);
+    if (dictSize(server.watched_keys)) {
+        list *clients = dictFetchValue(server.watched_keys,key);
+
+        if (clients) touchWatchingClients(clients,key);
+    }
+    if (radixSize(server.watched_prefixes))
+        radixWalkPrefixesOf(server.watched_prefixes,(unsigned char*)key,
+                            sdslen(key),touchWatchedPrefix,key);
+}
+
+/* Send the client a message with its changed keys, that are all the
+ * changes up to 'index'. */
+static void watchNotifyClient(prezClient *c, long long index) {
+    dictIterator *di;
+    dictEntry *de;
+    sds msg;
+
+    if (c->flags & PREZ_WATCH_NOTIFY) {
+        listDelNode(server.watch_notify,c->watch_notify_node);
+        c->watch_notify_node = NULL;
+        c->flags &= ~PREZ_WATCH_NOTIFY;
+    }
+    msg = sdscatprintf(sdsempty(),"*3\r\n$5\r\nwatch\r\n:%lld\r\n*%lu\r\n",
+        index, dictSize(c->watch_events));
+    di = dictGetIterator(c->watch_events);
+    while((de = dictNext(di)) != NULL) {
+        sds key = dictGetKey(de);
+
+        msg = sdscatprintf(msg,"$%lu\r\n",(unsigned long)sdslen(key));
+        msg = sdscatlen(msg,key,sdslen(key));
+        msg = sdscatlen(msg,"\r\n",2);
+    }
+    dictReleaseIterator(di);
+    dictEmpty(c->watch_events,NULL);
+    addReplyPush(c,msg);
+    server.stat_watch_notifications++;
+}
+
+/* Send every client with changed keys a single message with all of them.
+ * Called once a batch of log entries, up to 'index', is applied. */
+void watchNotifyClients(long long index) {
+    while (listLength(server.watch_notify))
+        watchNotifyClient(listNodeValue(listFirst(server.watch_notify)),index);
+}
+
+static int watchReplayMatch(void *privdata, unsigned char *prefix, size_t len,
+                            void *value)
+{
+    PREZ_NOTUSED(prefix);
+    PREZ_NOTUSED(len);
+    PREZ_NOTUSED(value);
+    *(int*)privdata = 1;
+    return 0;
+}
+
+/* Notify the client of the keys changed after 'index' in the history of
+ * 'g' that are one of the 'numkeys' keys, or start with one of them if
+ * 'prefix' is true. */
+static void watchReplay(prezClient *c, clusterState *g, long long index,
+                        robj **keys, int numkeys, int prefix)
+{
+    radix *match = radixNew();
+    long lo = 0, hi = g->watch_history_count;
+    int j;
+
+    for (j = 0; j < numkeys; j++)
+        radixInsert(match,keys[j]->ptr,sdslen(keys[j]->ptr),NULL);
+
+    /* The indexes in the history only grow: find the first change after
+     * 'index' with a binary search. */
+    while (lo < hi) {
+        long mid = (lo+hi)/2;
+
+        if (watchHistoryGet(g,mid)->index <= index) lo = mid+1;
+        else hi = mid;
+    }
+    for (; lo < g->watch_history_count; lo++) {
+        watchEvent *e = watchHistoryGet(g,lo);
+        int found = 0;
+
+        if (prefix)
+            radixWalkPrefixesOf(match,(unsigned char*)e->key,sdslen(e->key),
+                                watchReplayMatch,&found);
+        else
+            found = radixFind(match,(unsigned char*)e->key,sdslen(e->key),
+                              NULL);
+        if (!found) continue;
+        if (c->watch_events == NULL)
+            c->watch_events = dictCreate(&sdsSetDictType,NULL);
+        if (dictFind(c->watch_events,e->key) == NULL)
+            dictAdd(c->watch_events,sdsdup(e->key),NULL);
+    }
+    radixFree(match);
+    if (c->watch_events && dictSize(c->watch_events))
+        watchNotifyClient(c,g->last_applied);
+}
+
+/* WATCH and PWATCH, with the optional FROMINDEX <index> as last
+ * arguments. */
+static void watchGenericCommand(prezClient *c, robj **argv, int argc,
+                                int prefix)
+{
+    clusterState *g = NULL;
+    long long index = -1;
+    int j, last = argc;
+
+    if (argc >= 4 && !strcasecmp(argv[argc-2]->ptr,"fromindex")) {
+        int group = 0;
+
+        if (getLongLongFromObjectOrReply(c,argv[argc-1],&index,NULL) !=
+            PREZ_OK) return;
+        if (index < 0) {
+            addReplyError(c,"FROMINDEX can't be negative");
+            return;
+        }
+        last = argc-2;
+        if (prefix && server.cluster_groups > 1) {
+            addReplyError(c,"CROSSGROUP Prefixes span every Raft group, FROMINDEX needs a single group");
+            return;
+        }
+        for (j = 1; j < last && !prefix; j++) {
+            int keygroup = clusterKeyGroup(argv[j]);
+
+            if (j == 1) {
+                group = keygroup;
+            } else if (keygroup != group) {
+                addReplyError(c,"CROSSGROUP Keys in request don't hash to the same Raft group");
+                return;
+            }
+        }
+        g = server.groups[group];
+        if (index < g->watch_history_first-1) {
+            addReplyErrorFormat(c,"RESYNC The changes after index %lld are "
+                "no longer in the watch history, the oldest index is %lld",
+                index, g->watch_history_first);
+            return;
+        }
+    }
+
+    for (j = 1; j < last; j++) watchAdd(c,argv[j]->ptr,prefix);
+    addReply(c,shared.ok);
+    if (g) watchReplay(c,g,index,argv+1,last-1,prefix);
+}
+
+/* Return true if the command is accepted in watch mode. */
+int watchModeCommand(struct prezCommand *cmd) {
+    return cmd->proc == watchCommand || cmd->proc == pwatchCommand ||
+           cmd->proc == unwatchCommand || cmd->proc == punwatchCommand;
+}
+
+/* Leave watch mode once nothing is watched. processCommand() enters it as
+ * WATCH is received, so that the commands pipelined after it, that could
+ * be executed after the first message, are refused. */
+static void watchUpdateMode(prezClient *c) {
+    if ((c->watched_keys == NULL || dictSize(c->watched_keys) == 0) &&
+        (c->watched_prefixes == NULL || dictSize(c->watched_prefixes) == 0))
+        c->flags &= ~PREZ_WATCH_MODE;
+}
+
+/* WATCH <key> [<key> ...] [FROMINDEX <index>] */
+void watchCommand(prezClient *c, robj **argv, int argc) {
+    watchGenericCommand(c,argv,argc,0);
+    watchUpdateMode(c);
+}
+
+/* PWATCH <prefix> [<prefix> ...] [FROMINDEX <index>] */
+void pwatchCommand(prezClient *c, robj **argv, int argc) {
+    watchGenericCommand(c,argv,argc,1);
+    watchUpdateMode(c);
+}
+
+/* UNWATCH [<key> ...], without keys every key is unwatched. Reply with
+ * the number of keys still watched. */
+void unwatchCommand(prezClient *c, robj **argv, int argc) {
+    int j;
+
+    if (argc == 1) watchRemoveAll(c,0);
+    for (j = 1; j < argc; j++) watchRemove(c,argv[j]->ptr,0);
+    watchUpdateMode(c);
+    addReplyLongLong(c,c->watched_keys ? dictSize(c->watched_keys) : 0);
+}
+
+/* PUNWATCH [<prefix> ...], like UNWATCH for the prefixes. */
+void punwatchCommand(prezClient *c, robj **argv, int argc) {
+    int j;
+
+    if (argc == 1) watchRemoveAll(c,1);
+    for (j = 1; j < argc; j++) watchRemove(c,argv[j]->ptr,1);
+    watchUpdateMode(c);
+    addReplyLongLong(c,c->watched_prefixes ? dictSize(c->watched_prefixes) : 0);
+}